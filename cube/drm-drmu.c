@@ -45,7 +45,31 @@ void cube_run_drmu(struct drm * const drm, const struct gbm * const gbm, const s
 
     egl->draw(drm->run_no++);
 
-    glFinish();
+    // If we can get a fence for the rendering then let KMS wait for it
+    // rather than waiting here. If the plane has no IN_FENCE_FD drmu waits
+    // for the fence when the fb is added so there is no need to glFinish
+    if (egl->eglDupNativeFenceFDANDROID != NULL) {
+        static const EGLint attrib_list[] = {
+            EGL_SYNC_NATIVE_FENCE_FD_ANDROID, EGL_NO_NATIVE_FENCE_FD_ANDROID,
+            EGL_NONE,
+        };
+        EGLSyncKHR gpu_fence = egl->eglCreateSyncKHR(egl->display, EGL_SYNC_NATIVE_FENCE_ANDROID, attrib_list);
+        int fd = -1;
+
+        if (gpu_fence != EGL_NO_SYNC_KHR) {
+            // Fence fd isn't valid until it has been flushed
+            glFlush();
+            fd = egl->eglDupNativeFenceFDANDROID(egl->display, gpu_fence);
+            egl->eglDestroySyncKHR(egl->display, gpu_fence);
+        }
+        if (fd == -1)
+            glFinish();
+        else
+            drmu_fb_in_fence_set(gbm->dfbs[drm->buf_no], fd);
+    }
+    else {
+        glFinish();
+    }
 
     /*
      * Here you could also update drm plane layers if you want
@@ -21,12 +21,16 @@
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <sys/vfs.h>
 
 #include <libdrm/drm.h>
 #include <libdrm/drm_mode.h>
 #include <xf86drm.h>
 
 #include <linux/dma-buf.h>
+#include <linux/magic.h>
 
 #define TRACE_PROP_NEW 0
 
@@ -36,6 +40,15 @@
 
 struct drmu_bo_env_s;
 static struct drmu_bo_env_s * env_boe(drmu_env_t * const du);
+struct fb_cache_env_s;
+static struct fb_cache_env_s * env_fbc(drmu_env_t * const du);
+struct fb_reaper_s;
+static struct fb_reaper_s * env_fb_reaper(drmu_env_t * const du);
+static bool env_ref_try(drmu_env_t * const du);
+struct drmu_cap_cache_s;
+static struct drmu_cap_cache_s * env_cap_cache(drmu_env_t * const du);
+static void env_fb_remove(drmu_env_t * const du, uint32_t fb_id);
+static int env_getproperty(drmu_env_t * const du, struct drm_mode_get_property * const prop);
 static int env_object_state_save(drmu_env_t * const du, const uint32_t obj_id, const uint32_t obj_type);
 
 // Update return value with a new one for cases where we don't stop on error
@@ -283,6 +296,21 @@ atomic_prop_blob_ref(void * v)
     drmu_blob_ref(v);
 }
 
+// Blob ids are recycled so use the contents
+static uint64_t
+atomic_prop_blob_sig(void * v, uint64_t value)
+{
+    const drmu_blob_t * const blob = v;
+    const uint8_t * const p = blob->data;
+    uint64_t h = 0xcbf29ce484222325ULL;  // FNV-1a
+    size_t i;
+    (void)value;
+
+    for (i = 0; i != blob->len; ++i)
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    return h;
+}
+
 int
 drmu_atomic_add_prop_blob(drmu_atomic_t * const da, const uint32_t obj_id, const uint32_t prop_id, drmu_blob_t * const blob)
 {
@@ -290,7 +318,8 @@ drmu_atomic_add_prop_blob(drmu_atomic_t * const da, const uint32_t obj_id, const
     static const drmu_atomic_prop_fns_t fns = {
         .ref = atomic_prop_blob_ref,
         .unref = atomic_prop_blob_unref,
-        .commit = drmu_prop_fn_null_commit
+        .commit = drmu_prop_fn_null_commit,
+        .sig = atomic_prop_blob_sig,
     };
 
     if (blob == NULL)
@@ -403,7 +432,7 @@ drmu_prop_enum_new(drmu_env_t * const du, const uint32_t id)
             .enum_blob_ptr = (uintptr_t)enums
         };
 
-        if ((rv = drmu_ioctl(du, DRM_IOCTL_MODE_GETPROPERTY, &prop)) != 0) {
+        if ((rv = env_getproperty(du, &prop)) != 0) {
             drmu_err(du, "%s: get property failed: %s", __func__, strerror(-rv));
             goto fail;
         }
@@ -471,6 +500,83 @@ drmu_atomic_add_prop_enum(drmu_atomic_t * const da, const uint32_t obj_id, const
     return rv;
 }
 
+// Interned enum names
+// The fb metadata strings we know about are turned into small ids when set
+// on the fb and each plane maps those ids to its enum values at init, so
+// adding them every frame needs no string compares. Id 0 is unset or a
+// string we don't know (which takes the slow path).
+
+#define ENUM_INTERN_MAX 4
+
+static const char * const intern_color_encodings[ENUM_INTERN_MAX] = {
+    NULL,
+    DRMU_COLOR_ENCODING_BT2020,
+    DRMU_COLOR_ENCODING_BT709,
+    DRMU_COLOR_ENCODING_BT601,
+};
+static const char * const intern_color_ranges[ENUM_INTERN_MAX] = {
+    NULL,
+    DRMU_COLOR_RANGE_YCBCR_FULL_RANGE,
+    DRMU_COLOR_RANGE_YCBCR_LIMITED_RANGE,
+};
+static const char * const intern_pixel_blend_modes[ENUM_INTERN_MAX] = {
+    NULL,
+    DRMU_FB_PIXEL_BLEND_PRE_MULTIPLIED,
+    DRMU_FB_PIXEL_BLEND_COVERAGE,
+    DRMU_FB_PIXEL_BLEND_NONE,
+};
+
+static uint8_t
+enum_intern(const char * const names[ENUM_INTERN_MAX], const char * const s)
+{
+    unsigned int i;
+
+    if (s == NULL)
+        return 0;
+    // Almost always one of the DRMU_ constants so try pointers first
+    for (i = 1; i != ENUM_INTERN_MAX; ++i) {
+        if (names[i] == s)
+            return i;
+    }
+    for (i = 1; i != ENUM_INTERN_MAX; ++i) {
+        if (names[i] != NULL && strcmp(names[i], s) == 0)
+            return i;
+    }
+    return 0;
+}
+
+// Values of the interned names for one enum prop
+typedef struct enum_intern_map_s {
+    unsigned int valid;  // Bit per id
+    uint64_t vals[ENUM_INTERN_MAX];
+} enum_intern_map_t;
+
+static void
+enum_intern_map_init(enum_intern_map_t * const map, const drmu_prop_enum_t * const pen,
+                     const char * const names[ENUM_INTERN_MAX])
+{
+    unsigned int i;
+
+    map->valid = 0;
+    for (i = 1; i != ENUM_INTERN_MAX; ++i) {
+        const uint64_t * const p = drmu_prop_enum_value(pen, names[i]);
+        if (p != NULL) {
+            map->vals[i] = *p;
+            map->valid |= 1U << i;
+        }
+    }
+}
+
+// As drmu_atomic_add_prop_enum but uses the map if id is valid
+static int
+atomic_add_prop_enum_interned(drmu_atomic_t * const da, const uint32_t obj_id, const drmu_prop_enum_t * const pen,
+                              const enum_intern_map_t * const map, const unsigned int id, const char * const name)
+{
+    if ((map->valid & (1U << id)) != 0)
+        return drmu_atomic_add_prop_generic(da, obj_id, drmu_prop_enum_id(pen), map->vals[id], NULL, NULL);
+    return drmu_atomic_add_prop_enum(da, obj_id, pen, name);
+}
+
 int
 drmu_atomic_add_prop_bitmask(struct drmu_atomic_s * const da, const uint32_t obj_id, const drmu_prop_enum_t * const pen, const uint64_t val)
 {
@@ -576,7 +682,7 @@ drmu_prop_range_new(drmu_env_t * const du, const uint32_t id)
             .values_ptr = (uintptr_t)pra->range
         };
 
-        if ((rv = drmu_ioctl(du, DRM_IOCTL_MODE_GETPROPERTY, &prop)) != 0) {
+        if ((rv = env_getproperty(du, &prop)) != 0) {
             drmu_err(du, "%s: get property failed: %s", __func__, strerror(-rv));
             goto fail;
         }
@@ -736,22 +842,121 @@ enum drmu_bo_type_e {
 // They need very different alloc & free but BO usage is the same for both
 // so it is better to have a single type.
 typedef struct drmu_bo_s {
-    // Arguably could be non-atomic for FD as then it is always protected by mutex
+    // FD BOs may only drop their last ref with the boe write lock held
     atomic_int ref_count;
     struct drmu_env_s * du;
     enum drmu_bo_type_e bo_type;
     uint32_t handle;
-
-    // FD only els - FD BOs need to be tracked globally
-    struct drmu_bo_s * next;
-    struct drmu_bo_s * prev;
 } drmu_bo_t;
 
+// FD BOs need to be tracked globally by handle
+// Open addressed (linear probe) hash on handle; handle 0 marks an empty slot
+typedef struct bo_hash_ent_s {
+    uint32_t handle;
+    drmu_bo_t * bo;
+} bo_hash_ent_t;
+
+#define BO_HASH_SIZE_MIN 64
+
 typedef struct drmu_bo_env_s {
-    pthread_mutex_t lock;
-    drmu_bo_t * fd_head;
+    // Import & lookup take this for read, insert & remove for write
+    pthread_rwlock_t lock;
+    unsigned int n;
+    unsigned int size;  // Power of 2
+    bo_hash_ent_t * ents;
 } drmu_bo_env_t;
 
+static inline unsigned int
+bo_hash_slot(const drmu_bo_env_t * const boe, const uint32_t handle)
+{
+    // Handles are small sequential ints - Fibonacci hash spreads them
+    return (handle * 0x9e3779b1U) & (boe->size - 1);
+}
+
+// Lock (read or write) expected
+static drmu_bo_t *
+bo_hash_find(const drmu_bo_env_t * const boe, const uint32_t handle)
+{
+    unsigned int i;
+
+    if (boe->size == 0)
+        return NULL;
+
+    for (i = bo_hash_slot(boe, handle); boe->ents[i].handle != 0; i = (i + 1) & (boe->size - 1)) {
+        if (boe->ents[i].handle == handle)
+            return boe->ents[i].bo;
+    }
+    return NULL;
+}
+
+// Write lock expected
+static void
+bo_hash_put(drmu_bo_env_t * const boe, drmu_bo_t * const bo)
+{
+    unsigned int i = bo_hash_slot(boe, bo->handle);
+
+    while (boe->ents[i].handle != 0)
+        i = (i + 1) & (boe->size - 1);
+    boe->ents[i] = (bo_hash_ent_t){.handle = bo->handle, .bo = bo};
+}
+
+// Write lock expected
+static int
+bo_hash_add(drmu_bo_env_t * const boe, drmu_bo_t * const bo)
+{
+    // Keep load <= 1/2 so probe chains stay short
+    if ((boe->n + 1) * 2 > boe->size) {
+        const unsigned int old_size = boe->size;
+        bo_hash_ent_t * const old_ents = boe->ents;
+        const unsigned int size = old_size == 0 ? BO_HASH_SIZE_MIN : old_size * 2;
+        bo_hash_ent_t * const ents = calloc(size, sizeof(*ents));
+        unsigned int i;
+
+        if (ents == NULL)
+            return -ENOMEM;
+
+        boe->ents = ents;
+        boe->size = size;
+        for (i = 0; i != old_size; ++i) {
+            if (old_ents[i].handle != 0)
+                bo_hash_put(boe, old_ents[i].bo);
+        }
+        free(old_ents);
+    }
+
+    bo_hash_put(boe, bo);
+    ++boe->n;
+    return 0;
+}
+
+// Write lock expected
+// Backward shift delete so we never need tombstones
+static void
+bo_hash_remove(drmu_bo_env_t * const boe, const uint32_t handle)
+{
+    const unsigned int mask = boe->size - 1;
+    unsigned int i, j;
+
+    if (boe->size == 0)
+        return;
+
+    for (i = bo_hash_slot(boe, handle); boe->ents[i].handle != handle; i = (i + 1) & mask) {
+        if (boe->ents[i].handle == 0)
+            return;
+    }
+
+    for (j = (i + 1) & mask; boe->ents[j].handle != 0; j = (j + 1) & mask) {
+        const unsigned int k = bo_hash_slot(boe, boe->ents[j].handle);
+        // Move j into the hole at i if its home slot k isn't cyclically in (i, j]
+        if (((j - k) & mask) >= ((j - i) & mask)) {
+            boe->ents[i] = boe->ents[j];
+            i = j;
+        }
+    }
+    boe->ents[i] = (bo_hash_ent_t){.handle = 0, .bo = NULL};
+    --boe->n;
+}
+
 static int
 bo_close(drmu_env_t * const du, uint32_t * const ph)
 {
@@ -786,14 +991,9 @@ bo_free_fd(drmu_bo_t * const bo)
         drmu_bo_env_t *const boe = env_boe(du);
         const uint32_t h = bo->handle;
 
+        bo_hash_remove(boe, h);
         if (bo_close(du, &bo->handle) != 0)
             drmu_warn(du, "%s: Failed to close BO handle %d", __func__, h);
-        if (bo->next != NULL)
-            bo->next->prev = bo->prev;
-        if (bo->prev != NULL)
-            bo->prev->next = bo->next;
-        else
-            boe->fd_head = bo->next;
     }
     free(bo);
 }
@@ -845,11 +1045,20 @@ drmu_bo_unref(drmu_bo_t ** const ppbo)
         case BO_TYPE_FD:
         {
             drmu_bo_env_t * const boe = env_boe(bo->du);
+            int n = atomic_load(&bo->ref_count);
+
+            // Not the last ref - no need to lock
+            while (n > 0) {
+                if (atomic_compare_exchange_weak(&bo->ref_count, &n, n - 1))
+                    return;
+            }
 
-            pthread_mutex_lock(&boe->lock);
+            // Possibly the last ref - a racing import may ref it again
+            // but it can't do that whilst we hold the write lock
+            pthread_rwlock_wrlock(&boe->lock);
             if (atomic_fetch_sub(&bo->ref_count, 1) == 0)
                 bo_free_fd(bo);
-            pthread_mutex_unlock(&boe->lock);
+            pthread_rwlock_unlock(&boe->lock);
             break;
         }
         case BO_TYPE_DUMB:
@@ -929,35 +1138,51 @@ drmu_bo_new_fd(drmu_env_t *const du, const int fd)
     struct drm_prime_handle ph = { .fd = fd };
     int rv;
 
-    pthread_mutex_lock(&boe->lock);
+    // The handle must not be closed between import & ref so the import
+    // needs to be inside the lock. Read is enough as a BO can only be freed
+    // with the write lock held. The common case is that we already have it.
+    pthread_rwlock_rdlock(&boe->lock);
 
     if ((rv = drmu_ioctl(du, DRM_IOCTL_PRIME_FD_TO_HANDLE, &ph)) != 0) {
-        drmu_err(du, "Failed to convert fd %d to BO: %s", __func__, fd, strerror(-rv));
-        goto unlock;
+        pthread_rwlock_unlock(&boe->lock);
+        drmu_err(du, "%s: Failed to convert fd %d to BO: %s", __func__, fd, strerror(-rv));
+        return NULL;
     }
 
-    bo = boe->fd_head;
-    while (bo != NULL && bo->handle != ph.handle)
-        bo = bo->next;
+    if ((bo = bo_hash_find(boe, ph.handle)) != NULL)
+        drmu_bo_ref(bo);
+    pthread_rwlock_unlock(&boe->lock);
 
-    if (bo != NULL) {
+    if (bo != NULL)
+        return bo;
+
+    // Miss - with the lock dropped the handle may have been closed under us
+    // so reimport with the write lock held
+    pthread_rwlock_wrlock(&boe->lock);
+
+    if ((rv = drmu_ioctl(du, DRM_IOCTL_PRIME_FD_TO_HANDLE, &ph)) != 0) {
+        drmu_err(du, "%s: Failed to convert fd %d to BO: %s", __func__, fd, strerror(-rv));
+        goto unlock;
+    }
+
+    if ((bo = bo_hash_find(boe, ph.handle)) != NULL) {
         drmu_bo_ref(bo);
     }
+    else if ((bo = bo_alloc(du, BO_TYPE_FD)) == NULL) {
+        bo_close(du, &ph.handle);
+    }
     else {
-        if ((bo = bo_alloc(du, BO_TYPE_FD)) == NULL) {
-            bo_close(du, &ph.handle);
-        }
-        else {
-            bo->handle = ph.handle;
-
-            if ((bo->next = boe->fd_head) != NULL)
-                bo->next->prev = bo;
-            boe->fd_head = bo;
+        bo->handle = ph.handle;
+        if (bo_hash_add(boe, bo) != 0) {
+            drmu_err(du, "%s: Failed to add BO to hash", __func__);
+            bo_close(du, &bo->handle);
+            free(bo);
+            bo = NULL;
         }
     }
 
 unlock:
-    pthread_mutex_unlock(&boe->lock);
+    pthread_rwlock_unlock(&boe->lock);
     return bo;
 }
 
@@ -986,17 +1211,26 @@ drmu_bo_new_dumb(drmu_env_t *const du, struct drm_mode_create_dumb * const d)
 void
 drmu_bo_env_uninit(drmu_bo_env_t * const boe)
 {
-    if (boe->fd_head != NULL)
-        drmu_warn(boe->fd_head->du, "%s: fd chain not null", __func__);
-    boe->fd_head = NULL;
-    pthread_mutex_destroy(&boe->lock);
+    if (boe->n != 0) {
+        unsigned int i;
+        for (i = 0; boe->ents[i].handle == 0; ++i)
+            /* Loop */;
+        drmu_warn(boe->ents[i].bo->du, "%s: %u FD BOs still in use", __func__, boe->n);
+    }
+    free(boe->ents);
+    boe->ents = NULL;
+    boe->n = 0;
+    boe->size = 0;
+    pthread_rwlock_destroy(&boe->lock);
 }
 
 void
 drmu_bo_env_init(drmu_bo_env_t * boe)
 {
-    boe->fd_head = NULL;
-    pthread_mutex_init(&boe->lock, NULL);
+    boe->n = 0;
+    boe->size = 0;
+    boe->ents = NULL;
+    pthread_rwlock_init(&boe->lock, NULL);
 }
 
 //----------------------------------------------------------------------------
@@ -1027,11 +1261,17 @@ typedef struct drmu_fb_s {
 
     int8_t layer_obj[4];
 
+    // If set then fb_id belongs to this import cache entry rather than the fb
+    struct fb_cache_ent_s * fb_cache_ent;
+
     unsigned int orientation;  // Orientation of FB i.e. inverse of rot to 0
     drmu_color_encoding_t color_encoding; // Assumed to be constant strings that don't need freeing
     drmu_color_range_t    color_range;
     drmu_colorspace_t     colorspace;
     const char * pixel_blend_mode;
+    uint8_t color_encoding_id;  // Interned versions of the above
+    uint8_t color_range_id;
+    uint8_t pixel_blend_mode_id;
     drmu_chroma_siting_t chroma_siting;
     drmu_isset_t hdr_metadata_isset;
     struct hdr_output_metadata hdr_metadata;
@@ -1045,8 +1285,181 @@ typedef struct drmu_fb_s {
     // We pass a pointer to this to DRM which defines it as s32 so do not use
     // int that might be s64.
     int32_t fence_fd;
+
+    // Fence the plane waits on before scanning this out, NULL if none
+    drmu_fence_t * in_fence;
+    // Fence that signals once the fb is no longer being scanned out
+    // Set on the Q thread & waited for by whoever wants to reuse the fb so
+    // protected by release_fence_lock
+    pthread_mutex_t release_fence_lock;
+    drmu_fence_t * release_fence;
+
+    // Reaper queue
+    struct drmu_fb_s * reap_next;
 } drmu_fb_t;
 
+static void fb_cache_ent_unuse(drmu_env_t * const du, struct fb_cache_ent_s * const ent);
+
+//----------------------------------------------------------------------------
+//
+// Fences
+// A refcounted sync_file fd. fd is s32 as we may pass a pointer to it to DRM
+// as an OUT_FENCE_PTR.
+
+struct drmu_fence_s {
+    atomic_int ref_count;  // 0 == 1 ref for ease of init
+    int32_t fd;
+};
+
+static drmu_fence_t *
+fence_new(const int fd)
+{
+    drmu_fence_t * const fence = malloc(sizeof(*fence));
+    if (fence == NULL)
+        return NULL;
+    atomic_init(&fence->ref_count, 0);
+    fence->fd = fd;
+    return fence;
+}
+
+void
+drmu_fence_unref(drmu_fence_t ** const ppfence)
+{
+    drmu_fence_t * const fence = *ppfence;
+
+    if (fence == NULL)
+        return;
+    *ppfence = NULL;
+
+    if (atomic_fetch_sub(&fence->ref_count, 1) != 0)
+        return;
+    if (fence->fd != -1)
+        close(fence->fd);
+    free(fence);
+}
+
+drmu_fence_t *
+drmu_fence_ref(drmu_fence_t * const fence)
+{
+    if (fence != NULL)
+        atomic_fetch_add(&fence->ref_count, 1);
+    return fence;
+}
+
+int
+drmu_fence_fd(const drmu_fence_t * const fence)
+{
+    return fence == NULL ? -1 : fence->fd;
+}
+
+int
+drmu_fence_wait(const drmu_fence_t * const fence, const int timeout_ms)
+{
+    struct pollfd pf;
+    int rv;
+
+    // No fd (e.g. commit not done or failed) - nothing to wait for
+    if (fence == NULL || fence->fd == -1)
+        return 1;
+
+    do {
+        pf.fd = fence->fd;
+        pf.events = POLLIN;
+        pf.revents = 0;
+
+        rv = poll(&pf, 1, timeout_ms);
+        if (rv >= 0)
+            break;
+
+        rv = -errno;
+    } while (rv == -EINTR);
+
+    return rv;
+}
+
+static void
+atomic_prop_fence_unref_cb(void * v)
+{
+    drmu_fence_t * fence = v;
+    drmu_fence_unref(&fence);
+}
+
+static void
+atomic_prop_fence_ref_cb(void * v)
+{
+    drmu_fence_ref(v);
+}
+
+// The fd (or where it goes) is different every time but the result of a
+// test commit won't be
+static uint64_t
+atomic_prop_fence_sig_cb(void * v, uint64_t value)
+{
+    (void)v;
+    (void)value;
+    return 1;
+}
+
+static const drmu_atomic_prop_fns_t atomic_prop_fence_fns = {
+    .ref    = atomic_prop_fence_ref_cb,
+    .unref  = atomic_prop_fence_unref_cb,
+    .commit = drmu_prop_fn_null_commit,
+    .sig    = atomic_prop_fence_sig_cb,
+};
+
+void
+drmu_fb_release_fence_set(drmu_fb_t * const dfb, drmu_fence_t * const fence)
+{
+    drmu_fence_t * old;
+
+    drmu_fence_ref(fence);
+    pthread_mutex_lock(&dfb->release_fence_lock);
+    old = dfb->release_fence;
+    dfb->release_fence = fence;
+    pthread_mutex_unlock(&dfb->release_fence_lock);
+    drmu_fence_unref(&old);
+}
+
+drmu_fence_t *
+drmu_fb_release_fence_take(drmu_fb_t * const dfb)
+{
+    drmu_fence_t * fence;
+
+    pthread_mutex_lock(&dfb->release_fence_lock);
+    fence = dfb->release_fence;
+    dfb->release_fence = NULL;
+    pthread_mutex_unlock(&dfb->release_fence_lock);
+    return fence;
+}
+
+// Wait on our own ref so a set whilst waiting can't free the fence
+int
+drmu_fb_release_fence_wait(drmu_fb_t * const dfb, const int timeout_ms)
+{
+    drmu_fence_t * fence;
+    drmu_fence_t * done = NULL;
+    int rv;
+
+    pthread_mutex_lock(&dfb->release_fence_lock);
+    fence = drmu_fence_ref(dfb->release_fence);
+    pthread_mutex_unlock(&dfb->release_fence_lock);
+
+    rv = drmu_fence_wait(fence, timeout_ms);
+
+    // Once signalled it will stay that way - no need to keep it
+    if (rv > 0 && fence != NULL) {
+        pthread_mutex_lock(&dfb->release_fence_lock);
+        if (dfb->release_fence == fence) {
+            done = dfb->release_fence;
+            dfb->release_fence = NULL;
+        }
+        pthread_mutex_unlock(&dfb->release_fence_lock);
+    }
+    drmu_fence_unref(&done);
+    drmu_fence_unref(&fence);
+    return rv;
+}
+
 int
 drmu_fb_out_fence_wait(drmu_fb_t * const fb, const int timeout_ms)
 {
@@ -1085,27 +1498,16 @@ drmu_fb_out_fence_take_fd(drmu_fb_t * const fb)
     return fd;
 }
 
-void
-drmu_fb_int_free(drmu_fb_t * const dfb)
+static void
+fb_teardown(drmu_fb_t * const dfb)
 {
-    drmu_env_t * const du = dfb->du;
+    drmu_env_t * du = dfb->du;
+    struct fb_cache_ent_s * const ent = dfb->fb_cache_ent;
     unsigned int i;
 
-    // Assume pre_delete is used for pool - kill stuff we don't want in pool
-    if (dfb->fence_fd != -1) {
-        drmu_warn(du, "Out fence still set on FB on delete");
-        if (drmu_fb_out_fence_wait(dfb, 500) == 0) {
-            drmu_err(du, "Out fence stuck in FB free");
-            close(dfb->fence_fd);
-        }
-    }
-
-    // Pre delete
-    if (dfb->pre_delete_fn && dfb->pre_delete_fn(dfb, dfb->pre_delete_v) != 0)
-        return;
-
-    if (dfb->fb.fb_id != 0)
-        drmu_ioctl(du, DRM_IOCTL_MODE_RMFB, &dfb->fb.fb_id);
+    // A cache entry owns the fb_id
+    if (ent == NULL && dfb->fb.fb_id != 0)
+        env_fb_remove(du, dfb->fb.fb_id);
 
     for (i = 0; i != 4; ++i) {
         if (dfb->objects[i].map_ptr != NULL)
@@ -1121,12 +1523,184 @@ drmu_fb_int_free(drmu_fb_t * const dfb)
     {
         void * const v = dfb->on_delete_v;
         const drmu_fb_on_delete_fn fn = dfb->on_delete_fn;
+        // Releasing the source may free its dmabufs so only check the cache
+        // entry after on_delete. Hold the env over that as on_delete may drop
+        // the last ref; if the env is already being freed it is being freed
+        // by a thread that waits for us.
+        const bool env_held = ent != NULL && env_ref_try(du);
 
+        pthread_mutex_destroy(&dfb->release_fence_lock);
         free(dfb);
 
         if (fn)
             fn(v);
+
+        if (ent != NULL) {
+            fb_cache_ent_unuse(du, ent);
+            if (env_held)
+                drmu_env_unref(&du);
+        }
+    }
+}
+
+//----------------------------------------------------------------------------
+//
+// FB reaper
+// Removing an fb, unmapping & closing its BOs can block (RMFB of a recently
+// displayed fb waits for vblank) so optionally do it on a separate thread.
+// Every queued fb holds an env ref until its teardown is done so the env
+// can only be freed on this thread once the queue is empty. Refcounted as
+// the thread may then be the one freeing the env.
+
+typedef struct fb_reaper_s {
+    atomic_int ref_count;  // 0 == 1 ref
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool stop;
+    drmu_fb_t * head;      // FBs waiting for teardown
+    pthread_t thread;
+} fb_reaper_t;
+
+static void
+fb_reaper_unref(fb_reaper_t ** const ppr)
+{
+    fb_reaper_t * const r = *ppr;
+
+    if (r == NULL)
+        return;
+    *ppr = NULL;
+
+    if (atomic_fetch_sub(&r->ref_count, 1) != 0)
+        return;
+    pthread_cond_destroy(&r->cond);
+    pthread_mutex_destroy(&r->lock);
+    free(r);
+}
+
+static void
+fb_reaper_push(fb_reaper_t * const r, drmu_fb_t * const dfb)
+{
+    pthread_mutex_lock(&r->lock);
+    dfb->reap_next = r->head;
+    r->head = dfb;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+}
+
+static void *
+fb_reaper_thread(void * v)
+{
+    fb_reaper_t * r = v;
+
+    pthread_mutex_lock(&r->lock);
+    for (;;) {
+        drmu_fb_t * dfb;
+
+        while (r->head == NULL && !r->stop)
+            pthread_cond_wait(&r->cond, &r->lock);
+        // Flush everything before stopping
+        if (r->head == NULL)
+            break;
+
+        // Take the whole batch
+        dfb = r->head;
+        r->head = NULL;
+        pthread_mutex_unlock(&r->lock);
+
+        while (dfb != NULL) {
+            drmu_fb_t * const next = dfb->reap_next;
+            drmu_env_t * du = dfb->du;
+            fb_teardown(dfb);
+            // May free the env (& stop us) but only if this was the last fb
+            drmu_env_unref(&du);
+            dfb = next;
+        }
+
+        pthread_mutex_lock(&r->lock);
     }
+    pthread_mutex_unlock(&r->lock);
+
+    fb_reaper_unref(&r);
+    return NULL;
+}
+
+static fb_reaper_t *
+fb_reaper_new(drmu_env_t * const du)
+{
+    fb_reaper_t * const r = calloc(1, sizeof(*r));
+    int rv;
+
+    if (r == NULL)
+        return NULL;
+
+    atomic_init(&r->ref_count, 1);  // Env + thread
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+
+    if ((rv = pthread_create(&r->thread, NULL, fb_reaper_thread, r)) != 0) {
+        drmu_err(du, "%s: Failed to create thread: %s", __func__, strerror(rv));
+        pthread_cond_destroy(&r->cond);
+        pthread_mutex_destroy(&r->lock);
+        free(r);
+        return NULL;
+    }
+    return r;
+}
+
+// Flushes all pending fbs then stops
+static void
+fb_reaper_stop(fb_reaper_t ** const ppr)
+{
+    fb_reaper_t * const r = *ppr;
+
+    if (r == NULL)
+        return;
+
+    pthread_mutex_lock(&r->lock);
+    r->stop = true;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+
+    // If the last env ref was dropped by the reaper thread we can't wait
+    // for ourselves. Nothing else can be queued (it would hold a ref) so
+    // the thread exits without touching the env again.
+    if (pthread_equal(pthread_self(), r->thread))
+        pthread_detach(r->thread);
+    else
+        pthread_join(r->thread, NULL);
+
+    fb_reaper_unref(ppr);
+}
+
+void
+drmu_fb_int_free(drmu_fb_t * const dfb)
+{
+    drmu_env_t * const du = dfb->du;
+    fb_reaper_t * r;
+
+    // Assume pre_delete is used for pool - kill stuff we don't want in pool
+    // Any atomic still using the in fence has its own ref
+    drmu_fence_unref(&dfb->in_fence);
+    if (dfb->fence_fd != -1) {
+        drmu_warn(du, "Out fence still set on FB on delete");
+        if (drmu_fb_out_fence_wait(dfb, 500) == 0) {
+            drmu_err(du, "Out fence stuck in FB free");
+            close(dfb->fence_fd);
+        }
+    }
+
+    // Pre delete
+    if (dfb->pre_delete_fn && dfb->pre_delete_fn(dfb, dfb->pre_delete_v) != 0)
+        return;
+
+    drmu_fence_unref(&dfb->release_fence);
+
+    // Queued fbs hold an env ref. If the env is already being freed then
+    // tear down here - env_free is waiting for us anyway.
+    if (du != NULL && (r = env_fb_reaper(du)) != NULL && env_ref_try(du))
+        fb_reaper_push(r, dfb);
+    else
+        fb_teardown(dfb);
 }
 
 void
@@ -1171,6 +1745,7 @@ int
 drmu_fb_pixel_blend_mode_set(drmu_fb_t *const dfb, const char * const mode)
 {
     dfb->pixel_blend_mode = mode;
+    dfb->pixel_blend_mode_id = enum_intern(intern_pixel_blend_modes, mode);
     return 0;
 }
 
@@ -1235,6 +1810,18 @@ drmu_fb_height(const drmu_fb_t *const dfb)
     return dfb->fb.height;
 }
 
+size_t
+drmu_fb_size(const drmu_fb_t *const dfb)
+{
+    size_t size = 0;
+    unsigned int i;
+
+    for (i = 0; i != 4; ++i)
+        size += dfb->objects[i].map_size;
+    return size != 0 ? size :
+        drmu_fmt_info_frame_size(dfb->fmt_info, dfb->fb.width, dfb->fb.height);
+}
+
 // Set cropping (fractional) - x, y, relative to active x, y (and must be +ve)
 int
 drmu_fb_crop_frac_set(drmu_fb_t *const dfb, drmu_rect_t crop_frac)
@@ -1279,17 +1866,19 @@ drmu_fb_int_fmt_size_set(drmu_fb_t *const dfb, uint32_t fmt, uint32_t w, uint32_
     // This may be later set by _chroma_siting_set but it is good to have defaults
     dfb->chroma_siting   = drmu_fmt_info_chroma_siting(dfb->fmt_info);
     // These may be later set by _color_set but it is good to have defaults
-    dfb->color_encoding  = DRMU_COLOR_ENCODING_BT709;
-    dfb->color_range     = drmu_fmt_info_is_yuv(dfb->fmt_info) ? DRMU_COLOR_RANGE_YCBCR_LIMITED_RANGE : DRMU_COLOR_RANGE_YCBCR_FULL_RANGE;
-    dfb->colorspace      = DRMU_COLORSPACE_DEFAULT;
+    drmu_fb_color_set(dfb, DRMU_COLOR_ENCODING_BT709,
+                      drmu_fmt_info_is_yuv(dfb->fmt_info) ? DRMU_COLOR_RANGE_YCBCR_LIMITED_RANGE : DRMU_COLOR_RANGE_YCBCR_FULL_RANGE,
+                      DRMU_COLORSPACE_DEFAULT);
 }
 
 void
 drmu_fb_color_set(drmu_fb_t *const dfb, const drmu_color_encoding_t enc, const drmu_color_range_t range, const drmu_colorspace_t space)
 {
-    dfb->color_encoding = enc;
-    dfb->color_range    = range;
-    dfb->colorspace     = space;
+    dfb->color_encoding    = enc;
+    dfb->color_range       = range;
+    dfb->colorspace        = space;
+    dfb->color_encoding_id = enum_intern(intern_color_encodings, enc);
+    dfb->color_range_id    = enum_intern(intern_color_ranges, range);
 }
 
 void
@@ -1452,6 +2041,7 @@ drmu_fb_int_alloc(drmu_env_t * const du)
     for (unsigned int i = 0; i != 4; ++i)
         dfb->layer_obj[i] = -1;
     dfb->fence_fd = -1;
+    pthread_mutex_init(&dfb->release_fence_lock, NULL);
     return dfb;
 }
 
@@ -1572,6 +2162,15 @@ atomic_prop_fb_out_fence_commit_cb(void * v, uint64_t value)
 // Must be unset before set again
 // (This is as a handy hint that you must wait for the previous fence
 // to go ready before you set a new one)
+// Value is a pointer to where the fence fd goes - only presence matters
+static uint64_t
+atomic_prop_fb_out_fence_sig_cb(void * v, uint64_t value)
+{
+    (void)v;
+    (void)value;
+    return 1;
+}
+
 static int
 atomic_fb_add_out_fence(drmu_atomic_t * const da, const uint32_t obj_id, const uint32_t prop_id, drmu_fb_t * const dfb,
                         drmu_fb_fence_fd_fn * fn, void * v)
@@ -1582,7 +2181,8 @@ atomic_fb_add_out_fence(drmu_atomic_t * const da, const uint32_t obj_id, const u
     static const drmu_atomic_prop_fns_t fence_fns = {
         .ref    = atomic_prop_fb_out_fence_ref_cb,
         .unref  = atomic_prop_fb_out_fence_unref_cb,
-        .commit = atomic_prop_fb_out_fence_commit_cb
+        .commit = atomic_prop_fb_out_fence_commit_cb,
+        .sig    = atomic_prop_fb_out_fence_sig_cb,
     };
 
     if (ffce == NULL) {
@@ -1602,6 +2202,50 @@ atomic_fb_add_out_fence(drmu_atomic_t * const da, const uint32_t obj_id, const u
     return rv;
 }
 
+// How long to wait for an in fence ourselves - plenty for any render that
+// is going to finish
+#define FB_IN_FENCE_WAIT_MS 1000
+
+// Add the fb's in fence (or -1 if it has none or dfb == NULL) so that a
+// fence left in the atomic from an earlier fb isn't waited on for this one
+// The fence is refcounted so atomics (and their copies & merges) keep the
+// fd open for as long as they might commit it even if the fb has moved on
+// If the plane has no IN_FENCE_FD then KMS can't wait so wait here
+static int
+atomic_fb_add_in_fence(drmu_atomic_t * const da, const uint32_t obj_id, const uint32_t prop_id, drmu_fb_t * const dfb)
+{
+    if (prop_id == 0) {
+        int rv;
+
+        if (dfb == NULL || dfb->in_fence == NULL)
+            return 0;
+        if ((rv = drmu_fence_wait(dfb->in_fence, FB_IN_FENCE_WAIT_MS)) > 0)
+            return 0;
+        rv = rv == 0 ? -ETIMEDOUT : rv;
+        drmu_warn(dfb->du, "%s: Wait for in fence failed: %s", __func__, strerror(-rv));
+        return rv;
+    }
+    if (dfb == NULL || dfb->in_fence == NULL)
+        return drmu_atomic_add_prop_value(da, obj_id, prop_id, (uint64_t)(int64_t)-1);
+    return drmu_atomic_add_prop_generic(da, obj_id, prop_id, (uint64_t)(int64_t)dfb->in_fence->fd,
+                                        &atomic_prop_fence_fns, dfb->in_fence);
+}
+
+int
+drmu_fb_in_fence_set(drmu_fb_t * const dfb, const int fd)
+{
+    drmu_fence_t * fence = NULL;
+
+    if (fd != -1 && (fence = fence_new(fd)) == NULL) {
+        close(fd);
+        return -ENOMEM;
+    }
+
+    drmu_fence_unref(&dfb->in_fence);
+    dfb->in_fence = fence;
+    return 0;
+}
+
 // For allocation purposes given fb_pixel bits how tall
 // does the frame have to be to fit all planes if constant width
 static unsigned int
@@ -1733,10 +2377,16 @@ drmu_fb_new_dumb(drmu_env_t * const du, uint32_t w, uint32_t h, const uint32_t f
     return drmu_fb_new_dumb_multi(du, w, h, format, DRM_FORMAT_MOD_LINEAR, false);
 }
 
+bool
+drmu_fb_fits(const drmu_fb_t * dfb, uint32_t w, uint32_t h, const uint32_t format, const uint64_t mod)
+{
+    return w <= dfb->fb.width && h <= dfb->fb.height && format == dfb->fb.pixel_format && mod == dfb->fb.modifier[0];
+}
+
 bool
 drmu_fb_try_reuse(drmu_fb_t * dfb, uint32_t w, uint32_t h, const uint32_t format, const uint64_t mod)
 {
-    if (w > dfb->fb.width || h > dfb->fb.height || format != dfb->fb.pixel_format || mod != dfb->fb.modifier[0])
+    if (!drmu_fb_fits(dfb, w, h, format, mod))
         return false;
 
     dfb->active = drmu_rect_wh(w, h);
@@ -1776,26 +2426,391 @@ atomic_prop_fb_ref(void * v)
     drmu_fb_ref(v);
 }
 
+// FB ids change every frame but what matters to a test is the shape
+// Planes can differ in layout for the same format & size so that's all in
+static uint64_t
+atomic_prop_fb_sig(void * v, uint64_t value)
+{
+    const drmu_fb_t * const dfb = v;
+    uint64_t h = ((uint64_t)dfb->fb.pixel_format << 32) ^
+        ((uint64_t)dfb->fb.width << 16) ^ dfb->fb.height;
+    unsigned int i;
+    (void)value;
+
+    for (i = 0; i != 4; ++i) {
+        h = (h ^ (((uint64_t)dfb->fb.pitches[i] << 32) | dfb->fb.offsets[i])) * 0xff51afd7ed558ccdULL;
+        h = (h ^ dfb->fb.modifier[i]) * 0x9e3779b97f4a7c15ULL;
+    }
+    return h;
+}
+
+static const drmu_atomic_prop_fns_t atomic_prop_fb_fns = {
+    .ref    = atomic_prop_fb_ref,
+    .unref  = atomic_prop_fb_unref,
+    .commit = drmu_prop_fn_null_commit,
+    .sig    = atomic_prop_fb_sig,
+};
+
 int
 drmu_atomic_add_prop_fb(drmu_atomic_t * const da, const uint32_t obj_id, const uint32_t prop_id, drmu_fb_t * const dfb)
 {
     int rv;
-    static const drmu_atomic_prop_fns_t fns = {
-        .ref    = atomic_prop_fb_ref,
-        .unref  = atomic_prop_fb_unref,
-        .commit = drmu_prop_fn_null_commit,
-    };
 
     if (dfb == NULL)
         return drmu_atomic_add_prop_value(da, obj_id, prop_id, 0);
 
-    rv = drmu_atomic_add_prop_generic(da, obj_id, prop_id, dfb->fb.fb_id, &fns, dfb);
+    rv = drmu_atomic_add_prop_generic(da, obj_id, prop_id, dfb->fb.fb_id, &atomic_prop_fb_fns, dfb);
     if (rv != 0)
         drmu_warn(drmu_atomic_env(da), "%s: Failed to add fb obj_id=%#x, prop_id=%#x: %s", __func__, obj_id, prop_id, strerror(-rv));
 
     return rv;
 }
 
+//----------------------------------------------------------------------------
+//
+// FB import cache
+//
+// Imported dmabufs (typically from a decoder pool) are recycled so rather
+// than import & AddFB2 them every time they are attached keep the kernel FB
+// around, keyed on the identity of the dmabufs & the layout of the FB.
+// The kernel FB holds refs on its dmabufs so their inodes cannot be reused
+// whilst the entry exists. That also pins the buffer memory so once the last
+// FB using an entry has gone (and its on_delete has released the source) the
+// fds the source gave us are checked and if they no longer refer to the same
+// dmabufs the entry is evicted there & then. Unused entries whose source is
+// still alive are evicted LRU once the cache is full.
+
+#define FB_CACHE_SIZE 32
+
+typedef struct fb_cache_key_s {
+    uint64_t dev[4];
+    uint64_t ino[4];
+    uint64_t modifier[4];
+    uint32_t pitches[4];
+    uint32_t offsets[4];
+    uint32_t width;
+    uint32_t height;
+    uint32_t pixel_format;
+    uint32_t pad;  // Zero - we memcmp keys
+} fb_cache_key_t;
+
+typedef struct fb_cache_ent_s {
+    struct fb_cache_ent_s * next;  // LRU chain - most recently used at head
+    struct fb_cache_ent_s * prev;
+    unsigned int use_count;        // FBs currently using this ent; protected by fbc lock
+    uint32_t fb_id;
+    unsigned int bo_count;
+    drmu_bo_t * bos[4];
+    // Source fds (not owned) & what they referred to on last use
+    int src_fds[4];
+    dev_t src_dev[4];
+    ino_t src_ino[4];
+    fb_cache_key_t key;
+} fb_cache_ent_t;
+
+typedef struct fb_cache_env_s {
+    pthread_mutex_t lock;
+    int enabled;  // -1 not yet known
+    unsigned int n;
+    fb_cache_ent_t * head;
+    fb_cache_ent_t * tail;
+} fb_cache_env_t;
+
+static void
+fb_cache_ent_free(drmu_env_t * const du, fb_cache_ent_t * const ent)
+{
+    unsigned int i;
+
+    if (ent->fb_id != 0)
+        env_fb_remove(du, ent->fb_id);
+    for (i = 0; i != ent->bo_count; ++i)
+        drmu_bo_unref(ent->bos + i);
+    free(ent);
+}
+
+// Free a chain of ents previously removed from the cache by fb_cache_trim
+static void
+fb_cache_ent_free_chain(drmu_env_t * const du, fb_cache_ent_t * ent)
+{
+    while (ent != NULL) {
+        fb_cache_ent_t * const next = ent->next;
+        fb_cache_ent_free(du, ent);
+        ent = next;
+    }
+}
+
+// Lock expected
+static void
+fb_cache_unlink(fb_cache_env_t * const fbc, fb_cache_ent_t * const ent)
+{
+    if (ent->next != NULL)
+        ent->next->prev = ent->prev;
+    else
+        fbc->tail = ent->prev;
+    if (ent->prev != NULL)
+        ent->prev->next = ent->next;
+    else
+        fbc->head = ent->next;
+    ent->next = NULL;
+    ent->prev = NULL;
+}
+
+// Lock expected
+static void
+fb_cache_link_head(fb_cache_env_t * const fbc, fb_cache_ent_t * const ent)
+{
+    ent->prev = NULL;
+    if ((ent->next = fbc->head) != NULL)
+        ent->next->prev = ent;
+    else
+        fbc->tail = ent;
+    fbc->head = ent;
+}
+
+// Lock expected
+static fb_cache_ent_t *
+fb_cache_find(const fb_cache_env_t * const fbc, const fb_cache_key_t * const key)
+{
+    fb_cache_ent_t * ent;
+
+    for (ent = fbc->head; ent != NULL; ent = ent->next) {
+        if (ent->key.ino[0] == key->ino[0] && memcmp(&ent->key, key, sizeof(*key)) == 0)
+            break;
+    }
+    return ent;
+}
+
+// Lock expected
+// Removes unused ents, oldest first, until there are no more than max left
+// Returns a chain of removed ents that should be freed once the lock is
+// dropped
+static fb_cache_ent_t *
+fb_cache_trim(fb_cache_env_t * const fbc, const unsigned int max)
+{
+    fb_cache_ent_t * kill = NULL;
+    fb_cache_ent_t * ent = fbc->tail;
+
+    while (fbc->n > max && ent != NULL) {
+        fb_cache_ent_t * const prev = ent->prev;
+        if (ent->use_count == 0) {
+            fb_cache_unlink(fbc, ent);
+            ent->next = kill;
+            kill = ent;
+            --fbc->n;
+        }
+        ent = prev;
+    }
+    return kill;
+}
+
+// Lock expected
+static void
+fb_cache_src_set(fb_cache_ent_t * const ent, const int * const fds, const struct stat * const st)
+{
+    unsigned int i;
+    for (i = 0; i != ent->bo_count; ++i) {
+        ent->src_fds[i] = fds[i];
+        ent->src_dev[i] = st[i].st_dev;
+        ent->src_ino[i] = st[i].st_ino;
+    }
+}
+
+// Lock expected
+// Once the source has freed a buffer the fd it gave us is either closed or
+// reused for something else
+static bool
+fb_cache_src_gone(const fb_cache_ent_t * const ent)
+{
+    unsigned int i;
+    for (i = 0; i != ent->bo_count; ++i) {
+        struct stat st;
+        if (fstat(ent->src_fds[i], &st) != 0 ||
+            st.st_dev != ent->src_dev[i] || st.st_ino != ent->src_ino[i])
+            return true;
+    }
+    return false;
+}
+
+// Called once the FB using ent has been torn down and its on_delete called
+static void
+fb_cache_ent_unuse(drmu_env_t * const du, fb_cache_ent_t * const ent)
+{
+    fb_cache_env_t * const fbc = env_fbc(du);
+    fb_cache_ent_t * kill;
+
+    pthread_mutex_lock(&fbc->lock);
+    if (--ent->use_count == 0 && fb_cache_src_gone(ent)) {
+        fb_cache_unlink(fbc, ent);
+        --fbc->n;
+        kill = fb_cache_trim(fbc, FB_CACHE_SIZE);
+        ent->next = kill;
+        kill = ent;
+    }
+    else {
+        kill = fb_cache_trim(fbc, FB_CACHE_SIZE);
+    }
+    pthread_mutex_unlock(&fbc->lock);
+
+    fb_cache_ent_free_chain(du, kill);
+}
+
+// Only dmabufs from the dmabuf fs have unique inodes, older kernels used a
+// single anon inode for all of them which makes them useless as a key
+static bool
+fb_cache_fd_ok(const int fd)
+{
+    struct statfs sfs;
+    return fstatfs(fd, &sfs) == 0 && sfs.f_type == DMA_BUF_MAGIC;
+}
+
+static int
+fb_cache_key_make(fb_cache_key_t * const key, struct stat * const st,
+                  const drmu_fb_t * const dfb, const int * const fds, const unsigned int n_fds)
+{
+    unsigned int i;
+
+    memset(key, 0, sizeof(*key));
+
+    for (i = 0; i != n_fds; ++i) {
+        if (fstat(fds[i], st + i) != 0)
+            return -errno;
+    }
+
+    for (i = 0; i != 4; ++i) {
+        const int obj_idx = dfb->layer_obj[i];
+        if (obj_idx < 0)
+            continue;
+        if ((unsigned int)obj_idx >= n_fds)
+            return -EINVAL;
+        key->dev[i] = st[obj_idx].st_dev;
+        key->ino[i] = st[obj_idx].st_ino;
+        key->modifier[i] = dfb->fb.modifier[i];
+        key->pitches[i] = dfb->fb.pitches[i];
+        key->offsets[i] = dfb->fb.offsets[i];
+    }
+    key->width = dfb->fb.width;
+    key->height = dfb->fb.height;
+    key->pixel_format = dfb->fb.pixel_format;
+    return 0;
+}
+
+// Set handles from layer_obj once the BOs are known
+static void
+fb_layer_handles_set(drmu_fb_t * const dfb)
+{
+    unsigned int i;
+    for (i = 0; i != 4; ++i) {
+        if (dfb->layer_obj[i] >= 0)
+            dfb->fb.handles[i] = drmu_bo_handle(dfb->objects[dfb->layer_obj[i]].bo);
+    }
+}
+
+int
+drmu_fb_int_make_fds(drmu_fb_t * const dfb, const int * const fds, const unsigned int n_fds)
+{
+    drmu_env_t * const du = dfb->du;
+    fb_cache_env_t * const fbc = env_fbc(du);
+    fb_cache_ent_t * ent = NULL;
+    fb_cache_ent_t * kill;
+    fb_cache_key_t key;
+    struct stat st[4];
+    bool cache_ok = false;
+    unsigned int i;
+    int rv;
+
+    if (n_fds == 0 || n_fds > 4)
+        return -EINVAL;
+
+    if (fb_cache_key_make(&key, st, dfb, fds, n_fds) == 0) {
+        pthread_mutex_lock(&fbc->lock);
+        if (fbc->enabled < 0) {
+            fbc->enabled = fb_cache_fd_ok(fds[0]);
+            if (!fbc->enabled)
+                drmu_info(du, "%s: dmabuf inodes not unique - FB import cache disabled", __func__);
+        }
+        if ((cache_ok = fbc->enabled) && (ent = fb_cache_find(fbc, &key)) != NULL) {
+            ++ent->use_count;
+            fb_cache_src_set(ent, fds, st);
+            fb_cache_unlink(fbc, ent);
+            fb_cache_link_head(fbc, ent);
+        }
+        pthread_mutex_unlock(&fbc->lock);
+    }
+
+    // Hit - no ioctls required
+    if (ent != NULL) {
+        for (i = 0; i != n_fds; ++i)
+            drmu_fb_int_bo_set(dfb, i, drmu_bo_ref(ent->bos[i]));
+        fb_layer_handles_set(dfb);
+        dfb->fb.fb_id = ent->fb_id;
+        dfb->fb_cache_ent = ent;
+        return 0;
+    }
+
+    for (i = 0; i != n_fds; ++i) {
+        drmu_bo_t * const bo = drmu_bo_new_fd(du, fds[i]);
+        if (bo == NULL)
+            return -ENOMEM;
+        drmu_fb_int_bo_set(dfb, i, bo);
+    }
+    fb_layer_handles_set(dfb);
+
+    if ((rv = drmu_fb_int_make(dfb)) != 0)
+        return rv;
+
+    // Failure to cache isn't an error - the FB just owns its own fb_id
+    if (!cache_ok || (ent = calloc(1, sizeof(*ent))) == NULL)
+        return 0;
+
+    ent->key = key;
+    ent->use_count = 1;
+    ent->bo_count = n_fds;
+    for (i = 0; i != n_fds; ++i)
+        ent->bos[i] = drmu_bo_ref(dfb->objects[i].bo);
+    fb_cache_src_set(ent, fds, st);
+
+    pthread_mutex_lock(&fbc->lock);
+    if (fb_cache_find(fbc, &key) != NULL) {
+        // Lost a race with another import of the same buffer
+        pthread_mutex_unlock(&fbc->lock);
+        fb_cache_ent_free(du, ent);
+        return 0;
+    }
+    ent->fb_id = dfb->fb.fb_id;
+    fb_cache_link_head(fbc, ent);
+    ++fbc->n;
+    kill = fb_cache_trim(fbc, FB_CACHE_SIZE);
+    pthread_mutex_unlock(&fbc->lock);
+
+    dfb->fb_cache_ent = ent;
+    fb_cache_ent_free_chain(du, kill);
+    return 0;
+}
+
+static void
+fb_cache_env_uninit(drmu_env_t * const du)
+{
+    fb_cache_env_t * const fbc = env_fbc(du);
+    fb_cache_ent_t * kill;
+
+    pthread_mutex_lock(&fbc->lock);
+    kill = fb_cache_trim(fbc, 0);
+    if (fbc->n != 0)
+        drmu_warn(du, "%s: %u FB cache entries still in use", __func__, fbc->n);
+    pthread_mutex_unlock(&fbc->lock);
+
+    fb_cache_ent_free_chain(du, kill);
+    pthread_mutex_destroy(&fbc->lock);
+}
+
+static void
+fb_cache_env_init(fb_cache_env_t * const fbc)
+{
+    memset(fbc, 0, sizeof(*fbc));
+    fbc->enabled = -1;
+    pthread_mutex_init(&fbc->lock, NULL);
+}
+
 //----------------------------------------------------------------------------
 //
 // props fns (internal)
@@ -1862,6 +2877,25 @@ props_name_get_blob(const drmu_props_t * const props, const char * const name, v
     return blob_data_read(props->du, (uint32_t)pinfo->val, ppdata, plen);
 }
 
+// As props_name_get_blob but for blobs whose contents never change for a
+// given object so can come from the capability cache
+static int
+props_name_get_static_blob(const drmu_props_t * const props, const uint32_t obj_id, const char * const name,
+                           void ** const ppdata, size_t * const plen)
+{
+    struct drmu_cap_cache_s * const cc = env_cap_cache(props->du);
+    const uint32_t prop_id = props_name_to_id(props, name);
+    int rv;
+
+    if (cc != NULL && prop_id != 0 &&
+        drmu_cap_cache_int_blob_find(cc, obj_id, prop_id, ppdata, plen) == 0)
+        return 0;
+
+    if ((rv = props_name_get_blob(props, name, ppdata, plen)) == 0 && cc != NULL)
+        drmu_cap_cache_int_blob_add(cc, obj_id, prop_id, *ppdata, *plen);
+    return rv;
+}
+
 #if TRACE_PROP_NEW
 static void
 props_dump(const drmu_props_t * const props)
@@ -1932,7 +2966,7 @@ propinfo_fill(drmu_env_t * const du, drmu_propinfo_t * const inf, uint32_t propi
 
     inf->val = val;
     inf->prop.prop_id = propid;
-    if ((rv = drmu_ioctl(du, DRM_IOCTL_MODE_GETPROPERTY, &inf->prop)) != 0)
+    if ((rv = env_getproperty(du, &inf->prop)) != 0)
         drmu_err(du, "Failed to get property %d: %s", propid, strerror(-rv));
     return rv;
 }
@@ -2174,6 +3208,7 @@ typedef struct drmu_crtc_s {
         drmu_prop_range_t * active;
         drmu_prop_range_t * background_color;
         uint32_t mode_id;
+        uint32_t out_fence_ptr;
     } pid;
 
     drmu_blob_t * mode_id_blob;
@@ -2310,9 +3345,25 @@ crtc_init(drmu_env_t * const du, drmu_crtc_t * const dc, const unsigned int idx,
 #endif
         dc->pid.mode_id = props_name_to_id(props, "MODE_ID");
         dc->pid.background_color = drmu_prop_range_new(du, props_name_to_id(props, "BACKGROUND_COLOR"));
+        // Must be looked up before it can be registered
         dc->pid.active = drmu_prop_range_new(du, props_name_to_id(props, "ACTIVE"));
+        dc->pid.out_fence_ptr = props_name_to_id(props, "OUT_FENCE_PTR");
 
         props_free(props);
+
+        // Blob ids are recycled & OUT_FENCE_PTR is a pointer into a fence
+        // that may well be reused so both must always be sent
+        if ((rv = drmu_prop_shadow_int_volatile_add(drmu_env_int_prop_shadow(du), dc->pid.mode_id)) != 0 ||
+            (rv = drmu_prop_shadow_int_volatile_add(drmu_env_int_prop_shadow(du), dc->pid.out_fence_ptr)) != 0) {
+            drmu_err(du, "Failed to add CRTC volatile props to delta shadow: %s", strerror(-rv));
+            return rv;
+        }
+
+        if ((rv = drmu_test_cache_int_modeset_add(drmu_env_int_test_cache(du), dc->pid.mode_id)) != 0 ||
+            (rv = drmu_test_cache_int_modeset_add(drmu_env_int_test_cache(du), drmu_prop_range_id(dc->pid.active))) != 0) {
+            drmu_err(du, "Failed to add CRTC modeset props to test cache: %s", strerror(-rv));
+            return rv;
+        }
     }
 
     return 0;
@@ -2408,6 +3459,38 @@ drmu_atomic_crtc_add_active(struct drmu_atomic_s * const da, drmu_crtc_t * const
     return drmu_atomic_add_prop_range(da, dc->crtc.crtc_id, dc->pid.active, val);
 }
 
+int
+drmu_atomic_crtc_add_out_fence(struct drmu_atomic_s * const da, drmu_crtc_t * const dc, drmu_fence_t ** const ppfence)
+{
+    drmu_fence_t * fence;
+    int rv;
+
+    *ppfence = NULL;
+    if (dc->pid.out_fence_ptr == 0)
+        return -ENOENT;
+    if ((fence = fence_new(-1)) == NULL)
+        return -ENOMEM;
+
+    rv = drmu_atomic_add_prop_generic(da, dc->crtc.crtc_id, dc->pid.out_fence_ptr, (uintptr_t)&fence->fd,
+                                      &atomic_prop_fence_fns, fence);
+    if (rv == 0)
+        *ppfence = drmu_fence_ref(fence);
+    drmu_fence_unref(&fence);
+    return rv;
+}
+
+static void
+atomic_fb_release_fence_set_cb(void * prop_v, void * v)
+{
+    drmu_fb_release_fence_set(prop_v, v);
+}
+
+void
+drmu_atomic_fb_release_fence_set(struct drmu_atomic_s * const da, drmu_fence_t * const fence)
+{
+    drmu_atomic_int_prop_v_foreach(da, &atomic_prop_fb_fns, atomic_fb_release_fence_set_cb, fence);
+}
+
 bool
 drmu_crtc_has_background_color(const drmu_crtc_t * const dc)
 {
@@ -2510,6 +3593,15 @@ static const char * conn_type_names[32] = {
 #endif
 };
 
+// Connection state & mode list from a probe. Never changed once published;
+// a reprobe that finds a change swaps in a new one under state_lock & frees
+// the old. Readers copy out what they want under state_lock.
+typedef struct conn_state_s {
+    uint32_t connection;
+    unsigned int count_modes;
+    struct drm_mode_modeinfo * modes;
+} conn_state_t;
+
 struct drmu_conn_s {
     drmu_env_t * du;
     unsigned int conn_idx;
@@ -2517,11 +3609,11 @@ struct drmu_conn_s {
     atomic_int ref_count;
     bool saved;
 
-    struct drm_mode_get_connector conn;
+    struct drm_mode_get_connector conn;  // As at init; see state for modes
     bool probed;
-    unsigned int modes_size;
+    pthread_mutex_t state_lock;  // Held only to swap or copy from state
+    conn_state_t * state;
     unsigned int enc_ids_size;
-    struct drm_mode_modeinfo * modes;
     uint32_t * enc_ids;
 
     uint32_t avail_crtc_mask;
@@ -2691,17 +3783,57 @@ drmu_conn_has_writeback_format(drmu_conn_t * const dn, const uint32_t fmt)
                 sizeof(*dn->writeback_fmts_sorted), wb_fmt_cmp_cb) != NULL;
 }
 
-const struct drm_mode_modeinfo *
-drmu_conn_modeinfo(const drmu_conn_t * const dn, const int mode_id)
+// The lock isn't part of the conn's value so const conns may take it
+static const conn_state_t *
+conn_state_lock(const drmu_conn_t * const dn)
+{
+    pthread_mutex_lock(&((drmu_conn_t *)dn)->state_lock);
+    return dn->state;
+}
+
+static void
+conn_state_unlock(const drmu_conn_t * const dn)
 {
-    return !dn || mode_id < 0 || (unsigned int)mode_id >= dn->conn.count_modes ? NULL :
-        dn->modes + mode_id;
+    pthread_mutex_unlock(&((drmu_conn_t *)dn)->state_lock);
+}
+
+// Lock expected
+static const struct drm_mode_modeinfo *
+conn_state_modeinfo(const conn_state_t * const cs, const int mode_id)
+{
+    return !cs || mode_id < 0 || (unsigned int)mode_id >= cs->count_modes ? NULL :
+        cs->modes + mode_id;
+}
+
+int
+drmu_conn_modeinfo_get(const drmu_conn_t * const dn, const int mode_id, struct drm_mode_modeinfo * const mi)
+{
+    const struct drm_mode_modeinfo * src;
+    int rv = -ENOENT;
+
+    if (!dn)
+        return -ENOENT;
+
+    src = conn_state_modeinfo(conn_state_lock(dn), mode_id);
+    if (src != NULL) {
+        *mi = *src;
+        rv = 0;
+    }
+    conn_state_unlock(dn);
+    return rv;
 }
 
 drmu_mode_simple_params_t
 drmu_conn_mode_simple_params(const drmu_conn_t * const dn, const int mode_id)
 {
-    return modeinfo_simple_params(drmu_conn_modeinfo(dn, mode_id));
+    drmu_mode_simple_params_t sp;
+
+    if (!dn)
+        return modeinfo_simple_params(NULL);
+
+    sp = modeinfo_simple_params(conn_state_modeinfo(conn_state_lock(dn), mode_id));
+    conn_state_unlock(dn);
+    return sp;
 }
 
 bool
@@ -2751,66 +3883,122 @@ conn_uninit(drmu_conn_t * const dn)
 
     drmu_blob_unref(&dn->hdr_metadata_blob);
 
-    free(dn->modes);
+    if (dn->state != NULL) {
+        free(dn->state->modes);
+        free(dn->state);
+        dn->state = NULL;
+    }
+    pthread_mutex_destroy(&dn->state_lock);
     free(dn->enc_ids);
     free(dn->writeback_fmts);
     free(dn->writeback_fmts_sorted);
-    dn->modes = NULL;
     dn->enc_ids = NULL;
     dn->writeback_fmts = NULL;
     dn->writeback_fmts_sorted = NULL;
-    dn->modes_size = 0;
     dn->enc_ids_size = 0;
     dn->writeback_fmts_count = 0;
 }
 
-// Assumes zeroed before entry
+// Get connector info, growing the modes & encoder arrays as needed
+// * As count_modes == 0 this probes - do we really want this?
 static int
-conn_init(drmu_env_t * const du, drmu_conn_t * const dn, unsigned int conn_idx, const uint32_t conn_id)
+conn_get_info(drmu_env_t * const du, const uint32_t conn_id, struct drm_mode_get_connector * const pconn,
+              struct drm_mode_modeinfo ** const pmodes, unsigned int * const pmodes_size,
+              uint32_t ** const penc_ids, unsigned int * const penc_ids_size)
 {
-    int rv;
-    drmu_props_t * props;
     uint32_t modes_req = 0;
     uint32_t encs_req = 0;
-
-    dn->du = du;
-    dn->conn_idx = conn_idx;
-    // * As count_modes == 0 this probes - do we really want this?
+    int rv;
 
     do {
-        memset(&dn->conn, 0, sizeof(dn->conn));
-        dn->conn.connector_id = conn_id;
+        memset(pconn, 0, sizeof(*pconn));
+        pconn->connector_id = conn_id;
 
-        if (modes_req > dn->modes_size) {
-            free(dn->modes);
-            if (io_alloc(dn->modes, modes_req) == 0) {
+        if (modes_req > *pmodes_size) {
+            free(*pmodes);
+            if (io_alloc(*pmodes, modes_req) == 0) {
                 drmu_err(du, "Failed to alloc modes array");
-                goto fail;
+                *pmodes_size = 0;
+                return -ENOMEM;
             }
-            dn->modes_size = modes_req;
+            *pmodes_size = modes_req;
         }
-        dn->conn.modes_ptr = (uintptr_t)dn->modes;
-        dn->conn.count_modes = modes_req;
+        pconn->modes_ptr = (uintptr_t)*pmodes;
+        pconn->count_modes = modes_req;
 
-        if (encs_req > dn->enc_ids_size) {
-            free(dn->enc_ids);
-            if (io_alloc(dn->enc_ids, encs_req) == 0) {
+        if (encs_req > *penc_ids_size) {
+            free(*penc_ids);
+            if (io_alloc(*penc_ids, encs_req) == 0) {
                 drmu_err(du, "Failed to alloc encs array");
-                goto fail;
+                *penc_ids_size = 0;
+                return -ENOMEM;
             }
-            dn->enc_ids_size = encs_req;
+            *penc_ids_size = encs_req;
         }
-        dn->conn.encoders_ptr = (uintptr_t)dn->enc_ids;
-        dn->conn.count_encoders = encs_req;
+        pconn->encoders_ptr = (uintptr_t)*penc_ids;
+        pconn->count_encoders = encs_req;
 
-        if ((rv = drmu_ioctl(du, DRM_IOCTL_MODE_GETCONNECTOR, &dn->conn)) != 0) {
-            drmu_err(du, "Get connector id %d failed: %s", dn->conn.connector_id, strerror(-rv));
-            goto fail;
+        if ((rv = drmu_ioctl(du, DRM_IOCTL_MODE_GETCONNECTOR, pconn)) != 0) {
+            drmu_err(du, "Get connector id %d failed: %s", conn_id, strerror(-rv));
+            return rv;
         }
-        modes_req = dn->conn.count_modes;
-        encs_req = dn->conn.count_encoders;
+        modes_req = pconn->count_modes;
+        encs_req = pconn->count_encoders;
+
+    } while (*pmodes_size < modes_req || *penc_ids_size < encs_req);
+
+    return 0;
+}
+
+// Publish a new state & free the old. Takes ownership of modes (freed on
+// error). Writers must be serialised (hotplug_lock once the env is up).
+static int
+conn_state_set(drmu_conn_t * const dn, const struct drm_mode_get_connector * const conn,
+               struct drm_mode_modeinfo * const modes)
+{
+    conn_state_t * const cs = malloc(sizeof(*cs));
+    conn_state_t * old;
+
+    if (cs == NULL) {
+        free(modes);
+        return -ENOMEM;
+    }
+    cs->connection = conn->connection;
+    cs->count_modes = conn->count_modes;
+    cs->modes = modes;
+
+    pthread_mutex_lock(&dn->state_lock);
+    old = dn->state;
+    dn->state = cs;
+    pthread_mutex_unlock(&dn->state_lock);
+
+    if (old != NULL) {
+        free(old->modes);
+        free(old);
+    }
+    return 0;
+}
+
+// Assumes zeroed before entry
+static int
+conn_init(drmu_env_t * const du, drmu_conn_t * const dn, unsigned int conn_idx, const uint32_t conn_id)
+{
+    int rv;
+    drmu_props_t * props;
+    struct drm_mode_modeinfo * modes = NULL;
+    unsigned int modes_size = 0;
 
-    } while (dn->modes_size < modes_req || dn->enc_ids_size < encs_req);
+    dn->du = du;
+    dn->conn_idx = conn_idx;
+    pthread_mutex_init(&dn->state_lock, NULL);
+
+    if ((rv = conn_get_info(du, conn_id, &dn->conn, &modes, &modes_size,
+                            &dn->enc_ids, &dn->enc_ids_size)) != 0) {
+        free(modes);
+        goto fail;
+    }
+    if ((rv = conn_state_set(dn, &dn->conn, modes)) != 0)
+        goto fail;
 
     dn->probed = true;
 
@@ -2852,6 +4040,19 @@ conn_init(drmu_env_t * const du, drmu_conn_t * const dn, unsigned int conn_idx,
         dn->pid.hdr_output_metadata = props_name_to_id(props, "HDR_OUTPUT_METADATA");
         dn->pid.writeback_fb_id     = props_name_to_id(props, "WRITEBACK_FB_ID");
         dn->pid.writeback_out_fence_ptr = props_name_to_id(props, "WRITEBACK_OUT_FENCE_PTR");
+        if (dn->pid.crtc_id != NULL &&
+            (rv = drmu_test_cache_int_modeset_add(drmu_env_int_test_cache(du), dn->pid.crtc_id->prop_id)) != 0) {
+            drmu_err(du, "Failed to add conn modeset prop to test cache: %s", strerror(-rv));
+            props_free(props);
+            goto fail;
+        }
+        if ((rv = drmu_prop_shadow_int_volatile_add(drmu_env_int_prop_shadow(du), dn->pid.hdr_output_metadata)) != 0 ||
+            (rv = drmu_prop_shadow_int_volatile_add(drmu_env_int_prop_shadow(du), dn->pid.writeback_fb_id)) != 0 ||
+            (rv = drmu_prop_shadow_int_volatile_add(drmu_env_int_prop_shadow(du), dn->pid.writeback_out_fence_ptr)) != 0) {
+            drmu_err(du, "Failed to add conn volatile props to delta shadow: %s", strerror(-rv));
+            props_free(props);
+            goto fail;
+        }
 
         props_name_get_blob(props, "WRITEBACK_PIXEL_FORMATS", &wb_blob_data, &wb_blob_len);
         props_free(props);
@@ -2874,6 +4075,64 @@ fail:
     return rv;
 }
 
+// Re-read connection state & modes after a hotplug
+// A new state is only published if something has changed.
+// hotplug_lock must be held.
+static int
+conn_reprobe(drmu_conn_t * const dn)
+{
+    drmu_env_t * const du = dn->du;
+    // Only we change state so no need to lock to read it
+    const conn_state_t * const cs = dn->state;
+    struct drm_mode_get_connector conn;
+    struct drm_mode_modeinfo * modes = NULL;
+    uint32_t * enc_ids = NULL;
+    unsigned int modes_size = 0;
+    unsigned int enc_ids_size = 0;
+    bool changed;
+    int rv;
+
+    if ((rv = conn_get_info(du, dn->conn.connector_id, &conn, &modes, &modes_size,
+                            &enc_ids, &enc_ids_size)) != 0)
+        goto done;
+
+    changed = conn.connection != cs->connection ||
+        conn.count_modes != cs->count_modes ||
+        (conn.count_modes != 0 &&
+         memcmp(modes, cs->modes, conn.count_modes * sizeof(*modes)) != 0);
+
+    if (changed) {
+        rv = conn_state_set(dn, &conn, modes);
+        modes = NULL;
+        if (rv != 0)
+            goto done;
+    }
+    rv = changed;
+
+done:
+    free(modes);
+    free(enc_ids);
+    return rv;
+}
+
+bool
+drmu_conn_is_connected(const drmu_conn_t * const dn)
+{
+    const conn_state_t * const cs = conn_state_lock(dn);
+    const bool connected = cs != NULL && cs->connection == DRM_MODE_CONNECTED;
+    conn_state_unlock(dn);
+    return connected;
+}
+
+static unsigned int
+conn_mode_count(const drmu_conn_t * const dn)
+{
+    const conn_state_t * const cs = conn_state_lock(dn);
+    const unsigned int n = cs == NULL ? 0 : cs->count_modes;
+    conn_state_unlock(dn);
+    return n;
+}
+
 // Use the same claim logic as we do for planes
 // As it stands we don't do anything much on final unref so the logic
 // isn't really needed but it doesn't cost us much so do this way against
@@ -2995,6 +4254,7 @@ typedef struct drmu_plane_s {
     struct {
         uint32_t crtc_id;
         uint32_t fb_id;
+        uint32_t in_fence_fd;
         drmu_prop_range_t * crtc_h;
         drmu_prop_range_t * crtc_w;
         uint32_t crtc_x;
@@ -3013,6 +4273,10 @@ typedef struct drmu_plane_s {
         drmu_prop_range_t * zpos;
     } pid;
 
+    enum_intern_map_t color_encoding_map;
+    enum_intern_map_t color_range_map;
+    enum_intern_map_t pixel_blend_mode_map;
+
     unsigned int rot_mask;
     uint64_t rot_vals[8];
 } drmu_plane_t;
@@ -3027,6 +4291,11 @@ plane_set_atomic(drmu_atomic_t * const da,
                 uint32_t src_w, uint32_t src_h)
 {
     const uint32_t plid = dp->plane.plane_id;
+    int rv;
+
+    // First as it may wait & fail
+    if ((rv = atomic_fb_add_in_fence(da, plid, dp->pid.in_fence_fd, dfb)) != 0)
+        return rv;
     drmu_atomic_add_prop_value(da, plid, dp->pid.crtc_id, dfb == NULL ? 0 : drmu_crtc_id(dp->dc));
     drmu_atomic_add_prop_fb(da, plid, dp->pid.fb_id, dfb);
     drmu_atomic_add_prop_value(da, plid, dp->pid.crtc_x, crtc_x);
@@ -3105,9 +4374,12 @@ drmu_atomic_plane_add_fb(drmu_atomic_t * const da, drmu_plane_t * const dp,
                               dfb->crop.w, dfb->crop.h)) != 0)
         return rv;
 
-    drmu_atomic_add_prop_enum(da, plid, dp->pid.pixel_blend_mode, dfb->pixel_blend_mode);
-    drmu_atomic_add_prop_enum(da, plid, dp->pid.color_encoding,   dfb->color_encoding);
-    drmu_atomic_add_prop_enum(da, plid, dp->pid.color_range,      dfb->color_range);
+    atomic_add_prop_enum_interned(da, plid, dp->pid.pixel_blend_mode, &dp->pixel_blend_mode_map,
+                                  dfb->pixel_blend_mode_id, dfb->pixel_blend_mode);
+    atomic_add_prop_enum_interned(da, plid, dp->pid.color_encoding, &dp->color_encoding_map,
+                                  dfb->color_encoding_id, dfb->color_encoding);
+    atomic_add_prop_enum_interned(da, plid, dp->pid.color_range, &dp->color_range_map,
+                                  dfb->color_range_id, dfb->color_range);
     drmu_atomic_plane_add_chroma_siting(da, dp, dfb->chroma_siting);
     return 0;
 }
@@ -3306,6 +4578,21 @@ plane_uninit(drmu_plane_t * const dp)
     dp->formats_in = NULL;
 }
 
+// Check that the IN_FORMATS blob really holds the arrays its header says
+// it does - it may have come from the capability cache file
+static bool
+plane_formats_valid(const void * const blob, const size_t len)
+{
+    const struct drm_format_modifier_blob * const hdr = blob;
+
+    return blob != NULL && len >= sizeof(*hdr) &&
+        hdr->formats_offset % sizeof(uint32_t) == 0 &&
+        hdr->formats_offset <= len &&
+        hdr->count_formats <= (len - hdr->formats_offset) / sizeof(uint32_t) &&
+        hdr->modifiers_offset % sizeof(uint64_t) == 0 &&
+        hdr->modifiers_offset <= len &&
+        hdr->count_modifiers <= (len - hdr->modifiers_offset) / sizeof(struct drm_format_modifier);
+}
 
 static int
 plane_init(drmu_env_t * const du, drmu_plane_t * const dp, const uint32_t plane_id)
@@ -3342,11 +4629,23 @@ plane_init(drmu_env_t * const du, drmu_plane_t * const dp, const uint32_t plane_
         (dp->pid.src_w  = drmu_prop_range_new(du, props_name_to_id(props, "SRC_W"))) == NULL ||
         (dp->pid.src_x  = props_name_to_id(props, "SRC_X")) == 0 ||
         (dp->pid.src_y  = props_name_to_id(props, "SRC_Y")) == 0 ||
-        props_name_get_blob(props, "IN_FORMATS", &dp->formats_in, &dp->formats_in_len) != 0)
+        props_name_get_static_blob(props, plane_id, "IN_FORMATS", &dp->formats_in, &dp->formats_in_len) != 0)
     {
         drmu_err(du, "%s: failed to find required id", __func__);
         goto fail;
     }
+    dp->pid.in_fence_fd = props_name_to_id(props, "IN_FENCE_FD");
+    // FB ids are recycled so the same id may well be a different FB. As are
+    // fds - and the kernel forgets the fence after each commit anyway
+    if ((rv = drmu_prop_shadow_int_volatile_add(drmu_env_int_prop_shadow(du), dp->pid.fb_id)) != 0 ||
+        (rv = drmu_prop_shadow_int_volatile_add(drmu_env_int_prop_shadow(du), dp->pid.in_fence_fd)) != 0) {
+        drmu_err(du, "%s: Failed to add volatile props to delta shadow: %s", __func__, strerror(-rv));
+        goto fail_rv;
+    }
+    if (!plane_formats_valid(dp->formats_in, dp->formats_in_len)) {
+        drmu_err(du, "%s: Bad IN_FORMATS blob on plane %#x", __func__, plane_id);
+        goto fail;
+    }
     dp->fmts_hdr = dp->formats_in;
 
     if ((dp->fmt_idxs = malloc(sizeof(*dp->fmt_idxs) * dp->fmts_hdr->count_formats)) == NULL)
@@ -3376,6 +4675,9 @@ plane_init(drmu_env_t * const du, drmu_plane_t * const dp, const uint32_t plane_
     dp->pid.zpos             = drmu_prop_range_new(du, props_name_to_id(props, "zpos"));
 
     dp->rot_mask = rotation_make_array(dp->pid.rotation, dp->rot_vals);
+    enum_intern_map_init(&dp->color_encoding_map, dp->pid.color_encoding, intern_color_encodings);
+    enum_intern_map_init(&dp->color_range_map, dp->pid.color_range, intern_color_ranges);
+    enum_intern_map_init(&dp->pixel_blend_mode_map, dp->pid.pixel_blend_mode, intern_pixel_blend_modes);
 
     {
         const drmu_propinfo_t * const pinfo = props_name_to_propinfo(props, "type");
@@ -3399,14 +4701,28 @@ plane_init(drmu_env_t * const du, drmu_plane_t * const dp, const uint32_t plane_
     return 0;
 
 fail:
+    rv = -EINVAL;
+fail_rv:
+    // Not yet counted in plane_count so env_free_planes won't do this
+    plane_uninit(dp);
     props_free(props);
-    return -EINVAL;
+    return rv;
 }
 
 //----------------------------------------------------------------------------
 //
 // Env fns
 
+// Max listeners for connector hotplug
+#define ENV_HOTPLUG_LISTENERS_MAX 8
+
+typedef struct env_hotplug_listener_s {
+    drmu_env_hotplug_fn * fn;
+    drmu_env_hotplug_ref_fn * ref_fn;
+    drmu_env_hotplug_unref_fn * unref_fn;
+    void * v;
+} env_hotplug_listener_t;
+
 typedef struct drmu_env_s {
     atomic_int ref_count;  // 0 == 1 ref for ease of init
     bool kill;
@@ -3421,11 +4737,36 @@ typedef struct drmu_env_s {
     drmu_log_env_t log;
 
     pthread_mutex_t lock;
+    // Serialises reads of DRM events & calls to their handlers
+    pthread_mutex_t event_lock;
+    // Registered event handlers - protected by event_lock
+    drmu_event_handler_t ** evhs;
+    unsigned int evh_n;
+    unsigned int evh_size;
+    uint64_t evh_id_next;
 
     // global env for bo tracking
     drmu_bo_env_t boe;
+    // FB import cache
+    fb_cache_env_t fbc;
     // global atomic for restore op
     drmu_atomic_t * da_restore;
+    // Atomic allocation cache
+    struct drmu_atomic_cache_s * atomic_cache;
+    // Committed props for delta commits
+    struct drmu_prop_shadow_s * prop_shadow;
+    // TEST_ONLY results
+    struct drmu_test_cache_s * test_cache;
+    // Deferred fb teardown; NULL if fbs are freed synchronously
+    _Atomic(struct fb_reaper_s *) fb_reaper;
+    // Kernel has DRM_IOCTL_MODE_CLOSEFB - probed once at init
+    bool has_closefb;
+    // Persisted prop definitions; NULL if disabled
+    struct drmu_cap_cache_s * cap_cache;
+    // Serialises conn reprobes & guards the listener list
+    pthread_mutex_t hotplug_lock;
+    unsigned int hotplug_n;
+    env_hotplug_listener_t hotplug_listeners[ENV_HOTPLUG_LISTENERS_MAX];
 
     struct drmu_queue_s * poll_env;
     drmu_poll_destroy_fn poll_destroy;
@@ -3600,6 +4941,205 @@ env_boe(drmu_env_t * const du)
     return &du->boe;
 }
 
+static struct fb_cache_env_s *
+env_fbc(drmu_env_t * const du)
+{
+    return &du->fbc;
+}
+
+static struct fb_reaper_s *
+env_fb_reaper(drmu_env_t * const du)
+{
+    return atomic_load(&du->fb_reaper);
+}
+
+static struct drmu_cap_cache_s *
+env_cap_cache(drmu_env_t * const du)
+{
+    return du->cap_cache;
+}
+
+static int
+env_getproperty(drmu_env_t * const du, struct drm_mode_get_property * const prop)
+{
+    return du->cap_cache == NULL ?
+        drmu_ioctl(du, DRM_IOCTL_MODE_GETPROPERTY, prop) :
+        drmu_cap_cache_int_getproperty(du->cap_cache, prop);
+}
+
+void
+drmu_env_cap_cache_stats(drmu_env_t * const du, uint64_t * const pHits, uint64_t * const pMisses)
+{
+    *pHits = 0;
+    *pMisses = 0;
+    if (du->cap_cache != NULL)
+        drmu_cap_cache_int_stats(du->cap_cache, pHits, pMisses);
+}
+
+// Remove an fb id. CLOSEFB (if the kernel has it) leaves the planes alone
+// where RMFB disables any plane still using the fb & waits for that.
+static void
+env_fb_remove(drmu_env_t * const du, uint32_t fb_id)
+{
+#ifdef DRM_IOCTL_MODE_CLOSEFB
+    if (du->has_closefb) {
+        struct drm_mode_closefb cfb = {.fb_id = fb_id};
+        const int rv = drmu_ioctl(du, DRM_IOCTL_MODE_CLOSEFB, &cfb);
+
+        if (rv == 0)
+            return;
+        drmu_warn(du, "%s: CLOSEFB %#x failed: %s - using RMFB", __func__, fb_id, strerror(-rv));
+    }
+#endif
+    drmu_ioctl(du, DRM_IOCTL_MODE_RMFB, &fb_id);
+}
+
+// Closing fb id 0 fails with ENOENT if the kernel has CLOSEFB; kernels
+// without it reject the ioctl itself (EINVAL or ENOTTY)
+static bool
+env_has_closefb(drmu_env_t * const du)
+{
+#ifdef DRM_IOCTL_MODE_CLOSEFB
+    struct drm_mode_closefb cfb = {.fb_id = 0};
+    return drmu_ioctl(du, DRM_IOCTL_MODE_CLOSEFB, &cfb) == -ENOENT;
+#else
+    (void)du;
+    return false;
+#endif
+}
+
+int
+drmu_env_fb_reaper_start(drmu_env_t * const du)
+{
+    int rv = 0;
+
+    pthread_mutex_lock(&du->lock);
+    if (atomic_load(&du->fb_reaper) == NULL) {
+        fb_reaper_t * const r = fb_reaper_new(du);
+        if (r == NULL)
+            rv = -ENOMEM;
+        atomic_store(&du->fb_reaper, r);
+    }
+    pthread_mutex_unlock(&du->lock);
+    return rv;
+}
+
+int
+drmu_env_hotplug_listener_add(drmu_env_t * const du, drmu_env_hotplug_fn * const fn,
+                              drmu_env_hotplug_ref_fn * const ref_fn, drmu_env_hotplug_unref_fn * const unref_fn,
+                              void * const v)
+{
+    int rv = 0;
+
+    pthread_mutex_lock(&du->hotplug_lock);
+    if (du->hotplug_n >= ENV_HOTPLUG_LISTENERS_MAX)
+        rv = -ENOSPC;
+    else
+        du->hotplug_listeners[du->hotplug_n++] = (env_hotplug_listener_t){
+            .fn = fn, .ref_fn = ref_fn, .unref_fn = unref_fn, .v = v};
+    pthread_mutex_unlock(&du->hotplug_lock);
+    return rv;
+}
+
+void
+drmu_env_hotplug_listener_remove(drmu_env_t * const du, drmu_env_hotplug_fn * const fn, void * const v)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&du->hotplug_lock);
+    for (i = 0; i != du->hotplug_n; ++i) {
+        if (du->hotplug_listeners[i].fn == fn && du->hotplug_listeners[i].v == v) {
+            memmove(du->hotplug_listeners + i, du->hotplug_listeners + i + 1,
+                    (du->hotplug_n - i - 1) * sizeof(du->hotplug_listeners[0]));
+            --du->hotplug_n;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&du->hotplug_lock);
+}
+
+int
+drmu_conn_reprobe(drmu_conn_t * const dn)
+{
+    drmu_env_t * const du = dn->du;
+    int rv;
+
+    pthread_mutex_lock(&du->hotplug_lock);
+    rv = conn_reprobe(dn);
+    pthread_mutex_unlock(&du->hotplug_lock);
+    return rv;
+}
+
+// Copy out every listener whose v we can get a ref on. Lock must be held.
+static unsigned int
+env_hotplug_listeners_ref(drmu_env_t * const du, env_hotplug_listener_t * const ls)
+{
+    unsigned int n = 0;
+    unsigned int i;
+
+    for (i = 0; i != du->hotplug_n; ++i) {
+        const env_hotplug_listener_t * const l = du->hotplug_listeners + i;
+        // Skip anything already being freed
+        if (l->ref_fn == NULL || l->ref_fn(l->v))
+            ls[n++] = *l;
+    }
+    return n;
+}
+
+int
+drmu_env_hotplug_event(drmu_env_t * const du, const uint32_t conn_id)
+{
+    unsigned int changed = 0;
+    bool found = false;
+    uint32_t i;
+
+    // Conns are fixed once the env is up so only the reprobe needs the lock
+    for (i = 0; i != du->conn_count; ++i) {
+        drmu_conn_t * const dn = du->conns + i;
+        env_hotplug_listener_t ls[ENV_HOTPLUG_LISTENERS_MAX];
+        unsigned int n = 0;
+        unsigned int j;
+        int rv;
+
+        if (conn_id != 0 && dn->conn.connector_id != conn_id)
+            continue;
+        found = true;
+
+        pthread_mutex_lock(&du->hotplug_lock);
+        if ((rv = conn_reprobe(dn)) > 0) {
+            // Whatever we last committed to (or tested on) this display may
+            // no longer be true - after a power cycle it may not have any
+            // state
+            if (changed++ == 0) {
+                drmu_env_test_cache_invalidate(du);
+                drmu_env_delta_invalidate(du);
+            }
+            n = env_hotplug_listeners_ref(du, ls);
+        }
+        pthread_mutex_unlock(&du->hotplug_lock);
+
+        if (rv <= 0)
+            continue;
+
+        drmu_info(du, "Hotplug: %s %s, %d modes", drmu_conn_name(dn),
+                  drmu_conn_is_connected(dn) ? "connected" : "disconnected", conn_mode_count(dn));
+        // Unlocked so listeners may remove themselves or drop the last ref
+        // on their v
+        for (j = 0; j != n; ++j) {
+            ls[j].fn(ls[j].v, dn, drmu_conn_is_connected(dn));
+            if (ls[j].unref_fn != NULL)
+                ls[j].unref_fn(ls[j].v);
+        }
+    }
+
+    if (!found) {
+        // MST & the like can add connectors - we don't track those
+        drmu_debug(du, "%s: Unknown conn id %u", __func__, conn_id);
+        return -ENOENT;
+    }
+    return (int)changed;
+}
+
 static void
 env_restore(drmu_env_t * const du)
 {
@@ -3619,6 +5159,24 @@ env_restore(drmu_env_t * const du)
     drmu_atomic_unref(&du->da_restore);
 }
 
+struct drmu_atomic_cache_s *
+drmu_env_int_atomic_cache(drmu_env_t * const du)
+{
+    return du->atomic_cache;
+}
+
+struct drmu_prop_shadow_s *
+drmu_env_int_prop_shadow(drmu_env_t * const du)
+{
+    return du->prop_shadow;
+}
+
+struct drmu_test_cache_s *
+drmu_env_int_test_cache(drmu_env_t * const du)
+{
+    return du->test_cache;
+}
+
 void
 drmu_env_int_restore(drmu_env_t * const du)
 {
@@ -3639,7 +5197,25 @@ env_free(drmu_env_t * const du)
     env_free_planes(du);
     env_free_conns(du);
     env_free_crtcs(du);
+    // Anything still waiting for teardown uses the cache & BOs
+    {
+        fb_reaper_t * r = atomic_exchange(&du->fb_reaper, NULL);
+        fb_reaper_stop(&r);
+    }
+    // Cache entries hold BOs so must go first
+    fb_cache_env_uninit(du);
     drmu_bo_env_uninit(&du->boe);
+    // Atomics (inc. da_restore) must all be gone before this
+    drmu_atomic_int_cache_free(du->atomic_cache);
+    drmu_prop_shadow_int_free(du->prop_shadow);
+    drmu_test_cache_int_free(du->test_cache);
+    // Saved once after probe - don't do file I/O on whatever thread frees us
+    drmu_cap_cache_int_free(du->cap_cache);
+    pthread_mutex_destroy(&du->hotplug_lock);
+    if (du->evh_n != 0)
+        drmu_warn(du, "%s: %u event handlers still registered", __func__, du->evh_n);
+    free(du->evhs);
+    pthread_mutex_destroy(&du->event_lock);
     pthread_mutex_destroy(&du->lock);
 
     {
@@ -3707,6 +5283,18 @@ drmu_env_ref(drmu_env_t * const du)
     return du;
 }
 
+// Ref unless the last ref has already gone & the env is being freed
+static bool
+env_ref_try(drmu_env_t * const du)
+{
+    int n = atomic_load(&du->ref_count);
+    while (n >= 0) {
+        if (atomic_compare_exchange_weak(&du->ref_count, &n, n + 1))
+            return true;
+    }
+    return false;
+}
+
 static int
 env_object_state_save(drmu_env_t * const du, const uint32_t obj_id, const uint32_t obj_type)
 {
@@ -3830,6 +5418,109 @@ drmu_env_int_poll_set(drmu_env_t * const du,
     return rv;
 }
 
+int
+drmu_env_int_event_handler_add(drmu_env_t * const du, drmu_event_handler_t * const evh)
+{
+    int rv = 0;
+
+    pthread_mutex_lock(&du->event_lock);
+    if (du->evh_n >= du->evh_size) {
+        const unsigned int size = du->evh_size < 4 ? 4 : du->evh_size * 2;
+        drmu_event_handler_t ** const evhs = realloc(du->evhs, size * sizeof(*evhs));
+        if (evhs == NULL) {
+            rv = -ENOMEM;
+            goto fail;
+        }
+        du->evhs = evhs;
+        du->evh_size = size;
+    }
+    evh->id = ++du->evh_id_next;
+    du->evhs[du->evh_n++] = evh;
+fail:
+    pthread_mutex_unlock(&du->event_lock);
+    return rv;
+}
+
+void
+drmu_env_int_event_handler_remove(drmu_env_t * const du, drmu_event_handler_t * const evh)
+{
+    unsigned int i;
+
+    // Taking the lock also waits for any call to fn in progress
+    pthread_mutex_lock(&du->event_lock);
+    for (i = 0; i != du->evh_n; ++i) {
+        if (du->evhs[i] == evh) {
+            du->evhs[i] = du->evhs[--du->evh_n];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&du->event_lock);
+}
+
+// Lock expected
+static const drmu_event_handler_t *
+env_event_handler_find(const drmu_env_t * const du, const uint64_t id)
+{
+    unsigned int i;
+
+    for (i = 0; i != du->evh_n; ++i) {
+        if (du->evhs[i]->id == id)
+            return du->evhs[i];
+    }
+    return NULL;
+}
+
+int
+drmu_env_int_events_dispatch(drmu_env_t * const du)
+{
+    // Events are small - this should hold everything that can be pending
+    uint64_t buf[512];
+    struct pollfd pf = {.fd = du->fd, .events = POLLIN};
+    ssize_t len;
+    size_t off;
+    int n = 0;
+
+    // The DRM fd is blocking and there may be multiple readers so check that
+    // there is something to read with the lock held. Handlers are called
+    // with it held too so that once removed they are never called.
+    pthread_mutex_lock(&du->event_lock);
+    if (poll(&pf, 1, 0) <= 0 || (pf.revents & POLLIN) == 0) {
+        pthread_mutex_unlock(&du->event_lock);
+        return 0;
+    }
+    len = read(du->fd, buf, sizeof(buf));
+
+    if (len < 0) {
+        const int err = errno;
+        pthread_mutex_unlock(&du->event_lock);
+        drmu_err(du, "%s: Read failed: %s", __func__, strerror(err));
+        return -err;
+    }
+
+    for (off = 0; off + sizeof(struct drm_event) <= (size_t)len;) {
+        const struct drm_event * const ev = (const struct drm_event *)((const uint8_t *)buf + off);
+
+        if (ev->length < sizeof(*ev) || off + ev->length > (size_t)len)
+            break;
+
+        if ((ev->type == DRM_EVENT_FLIP_COMPLETE || ev->type == DRM_EVENT_VBLANK) &&
+            ev->length >= sizeof(struct drm_event_vblank)) {
+            const struct drm_event_vblank * const vb = (const struct drm_event_vblank *)ev;
+            // Unknown if its handler has been removed (e.g. a Q that gave up
+            // waiting for it)
+            const drmu_event_handler_t * const evh = env_event_handler_find(du, vb->user_data);
+
+            if (evh != NULL && evh->fn != NULL)
+                evh->fn(evh->v, vb);
+            ++n;
+        }
+        off += ev->length;
+    }
+    pthread_mutex_unlock(&du->event_lock);
+
+    return n;
+}
+
 struct drmu_queue_s *
 drmu_env_int_poll_get(drmu_env_t * const du)
 {
@@ -3840,6 +5531,55 @@ drmu_env_int_poll_get(drmu_env_t * const du)
     return pe;
 }
 
+static uint64_t
+env_ids_hash(uint64_t h, const uint32_t n, const uint32_t * const ids)
+{
+    uint32_t i;
+
+    h = (h ^ n) * 0x100000001b3ULL;
+    for (i = 0; i != n; ++i)
+        h = (h ^ ids[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+// Capability cache key: anything that might change prop ids or definitions.
+// Prop ids are allocated as the driver creates its objects so the same
+// driver build with the same object ids gives the same props.
+static int
+env_cap_cache_new(drmu_env_t * const du,
+                  const uint32_t n_planes, const uint32_t * const plane_ids,
+                  const uint32_t n_crtcs, const uint32_t * const crtc_ids,
+                  const uint32_t n_conns, const uint32_t * const conn_ids)
+{
+    char name[64] = "";
+    char date[64] = "";
+    struct drm_version ver = {
+        .name_len = sizeof(name) - 1,
+        .name = name,
+        .date_len = sizeof(date) - 1,
+        .date = date,
+    };
+    struct utsname uts;
+    char key[512];
+    uint64_t h = 0xcbf29ce484222325ULL;
+    int rv;
+
+    if ((rv = drmu_ioctl(du, DRM_IOCTL_VERSION, &ver)) != 0)
+        return rv;
+    if (uname(&uts) != 0)
+        return -errno;
+
+    h = env_ids_hash(h, n_planes, plane_ids);
+    h = env_ids_hash(h, n_crtcs, crtc_ids);
+    h = env_ids_hash(h, n_conns, conn_ids);
+
+    snprintf(key, sizeof(key), "%s %d.%d.%d %s|%s %s|%u/%u/%u %016"PRIx64,
+             name, ver.version_major, ver.version_minor, ver.version_patchlevel, date,
+             uts.release, uts.version, n_planes, n_crtcs, n_conns, h);
+    du->cap_cache = drmu_cap_cache_int_new(du, key);
+    return 0;
+}
+
 // Closes fd on failure
 drmu_env_t *
 drmu_env_new_fd2(const int fd, const struct drmu_log_env_s * const log,
@@ -3850,6 +5590,7 @@ drmu_env_new_fd2(const int fd, const struct drmu_log_env_s * const log,
     uint32_t * conn_ids = NULL;
     uint32_t * crtc_ids = NULL;
     uint32_t * plane_ids = NULL;
+    uint32_t n_planes;
 
     if (!du) {
         drmu_err_log(log, "Failed to create du: No memory");
@@ -3863,7 +5604,15 @@ drmu_env_new_fd2(const int fd, const struct drmu_log_env_s * const log,
     du->post_delete_v = post_delete_v;
 
     pthread_mutex_init(&du->lock, NULL);
+    pthread_mutex_init(&du->event_lock, NULL);
+    pthread_mutex_init(&du->hotplug_lock, NULL);
     drmu_bo_env_init(&du->boe);
+    fb_cache_env_init(&du->fbc);
+    // If this fails then atomics fall back to the heap
+    du->atomic_cache = drmu_atomic_int_cache_new();
+    // If this fails then delta commits are unavailable
+    du->prop_shadow = drmu_prop_shadow_int_new();
+    du->test_cache = drmu_test_cache_int_new();
 
     // We need atomic for almost everything we do
     if (env_set_client_cap(du, DRM_CLIENT_CAP_ATOMIC, 1) != 0) {
@@ -3879,6 +5628,8 @@ drmu_env_new_fd2(const int fd, const struct drmu_log_env_s * const log,
     // We would like to see writeback connectors
     if (env_set_client_cap(du, DRM_CLIENT_CAP_WRITEBACK_CONNECTORS, 1) != 0)
         drmu_debug(du, "Failed to set writeback cap");
+    if (!(du->has_closefb = env_has_closefb(du)))
+        drmu_debug(du, "No CLOSEFB - using RMFB");
 
     {
         struct drm_mode_get_plane_res res;
@@ -3896,12 +5647,7 @@ drmu_env_new_fd2(const int fd, const struct drmu_log_env_s * const log,
         } while ((rv = retry_alloc_u32(&plane_ids, &req_planes, res.count_planes)) == 1);
         if (rv < 0)
             goto fail1;
-
-        if (env_planes_populate(du, res.count_planes, plane_ids) != 0)
-            goto fail1;
-
-        free(plane_ids);
-        plane_ids = NULL;
+        n_planes = res.count_planes;
     }
 
     {
@@ -3929,17 +5675,25 @@ drmu_env_new_fd2(const int fd, const struct drmu_log_env_s * const log,
                 goto fail1;
         }
 
+        // Keyed on all the object ids so must come before any populate
+        if (env_cap_cache_new(du, n_planes, plane_ids,
+                              res.count_crtcs, crtc_ids,
+                              res.count_connectors, conn_ids) != 0)
+            drmu_debug(du, "Failed to get driver version - no capability cache");
+
+        if (env_planes_populate(du, n_planes, plane_ids) != 0)
+            goto fail1;
         if (env_conn_populate(du, res.count_connectors, conn_ids) != 0)
             goto fail1;
         if (env_crtc_populate(du, res.count_crtcs,      crtc_ids) != 0)
             goto fail1;
-
-        free(conn_ids);
-        free(crtc_ids);
-        conn_ids = NULL;
-        crtc_ids = NULL;
     }
 
+    if (du->cap_cache != NULL)
+        drmu_cap_cache_int_save(du->cap_cache);
+
+    free(conn_ids);
+    free(crtc_ids);
     free(plane_ids);
     return du;
 
@@ -34,6 +34,9 @@ typedef struct drmu_bo_env_s drmu_bo_env_t;
 struct drmu_fb_s;
 typedef struct drmu_fb_s drmu_fb_t;
 
+struct drmu_fence_s;
+typedef struct drmu_fence_s drmu_fence_t;
+
 struct drmu_prop_object_s;
 typedef struct drmu_prop_object_s drmu_prop_object_t;
 
@@ -174,6 +177,8 @@ drmu_fb_t * drmu_fb_realloc_dumb_mod(drmu_env_t * const du, drmu_fb_t * dfb, uin
 // Try to reset geometry to these values
 // True if done, false if not
 bool drmu_fb_try_reuse(drmu_fb_t * dfb, uint32_t w, uint32_t h, const uint32_t format, const uint64_t mod);
+// True if drmu_fb_try_reuse would succeed; doesn't change the fb
+bool drmu_fb_fits(const drmu_fb_t * dfb, uint32_t w, uint32_t h, const uint32_t format, const uint64_t mod);
 void drmu_fb_unref(drmu_fb_t ** const ppdfb);
 drmu_fb_t * drmu_fb_ref(drmu_fb_t * const dfb);
 
@@ -191,6 +196,9 @@ drmu_bo_t * drmu_fb_bo(const drmu_fb_t * const dfb, const unsigned int layer);
 // Allocated width height - may be rounded up from requested w/h
 uint32_t drmu_fb_width(const drmu_fb_t *const dfb);
 uint32_t drmu_fb_height(const drmu_fb_t *const dfb);
+// Bytes of memory behind the fb - mapped size if known, otherwise an
+// estimate from format & allocated size
+size_t drmu_fb_size(const drmu_fb_t *const dfb);
 // Set cropping (fractional) - x, y, relative to active x, y (and must be +ve)
 int drmu_fb_crop_frac_set(drmu_fb_t *const dfb, drmu_rect_t crop_frac);
 // get cropping (fractional 16.16) x, y relative to active area
@@ -215,7 +223,7 @@ typedef const char * drmu_color_encoding_t;
 #define DRMU_COLOR_ENCODING_BT709               "ITU-R BT.709 YCbCr"
 #define DRMU_COLOR_ENCODING_BT601               "ITU-R BT.601 YCbCr"
 static inline bool drmu_color_encoding_is_set(const drmu_color_encoding_t x) {return x != NULL;}
-static inline bool drmu_color_encoding_eq(const drmu_color_encoding_t a, const drmu_color_encoding_t b) {return a != NULL && b != NULL && !strcmp(a, b);}
+static inline bool drmu_color_encoding_eq(const drmu_color_encoding_t a, const drmu_color_encoding_t b) {return a != NULL && b != NULL && (a == b || !strcmp(a, b));}
 // Note: Color range only applies to YCbCr planes - ignored for RGB
 typedef const char * drmu_color_range_t;
 #define DRMU_COLOR_RANGE_UNSET                  NULL
@@ -262,6 +270,13 @@ const struct drmu_fmt_info_s * drmu_fb_format_info_get(const drmu_fb_t * const d
 #define drmu_fb_fmt_info drmu_fb_format_info_get
 void drmu_fb_hdr_metadata_set(drmu_fb_t *const dfb, const struct hdr_output_metadata * meta);
 int drmu_fb_int_make(drmu_fb_t *const dfb);
+// Import fds as objects 0..n_fds-1 and make the FB
+// Layers must be set first, BOs need not be. Uses the env FB import cache
+// so remaking an FB from buffers that have been seen before needs no ioctls.
+// The fds are not taken but should stay open for as long as their source
+// keeps the buffers; once they are closed the cache entry is dropped when
+// the last FB using it is deleted
+int drmu_fb_int_make_fds(drmu_fb_t *const dfb, const int * const fds, const unsigned int n_fds);
 
 // Set FB orientation.
 // Orienation is the orintatin of the FB i.e. the inverse of the rotation
@@ -299,6 +314,41 @@ int drmu_fb_out_fence_wait(drmu_fb_t * const fb, const int timeout_ms);
 // Take the fence fd. Resets fb fence fd. User is now responsible for closing it.
 int drmu_fb_out_fence_take_fd(drmu_fb_t * const fb);
 
+// Set a fence that must signal before the fb is scanned out (e.g. from
+// EGL_ANDROID_native_fence_sync or a dmabuf producer) so the fb can be queued
+// before rendering into it has finished. drmu_atomic_plane_add_fb adds it
+// as the plane's IN_FENCE_FD.
+// Takes ownership of fd (closed even on error). -1 clears the fence.
+// The fence stays set until replaced or the fb is freed (or returned to its
+// pool); atomics that have already added it keep their own ref.
+// If the plane has no IN_FENCE_FD then drmu_atomic_plane_add_fb waits for
+// the fence itself (-ETIMEDOUT if it takes over a second).
+int drmu_fb_in_fence_set(drmu_fb_t * const dfb, const int fd);
+
+// Fences
+// Refcounted sync_file fd, closed on last unref
+drmu_fence_t * drmu_fence_ref(drmu_fence_t * const fence);
+void drmu_fence_unref(drmu_fence_t ** const ppfence);
+// -1 if none (yet) e.g. an out fence whose commit hasn't been done
+int drmu_fence_fd(const drmu_fence_t * const fence);
+// Returns:
+//  -ve   error
+//  0     timeout
+//  1     ready (or no fd)
+int drmu_fence_wait(const drmu_fence_t * const fence, const int timeout_ms);
+
+// Release fence - signals once the fb is no longer being scanned out so it
+// can be written again. Set on fbs by drmu_atomic_fb_release_fence_set.
+// Kept over pool return so a pool can hand out fbs that are still on screen.
+// Set replaces (and unrefs) any existing fence; NULL clears.
+// Set, take & wait may be called from different threads.
+void drmu_fb_release_fence_set(drmu_fb_t * const dfb, drmu_fence_t * const fence);
+// Take the fence (may be NULL) - caller must unref it
+drmu_fence_t * drmu_fb_release_fence_take(drmu_fb_t * const dfb);
+// Wait for the release fence - returns as drmu_fence_wait. The fence is
+// dropped once it has signalled.
+int drmu_fb_release_fence_wait(drmu_fb_t * const dfb, const int timeout_ms);
+
 // Object Id
 
 struct drmu_propinfo_s;
@@ -345,6 +395,13 @@ drmu_mode_simple_params_t drmu_crtc_mode_simple_params(const drmu_crtc_t * const
 
 int drmu_atomic_crtc_add_modeinfo(struct drmu_atomic_s * const da, drmu_crtc_t * const dc, const struct drm_mode_modeinfo * const modeinfo);
 int drmu_atomic_crtc_add_active(struct drmu_atomic_s * const da, drmu_crtc_t * const dc, unsigned int val);
+// Add OUT_FENCE_PTR. On a successful commit *ppfence gets an fd that signals
+// when the new state is on screen i.e. when anything it replaced has been
+// released. Commit the atomic once only - a 2nd commit would overwrite (and
+// leak) the 1st fd. *ppfence is NULL on error; -ENOENT if no OUT_FENCE_PTR.
+int drmu_atomic_crtc_add_out_fence(struct drmu_atomic_s * const da, drmu_crtc_t * const dc, drmu_fence_t ** const ppfence);
+// Set the release fence on every fb in da (see drmu_fb_release_fence_set)
+void drmu_atomic_fb_release_fence_set(struct drmu_atomic_s * const da, drmu_fence_t * const fence);
 // background color.
 bool drmu_crtc_has_background_color(const drmu_crtc_t * const dc);
 int drmu_atomic_crtc_add_background_color(struct drmu_atomic_s * const da, drmu_crtc_t * const dc, const drmu_rgba_t rgba);
@@ -394,7 +451,10 @@ unsigned int drmu_conn_rotation_mask(const drmu_conn_t * const dn);
 // Add rotation to connector
 int drmu_atomic_conn_add_rotation(struct drmu_atomic_s * const da, drmu_conn_t * const dn, const unsigned int rotation);
 
-const struct drm_mode_modeinfo * drmu_conn_modeinfo(const drmu_conn_t * const dn, const int mode_id);
+// Copy mode mode_id into *mi. A hotplug can change the mode list at any time
+// so this copies rather than returning a pointer into it.
+// Returns 0 or -ENOENT if no such mode
+int drmu_conn_modeinfo_get(const drmu_conn_t * const dn, const int mode_id, struct drm_mode_modeinfo * const mi);
 drmu_mode_simple_params_t drmu_conn_mode_simple_params(const drmu_conn_t * const dn, const int mode_id);
 
 // Beware: this refects initial value or the last thing set, but currently
@@ -409,6 +469,14 @@ bool drmu_conn_is_output(const drmu_conn_t * const dn);
 bool drmu_conn_is_writeback(const drmu_conn_t * const dn);
 const char * drmu_conn_name(const drmu_conn_t * const dn);
 unsigned int drmu_conn_idx_get(const drmu_conn_t * const dn);
+// Connection state as of init or the last reprobe
+bool drmu_conn_is_connected(const drmu_conn_t * const dn);
+// Re-read connection state & mode list from the kernel
+// Normally called via drmu_env_hotplug_event rather than directly. If
+// anything changed then mode ids from before the call may now refer to a
+// different mode.
+// Returns 1 if changed, 0 if not, -ve error
+int drmu_conn_reprobe(drmu_conn_t * const dn);
 
 // Retrieve the the n-th conn. Use for iteration. Returns NULL when none left
 drmu_conn_t * drmu_env_conn_find_n(drmu_env_t * const du, const unsigned int n);
@@ -571,6 +639,74 @@ int drmu_env_int_poll_set(drmu_env_t * const du,
 // Return poll env. NULL if unset
 struct drmu_queue_s * drmu_env_int_poll_get(drmu_env_t * const du);
 
+// Per env allocation cache for atomics & their prop arrays
+// All atomics on the env must be freed before the cache
+struct drmu_atomic_cache_s;
+struct drmu_atomic_cache_s * drmu_atomic_int_cache_new(void);
+void drmu_atomic_int_cache_free(struct drmu_atomic_cache_s * const ac);
+struct drmu_atomic_cache_s * drmu_env_int_atomic_cache(drmu_env_t * const du);
+
+// Per env shadow of committed prop values for delta commits
+struct drmu_prop_shadow_s;
+struct drmu_prop_shadow_s * drmu_prop_shadow_int_new(void);
+void drmu_prop_shadow_int_free(struct drmu_prop_shadow_s * const ps);
+// Prop is always sent in delta commits (one-shot props & FB_ID)
+// Returns -ENOMEM if there are already too many
+int drmu_prop_shadow_int_volatile_add(struct drmu_prop_shadow_s * const ps, const uint32_t prop_id);
+struct drmu_prop_shadow_s * drmu_env_int_prop_shadow(drmu_env_t * const du);
+
+// Per env TEST_ONLY result cache
+struct drmu_test_cache_s;
+struct drmu_test_cache_s * drmu_test_cache_int_new(void);
+void drmu_test_cache_int_free(struct drmu_test_cache_s * const tc);
+// A successful commit including this prop flushes the cache (MODE_ID etc.)
+// Repeats are ignored; -ENOMEM if there are too many distinct props
+int drmu_test_cache_int_modeset_add(struct drmu_test_cache_s * const tc, const uint32_t prop_id);
+struct drmu_test_cache_s * drmu_env_int_test_cache(drmu_env_t * const du);
+
+// Per env persistent capability cache (see drmu_cap_cache_dir_set)
+// _new returns NULL if caching is disabled. key must identify the driver
+// build & object layout.
+struct drm_mode_get_property;
+struct drmu_cap_cache_s;
+struct drmu_cap_cache_s * drmu_cap_cache_int_new(drmu_env_t * const du, const char * const key);
+void drmu_cap_cache_int_free(struct drmu_cap_cache_s * const cc);
+// Write the cache file if anything has been added since it was loaded
+int drmu_cap_cache_int_save(struct drmu_cap_cache_s * const cc);
+// As DRM_IOCTL_MODE_GETPROPERTY but only calls the kernel on a miss
+int drmu_cap_cache_int_getproperty(struct drmu_cap_cache_s * const cc, struct drm_mode_get_property * const prop);
+// Contents of blobs that never change for a given object & prop
+// _find returns a malloced copy in *ppdata or -ENOENT if not cached
+int drmu_cap_cache_int_blob_find(struct drmu_cap_cache_s * const cc, const uint32_t obj_id, const uint32_t prop_id,
+                                 void ** const ppdata, size_t * const plen);
+int drmu_cap_cache_int_blob_add(struct drmu_cap_cache_s * const cc, const uint32_t obj_id, const uint32_t prop_id,
+                                const void * const data, const size_t len);
+void drmu_cap_cache_int_stats(struct drmu_cap_cache_s * const cc, uint64_t * const pHits, uint64_t * const pMisses);
+
+// DRM event handling
+// A handler is registered with the env and its id is given as the user_data
+// of a commit that asks for a flip event (drmu_atomic_commit_flip_event); fn
+// is called with the event when it is read by drmu_env_int_events_dispatch.
+// As any thread may read the event fn may be called on any thread. It is
+// called with the env event lock held so must not dispatch events or add or
+// remove handlers itself.
+struct drm_event_vblank;
+typedef void drmu_event_fn(void * v, const struct drm_event_vblank * const ev);
+typedef struct drmu_event_handler_s {
+    drmu_event_fn * fn;
+    void * v;
+    uint64_t id;  // Set by _add, never reused
+} drmu_event_handler_t;
+// Register evh. Must be done before it is used for a commit
+int drmu_env_int_event_handler_add(drmu_env_t * const du, drmu_event_handler_t * const evh);
+// Unregister evh. Once this returns fn is not running and will not be called
+// again; an event still outstanding for evh is dropped when it arrives so evh
+// may be freed. Removing an evh that isn't registered is a noop.
+void drmu_env_int_event_handler_remove(drmu_env_t * const du, drmu_event_handler_t * const evh);
+// Read any pending events from the DRM fd & call their handlers
+// Does not block. Returns number of events dispatched or -errno
+int drmu_env_int_events_dispatch(drmu_env_t * const du);
+
 // Do ioctl - returns -errno on error, 0 on success
 // deals with recalling the ioctl when required
 int drmu_ioctl(const drmu_env_t * const du, unsigned long req, void * arg);
@@ -593,6 +729,76 @@ int drmu_atomic_env_restore_add_snapshot(struct drmu_atomic_s ** const ppda);
 // a poll shutdown function. Leaves restore disabled.
 void drmu_env_int_restore(drmu_env_t * const du);
 
+// Delta commits
+// Only send props whose value differs from that last committed on this env.
+// Committed values are only tracked whilst enabled. Default is off.
+// This assumes that nothing else changes the state of the objects we use -
+// if something might have done then call _delta_invalidate.
+void drmu_env_delta_commit_set(drmu_env_t * const du, const bool enable);
+void drmu_env_delta_invalidate(drmu_env_t * const du);
+
+// TEST_ONLY result cache
+// Remembers the result (and with _commit_test the failing props) of
+// TEST_ONLY commits keyed on their configuration: FBs are compared by
+// format, modifier & size and blobs by content rather than by id, so
+// repeated probes of the same plane setup only reach the kernel once.
+// Flushed by any commit that changes a mode or connector routing and by
+// _invalidate which should be called on hotplug. Results can depend on
+// state outside the atomic being tested so only enable when probing against
+// a stable setup. Default is off.
+void drmu_env_test_cache_set(drmu_env_t * const du, const bool enable);
+void drmu_env_test_cache_invalidate(drmu_env_t * const du);
+void drmu_env_test_cache_stats(drmu_env_t * const du, uint64_t * const pHits, uint64_t * const pMisses);
+
+// Connector hotplug
+// drmu_env_hotplug_event reprobes the conn with the given id (0 => all
+// conns) and, if anything changed, flushes the TEST_ONLY cache & delta
+// shadow and calls the listeners for each changed conn. Usually called by a
+// drmu_hotplug_t (drmu_hotplug.h) on uevents but can be called by anything
+// that knows that a hotplug has happened.
+// Listeners are called on the thread that called _event with no env lock
+// held, so may add or remove listeners. Each call holds a ref on v taken
+// by ref_fn (which must return false if v is already being freed) &
+// dropped with unref_fn after, so the listener may drop what would
+// otherwise be the last ref. A call already in progress may still be
+// running when _remove returns so ref_fn & unref_fn may only be NULL if v
+// outlives the env.
+// Conn mode lists & connection state are swapped under a per-conn lock on
+// reprobe & the old list freed; drmu_conn_modeinfo_get &c. copy out under
+// the same lock so are safe on any thread.
+// _event returns number of conns changed or -ve error
+typedef void drmu_env_hotplug_fn(void * v, drmu_conn_t * const dn, const bool connected);
+typedef bool drmu_env_hotplug_ref_fn(void * v);
+typedef void drmu_env_hotplug_unref_fn(void * v);
+int drmu_env_hotplug_listener_add(drmu_env_t * const du, drmu_env_hotplug_fn * const fn,
+                                  drmu_env_hotplug_ref_fn * const ref_fn, drmu_env_hotplug_unref_fn * const unref_fn,
+                                  void * const v);
+void drmu_env_hotplug_listener_remove(drmu_env_t * const du, drmu_env_hotplug_fn * const fn, void * const v);
+int drmu_env_hotplug_event(drmu_env_t * const du, const uint32_t conn_id);
+
+// FB reaper
+// Once started, fbs whose last ref is dropped have their fb id removed &
+// BOs unmapped & closed on a separate thread so a commit thread never
+// blocks on it. An fb's on_delete callback is then called on that thread.
+// Each queued fb holds an env ref until it is torn down so the env is only
+// freed once nothing is pending. Not stoppable.
+// Returns 0 or -ve error
+int drmu_env_fb_reaper_start(drmu_env_t * const du);
+
+// Capability cache
+// If set then property definitions & plane format lists are saved in a file
+// in dir (created if needed) keyed by driver version, kernel release & the
+// env's object ids. Later env opens that match the key only re-read the
+// volatile state. Applies to envs opened after the call. NULL (the default)
+// disables it. The cache trusts the driver to report its version honestly -
+// delete the files if a driver changes its props without a version bump.
+// dir is created 0700; it & the files in it are ignored unless owned by
+// the effective uid & not writable by group or others.
+// Returns 0 or -ve error (-EPERM if dir fails the ownership check)
+int drmu_cap_cache_dir_set(const char * const dir);
+// Hits & misses on the env's capability cache - both 0 if it has none
+void drmu_env_cap_cache_stats(drmu_env_t * const du, uint64_t * const pHits, uint64_t * const pMisses);
+
 // Open a drmu environment with the drm fd
 // Takes a logging structure so early errors can be reported. The logging
 // environment is copied so does not have to be valid for greater than the
@@ -660,6 +866,14 @@ int drmu_atomic_commit(const drmu_atomic_t * const da, uint32_t flags);
 // Attempt commit - if it fails add failing members to da_fail
 // This does NOT remove failing props from da.  If da_fail == NULL then same as _commit
 int drmu_atomic_commit_test(const drmu_atomic_t * const da, uint32_t flags, drmu_atomic_t * const da_fail);
+// Commit with DRM_MODE_PAGE_FLIP_EVENT added to flags, evh (which must be
+// registered) is called when the flip completes
+// (see drmu_env_int_events_dispatch)
+// Commit callbacks are NOT run - it is up to the event handler to do that
+int drmu_atomic_commit_flip_event(const drmu_atomic_t * const da, uint32_t flags, drmu_event_handler_t * const evh);
+// TEST_ONLY commit that runs no callbacks of any sort. flags as _commit,
+// DRM_MODE_ATOMIC_TEST_ONLY is added & DRM_MODE_ATOMIC_NONBLOCK removed
+int drmu_atomic_int_commit_check(const drmu_atomic_t * const da, uint32_t flags);
 
 // Add a callback that occurs when the atomic has been committed
 // This will occur on flip if atomic queued via _atomic_queue - if multiple
@@ -675,14 +889,41 @@ void drmu_atomic_run_commit_callbacks(const drmu_atomic_t * const da);
 // Run the property commit callbacks - only call on a successful commit
 void drmu_atomic_run_prop_commit_callbacks(const drmu_atomic_t * const da);
 
+// Presentation feedback
+// Present callbacks are run by the Q when the atomic gets to the screen with
+// the vblank it was displayed on. If the atomic is merged with a later one
+// that overrides everything it sets then it is marked as dropped and its
+// callbacks are run with the vblank its replacement was displayed on. If it
+// is discarded (or fails to commit) they are run with dropped set and zero
+// sequence & time.
+// Callbacks may be run on any thread.
+typedef struct drmu_present_info_s {
+    uint64_t sequence;  // CRTC vblank count, 0 if unknown
+    uint64_t time_ns;   // Kernel vblank timestamp (CLOCK_MONOTONIC), 0 if unknown
+    bool dropped;       // Atomic was replaced before it got to the screen
+} drmu_present_info_t;
+typedef void drmu_atomic_present_fn(void * v, const drmu_present_info_t * const info);
+// If cb is 0 then NOP
+int drmu_atomic_add_present_callback(drmu_atomic_t * const da, drmu_atomic_present_fn * const cb, void * const v);
+void drmu_atomic_clear_present_callbacks(drmu_atomic_t * const da);
+bool drmu_atomic_has_present_callbacks(const drmu_atomic_t * const da);
+// Run all present callbacks on this atomic. Callbacks are not cleared.
+// info->dropped is ORed with the dropped state of each callback
+void drmu_atomic_run_present_callbacks(const drmu_atomic_t * const da, const drmu_present_info_t * const info);
+
 typedef void drmu_prop_unref_fn(void * v);
 typedef void drmu_prop_ref_fn(void * v);
 typedef void drmu_prop_commit_fn(void * v, uint64_t value);
+// Value to compare in place of the prop value when looking up the TEST_ONLY
+// cache, e.g. an FB's format, modifier & size rather than its (recyclable)
+// id. Optional - if NULL the value is used.
+typedef uint64_t drmu_prop_sig_fn(void * v, uint64_t value);
 
 typedef struct drmu_atomic_prop_fns_s {
     drmu_prop_ref_fn * ref;
     drmu_prop_unref_fn * unref;
     drmu_prop_commit_fn * commit;
+    drmu_prop_sig_fn * sig;
 } drmu_atomic_prop_fns_t;
 
 drmu_prop_ref_fn drmu_prop_fn_null_unref;
@@ -694,6 +935,42 @@ int drmu_atomic_add_prop_generic(drmu_atomic_t * const da,
         const drmu_atomic_prop_fns_t * const fns, void * const v);
 int drmu_atomic_add_prop_value(drmu_atomic_t * const da, const uint32_t obj_id, const uint32_t prop_id, const uint64_t value);
 
+// Call fn(prop v, v) for every prop in da that was added with fns
+typedef void drmu_prop_foreach_fn(void * prop_v, void * v);
+void drmu_atomic_int_prop_v_foreach(const drmu_atomic_t * const da, const drmu_atomic_prop_fns_t * const fns,
+                                    drmu_prop_foreach_fn * const fn, void * const v);
+
+// Prepared atomics
+// A fixed set of (obj, prop) slots with persistent ioctl arrays so a commit
+// just sends the current slot values - no per-commit allocation, sorting or
+// flattening. Intended for things like a video plane's FB_ID/SRC_*/CRTC_*
+// that are updated every frame.
+// Values are plain numbers: no refs are taken on FBs or blobs and no prop
+// commit callbacks are run so the caller must keep anything referenced
+// alive until it has been replaced on screen. Not thread safe.
+struct drmu_atomic_prep_s;
+typedef struct drmu_atomic_prep_s drmu_atomic_prep_t;
+
+drmu_atomic_prep_t * drmu_atomic_prep_new(drmu_env_t * const du);
+// Create with a slot for every prop in da (with its current value)
+drmu_atomic_prep_t * drmu_atomic_prep_new_atomic(const drmu_atomic_t * const da);
+void drmu_atomic_prep_delete(drmu_atomic_prep_t ** const ppap);
+
+// Add a slot, returns slot number or -ve error. Slot numbers are stable.
+// If obj/prop already has a slot then its value is set & that slot returned
+int drmu_atomic_prep_add_slot(drmu_atomic_prep_t * const ap, const uint32_t obj_id, const uint32_t prop_id, const uint64_t value);
+// Returns slot number or -ENOENT
+int drmu_atomic_prep_slot_find(const drmu_atomic_prep_t * const ap, const uint32_t obj_id, const uint32_t prop_id);
+unsigned int drmu_atomic_prep_slot_count(const drmu_atomic_prep_t * const ap);
+void drmu_atomic_prep_set(drmu_atomic_prep_t * const ap, const unsigned int slot, const uint64_t value);
+uint64_t drmu_atomic_prep_get(const drmu_atomic_prep_t * const ap, const unsigned int slot);
+
+// As drmu_atomic_commit / _commit_flip_event
+int drmu_atomic_prep_commit(const drmu_atomic_prep_t * const ap, uint32_t flags);
+int drmu_atomic_prep_commit_flip_event(const drmu_atomic_prep_t * const ap, uint32_t flags, drmu_event_handler_t * const evh);
+// Add all slots with their current values to da e.g. to go via a drmu_queue
+int drmu_atomic_add_prep(drmu_atomic_t * const da, const drmu_atomic_prep_t * const ap);
+
 // drmu_xlease
 
 drmu_env_t * drmu_env_new_xlease(const struct drmu_log_env_s * const log);
@@ -4,7 +4,10 @@
 #include <assert.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <libdrm/drm.h>
@@ -18,12 +21,20 @@ typedef struct aprop_prop_s {
     const drmu_atomic_prop_fns_t * fns;
 } aprop_prop_t;
 
+// Props arrays are refcounted and shared between atomics by copy & merge.
+// A shared array is immutable (and always sorted) - anything that wants to
+// change it takes a private copy first. The array owns the refs on its props.
+typedef struct aprop_array_s {
+    atomic_int ref_count;  // 0 == 1 ref for ease of init
+    aprop_prop_t props[];
+} aprop_array_t;
+
 typedef struct aprop_obj_s {
     uint32_t id;
     unsigned int n;
     unsigned int size;
     bool unsorted;
-    aprop_prop_t * props;
+    aprop_prop_t * props;  // -> aprop_array_t.props
 } aprop_obj_t;
 
 typedef struct aprop_hdr_s {
@@ -33,42 +44,914 @@ typedef struct aprop_hdr_s {
     aprop_obj_t * objs;
 } aprop_hdr_t;
 
+// Commit callbacks
+// Nearly every atomic has one or two so the first few live in the atomic.
+// Any more go in chunks - all inline cbs come before any chunk cbs.
+#define ATOMIC_CBS_INLINE 4
+#define ATOMIC_CBS_CHUNK  16
+
 typedef struct atomic_cb_s {
-    struct atomic_cb_s * next;
     void * v;
     drmu_atomic_commit_fn * cb;
 } atomic_cb_t;
 
+typedef struct atomic_cb_chunk_s {
+    struct atomic_cb_chunk_s * next;
+    unsigned int n;
+    atomic_cb_t cbs[ATOMIC_CBS_CHUNK];
+} atomic_cb_chunk_t;
+
+typedef struct atomic_present_cb_s {
+    struct atomic_present_cb_s * next;
+    void * v;
+    drmu_atomic_present_fn * cb;
+    bool dropped;  // Everything in the atomic this was added to has been overridden
+} atomic_present_cb_t;
+
 typedef struct drmu_atomic_s {
     atomic_int ref_count;  // 0 == 1 ref for ease of init
 
     struct drmu_env_s * du;
+    struct drmu_atomic_cache_s * ac;
 
     aprop_hdr_t props;
 
-    atomic_cb_t * commit_cb_q;
-    atomic_cb_t ** commit_cb_last_ptr;
+    unsigned int commit_cb_n;  // Inline cbs in use
+    atomic_cb_t commit_cbs[ATOMIC_CBS_INLINE];
+    atomic_cb_chunk_t * commit_cb_chunks;
+    atomic_cb_chunk_t * commit_cb_last;  // Last chunk, NULL if none
+
+    atomic_present_cb_t * present_cb_q;
+    atomic_present_cb_t ** present_cb_last_ptr;
 } drmu_atomic_t;
 
+//----------------------------------------------------------------------------
+//
+// Allocation cache
+// Atomics are created, merged & destroyed several times a frame so rather
+// than going to the heap each time keep per-env free lists of atomics,
+// callback nodes and prop arrays. Prop arrays are always 16 << n els so
+// they fall into a few size classes.
+// Each free list may hold as many blocks as were in use at the peak of the
+// previous CACHE_WINDOW allocs from it so it follows the working set.
+
+#define CACHE_WINDOW        64
+#define CACHE_LIMIT_INIT    8
+#define CACHE_ARRAY_CLASSES 6  // 16..512 els
+
+typedef struct cache_block_s {
+    struct cache_block_s * next;
+} cache_block_t;
+
+typedef struct cache_class_s {
+    size_t size;
+    cache_block_t * free;
+    unsigned int n_free;
+    unsigned int in_use;
+    unsigned int high;    // Peak in_use in this window
+    unsigned int limit;   // Max n_free
+    unsigned int window;  // Allocs left in this window
+} cache_class_t;
+
+typedef struct drmu_atomic_cache_s {
+    pthread_mutex_t lock;
+    cache_class_t atomics;
+    cache_class_t cbs;
+    cache_class_t cb_chunks;
+    cache_class_t props[CACHE_ARRAY_CLASSES];
+    cache_class_t objs[CACHE_ARRAY_CLASSES];
+} drmu_atomic_cache_t;
+
+static void
+cache_class_init(cache_class_t * const cc, const size_t size)
+{
+    *cc = (cache_class_t){
+        .size = size < sizeof(cache_block_t) ? sizeof(cache_block_t) : size,
+        .limit = CACHE_LIMIT_INIT,
+        .window = CACHE_WINDOW
+    };
+}
+
+static void
+cache_class_uninit(cache_class_t * const cc)
+{
+    cache_block_t * b = cc->free;
+
+    while (b != NULL) {
+        cache_block_t * const next = b->next;
+        free(b);
+        b = next;
+    }
+    cc->free = NULL;
+    cc->n_free = 0;
+}
+
+// Zeroed on return
+static void *
+cache_alloc(drmu_atomic_cache_t * const ac, cache_class_t * const cc)
+{
+    cache_block_t * b;
+
+    pthread_mutex_lock(&ac->lock);
+    if ((b = cc->free) != NULL) {
+        cc->free = b->next;
+        --cc->n_free;
+    }
+    if (++cc->in_use > cc->high)
+        cc->high = cc->in_use;
+    if (--cc->window == 0) {
+        cc->limit = cc->high;
+        cc->high = cc->in_use;
+        cc->window = CACHE_WINDOW;
+    }
+    pthread_mutex_unlock(&ac->lock);
+
+    if (b == NULL && (b = malloc(cc->size)) == NULL) {
+        pthread_mutex_lock(&ac->lock);
+        --cc->in_use;
+        pthread_mutex_unlock(&ac->lock);
+        return NULL;
+    }
+    memset(b, 0, cc->size);
+    return b;
+}
+
+static void
+cache_free(drmu_atomic_cache_t * const ac, cache_class_t * const cc, void * const v)
+{
+    cache_block_t * b = v;
+
+    if (b == NULL)
+        return;
+
+    pthread_mutex_lock(&ac->lock);
+    --cc->in_use;
+    if (cc->n_free < cc->limit) {
+        b->next = cc->free;
+        cc->free = b;
+        ++cc->n_free;
+        b = NULL;
+    }
+    pthread_mutex_unlock(&ac->lock);
+
+    free(b);
+}
+
+static cache_class_t *
+cache_array_class(cache_class_t * const classes, const unsigned int n)
+{
+    unsigned int i;
+
+    for (i = 0; i != CACHE_ARRAY_CLASSES; ++i) {
+        if (n == (16U << i))
+            return classes + i;
+    }
+    return NULL;
+}
+
+static inline aprop_array_t *
+aprop_array(aprop_prop_t * const props)
+{
+    return (aprop_array_t *)((uint8_t *)props - offsetof(aprop_array_t, props));
+}
+
+// Atomics without an env (shouldn't happen) or unusually sized arrays just
+// use the heap
+// Returns the props of an unshared aprop_array_t
+static aprop_prop_t *
+cache_props_alloc(drmu_atomic_cache_t * const ac, const unsigned int n)
+{
+    cache_class_t * const cc = ac == NULL ? NULL : cache_array_class(ac->props, n);
+    aprop_array_t * const pa = cc == NULL ?
+        calloc(1, sizeof(aprop_array_t) + n * sizeof(aprop_prop_t)) :
+        cache_alloc(ac, cc);
+    return pa == NULL ? NULL : pa->props;
+}
+
+static void
+cache_props_free(drmu_atomic_cache_t * const ac, aprop_prop_t * const props, const unsigned int n)
+{
+    cache_class_t * const cc = ac == NULL ? NULL : cache_array_class(ac->props, n);
+
+    if (props == NULL)
+        return;
+    if (cc == NULL)
+        free(aprop_array(props));
+    else
+        cache_free(ac, cc, aprop_array(props));
+}
+
+static aprop_obj_t *
+cache_objs_alloc(drmu_atomic_cache_t * const ac, const unsigned int n)
+{
+    cache_class_t * const cc = ac == NULL ? NULL : cache_array_class(ac->objs, n);
+    return cc == NULL ? calloc(n, sizeof(aprop_obj_t)) : cache_alloc(ac, cc);
+}
+
+static void
+cache_objs_free(drmu_atomic_cache_t * const ac, aprop_obj_t * const objs, const unsigned int n)
+{
+    cache_class_t * const cc = ac == NULL ? NULL : cache_array_class(ac->objs, n);
+    if (cc == NULL)
+        free(objs);
+    else
+        cache_free(ac, cc, objs);
+}
+
+static void *
+cache_cb_alloc(drmu_atomic_cache_t * const ac, const size_t size)
+{
+    return ac == NULL ? malloc(size) : cache_alloc(ac, &ac->cbs);
+}
+
+// Zeroed on return
+static atomic_cb_chunk_t *
+cache_cb_chunk_alloc(drmu_atomic_cache_t * const ac)
+{
+    return ac == NULL ? calloc(1, sizeof(atomic_cb_chunk_t)) : cache_alloc(ac, &ac->cb_chunks);
+}
+
+static void
+cache_cb_chunk_free(drmu_atomic_cache_t * const ac, atomic_cb_chunk_t * const acc)
+{
+    if (ac == NULL)
+        free(acc);
+    else
+        cache_free(ac, &ac->cb_chunks, acc);
+}
+
+static void
+cache_cb_free(drmu_atomic_cache_t * const ac, void * const v)
+{
+    if (ac == NULL)
+        free(v);
+    else
+        cache_free(ac, &ac->cbs, v);
+}
+
+drmu_atomic_cache_t *
+drmu_atomic_int_cache_new(void)
+{
+    drmu_atomic_cache_t * const ac = calloc(1, sizeof(*ac));
+    unsigned int i;
+
+    if (ac == NULL)
+        return NULL;
+
+    pthread_mutex_init(&ac->lock, NULL);
+    cache_class_init(&ac->atomics, sizeof(drmu_atomic_t));
+    cache_class_init(&ac->cbs, sizeof(atomic_present_cb_t));
+    cache_class_init(&ac->cb_chunks, sizeof(atomic_cb_chunk_t));
+    for (i = 0; i != CACHE_ARRAY_CLASSES; ++i) {
+        cache_class_init(ac->props + i, sizeof(aprop_array_t) + (sizeof(aprop_prop_t) << (4 + i)));
+        cache_class_init(ac->objs + i, sizeof(aprop_obj_t) << (4 + i));
+    }
+    return ac;
+}
+
+// All atomics on this env must have been freed
+void
+drmu_atomic_int_cache_free(drmu_atomic_cache_t * const ac)
+{
+    unsigned int i;
+
+    if (ac == NULL)
+        return;
+
+    cache_class_uninit(&ac->atomics);
+    cache_class_uninit(&ac->cbs);
+    cache_class_uninit(&ac->cb_chunks);
+    for (i = 0; i != CACHE_ARRAY_CLASSES; ++i) {
+        cache_class_uninit(ac->props + i);
+        cache_class_uninit(ac->objs + i);
+    }
+    pthread_mutex_destroy(&ac->lock);
+    free(ac);
+}
+
+//----------------------------------------------------------------------------
+//
+// Committed prop shadow
+// Per-env record of the last committed value of every (obj, prop) so that
+// delta commits can leave out anything that hasn't changed. Open addressed
+// hash on obj_id << 32 | prop_id; obj ids are never 0 so key 0 is empty.
+// Only maintained whilst delta commits are enabled.
+// Volatile props are one-shot (fence ptrs, writeback fbs) or may refer to
+// something that has been recreated with the same id (FB_ID) and are always
+// sent.
+
+#define SHADOW_SIZE_MIN     64
+#define SHADOW_VOLATILE_MAX 16
+
+typedef struct shadow_ent_s {
+    uint64_t key;
+    uint64_t value;
+} shadow_ent_t;
+
+typedef struct drmu_prop_shadow_s {
+    pthread_mutex_t lock;
+    atomic_bool enabled;
+    unsigned int n;
+    unsigned int size;  // Power of 2 (or 0)
+    shadow_ent_t * ents;
+    unsigned int n_volatile;
+    uint32_t volatile_ids[SHADOW_VOLATILE_MAX];
+} drmu_prop_shadow_t;
+
+static inline uint64_t
+shadow_key(const uint32_t obj_id, const uint32_t prop_id)
+{
+    return ((uint64_t)obj_id << 32) | prop_id;
+}
+
+static inline unsigned int
+shadow_slot(const uint64_t key, const unsigned int size)
+{
+    return (unsigned int)((key * 0x9e3779b97f4a7c15ULL) >> 32) & (size - 1);
+}
+
+// Lock expected
+static shadow_ent_t *
+shadow_find(const drmu_prop_shadow_t * const ps, const uint64_t key)
+{
+    unsigned int i;
+
+    if (ps->size == 0)
+        return NULL;
+    for (i = shadow_slot(key, ps->size); ps->ents[i].key != 0; i = (i + 1) & (ps->size - 1)) {
+        if (ps->ents[i].key == key)
+            return ps->ents + i;
+    }
+    return NULL;
+}
+
+// Lock expected
+static bool
+shadow_is_volatile(const drmu_prop_shadow_t * const ps, const uint32_t prop_id)
+{
+    unsigned int i;
+
+    for (i = 0; i != ps->n_volatile; ++i) {
+        if (ps->volatile_ids[i] == prop_id)
+            return true;
+    }
+    return false;
+}
+
+// Lock expected
+// On alloc failure the shadow is simply left without this prop
+static void
+shadow_set(drmu_prop_shadow_t * const ps, const uint64_t key, const uint64_t value)
+{
+    shadow_ent_t * ent = shadow_find(ps, key);
+    unsigned int i;
+
+    if (ent != NULL) {
+        ent->value = value;
+        return;
+    }
+
+    // Keep load <= 1/2
+    if ((ps->n + 1) * 2 > ps->size) {
+        const unsigned int newsize = ps->size < SHADOW_SIZE_MIN ? SHADOW_SIZE_MIN : ps->size * 2;
+        shadow_ent_t * const newents = calloc(newsize, sizeof(*newents));
+
+        if (newents == NULL)
+            return;
+        for (i = 0; i != ps->size; ++i) {
+            unsigned int j;
+            if (ps->ents[i].key == 0)
+                continue;
+            for (j = shadow_slot(ps->ents[i].key, newsize); newents[j].key != 0; j = (j + 1) & (newsize - 1))
+                /* loop */;
+            newents[j] = ps->ents[i];
+        }
+        free(ps->ents);
+        ps->ents = newents;
+        ps->size = newsize;
+    }
+
+    for (i = shadow_slot(key, ps->size); ps->ents[i].key != 0; i = (i + 1) & (ps->size - 1))
+        /* loop */;
+    ps->ents[i] = (shadow_ent_t){.key = key, .value = value};
+    ++ps->n;
+}
+
+// Lock expected
+static void
+shadow_clear(drmu_prop_shadow_t * const ps)
+{
+    if (ps->n != 0)
+        memset(ps->ents, 0, ps->size * sizeof(*ps->ents));
+    ps->n = 0;
+}
+
+// Remove props from the ioctl arrays whose value matches the shadow
+// If that would leave nothing then nothing is removed - an empty commit
+// is no use to anyone.
+// Returns the new prop count
+static unsigned int
+shadow_strip(drmu_prop_shadow_t * const ps, struct drm_mode_atomic * const atomic, const unsigned int n_props)
+{
+    uint32_t * const objs = (uint32_t *)(uintptr_t)atomic->objs_ptr;
+    uint32_t * const counts = (uint32_t *)(uintptr_t)atomic->count_props_ptr;
+    uint32_t * const props = (uint32_t *)(uintptr_t)atomic->props_ptr;
+    uint64_t * const values = (uint64_t *)(uintptr_t)atomic->prop_values_ptr;
+    bool keep[n_props];
+    unsigned int kept = 0;
+    unsigned int i, j, k, n, o;
+    unsigned int p = 0;
+
+    pthread_mutex_lock(&ps->lock);
+    for (i = 0; i != atomic->count_objs; ++i) {
+        for (j = 0; j != counts[i]; ++j, ++p) {
+            const shadow_ent_t * const ent = shadow_find(ps, shadow_key(objs[i], props[p]));
+            keep[p] = ent == NULL || ent->value != values[p] || shadow_is_volatile(ps, props[p]);
+            kept += keep[p];
+        }
+    }
+    pthread_mutex_unlock(&ps->lock);
+
+    if (kept == 0 || kept == n_props)
+        return n_props;
+
+    for (i = 0, p = 0, k = 0, o = 0; i != atomic->count_objs; ++i) {
+        for (j = 0, n = 0; j != counts[i]; ++j, ++p) {
+            if (keep[p]) {
+                props[k] = props[p];
+                values[k] = values[p];
+                ++k;
+                ++n;
+            }
+        }
+        if (n != 0) {
+            objs[o] = objs[i];
+            counts[o] = n;
+            ++o;
+        }
+    }
+    atomic->count_objs = o;
+    return kept;
+}
+
+// Record the props in a successful (non-test) commit
+static void
+shadow_update(drmu_prop_shadow_t * const ps, const struct drm_mode_atomic * const atomic)
+{
+    const uint32_t * const objs = (const uint32_t *)(uintptr_t)atomic->objs_ptr;
+    const uint32_t * const counts = (const uint32_t *)(uintptr_t)atomic->count_props_ptr;
+    const uint32_t * const props = (const uint32_t *)(uintptr_t)atomic->props_ptr;
+    const uint64_t * const values = (const uint64_t *)(uintptr_t)atomic->prop_values_ptr;
+    unsigned int i, j;
+    unsigned int p = 0;
+
+    pthread_mutex_lock(&ps->lock);
+    for (i = 0; i != atomic->count_objs; ++i) {
+        for (j = 0; j != counts[i]; ++j, ++p) {
+            if (!shadow_is_volatile(ps, props[p]))
+                shadow_set(ps, shadow_key(objs[i], props[p]), values[p]);
+        }
+    }
+    pthread_mutex_unlock(&ps->lock);
+}
+
+drmu_prop_shadow_t *
+drmu_prop_shadow_int_new(void)
+{
+    drmu_prop_shadow_t * const ps = calloc(1, sizeof(*ps));
+
+    if (ps == NULL)
+        return NULL;
+    pthread_mutex_init(&ps->lock, NULL);
+    atomic_init(&ps->enabled, false);
+    return ps;
+}
+
+void
+drmu_prop_shadow_int_free(drmu_prop_shadow_t * const ps)
+{
+    if (ps == NULL)
+        return;
+    free(ps->ents);
+    pthread_mutex_destroy(&ps->lock);
+    free(ps);
+}
+
+int
+drmu_prop_shadow_int_volatile_add(drmu_prop_shadow_t * const ps, const uint32_t prop_id)
+{
+    int rv = 0;
+
+    if (ps == NULL || prop_id == 0)
+        return 0;
+
+    pthread_mutex_lock(&ps->lock);
+    if (!shadow_is_volatile(ps, prop_id)) {
+        if (ps->n_volatile >= SHADOW_VOLATILE_MAX)
+            rv = -ENOMEM;
+        else
+            ps->volatile_ids[ps->n_volatile++] = prop_id;
+    }
+    pthread_mutex_unlock(&ps->lock);
+    return rv;
+}
+
+void
+drmu_env_delta_commit_set(drmu_env_t * const du, const bool enable)
+{
+    drmu_prop_shadow_t * const ps = drmu_env_int_prop_shadow(du);
+
+    if (ps == NULL)
+        return;
+
+    // Start from nothing - we don't know what has been committed whilst off
+    pthread_mutex_lock(&ps->lock);
+    shadow_clear(ps);
+    atomic_store(&ps->enabled, enable);
+    pthread_mutex_unlock(&ps->lock);
+}
+
+void
+drmu_env_delta_invalidate(drmu_env_t * const du)
+{
+    drmu_prop_shadow_t * const ps = drmu_env_int_prop_shadow(du);
+
+    if (ps == NULL)
+        return;
+
+    pthread_mutex_lock(&ps->lock);
+    shadow_clear(ps);
+    pthread_mutex_unlock(&ps->lock);
+}
+
+//----------------------------------------------------------------------------
+//
+// TEST_ONLY result cache
+// Per-env memo of TEST_ONLY commit results. The key is the sorted list of
+// (obj, prop, sig) where sig is the prop value or, for props that refer to
+// recyclable objects (FBs, blobs), a signature of what they describe.
+// Entries are kept MRU first; lookup is a linear scan on hash which is
+// plenty for a few dozen entries when the alternative is an ioctl (or a
+// bisection's worth of them).
+
+#define TCACHE_ENTS_MAX    64
+#define TCACHE_MODESET_MAX 16
+
+typedef struct tcache_prop_s {
+    uint32_t obj_id;
+    uint32_t prop_id;
+    uint64_t sig;
+} tcache_prop_t;
+
+typedef struct tcache_ent_s {
+    struct tcache_ent_s * next;
+    uint64_t hash;
+    uint32_t flags;
+    int rv;
+    bool fails_known;      // Failing props were found (commit had da_fail)
+    unsigned int n;        // Props in key
+    unsigned int n_fail;   // Failing props (sig unused) - follow key in props
+    tcache_prop_t props[];
+} tcache_ent_t;
+
+typedef struct drmu_test_cache_s {
+    pthread_mutex_t lock;
+    atomic_bool enabled;
+    unsigned int n;
+    tcache_ent_t * ents;
+    uint64_t hits;
+    uint64_t misses;
+    unsigned int n_modeset;
+    uint32_t modeset_ids[TCACHE_MODESET_MAX];
+} drmu_test_cache_t;
+
+static inline uint64_t
+tcache_mix(uint64_t h, const uint64_t x)
+{
+    h ^= x + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+    return h * 0xff51afd7ed558ccdULL;
+}
+
+static int
+tcache_prop_qsort_cb(const void * va, const void * vb)
+{
+    const tcache_prop_t * const a = va;
+    const tcache_prop_t * const b = vb;
+    return a->obj_id != b->obj_id ? (a->obj_id < b->obj_id ? -1 : 1) :
+        a->prop_id == b->prop_id ? 0 : a->prop_id < b->prop_id ? -1 : 1;
+}
+
+// Fill key (n_props long) from da and return its hash
+static uint64_t
+tcache_key_make(const drmu_atomic_t * const da, tcache_prop_t * const key, const unsigned int n_props, const uint32_t flags)
+{
+    uint64_t h = flags;
+    unsigned int i, j;
+    unsigned int k = 0;
+
+    for (i = 0; i != da->props.n; ++i) {
+        const aprop_obj_t * const po = da->props.objs + i;
+        for (j = 0; j != po->n; ++j, ++k) {
+            const aprop_prop_t * const pp = po->props + j;
+            key[k] = (tcache_prop_t){
+                .obj_id = po->id,
+                .prop_id = pp->id,
+                .sig = pp->fns->sig == NULL ? pp->value : pp->fns->sig(pp->v, pp->value)
+            };
+        }
+    }
+    assert(k == n_props);
+
+    qsort(key, n_props, sizeof(*key), tcache_prop_qsort_cb);
+    for (k = 0; k != n_props; ++k)
+        h = tcache_mix(tcache_mix(h, ((uint64_t)key[k].obj_id << 32) | key[k].prop_id), key[k].sig);
+    return h;
+}
+
+static void
+tcache_clear(drmu_test_cache_t * const tc)
+{
+    tcache_ent_t * ent = tc->ents;
+
+    while (ent != NULL) {
+        tcache_ent_t * const next = ent->next;
+        free(ent);
+        ent = next;
+    }
+    tc->ents = NULL;
+    tc->n = 0;
+}
+
+// Lock expected
+// Found entry is moved to the head of the list
+static tcache_ent_t *
+tcache_find(drmu_test_cache_t * const tc, const uint64_t hash, const uint32_t flags,
+            const tcache_prop_t * const key, const unsigned int n)
+{
+    tcache_ent_t ** pent;
+
+    for (pent = &tc->ents; *pent != NULL; pent = &(*pent)->next) {
+        tcache_ent_t * const ent = *pent;
+        if (ent->hash == hash && ent->flags == flags && ent->n == n &&
+            memcmp(ent->props, key, n * sizeof(*key)) == 0) {
+            *pent = ent->next;
+            ent->next = tc->ents;
+            tc->ents = ent;
+            return ent;
+        }
+    }
+    return NULL;
+}
+
+// Lock expected
+// Replaces any existing entry with the same key, drops the LRU if full
+static void
+tcache_add(drmu_test_cache_t * const tc, const uint64_t hash, const uint32_t flags,
+           const tcache_prop_t * const key, const unsigned int n,
+           const int rv, const bool fails_known, const tcache_prop_t * const fails, const unsigned int n_fail)
+{
+    tcache_ent_t * ent = tcache_find(tc, hash, flags, key, n);
+
+    if (ent != NULL) {
+        tc->ents = ent->next;
+        free(ent);
+        --tc->n;
+    }
+
+    if (tc->n >= TCACHE_ENTS_MAX) {
+        tcache_ent_t ** pent = &tc->ents;
+        while ((*pent)->next != NULL)
+            pent = &(*pent)->next;
+        free(*pent);
+        *pent = NULL;
+        --tc->n;
+    }
+
+    if ((ent = malloc(sizeof(*ent) + (n + n_fail) * sizeof(ent->props[0]))) == NULL)
+        return;
+    ent->hash = hash;
+    ent->flags = flags;
+    ent->rv = rv;
+    ent->fails_known = fails_known;
+    ent->n = n;
+    ent->n_fail = n_fail;
+    memcpy(ent->props, key, n * sizeof(*key));
+    if (n_fail != 0)
+        memcpy(ent->props + n, fails, n_fail * sizeof(*fails));
+
+    ent->next = tc->ents;
+    tc->ents = ent;
+    ++tc->n;
+}
+
+// Does this commit contain anything that changes modes or routing?
+static bool
+tcache_is_modeset(drmu_test_cache_t * const tc, const struct drm_mode_atomic * const atomic, const unsigned int n_props)
+{
+    const uint32_t * const props = (const uint32_t *)(uintptr_t)atomic->props_ptr;
+    unsigned int i, j;
+    bool rv = false;
+
+    pthread_mutex_lock(&tc->lock);
+    for (i = 0; i != n_props && !rv; ++i) {
+        for (j = 0; j != tc->n_modeset && !rv; ++j)
+            rv = props[i] == tc->modeset_ids[j];
+    }
+    pthread_mutex_unlock(&tc->lock);
+    return rv;
+}
+
+// Find the current value of obj/prop in the commit arrays
+static bool
+atomic_value_find(const struct drm_mode_atomic * const atomic, const uint32_t obj_id, const uint32_t prop_id,
+                  uint64_t * const pval)
+{
+    const uint32_t * const objs = (const uint32_t *)(uintptr_t)atomic->objs_ptr;
+    const uint32_t * const counts = (const uint32_t *)(uintptr_t)atomic->count_props_ptr;
+    const uint32_t * const props = (const uint32_t *)(uintptr_t)atomic->props_ptr;
+    const uint64_t * const values = (const uint64_t *)(uintptr_t)atomic->prop_values_ptr;
+    unsigned int i, j;
+    unsigned int p = 0;
+
+    for (i = 0; i != atomic->count_objs; ++i) {
+        if (objs[i] != obj_id) {
+            p += counts[i];
+            continue;
+        }
+        for (j = 0; j != counts[i]; ++j, ++p) {
+            if (props[p] == prop_id) {
+                *pval = values[p];
+                return true;
+            }
+        }
+        break;
+    }
+    return false;
+}
+
+drmu_test_cache_t *
+drmu_test_cache_int_new(void)
+{
+    drmu_test_cache_t * const tc = calloc(1, sizeof(*tc));
+
+    if (tc == NULL)
+        return NULL;
+    pthread_mutex_init(&tc->lock, NULL);
+    atomic_init(&tc->enabled, false);
+    return tc;
+}
+
+void
+drmu_test_cache_int_free(drmu_test_cache_t * const tc)
+{
+    if (tc == NULL)
+        return;
+    tcache_clear(tc);
+    pthread_mutex_destroy(&tc->lock);
+    free(tc);
+}
+
+// Prop ids are shared between objects of the same type so most adds are
+// repeats
+int
+drmu_test_cache_int_modeset_add(drmu_test_cache_t * const tc, const uint32_t prop_id)
+{
+    unsigned int i;
+    int rv = 0;
+
+    if (tc == NULL || prop_id == 0)
+        return 0;
+
+    pthread_mutex_lock(&tc->lock);
+    for (i = 0; i != tc->n_modeset; ++i) {
+        if (tc->modeset_ids[i] == prop_id)
+            goto unlock;
+    }
+    if (tc->n_modeset >= TCACHE_MODESET_MAX)
+        rv = -ENOMEM;
+    else
+        tc->modeset_ids[tc->n_modeset++] = prop_id;
+unlock:
+    pthread_mutex_unlock(&tc->lock);
+    return rv;
+}
+
+void
+drmu_env_test_cache_set(drmu_env_t * const du, const bool enable)
+{
+    drmu_test_cache_t * const tc = drmu_env_int_test_cache(du);
+
+    if (tc == NULL)
+        return;
+
+    pthread_mutex_lock(&tc->lock);
+    tcache_clear(tc);
+    atomic_store(&tc->enabled, enable);
+    pthread_mutex_unlock(&tc->lock);
+}
+
+void
+drmu_env_test_cache_invalidate(drmu_env_t * const du)
+{
+    drmu_test_cache_t * const tc = drmu_env_int_test_cache(du);
+
+    if (tc == NULL)
+        return;
+
+    pthread_mutex_lock(&tc->lock);
+    tcache_clear(tc);
+    pthread_mutex_unlock(&tc->lock);
+}
+
+void
+drmu_env_test_cache_stats(drmu_env_t * const du, uint64_t * const pHits, uint64_t * const pMisses)
+{
+    drmu_test_cache_t * const tc = drmu_env_int_test_cache(du);
+
+    if (tc == NULL) {
+        *pHits = 0;
+        *pMisses = 0;
+        return;
+    }
+
+    pthread_mutex_lock(&tc->lock);
+    *pHits = tc->hits;
+    *pMisses = tc->misses;
+    pthread_mutex_unlock(&tc->lock);
+}
+
+//----------------------------------------------------------------------------
+//
+// Atomic props
+
 static inline unsigned int
 max_uint(const unsigned int a, const unsigned int b)
 {
     return a < b ? b : a;
 }
 
-static atomic_cb_t *
-atomic_cb_new(drmu_atomic_commit_fn * cb, void * v)
+// Append a new chunk to da
+static atomic_cb_chunk_t *
+atomic_cb_chunk_add(drmu_atomic_t * const da)
 {
-    atomic_cb_t * acb = malloc(sizeof(*acb));
-    if (acb == NULL)
+    atomic_cb_chunk_t * const acc = cache_cb_chunk_alloc(da->ac);
+
+    if (acc == NULL)
         return NULL;
+    if (da->commit_cb_last == NULL)
+        da->commit_cb_chunks = acc;
+    else
+        da->commit_cb_last->next = acc;
+    da->commit_cb_last = acc;
+    return acc;
+}
+
+// Move b's commit cbs onto the end of a's
+// b's chunks are spliced on. b's inline cbs go in the spare space at the
+// end of a or at the start of b's first chunk so a new chunk is only needed
+// if neither has room.
+static int
+atomic_cbs_merge(drmu_atomic_t * const a, drmu_atomic_t * const b)
+{
+    const unsigned int n = b->commit_cb_n;
+    atomic_cb_chunk_t * const b_first = b->commit_cb_chunks;
+
+    if (n != 0) {
+        atomic_cb_chunk_t * const a_last = a->commit_cb_last;
+
+        if (a_last == NULL && a->commit_cb_n + n <= ATOMIC_CBS_INLINE) {
+            memcpy(a->commit_cbs + a->commit_cb_n, b->commit_cbs, n * sizeof(atomic_cb_t));
+            a->commit_cb_n += n;
+        }
+        else if (a_last != NULL && a_last->n + n <= ATOMIC_CBS_CHUNK) {
+            memcpy(a_last->cbs + a_last->n, b->commit_cbs, n * sizeof(atomic_cb_t));
+            a_last->n += n;
+        }
+        else if (b_first != NULL && b_first->n + n <= ATOMIC_CBS_CHUNK) {
+            memmove(b_first->cbs + n, b_first->cbs, b_first->n * sizeof(atomic_cb_t));
+            memcpy(b_first->cbs, b->commit_cbs, n * sizeof(atomic_cb_t));
+            b_first->n += n;
+        }
+        else {
+            atomic_cb_chunk_t * const acc = atomic_cb_chunk_add(a);
+            if (acc == NULL)
+                return -ENOMEM;
+            memcpy(acc->cbs, b->commit_cbs, n * sizeof(atomic_cb_t));
+            acc->n = n;
+        }
+        b->commit_cb_n = 0;
+    }
 
-    *acb = (atomic_cb_t){
-        .next = NULL,
-        .cb = cb,
-        .v = v
-    };
-    return acb;
+    if (b_first != NULL) {
+        if (a->commit_cb_last == NULL)
+            a->commit_cb_chunks = b_first;
+        else
+            a->commit_cb_last->next = b_first;
+        a->commit_cb_last = b->commit_cb_last;
+        b->commit_cb_chunks = NULL;
+        b->commit_cb_last = NULL;
+    }
+    return 0;
 }
 
 static void
@@ -89,35 +972,86 @@ aprop_prop_committed(aprop_prop_t * const pp)
     pp->fns->commit(pp->v, pp->value);
 }
 
+static bool
+aprop_obj_is_shared(const aprop_obj_t * const po)
+{
+    return po->props != NULL && atomic_load(&aprop_array(po->props)->ref_count) != 0;
+}
+
+// Drop a ref on a props array, unreffing the props if it was the last
+// n & size are the same for every holder as shared arrays never change
 static void
-aprop_obj_uninit(aprop_obj_t * const po)
+aprop_props_unref(drmu_atomic_cache_t * const ac, aprop_prop_t * const props, const unsigned int n, const unsigned int size)
 {
     unsigned int i;
-    for (i = 0; i != po->n; ++i)
-        aprop_prop_unref(po->props + i);
-    free(po->props);
+
+    if (props == NULL || atomic_fetch_sub(&aprop_array(props)->ref_count, 1) != 0)
+        return;
+
+    for (i = 0; i != n; ++i)
+        aprop_prop_unref(props + i);
+    cache_props_free(ac, props, size);
+}
+
+static void
+aprop_obj_uninit(drmu_atomic_cache_t * const ac, aprop_obj_t * const po)
+{
+    aprop_props_unref(ac, po->props, po->n, po->size);
     memset(po, 0, sizeof(*po));
 }
 
+// Give po its own copy of its props array so it can be changed
 static int
-aprop_obj_copy(aprop_obj_t * const po_c, const aprop_obj_t * const po_a)
+aprop_obj_unshare(drmu_atomic_cache_t * const ac, aprop_obj_t * const po)
 {
     unsigned int i;
     aprop_prop_t * props;
 
-    aprop_obj_uninit(po_c);
-    if (po_a->n == 0)
+    if (!aprop_obj_is_shared(po))
         return 0;
 
-    if ((props = calloc(po_a->size, sizeof(*props))) == NULL)
+    if ((props = cache_props_alloc(ac, po->size)) == NULL)
         return -ENOMEM;
-    memcpy(props, po_a->props, po_a->n * sizeof(*po_a->props));
+    memcpy(props, po->props, po->n * sizeof(*props));
+    for (i = 0; i != po->n; ++i)
+        aprop_prop_ref(props + i);
 
-    *po_c = *po_a;
-    po_c->props = props;
+    aprop_props_unref(ac, po->props, po->n, po->size);
+    po->props = props;
+    return 0;
+}
+
+static void aprop_obj_props_sort(aprop_obj_t * const po);
+
+// Copy is just another ref on a's props array if that is sorted
+// Shared arrays are kept sorted so nothing ever needs to sort them, but a
+// may have other holders so it mustn't be sorted here - if it isn't
+// sorted already then c gets a sorted array of its own.
+static int
+aprop_obj_copy(drmu_atomic_cache_t * const ac, aprop_obj_t * const po_c, const aprop_obj_t * const po_a)
+{
+    aprop_prop_t * props;
+    unsigned int i;
+
+    aprop_obj_uninit(ac, po_c);
+    if (po_a->n == 0)
+        return 0;
+
+    if (!po_a->unsorted) {
+        atomic_fetch_add(&aprop_array(po_a->props)->ref_count, 1);
+        *po_c = *po_a;
+        return 0;
+    }
 
+    if ((props = cache_props_alloc(ac, po_a->size)) == NULL)
+        return -ENOMEM;
+    memcpy(props, po_a->props, po_a->n * sizeof(*props));
     for (i = 0; i != po_a->n; ++i)
         aprop_prop_ref(props + i);
+
+    *po_c = *po_a;
+    po_c->props = props;
+    aprop_obj_props_sort(po_c);
     return 0;
 }
 
@@ -141,20 +1075,34 @@ aprop_obj_props_sort(aprop_obj_t * const po)
 {
     if (!po->unsorted)
         return;
+    assert(!aprop_obj_is_shared(po));
     qsort(po->props, po->n, sizeof(po->props[0]), aprop_prop_qsort_cb);
     po->unsorted = false;
 }
 
 // Merge b into a and put the result in c. a & b are uninit on exit
 // Could (easily) merge into a but its more convienient for the caller to create new
+// *pa_kept is incremented by the number of props from a that survive
+// Props from an unshared array are moved, from a shared one they are reffed
 static int
-aprop_obj_merge(aprop_obj_t * const po_c, aprop_obj_t * const po_a, aprop_obj_t * const po_b)
+aprop_obj_merge(drmu_atomic_cache_t * const ac,
+                aprop_obj_t * const po_c, aprop_obj_t * const po_a, aprop_obj_t * const po_b,
+                unsigned int * const pa_kept)
 {
     unsigned int i, j, k;
     unsigned int c_size;
     aprop_prop_t * c;
     aprop_prop_t * const a = po_a->props;
     aprop_prop_t * const b = po_b->props;
+    const bool a_shared = aprop_obj_is_shared(po_a);
+    const bool b_shared = aprop_obj_is_shared(po_b);
+
+    // Both copies of the same array - b overrides everything in a
+    if (a == b) {
+        aprop_obj_uninit(ac, po_a);
+        aprop_obj_move(po_c, po_b);
+        return 0;
+    }
 
     // As we should have no identical els we don't care that qsort is unstable
     aprop_obj_props_sort(po_a);
@@ -164,23 +1112,41 @@ aprop_obj_merge(aprop_obj_t * const po_c, aprop_obj_t * const po_a, aprop_obj_t
     c_size = max_uint(po_a->size, po_b->size);
     if (c_size < po_a->n + po_b->n)
         c_size *= 2;
-    if ((c = calloc(c_size, sizeof(*c))) == NULL)
+    if ((c = cache_props_alloc(ac, c_size)) == NULL)
         return -ENOMEM;
 
     for (i = 0, j = 0, k = 0; i < po_a->n && j < po_b->n; ++k) {
-        if (a[i].id < b[j].id)
+        if (a[i].id < b[j].id) {
             c[k] = a[i++];
-        else if (a[i].id > b[j].id)
+            if (a_shared)
+                aprop_prop_ref(c + k);
+            ++*pa_kept;
+        }
+        else if (a[i].id > b[j].id) {
             c[k] = b[j++];
+            if (b_shared)
+                aprop_prop_ref(c + k);
+        }
         else {
             c[k] = b[j++];
-            aprop_prop_unref(a + i++);
+            if (b_shared)
+                aprop_prop_ref(c + k);
+            if (!a_shared)
+                aprop_prop_unref(a + i);
+            ++i;
         }
     }
-    for (; i < po_a->n; ++i, ++k)
+    *pa_kept += po_a->n - i;
+    for (; i < po_a->n; ++i, ++k) {
         c[k] = a[i];
-    for (; j < po_b->n; ++j, ++k)
+        if (a_shared)
+            aprop_prop_ref(c + k);
+    }
+    for (; j < po_b->n; ++j, ++k) {
         c[k] = b[j];
+        if (b_shared)
+            aprop_prop_ref(c + k);
+    }
 
     *po_c = (aprop_obj_t){
         .id = po_a->id,
@@ -190,9 +1156,16 @@ aprop_obj_merge(aprop_obj_t * const po_c, aprop_obj_t * const po_a, aprop_obj_t
         .props = c
     };
 
-    // We have avoided excess ref / unref by simple copy so just free the props array
-    free(a);
-    free(b);
+    // We have avoided excess ref / unref by simple copy so just free unshared
+    // props arrays
+    if (a_shared)
+        aprop_props_unref(ac, a, po_a->n, po_a->size);
+    else
+        cache_props_free(ac, a, po_a->size);
+    if (b_shared)
+        aprop_props_unref(ac, b, po_b->n, po_b->size);
+    else
+        cache_props_free(ac, b, po_b->size);
 
     memset(po_a, 0, sizeof(*po_a));
     memset(po_b, 0, sizeof(*po_b));
@@ -204,10 +1177,10 @@ aprop_obj_merge(aprop_obj_t * const po_c, aprop_obj_t * const po_a, aprop_obj_t
 // b must be sorted
 // Returns count of props remaining in a
 static unsigned int
-aprop_obj_sub(aprop_obj_t * const po_a, const aprop_obj_t * const po_b)
+aprop_obj_sub(drmu_atomic_cache_t * const ac, aprop_obj_t * const po_a, const aprop_obj_t * const po_b)
 {
     unsigned int i = 0, j = 0, k;
-    aprop_prop_t * const a = po_a->props;
+    aprop_prop_t * a = po_a->props;
     const aprop_prop_t * const b = po_b->props;
 
     if (po_a->n == 0 || po_b->n == 0)
@@ -229,6 +1202,10 @@ aprop_obj_sub(aprop_obj_t * const po_a, const aprop_obj_t * const po_b)
         }
     }
     // We have a match - next loop will do the unref
+    // If we can't get our own copy to change then leave a alone
+    if (aprop_obj_unshare(ac, po_a) != 0)
+        return po_a->n;
+    a = po_a->props;
     k = i;
 
     do {
@@ -250,10 +1227,10 @@ aprop_obj_sub(aprop_obj_t * const po_a, const aprop_obj_t * const po_b)
 
 
 static aprop_prop_t *
-aprop_obj_prop_get(aprop_obj_t * const po, const uint32_t id)
+aprop_obj_prop_get(drmu_atomic_cache_t * const ac, aprop_obj_t * const po, const uint32_t id)
 {
     unsigned int i;
-    aprop_prop_t * pp = po->props;
+    aprop_prop_t * pp;
 
     static const drmu_atomic_prop_fns_t null_fns = {
         .ref    = drmu_prop_fn_null_ref,
@@ -261,16 +1238,23 @@ aprop_obj_prop_get(aprop_obj_t * const po, const uint32_t id)
         .commit = drmu_prop_fn_null_commit
     };
 
+    // Caller is going to change the prop
+    if (aprop_obj_unshare(ac, po) != 0)
+        return NULL;
+    pp = po->props;
+
     for (i = 0; i != po->n; ++i, ++pp) {
         if (pp->id == id)
             return pp;
     }
 
     if (po->n >= po->size) {
-        size_t newsize = po->size < 16 ? 16 : po->size * 2;
-        if ((pp = realloc(po->props, newsize * sizeof(*pp))) == NULL)
+        const unsigned int newsize = po->size < 16 ? 16 : po->size * 2;
+        if ((pp = cache_props_alloc(ac, newsize)) == NULL)
             return NULL;
-        memset(pp + po->size, 0, (newsize - po->size) * sizeof(*pp));
+        if (po->n != 0)
+            memcpy(pp, po->props, po->n * sizeof(*pp));
+        cache_props_free(ac, po->props, po->size);
 
         po->props = pp;
         po->size = newsize;
@@ -339,7 +1323,7 @@ aprop_hdr_committed(const aprop_hdr_t * const ph)
 }
 
 static aprop_obj_t *
-aprop_hdr_obj_get(aprop_hdr_t * const ph, const uint32_t id)
+aprop_hdr_obj_get(drmu_atomic_cache_t * const ac, aprop_hdr_t * const ph, const uint32_t id)
 {
     unsigned int i;
     aprop_obj_t * po = ph->objs;
@@ -350,10 +1334,12 @@ aprop_hdr_obj_get(aprop_hdr_t * const ph, const uint32_t id)
     }
 
     if (ph->n >= ph->size) {
-        size_t newsize = ph->size < 16 ? 16 : ph->size * 2;
-        if ((po = realloc(ph->objs, newsize * sizeof(*po))) == NULL)
+        const unsigned int newsize = ph->size < 16 ? 16 : ph->size * 2;
+        if ((po = cache_objs_alloc(ac, newsize)) == NULL)
             return NULL;
-        memset(po + ph->size, 0, (newsize - ph->size) * sizeof(*po));
+        if (ph->n != 0)
+            memcpy(po, ph->objs, ph->n * sizeof(*po));
+        cache_objs_free(ac, ph->objs, ph->size);
 
         ph->objs = po;
         ph->size = newsize;
@@ -368,34 +1354,40 @@ aprop_hdr_obj_get(aprop_hdr_t * const ph, const uint32_t id)
 }
 
 static void
-aprop_hdr_uninit(aprop_hdr_t * const ph)
+aprop_hdr_uninit(drmu_atomic_cache_t * const ac, aprop_hdr_t * const ph)
 {
     unsigned int i;
     for (i = 0; i != ph->n; ++i)
-        aprop_obj_uninit(ph->objs + i);
-    free(ph->objs);
+        aprop_obj_uninit(ac, ph->objs + i);
+    cache_objs_free(ac, ph->objs, ph->size);
     memset(ph, 0, sizeof(*ph));
 }
 
+// Props arrays are shared with a, only the objs array is copied
 static int
-aprop_hdr_copy(aprop_hdr_t * const ph_c, const aprop_hdr_t * const ph_a)
+aprop_hdr_copy(drmu_atomic_cache_t * const ac, aprop_hdr_t * const ph_c, const aprop_hdr_t * const ph_a)
 {
     unsigned int i;
+    int rv;
 
-    aprop_hdr_uninit(ph_c);
+    aprop_hdr_uninit(ac, ph_c);
 
     if (ph_a->n == 0)
         return 0;
 
-    if ((ph_c->objs = calloc(ph_a->size, sizeof(*ph_c->objs))) == NULL)
+    if ((ph_c->objs = cache_objs_alloc(ac, ph_a->size)) == NULL)
         return -ENOMEM;
 
     ph_c->n = ph_a->n;
     ph_c->size = ph_a->size;
     ph_c->unsorted = ph_a->unsorted;
 
-    for (i = 0; i != ph_a->n; ++i)
-        aprop_obj_copy(ph_c->objs + i, ph_a->objs + i);
+    for (i = 0; i != ph_a->n; ++i) {
+        if ((rv = aprop_obj_copy(ac, ph_c->objs + i, ph_a->objs + i)) != 0) {
+            ph_c->n = i;
+            return rv;
+        }
+    }
     return 0;
 }
 
@@ -428,8 +1420,11 @@ aprop_hdr_sort(aprop_hdr_t * const ph)
 }
 
 // Merge b into a. b will be uninited
+// *pa_kept is set to the number of props originally in a that were not
+// overridden by b
 static int
-aprop_hdr_merge(aprop_hdr_t * const ph_a, aprop_hdr_t * const ph_b)
+aprop_hdr_merge(drmu_atomic_cache_t * const ac,
+                aprop_hdr_t * const ph_a, aprop_hdr_t * const ph_b, unsigned int * const pa_kept)
 {
     unsigned int i, j, k;
     unsigned int c_size;
@@ -437,8 +1432,12 @@ aprop_hdr_merge(aprop_hdr_t * const ph_a, aprop_hdr_t * const ph_b)
     aprop_obj_t * const a = ph_a->objs;
     aprop_obj_t * const b = ph_b->objs;
 
-    if (ph_b->n == 0)
+    *pa_kept = 0;
+    if (ph_b->n == 0) {
+        for (i = 0; i != ph_a->n; ++i)
+            *pa_kept += a[i].n;
         return 0;
+    }
     if (ph_a->n == 0)
         return aprop_hdr_move(ph_a, ph_b);
 
@@ -449,24 +1448,28 @@ aprop_hdr_merge(aprop_hdr_t * const ph_a, aprop_hdr_t * const ph_b)
     c_size = max_uint(ph_a->size, ph_b->size);
     if (c_size < ph_a->n + ph_b->n)
         c_size *= 2;
-    if ((c = calloc(c_size, sizeof(*c))) == NULL)
+    if ((c = cache_objs_alloc(ac, c_size)) == NULL)
         return -ENOMEM;
 
     for (i = 0, j = 0, k = 0; i < ph_a->n && j < ph_b->n; ++k) {
-        if (a[i].id < b[j].id)
+        if (a[i].id < b[j].id) {
+            *pa_kept += a[i].n;
             aprop_obj_move(c + k, a + i++);
+        }
         else if (a[i].id > b[j].id)
             aprop_obj_move(c + k, b + j++);
         else
-            aprop_obj_merge(c + k, a + i++, b + j++);
+            aprop_obj_merge(ac, c + k, a + i++, b + j++, pa_kept);
     }
-    for (; i < ph_a->n; ++i, ++k)
+    for (; i < ph_a->n; ++i, ++k) {
+        *pa_kept += a[i].n;
         aprop_obj_move(c + k, a + i);
+    }
     for (; j < ph_b->n; ++j, ++k)
         aprop_obj_move(c + k, b + j);
 
-    aprop_hdr_uninit(ph_a);
-    aprop_hdr_uninit(ph_b);
+    aprop_hdr_uninit(ac, ph_a);
+    aprop_hdr_uninit(ac, ph_b);
 
     ph_a->n = k;
     ph_a->size = c_size;
@@ -479,7 +1482,7 @@ aprop_hdr_merge(aprop_hdr_t * const ph_a, aprop_hdr_t * const ph_b)
 // Remove any props in a that are also in b
 // b must be sorted
 static void
-aprop_hdr_sub(aprop_hdr_t * const ph_a, const aprop_hdr_t * const ph_b)
+aprop_hdr_sub(drmu_atomic_cache_t * const ac, aprop_hdr_t * const ph_a, const aprop_hdr_t * const ph_b)
 {
     unsigned int i = 0, j = 0, k;
     aprop_obj_t * const a = ph_a->objs;
@@ -500,8 +1503,8 @@ aprop_hdr_sub(aprop_hdr_t * const ph_a, const aprop_hdr_t * const ph_b)
             ++j;
         else {
             k = i;
-            if (aprop_obj_sub(a + i++, b + j++) == 0) {
-                aprop_obj_uninit(a + k);
+            if (aprop_obj_sub(ac, a + i++, b + j++) == 0) {
+                aprop_obj_uninit(ac, a + k);
                 break;
             }
         }
@@ -514,8 +1517,8 @@ aprop_hdr_sub(aprop_hdr_t * const ph_a, const aprop_hdr_t * const ph_b)
         else if (a[i].id > b[j].id)
             j++;
         else {
-            if (aprop_obj_sub(a + i, b + j) == 0)
-                aprop_obj_uninit(a + i);
+            if (aprop_obj_sub(ac, a + i, b + j) == 0)
+                aprop_obj_uninit(ac, a + i);
             else
                 aprop_obj_move(a + k++, a + i);
             i++;
@@ -541,10 +1544,10 @@ aprop_hdr_props_sort(aprop_hdr_t * const ph)
 }
 
 static aprop_prop_t *
-aprop_hdr_prop_get(aprop_hdr_t * const ph, const uint32_t obj_id, const uint32_t prop_id)
+aprop_hdr_prop_get(drmu_atomic_cache_t * const ac, aprop_hdr_t * const ph, const uint32_t obj_id, const uint32_t prop_id)
 {
-    aprop_obj_t * const po = aprop_hdr_obj_get(ph, obj_id);
-    return po == NULL ? NULL : aprop_obj_prop_get(po, prop_id);
+    aprop_obj_t * const po = aprop_hdr_obj_get(ac, ph, obj_id);
+    return po == NULL ? NULL : aprop_obj_prop_get(ac, po, prop_id);
 }
 
 // Total props
@@ -617,30 +1620,36 @@ drmu_prop_fn_null_commit(void * v, uint64_t value)
 int
 drmu_atomic_add_commit_callback(drmu_atomic_t * const da, drmu_atomic_commit_fn * const cb, void * const v)
 {
-    if (cb) {
-        atomic_cb_t *acb = atomic_cb_new(cb, v);
-        if (acb == NULL)
-            return -ENOMEM;
+    atomic_cb_chunk_t * acc = da->commit_cb_last;
+
+    if (!cb)
+        return 0;
 
-        *da->commit_cb_last_ptr = acb;
-        da->commit_cb_last_ptr = &acb->next;
+    if (acc == NULL && da->commit_cb_n < ATOMIC_CBS_INLINE) {
+        da->commit_cbs[da->commit_cb_n++] = (atomic_cb_t){.cb = cb, .v = v};
+        return 0;
     }
 
+    if ((acc == NULL || acc->n >= ATOMIC_CBS_CHUNK) &&
+        (acc = atomic_cb_chunk_add(da)) == NULL)
+        return -ENOMEM;
+    acc->cbs[acc->n++] = (atomic_cb_t){.cb = cb, .v = v};
     return 0;
 }
 
 void
 drmu_atomic_clear_commit_callbacks(drmu_atomic_t * const da)
 {
-    atomic_cb_t *p = da->commit_cb_q;
+    atomic_cb_chunk_t * acc = da->commit_cb_chunks;
 
-    da->commit_cb_q = NULL;
-    da->commit_cb_last_ptr = &da->commit_cb_q;
+    da->commit_cb_n = 0;
+    da->commit_cb_chunks = NULL;
+    da->commit_cb_last = NULL;
 
-    while (p != NULL) {
-        atomic_cb_t * const next = p->next;
-        free(p);
-        p = next;
+    while (acc != NULL) {
+        atomic_cb_chunk_t * const next = acc->next;
+        cache_cb_chunk_free(da->ac, acc);
+        acc = next;
     }
 }
 
@@ -658,8 +1667,71 @@ drmu_atomic_run_commit_callbacks(const drmu_atomic_t * const da)
     if (da == NULL)
         return;
 
-    for (const atomic_cb_t *p = da->commit_cb_q; p != NULL; p = p->next)
-        p->cb(p->v);
+    for (unsigned int i = 0; i != da->commit_cb_n; ++i)
+        da->commit_cbs[i].cb(da->commit_cbs[i].v);
+    for (const atomic_cb_chunk_t * acc = da->commit_cb_chunks; acc != NULL; acc = acc->next)
+        for (unsigned int i = 0; i != acc->n; ++i)
+            acc->cbs[i].cb(acc->cbs[i].v);
+}
+
+static int
+atomic_present_cb_add(drmu_atomic_t * const da, drmu_atomic_present_fn * const cb, void * const v,
+                      const bool dropped)
+{
+    atomic_present_cb_t * const pcb = cache_cb_alloc(da->ac, sizeof(*pcb));
+
+    if (pcb == NULL)
+        return -ENOMEM;
+    *pcb = (atomic_present_cb_t){
+        .next = NULL,
+        .v = v,
+        .cb = cb,
+        .dropped = dropped
+    };
+
+    *da->present_cb_last_ptr = pcb;
+    da->present_cb_last_ptr = &pcb->next;
+    return 0;
+}
+
+int
+drmu_atomic_add_present_callback(drmu_atomic_t * const da, drmu_atomic_present_fn * const cb, void * const v)
+{
+    return !cb ? 0 : atomic_present_cb_add(da, cb, v, false);
+}
+
+void
+drmu_atomic_clear_present_callbacks(drmu_atomic_t * const da)
+{
+    atomic_present_cb_t *p = da->present_cb_q;
+
+    da->present_cb_q = NULL;
+    da->present_cb_last_ptr = &da->present_cb_q;
+
+    while (p != NULL) {
+        atomic_present_cb_t * const next = p->next;
+        cache_cb_free(da->ac, p);
+        p = next;
+    }
+}
+
+bool
+drmu_atomic_has_present_callbacks(const drmu_atomic_t * const da)
+{
+    return da != NULL && da->present_cb_q != NULL;
+}
+
+void
+drmu_atomic_run_present_callbacks(const drmu_atomic_t * const da, const drmu_present_info_t * const info)
+{
+    if (da == NULL)
+        return;
+
+    for (const atomic_present_cb_t *p = da->present_cb_q; p != NULL; p = p->next) {
+        drmu_present_info_t pi = *info;
+        pi.dropped = pi.dropped || p->dropped;
+        p->cb(p->v, &pi);
+    }
 }
 
 int
@@ -675,7 +1747,7 @@ drmu_atomic_add_prop_generic(drmu_atomic_t * const da,
     }
     else
     {
-        aprop_prop_t *const pp = aprop_hdr_prop_get(ph, obj_id, prop_id);
+        aprop_prop_t *const pp = aprop_hdr_prop_get(da->ac, ph, obj_id, prop_id);
         if (pp == NULL)
             return -ENOMEM;
 
@@ -699,6 +1771,24 @@ drmu_atomic_add_prop_value(drmu_atomic_t * const da, const uint32_t obj_id, cons
     return 0;
 }
 
+void
+drmu_atomic_int_prop_v_foreach(const drmu_atomic_t * const da, const drmu_atomic_prop_fns_t * const fns,
+                               drmu_prop_foreach_fn * const fn, void * const v)
+{
+    unsigned int i, j;
+
+    if (da == NULL)
+        return;
+
+    // Read only so shared prop arrays can be walked as they are
+    for (i = 0; i != da->props.n; ++i) {
+        const aprop_obj_t * const po = da->props.objs + i;
+        for (j = 0; j != po->n; ++j)
+            if (po->props[j].fns == fns)
+                fn(po->props[j].v, v);
+    }
+}
+
 void
 drmu_atomic_dump_lvl(const drmu_atomic_t * const da, const int lvl)
 {
@@ -728,8 +1818,12 @@ static void
 drmu_atomic_free(drmu_atomic_t * const da)
 {
     drmu_atomic_clear_commit_callbacks(da);
-    aprop_hdr_uninit(&da->props);
-    free(da);
+    drmu_atomic_clear_present_callbacks(da);
+    aprop_hdr_uninit(da->ac, &da->props);
+    if (da->ac == NULL)
+        free(da);
+    else
+        cache_free(da->ac, &da->ac->atomics, da);
 }
 
 void
@@ -755,14 +1849,16 @@ drmu_atomic_ref(drmu_atomic_t * const da)
 drmu_atomic_t *
 drmu_atomic_new(drmu_env_t * const du)
 {
-    drmu_atomic_t * const da = calloc(1, sizeof(*da));
+    drmu_atomic_cache_t * const ac = du == NULL ? NULL : drmu_env_int_atomic_cache(du);
+    drmu_atomic_t * const da = ac == NULL ? calloc(1, sizeof(*da)) : cache_alloc(ac, &ac->atomics);
 
     if (da == NULL) {
         drmu_err(du, "%s: Failed to alloc struct", __func__);
         return NULL;
     }
     da->du = du;
-    da->commit_cb_last_ptr = &da->commit_cb_q;
+    da->ac = ac;
+    da->present_cb_last_ptr = &da->present_cb_q;
 
     return da;
 }
@@ -775,10 +1871,17 @@ drmu_atomic_copy(drmu_atomic_t * const b)
     if (b == NULL || (a = drmu_atomic_new(b->du)) == NULL)
         return NULL;
 
-    if (aprop_hdr_copy(&a->props, &b->props) != 0)
+    if (aprop_hdr_copy(a->ac, &a->props, &b->props) != 0)
         goto fail;
-    for (atomic_cb_t * p = b->commit_cb_q; p != NULL; p = p->next)
-        if (drmu_atomic_add_commit_callback(a, p->cb, p->v) != 0)
+    for (unsigned int i = 0; i != b->commit_cb_n; ++i)
+        if (drmu_atomic_add_commit_callback(a, b->commit_cbs[i].cb, b->commit_cbs[i].v) != 0)
+            goto fail;
+    for (const atomic_cb_chunk_t * acc = b->commit_cb_chunks; acc != NULL; acc = acc->next)
+        for (unsigned int i = 0; i != acc->n; ++i)
+            if (drmu_atomic_add_commit_callback(a, acc->cbs[i].cb, acc->cbs[i].v) != 0)
+                goto fail;
+    for (atomic_present_cb_t * p = b->present_cb_q; p != NULL; p = p->next)
+        if (atomic_present_cb_add(a, p->cb, p->v, p->dropped) != 0)
             goto fail;
     return a;
 
@@ -803,11 +1906,14 @@ drmu_atomic_move(drmu_atomic_t ** const ppb)
 }
 
 // Merge b into a. b is unrefed (inc on error)
-// Commit cbs are added
+// Commit & present cbs are added. If b overrides everything in a then a's
+// present cbs are marked dropped
 int
 drmu_atomic_merge(drmu_atomic_t * const a, drmu_atomic_t ** const ppb)
 {
     drmu_atomic_t * b;
+    unsigned int a_kept;
+    bool a_empty;
     int rv = -EINVAL;
 
     if (*ppb == NULL)
@@ -821,13 +1927,26 @@ drmu_atomic_merge(drmu_atomic_t * const a, drmu_atomic_t ** const ppb)
     if ((b = drmu_atomic_move(ppb)) == NULL)
         return -ENOMEM;
 
-    if (b->commit_cb_q != NULL) {
-        *a->commit_cb_last_ptr = b->commit_cb_q;
-        a->commit_cb_last_ptr = b->commit_cb_last_ptr;
-        b->commit_cb_q = NULL;
+    if ((rv = atomic_cbs_merge(a, b)) != 0) {
+        drmu_err(a->du, "%s: Commit callback merge failed", __func__);
+        drmu_atomic_unref(&b);
+        return rv;
+    }
+
+    a_empty = aprop_hdr_props_is_empty(&a->props);
+    rv = aprop_hdr_merge(a->ac, &a->props, &b->props, &a_kept);
+
+    // If nothing from a survived then a will never get to the screen
+    if (rv == 0 && !a_empty && a_kept == 0) {
+        for (atomic_present_cb_t * p = a->present_cb_q; p != NULL; p = p->next)
+            p->dropped = true;
+    }
+    if (b->present_cb_q != NULL) {
+        *a->present_cb_last_ptr = b->present_cb_q;
+        a->present_cb_last_ptr = b->present_cb_last_ptr;
+        b->present_cb_q = NULL;
     }
 
-    rv = aprop_hdr_merge(&a->props, &b->props);
     drmu_atomic_unref(&b);
 
     if (rv != 0) {
@@ -842,7 +1961,7 @@ void
 drmu_atomic_sub(drmu_atomic_t * const a, drmu_atomic_t * const b)
 {
     aprop_hdr_props_sort(&b->props);
-    aprop_hdr_sub(&a->props, &b->props);
+    aprop_hdr_sub(a->ac, &a->props, &b->props);
 }
 
 static void
@@ -925,10 +2044,15 @@ commit_find_good(drmu_env_t * const du, const struct drm_mode_atomic * const ato
 }
 
 // da_fail does not keep refs to its values - for info only
-int
-drmu_atomic_commit_test(const drmu_atomic_t * const da, uint32_t flags, drmu_atomic_t * const da_fail)
+static int
+atomic_commit(const drmu_atomic_t * const da, const uint32_t flags, const uint64_t user_data,
+              const bool run_commit_cbs, const bool run_prop_cbs, drmu_atomic_t * const da_fail)
 {
     drmu_env_t * const du = da->du;
+    drmu_prop_shadow_t * const ps = du == NULL ? NULL : drmu_env_int_prop_shadow(du);
+    drmu_test_cache_t * const tc = du == NULL ? NULL : drmu_env_int_test_cache(du);
+    const bool delta = ps != NULL && atomic_load(&ps->enabled);
+    const bool test_cache = tc != NULL && (flags & DRM_MODE_ATOMIC_TEST_ONLY) != 0 && atomic_load(&tc->enabled);
     const unsigned int n_objs = aprop_hdr_objs_count(&da->props);
     unsigned int n_props = aprop_hdr_props_count(&da->props);
     int rv = 0;
@@ -938,6 +2062,12 @@ drmu_atomic_commit_test(const drmu_atomic_t * const da, uint32_t flags, drmu_ato
         uint32_t prop_counts[n_objs];
         uint32_t prop_ids[n_props];
         uint64_t prop_values[n_props];
+        // Only used with the test cache
+        tcache_prop_t key[test_cache ? n_props : 1];
+        tcache_prop_t fails[test_cache ? n_props : 1];
+        const unsigned int key_n = n_props;
+        unsigned int n_fail = 0;
+        uint64_t hash = 0;
         struct drm_mode_atomic atomic = {
             .flags           = flags,
             .count_objs      = n_objs,
@@ -945,15 +2075,68 @@ drmu_atomic_commit_test(const drmu_atomic_t * const da, uint32_t flags, drmu_ato
             .count_props_ptr = (uintptr_t)prop_counts,
             .props_ptr       = (uintptr_t)prop_ids,
             .prop_values_ptr = (uintptr_t)prop_values,
-            .user_data       = (uintptr_t)da
+            .user_data       = user_data
         };
 
         aprop_hdr_atomic_fill(&da->props, obj_ids, prop_counts, prop_ids, prop_values);
 
+        if (test_cache) {
+            const tcache_ent_t * ent;
+            bool hit = false;
+
+            hash = tcache_key_make(da, key, key_n, flags);
+            pthread_mutex_lock(&tc->lock);
+            // Only use a failure if we know what failed or don't care
+            if ((ent = tcache_find(tc, hash, flags, key, key_n)) != NULL &&
+                (ent->rv == 0 || da_fail == NULL || ent->fails_known)) {
+                hit = true;
+                rv = ent->rv;
+                n_fail = ent->n_fail;
+                memcpy(fails, ent->props + ent->n, n_fail * sizeof(fails[0]));
+                ++tc->hits;
+            }
+            else {
+                ++tc->misses;
+            }
+            pthread_mutex_unlock(&tc->lock);
+
+            if (hit) {
+                if (rv == 0 && run_prop_cbs)
+                    drmu_atomic_run_prop_commit_callbacks(da);
+                if (run_commit_cbs)
+                    drmu_atomic_run_commit_callbacks(da);
+                if (rv != 0 && da_fail != NULL) {
+                    for (unsigned int i = 0; i != n_fail; ++i) {
+                        uint64_t val = 0;
+                        atomic_value_find(&atomic, fails[i].obj_id, fails[i].prop_id, &val);
+                        drmu_atomic_add_prop_value(da_fail, fails[i].obj_id, fails[i].prop_id, val);
+                    }
+                }
+                return rv;
+            }
+        }
+
+        if (delta)
+            n_props = shadow_strip(ps, &atomic, n_props);
+
         rv = drmu_ioctl(du, DRM_IOCTL_MODE_ATOMIC, &atomic);
-        if (rv == 0)
+        if (rv == 0 && (flags & DRM_MODE_ATOMIC_TEST_ONLY) == 0) {
+            if (delta)
+                shadow_update(ps, &atomic);
+            if (tc != NULL && atomic_load(&tc->enabled) && tcache_is_modeset(tc, &atomic, n_props))
+                drmu_env_test_cache_invalidate(du);
+        }
+        if (rv == 0 && run_prop_cbs)
             drmu_atomic_run_prop_commit_callbacks(da);
-        drmu_atomic_run_commit_callbacks(da);
+        if (run_commit_cbs)
+            drmu_atomic_run_commit_callbacks(da);
+
+        // Other errors (e.g. -EACCES if we aren't master) are transient
+        if (test_cache && (rv == 0 || rv == -EINVAL || rv == -ERANGE) && (rv == 0 || da_fail == NULL)) {
+            pthread_mutex_lock(&tc->lock);
+            tcache_add(tc, hash, flags, key, key_n, rv, false, NULL, 0);
+            pthread_mutex_unlock(&tc->lock);
+        }
 
         if (rv  == 0 || !da_fail)
             return rv;
@@ -971,12 +2154,41 @@ drmu_atomic_commit_test(const drmu_atomic_t * const da, uint32_t flags, drmu_ato
             --n_props;
 
             drmu_atomic_add_prop_value(da_fail, objid, propid, val);
+            if (test_cache)
+                fails[n_fail++] = (tcache_prop_t){.obj_id = objid, .prop_id = propid};
+        }
+
+        if (test_cache && (rv == -EINVAL || rv == -ERANGE)) {
+            pthread_mutex_lock(&tc->lock);
+            tcache_add(tc, hash, flags, key, key_n, rv, true, fails, n_fail);
+            pthread_mutex_unlock(&tc->lock);
         }
     }
 
     return rv;
 }
 
+int
+drmu_atomic_commit_test(const drmu_atomic_t * const da, uint32_t flags, drmu_atomic_t * const da_fail)
+{
+    return atomic_commit(da, flags, (uintptr_t)da, true, true, da_fail);
+}
+
+int
+drmu_atomic_commit_flip_event(const drmu_atomic_t * const da, uint32_t flags, drmu_event_handler_t * const evh)
+{
+    // Nothing to commit means no event
+    if (drmu_atomic_is_empty(da))
+        return -EINVAL;
+    return atomic_commit(da, flags | DRM_MODE_PAGE_FLIP_EVENT, evh->id, false, true, NULL);
+}
+
+int
+drmu_atomic_int_commit_check(const drmu_atomic_t * const da, uint32_t flags)
+{
+    flags = (flags & ~DRM_MODE_ATOMIC_NONBLOCK) | DRM_MODE_ATOMIC_TEST_ONLY;
+    return atomic_commit(da, flags, 0, false, false, NULL);
+}
 
 int
 drmu_atomic_commit(const drmu_atomic_t * const da, uint32_t flags)
@@ -990,3 +2202,256 @@ drmu_atomic_is_empty(const drmu_atomic_t * const da)
     return da == NULL || aprop_hdr_props_is_empty(&da->props);
 }
 
+
+//----------------------------------------------------------------------------
+//
+// Prepared atomics
+// Slot values live directly in the ioctl value array, props grouped by obj
+// in the order objs were first added. slot_pos maps slot -> array index.
+
+typedef struct prep_slot_s {
+    uint32_t obj_id;
+    uint32_t prop_id;
+    unsigned int pos;
+} prep_slot_t;
+
+typedef struct drmu_atomic_prep_s {
+    drmu_env_t * du;
+
+    unsigned int n;     // Slots
+    unsigned int size;  // Allocated size of all arrays
+    prep_slot_t * slots;
+
+    unsigned int n_objs;
+    uint32_t * obj_ids;
+    uint32_t * prop_counts;
+    uint32_t * prop_ids;
+    uint64_t * prop_values;
+} drmu_atomic_prep_t;
+
+// Regroup the ioctl arrays after slot n-1 has been added
+static void
+prep_rebuild(drmu_atomic_prep_t * const ap, const uint64_t new_value)
+{
+    uint64_t values[ap->n];
+    bool done[ap->n];
+    unsigned int i, j;
+    unsigned int pos = 0;
+
+    for (i = 0; i != ap->n - 1; ++i)
+        values[i] = ap->prop_values[ap->slots[i].pos];
+    values[ap->n - 1] = new_value;
+    memset(done, 0, sizeof(done));
+
+    ap->n_objs = 0;
+    for (i = 0; i != ap->n; ++i) {
+        const uint32_t obj_id = ap->slots[i].obj_id;
+        unsigned int count = 0;
+
+        if (done[i])
+            continue;
+        for (j = i; j != ap->n; ++j) {
+            if (done[j] || ap->slots[j].obj_id != obj_id)
+                continue;
+            done[j] = true;
+            ap->slots[j].pos = pos;
+            ap->prop_ids[pos] = ap->slots[j].prop_id;
+            ap->prop_values[pos] = values[j];
+            ++pos;
+            ++count;
+        }
+        ap->obj_ids[ap->n_objs] = obj_id;
+        ap->prop_counts[ap->n_objs] = count;
+        ++ap->n_objs;
+    }
+}
+
+static int
+prep_resize(drmu_atomic_prep_t * const ap, const unsigned int size)
+{
+    prep_slot_t * slots;
+    uint32_t * obj_ids;
+    uint32_t * prop_counts;
+    uint32_t * prop_ids;
+    uint64_t * prop_values;
+
+    // Each realloc that succeeds is kept so failure part way is harmless
+    if ((slots = realloc(ap->slots, size * sizeof(*slots))) == NULL)
+        return -ENOMEM;
+    ap->slots = slots;
+    if ((obj_ids = realloc(ap->obj_ids, size * sizeof(*obj_ids))) == NULL)
+        return -ENOMEM;
+    ap->obj_ids = obj_ids;
+    if ((prop_counts = realloc(ap->prop_counts, size * sizeof(*prop_counts))) == NULL)
+        return -ENOMEM;
+    ap->prop_counts = prop_counts;
+    if ((prop_ids = realloc(ap->prop_ids, size * sizeof(*prop_ids))) == NULL)
+        return -ENOMEM;
+    ap->prop_ids = prop_ids;
+    if ((prop_values = realloc(ap->prop_values, size * sizeof(*prop_values))) == NULL)
+        return -ENOMEM;
+    ap->prop_values = prop_values;
+
+    ap->size = size;
+    return 0;
+}
+
+int
+drmu_atomic_prep_slot_find(const drmu_atomic_prep_t * const ap, const uint32_t obj_id, const uint32_t prop_id)
+{
+    unsigned int i;
+
+    for (i = 0; i != ap->n; ++i) {
+        if (ap->slots[i].obj_id == obj_id && ap->slots[i].prop_id == prop_id)
+            return (int)i;
+    }
+    return -ENOENT;
+}
+
+int
+drmu_atomic_prep_add_slot(drmu_atomic_prep_t * const ap, const uint32_t obj_id, const uint32_t prop_id, const uint64_t value)
+{
+    int slot;
+    int rv;
+
+    if (obj_id == 0 || prop_id == 0)
+        return -EINVAL;
+
+    if ((slot = drmu_atomic_prep_slot_find(ap, obj_id, prop_id)) >= 0) {
+        drmu_atomic_prep_set(ap, slot, value);
+        return slot;
+    }
+
+    if (ap->n >= ap->size &&
+        (rv = prep_resize(ap, ap->size < 8 ? 8 : ap->size * 2)) != 0)
+        return rv;
+
+    slot = ap->n++;
+    ap->slots[slot] = (prep_slot_t){.obj_id = obj_id, .prop_id = prop_id};
+    prep_rebuild(ap, value);
+    return slot;
+}
+
+void
+drmu_atomic_prep_set(drmu_atomic_prep_t * const ap, const unsigned int slot, const uint64_t value)
+{
+    assert(slot < ap->n);
+    ap->prop_values[ap->slots[slot].pos] = value;
+}
+
+uint64_t
+drmu_atomic_prep_get(const drmu_atomic_prep_t * const ap, const unsigned int slot)
+{
+    assert(slot < ap->n);
+    return ap->prop_values[ap->slots[slot].pos];
+}
+
+unsigned int
+drmu_atomic_prep_slot_count(const drmu_atomic_prep_t * const ap)
+{
+    return ap->n;
+}
+
+static int
+prep_commit(const drmu_atomic_prep_t * const ap, const uint32_t flags, const uint64_t user_data)
+{
+    drmu_prop_shadow_t * const ps = drmu_env_int_prop_shadow(ap->du);
+    struct drm_mode_atomic atomic = {
+        .flags           = flags,
+        .count_objs      = ap->n_objs,
+        .objs_ptr        = (uintptr_t)ap->obj_ids,
+        .count_props_ptr = (uintptr_t)ap->prop_counts,
+        .props_ptr       = (uintptr_t)ap->prop_ids,
+        .prop_values_ptr = (uintptr_t)ap->prop_values,
+        .user_data       = user_data
+    };
+    int rv;
+
+    if (ap->n == 0)
+        return 0;
+
+    // Always a full commit but keep any delta shadow in step
+    rv = drmu_ioctl(ap->du, DRM_IOCTL_MODE_ATOMIC, &atomic);
+    if (rv == 0 && ps != NULL && atomic_load(&ps->enabled) && (flags & DRM_MODE_ATOMIC_TEST_ONLY) == 0)
+        shadow_update(ps, &atomic);
+    return rv;
+}
+
+int
+drmu_atomic_prep_commit(const drmu_atomic_prep_t * const ap, uint32_t flags)
+{
+    return prep_commit(ap, flags, 0);
+}
+
+int
+drmu_atomic_prep_commit_flip_event(const drmu_atomic_prep_t * const ap, uint32_t flags, drmu_event_handler_t * const evh)
+{
+    // Nothing to commit means no event
+    if (ap->n == 0)
+        return -EINVAL;
+    return prep_commit(ap, flags | DRM_MODE_PAGE_FLIP_EVENT, evh->id);
+}
+
+int
+drmu_atomic_add_prep(drmu_atomic_t * const da, const drmu_atomic_prep_t * const ap)
+{
+    unsigned int i;
+    int rv = 0;
+
+    for (i = 0; i != ap->n && rv == 0; ++i)
+        rv = drmu_atomic_add_prop_value(da, ap->slots[i].obj_id, ap->slots[i].prop_id,
+                                        ap->prop_values[ap->slots[i].pos]);
+    return rv;
+}
+
+void
+drmu_atomic_prep_delete(drmu_atomic_prep_t ** const ppap)
+{
+    drmu_atomic_prep_t * const ap = *ppap;
+
+    if (ap == NULL)
+        return;
+    *ppap = NULL;
+
+    free(ap->slots);
+    free(ap->obj_ids);
+    free(ap->prop_counts);
+    free(ap->prop_ids);
+    free(ap->prop_values);
+    free(ap);
+}
+
+drmu_atomic_prep_t *
+drmu_atomic_prep_new(drmu_env_t * const du)
+{
+    drmu_atomic_prep_t * const ap = calloc(1, sizeof(*ap));
+
+    if (ap == NULL) {
+        drmu_err(du, "%s: Failed alloc", __func__);
+        return NULL;
+    }
+    ap->du = du;
+    return ap;
+}
+
+drmu_atomic_prep_t *
+drmu_atomic_prep_new_atomic(const drmu_atomic_t * const da)
+{
+    drmu_atomic_prep_t * ap = drmu_atomic_prep_new(da->du);
+    unsigned int i, j;
+
+    if (ap == NULL)
+        return NULL;
+
+    for (i = 0; i != da->props.n; ++i) {
+        const aprop_obj_t * const po = da->props.objs + i;
+        for (j = 0; j != po->n; ++j) {
+            if (drmu_atomic_prep_add_slot(ap, po->id, po->props[j].id, po->props[j].value) < 0) {
+                drmu_err(da->du, "%s: Failed to add slot", __func__);
+                drmu_atomic_prep_delete(&ap);
+                return NULL;
+            }
+        }
+    }
+    return ap;
+}
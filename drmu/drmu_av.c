@@ -364,6 +364,7 @@ drmu_fb_t *
 drmu_fb_av_new_frame_attach(drmu_env_t * const du, AVFrame * const frame)
 {
     int i, j, n;
+    int fds[4];
     drmu_fb_t * const dfb = drmu_fb_int_alloc(du);
     const AVDRMFrameDescriptor * const desc = (const AVDRMFrameDescriptor *)frame->data[0];
     fb_aux_buf_t * aux = NULL;
@@ -402,12 +403,7 @@ drmu_fb_av_new_frame_attach(drmu_env_t * const du, AVFrame * const frame)
     drmu_fb_int_on_delete_set(dfb, buf_fb_delete_cb, aux);
 
     for (i = 0; i < desc->nb_objects; ++i)
-    {
-        drmu_bo_t * bo = drmu_bo_new_fd(du, desc->objects[i].fd);
-        if (bo == NULL)
-            goto fail;
-        drmu_fb_int_bo_set(dfb, i, bo);
-    }
+        fds[i] = desc->objects[i].fd;
 
     n = 0;
     for (i = 0; i < desc->nb_layers; ++i)
@@ -421,7 +417,8 @@ drmu_fb_av_new_frame_attach(drmu_env_t * const du, AVFrame * const frame)
         }
     }
 
-    if (drmu_fb_int_make(dfb) != 0)
+    // Decoders recycle their buffers so this will usually hit the FB cache
+    if (drmu_fb_int_make_fds(dfb, fds, desc->nb_objects) != 0)
         goto fail;
 
     drmu_av_fb_frame_metadata_set(dfb, frame);
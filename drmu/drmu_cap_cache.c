@@ -0,0 +1,638 @@
+#include "drmu.h"
+#include "drmu_log.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <libdrm/drm.h>
+#include <libdrm/drm_mode.h>
+
+//----------------------------------------------------------------------------
+//
+// Persistent capability cache
+//
+// Property definitions (name, flags, range values & enum lists) and the
+// contents of plane IN_FORMATS blobs are fixed for a given driver build &
+// object layout but fetching them is most of the ioctls in env creation.
+// This keeps them in a file keyed by a string that the env builds from the
+// driver version, kernel release & object ids so later opens only need to
+// read the volatile state (current prop values, modes, connection status).
+//
+// A file that doesn't match its key (or is damaged) is simply ignored &
+// replaced when the cache is next saved. Everything after the magic is
+// covered by a checksum in the end record. The dir & file must belong to
+// us & not be writable by anyone else as the contents are trusted.
+
+#define CAP_CACHE_MAGIC      "DRMUCAP2"
+#define CAP_CACHE_HASH_SIZE  64
+#define CAP_CACHE_KEY_MAX    1024
+
+#define CAP_REC_PROP 'P'
+#define CAP_REC_BLOB 'B'
+#define CAP_REC_END  'E'
+
+#define CAP_HASH_INIT 0xcbf29ce484222325ULL
+
+typedef struct cap_prop_s {
+    struct cap_prop_s * next;
+    uint32_t prop_id;
+    uint32_t flags;
+    uint32_t count_values;
+    uint32_t count_enum_blobs;
+    char name[DRM_PROP_NAME_LEN];
+    uint64_t * values;
+    struct drm_mode_property_enum * enums;
+} cap_prop_t;
+
+typedef struct cap_blob_s {
+    struct cap_blob_s * next;
+    uint32_t obj_id;
+    uint32_t prop_id;
+    uint32_t len;
+    uint8_t data[];
+} cap_blob_t;
+
+typedef struct drmu_cap_cache_s {
+    pthread_mutex_t lock;
+    drmu_env_t * du;  // Only used for logging
+    bool dirty;
+    char * path;
+    char * key;
+    cap_prop_t * props[CAP_CACHE_HASH_SIZE];
+    cap_blob_t * blobs;
+    uint64_t hits;
+    uint64_t misses;
+} drmu_cap_cache_t;
+
+static pthread_mutex_t cap_dir_lock = PTHREAD_MUTEX_INITIALIZER;
+static char * cap_dir = NULL;
+
+static uint64_t
+cap_fnv1a(uint64_t h, const void * const data, const size_t len)
+{
+    const uint8_t * p = data;
+    size_t i;
+
+    for (i = 0; i != len; ++i)
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+// malloced string "<a><b>" - NULL on failure
+static char *
+cap_strcat2(const char * const a, const char * const b)
+{
+    const size_t la = strlen(a);
+    const size_t lb = strlen(b);
+    char * const s = malloc(la + lb + 1);
+
+    if (s == NULL)
+        return NULL;
+    memcpy(s, a, la);
+    memcpy(s + la, b, lb + 1);
+    return s;
+}
+
+static cap_prop_t *
+cap_prop_alloc(const uint32_t count_values, const uint32_t count_enum_blobs)
+{
+    cap_prop_t * const cp = calloc(1, sizeof(*cp) +
+                                   count_values * sizeof(*cp->values) +
+                                   count_enum_blobs * sizeof(*cp->enums));
+    if (cp == NULL)
+        return NULL;
+    cp->count_values = count_values;
+    cp->count_enum_blobs = count_enum_blobs;
+    // u64 values first to keep alignment - enums are u64 aligned too
+    cp->values = (uint64_t *)(cp + 1);
+    cp->enums = (struct drm_mode_property_enum *)(cp->values + count_values);
+    return cp;
+}
+
+static cap_prop_t **
+cap_prop_head(drmu_cap_cache_t * const cc, const uint32_t prop_id)
+{
+    return cc->props + (prop_id % CAP_CACHE_HASH_SIZE);
+}
+
+static cap_prop_t *
+cap_prop_find(drmu_cap_cache_t * const cc, const uint32_t prop_id)
+{
+    cap_prop_t * cp;
+    for (cp = *cap_prop_head(cc, prop_id); cp != NULL; cp = cp->next) {
+        if (cp->prop_id == prop_id)
+            return cp;
+    }
+    return NULL;
+}
+
+static void
+cap_prop_insert(drmu_cap_cache_t * const cc, cap_prop_t * const cp)
+{
+    cap_prop_t ** const ph = cap_prop_head(cc, cp->prop_id);
+    cp->next = *ph;
+    *ph = cp;
+}
+
+static cap_blob_t *
+cap_blob_find(drmu_cap_cache_t * const cc, const uint32_t obj_id, const uint32_t prop_id)
+{
+    cap_blob_t * cb;
+    for (cb = cc->blobs; cb != NULL; cb = cb->next) {
+        if (cb->obj_id == obj_id && cb->prop_id == prop_id)
+            return cb;
+    }
+    return NULL;
+}
+
+static void
+cap_clear(drmu_cap_cache_t * const cc)
+{
+    unsigned int i;
+
+    for (i = 0; i != CAP_CACHE_HASH_SIZE; ++i) {
+        cap_prop_t * cp = cc->props[i];
+        while (cp != NULL) {
+            cap_prop_t * const next = cp->next;
+            free(cp);
+            cp = next;
+        }
+        cc->props[i] = NULL;
+    }
+    while (cc->blobs != NULL) {
+        cap_blob_t * const next = cc->blobs->next;
+        free(cc->blobs);
+        cc->blobs = next;
+    }
+}
+
+// Get the full property definition from the kernel
+// Docn says we must loop till stable as there may be hotplug races
+static int
+cap_prop_fetch(drmu_env_t * const du, const uint32_t prop_id, cap_prop_t ** const pcp)
+{
+    cap_prop_t * cp = NULL;
+    unsigned int retries;
+    int rv;
+
+    for (retries = 0; retries < 8; ++retries) {
+        struct drm_mode_get_property prop = {
+            .prop_id = prop_id,
+            .count_values = cp == NULL ? 0 : cp->count_values,
+            .count_enum_blobs = cp == NULL ? 0 : cp->count_enum_blobs,
+            .values_ptr = cp == NULL ? 0 : (uintptr_t)cp->values,
+            .enum_blob_ptr = cp == NULL ? 0 : (uintptr_t)cp->enums,
+        };
+
+        if ((rv = drmu_ioctl(du, DRM_IOCTL_MODE_GETPROPERTY, &prop)) != 0)
+            goto fail;
+
+        if (cp != NULL &&
+            prop.count_values <= cp->count_values &&
+            prop.count_enum_blobs <= cp->count_enum_blobs) {
+            cp->prop_id = prop_id;
+            cp->flags = prop.flags;
+            cp->count_values = prop.count_values;
+            cp->count_enum_blobs = prop.count_enum_blobs;
+            memcpy(cp->name, prop.name, sizeof(cp->name));
+            *pcp = cp;
+            return 0;
+        }
+
+        free(cp);
+        if ((cp = cap_prop_alloc(prop.count_values, prop.count_enum_blobs)) == NULL)
+            return -ENOMEM;
+    }
+    rv = -EAGAIN;
+
+fail:
+    free(cp);
+    return rv;
+}
+
+// Fill in the request in the same way as the kernel would
+static void
+cap_prop_copy_out(struct drm_mode_get_property * const prop, const cap_prop_t * const cp)
+{
+    prop->flags = cp->flags;
+    memcpy(prop->name, cp->name, sizeof(prop->name));
+
+    if (cp->count_values != 0 && prop->count_values >= cp->count_values && prop->values_ptr != 0)
+        memcpy((void *)(uintptr_t)prop->values_ptr, cp->values, cp->count_values * sizeof(*cp->values));
+    prop->count_values = cp->count_values;
+
+    if (cp->count_enum_blobs != 0 && prop->count_enum_blobs >= cp->count_enum_blobs && prop->enum_blob_ptr != 0)
+        memcpy((void *)(uintptr_t)prop->enum_blob_ptr, cp->enums, cp->count_enum_blobs * sizeof(*cp->enums));
+    prop->count_enum_blobs = cp->count_enum_blobs;
+}
+
+int
+drmu_cap_cache_int_getproperty(drmu_cap_cache_t * const cc, struct drm_mode_get_property * const prop)
+{
+    cap_prop_t * cp;
+    int rv;
+
+    pthread_mutex_lock(&cc->lock);
+    if ((cp = cap_prop_find(cc, prop->prop_id)) != NULL) {
+        ++cc->hits;
+        cap_prop_copy_out(prop, cp);
+        pthread_mutex_unlock(&cc->lock);
+        return 0;
+    }
+    ++cc->misses;
+    pthread_mutex_unlock(&cc->lock);
+
+    if ((rv = cap_prop_fetch(cc->du, prop->prop_id, &cp)) != 0)
+        return rv;
+
+    pthread_mutex_lock(&cc->lock);
+    if (cap_prop_find(cc, cp->prop_id) == NULL) {
+        cap_prop_insert(cc, cp);
+        cc->dirty = true;
+        cp = NULL;
+    }
+    cap_prop_copy_out(prop, cap_prop_find(cc, prop->prop_id));
+    pthread_mutex_unlock(&cc->lock);
+
+    free(cp);
+    return 0;
+}
+
+int
+drmu_cap_cache_int_blob_find(drmu_cap_cache_t * const cc, const uint32_t obj_id, const uint32_t prop_id,
+                             void ** const ppdata, size_t * const plen)
+{
+    const cap_blob_t * cb;
+    void * data = NULL;
+    size_t len;
+
+    *ppdata = NULL;
+    *plen = 0;
+
+    pthread_mutex_lock(&cc->lock);
+    if ((cb = cap_blob_find(cc, obj_id, prop_id)) == NULL) {
+        ++cc->misses;
+        pthread_mutex_unlock(&cc->lock);
+        return -ENOENT;
+    }
+    ++cc->hits;
+    len = cb->len;
+    if (len != 0 && (data = malloc(len)) != NULL)
+        memcpy(data, cb->data, len);
+    pthread_mutex_unlock(&cc->lock);
+
+    if (len != 0 && data == NULL)
+        return -ENOMEM;
+    *ppdata = data;
+    *plen = len;
+    return 0;
+}
+
+int
+drmu_cap_cache_int_blob_add(drmu_cap_cache_t * const cc, const uint32_t obj_id, const uint32_t prop_id,
+                            const void * const data, const size_t len)
+{
+    cap_blob_t * cb;
+
+    if (len > UINT32_MAX)
+        return -EINVAL;
+    if ((cb = malloc(sizeof(*cb) + len)) == NULL)
+        return -ENOMEM;
+    cb->obj_id = obj_id;
+    cb->prop_id = prop_id;
+    cb->len = (uint32_t)len;
+    if (len != 0)
+        memcpy(cb->data, data, len);
+
+    pthread_mutex_lock(&cc->lock);
+    if (cap_blob_find(cc, obj_id, prop_id) == NULL) {
+        cb->next = cc->blobs;
+        cc->blobs = cb;
+        cc->dirty = true;
+        cb = NULL;
+    }
+    pthread_mutex_unlock(&cc->lock);
+
+    free(cb);
+    return 0;
+}
+
+// Read/write & add to the running checksum
+static bool
+cap_read(FILE * const f, uint64_t * const phash, void * const buf, const size_t len)
+{
+    if (len != 0 && fread(buf, len, 1, f) != 1)
+        return false;
+    *phash = cap_fnv1a(*phash, buf, len);
+    return true;
+}
+
+static bool
+cap_write(FILE * const f, uint64_t * const phash, const void * const buf, const size_t len)
+{
+    if (len != 0 && fwrite(buf, len, 1, f) != 1)
+        return false;
+    *phash = cap_fnv1a(*phash, buf, len);
+    return true;
+}
+
+// Only trust files (& dirs) that are ours & that nobody else can write
+static bool
+cap_stat_ok(const struct stat * const st)
+{
+    return st->st_uid == geteuid() && (st->st_mode & (S_IWGRP | S_IWOTH)) == 0;
+}
+
+// Returns 0 on a good load, -ENOENT if there is no file, -EPERM if the
+// file isn't safe to trust, -EINVAL if it was for a different key or damaged
+static int
+cap_load(drmu_cap_cache_t * const cc)
+{
+    FILE * f;
+    struct stat st;
+    char magic[sizeof(CAP_CACHE_MAGIC) - 1];
+    uint64_t hash = CAP_HASH_INIT;
+    uint32_t key_len;
+    char * key = NULL;
+    int rv = -EINVAL;
+
+    if ((f = fopen(cc->path, "rb")) == NULL)
+        return -errno;
+
+    if (fstat(fileno(f), &st) != 0 || !S_ISREG(st.st_mode) || !cap_stat_ok(&st)) {
+        fclose(f);
+        return -EPERM;
+    }
+
+    if (fread(magic, sizeof(magic), 1, f) != 1 ||
+        memcmp(magic, CAP_CACHE_MAGIC, sizeof(magic)) != 0 ||
+        !cap_read(f, &hash, &key_len, sizeof(key_len)) ||
+        key_len != strlen(cc->key) ||
+        (key = malloc(key_len)) == NULL ||
+        !cap_read(f, &hash, key, key_len) ||
+        memcmp(key, cc->key, key_len) != 0)
+        goto fail;
+
+    for (;;) {
+        uint8_t rec;
+
+        if (!cap_read(f, &hash, &rec, 1))
+            goto fail;
+
+        if (rec == CAP_REC_END) {
+            const uint64_t hash_calc = hash;
+            uint64_t hash_file;
+
+            // Checksum must match & be the last thing in the file
+            if (fread(&hash_file, sizeof(hash_file), 1, f) != 1 ||
+                hash_file != hash_calc || fgetc(f) != EOF)
+                goto fail;
+            break;
+        }
+
+        if (rec == CAP_REC_PROP) {
+            uint32_t hdr[4];
+            cap_prop_t * cp;
+
+            if (!cap_read(f, &hash, hdr, sizeof(hdr)) ||
+                hdr[2] > 0x10000 || hdr[3] > 0x10000 ||
+                (cp = cap_prop_alloc(hdr[2], hdr[3])) == NULL)
+                goto fail;
+            cp->prop_id = hdr[0];
+            cp->flags = hdr[1];
+            if (!cap_read(f, &hash, cp->name, sizeof(cp->name)) ||
+                !cap_read(f, &hash, cp->values, cp->count_values * sizeof(*cp->values)) ||
+                !cap_read(f, &hash, cp->enums, cp->count_enum_blobs * sizeof(*cp->enums)) ||
+                cap_prop_find(cc, cp->prop_id) != NULL) {
+                free(cp);
+                goto fail;
+            }
+            cp->name[sizeof(cp->name) - 1] = 0;
+            cap_prop_insert(cc, cp);
+        }
+        else if (rec == CAP_REC_BLOB) {
+            uint32_t hdr[3];
+            cap_blob_t * cb;
+
+            if (!cap_read(f, &hash, hdr, sizeof(hdr)) ||
+                hdr[2] > 0x1000000 ||
+                (cb = malloc(sizeof(*cb) + hdr[2])) == NULL)
+                goto fail;
+            cb->obj_id = hdr[0];
+            cb->prop_id = hdr[1];
+            cb->len = hdr[2];
+            if (!cap_read(f, &hash, cb->data, cb->len)) {
+                free(cb);
+                goto fail;
+            }
+            cb->next = cc->blobs;
+            cc->blobs = cb;
+        }
+        else {
+            goto fail;
+        }
+    }
+    rv = 0;
+
+fail:
+    if (rv != 0)
+        cap_clear(cc);
+    free(key);
+    fclose(f);
+    return rv;
+}
+
+// Write to a temp file & rename over the old one so a concurrent load never
+// sees a partial file
+int
+drmu_cap_cache_int_save(drmu_cap_cache_t * const cc)
+{
+    char * tmp_path = NULL;
+    FILE * f = NULL;
+    uint64_t hash = CAP_HASH_INIT;
+    uint32_t key_len;
+    unsigned int i;
+    int fd;
+    int rv = 0;
+
+    pthread_mutex_lock(&cc->lock);
+    if (!cc->dirty)
+        goto done;
+
+    if ((tmp_path = cap_strcat2(cc->path, ".XXXXXX")) == NULL) {
+        rv = -ENOMEM;
+        goto done;
+    }
+    // Unique name so saves from other envs or processes can't collide.
+    // mkstemp creates it 0600 & O_EXCL so a planted link is never followed.
+    if ((fd = mkstemp(tmp_path)) == -1) {
+        rv = -errno;
+        goto done;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    if ((f = fdopen(fd, "wb")) == NULL) {
+        rv = -errno;
+        close(fd);
+        unlink(tmp_path);
+        goto done;
+    }
+
+    key_len = (uint32_t)strlen(cc->key);
+    if (fwrite(CAP_CACHE_MAGIC, sizeof(CAP_CACHE_MAGIC) - 1, 1, f) != 1 ||
+        !cap_write(f, &hash, &key_len, sizeof(key_len)) ||
+        !cap_write(f, &hash, cc->key, key_len))
+        goto fail_write;
+
+    for (i = 0; i != CAP_CACHE_HASH_SIZE; ++i) {
+        const cap_prop_t * cp;
+        for (cp = cc->props[i]; cp != NULL; cp = cp->next) {
+            static const uint8_t rec = CAP_REC_PROP;
+            const uint32_t hdr[4] = {cp->prop_id, cp->flags, cp->count_values, cp->count_enum_blobs};
+            if (!cap_write(f, &hash, &rec, 1) ||
+                !cap_write(f, &hash, hdr, sizeof(hdr)) ||
+                !cap_write(f, &hash, cp->name, sizeof(cp->name)) ||
+                !cap_write(f, &hash, cp->values, cp->count_values * sizeof(*cp->values)) ||
+                !cap_write(f, &hash, cp->enums, cp->count_enum_blobs * sizeof(*cp->enums)))
+                goto fail_write;
+        }
+    }
+    {
+        const cap_blob_t * cb;
+        for (cb = cc->blobs; cb != NULL; cb = cb->next) {
+            static const uint8_t rec = CAP_REC_BLOB;
+            const uint32_t hdr[3] = {cb->obj_id, cb->prop_id, cb->len};
+            if (!cap_write(f, &hash, &rec, 1) ||
+                !cap_write(f, &hash, hdr, sizeof(hdr)) ||
+                !cap_write(f, &hash, cb->data, cb->len))
+                goto fail_write;
+        }
+    }
+    {
+        static const uint8_t rec = CAP_REC_END;
+        if (!cap_write(f, &hash, &rec, 1) ||
+            fwrite(&hash, sizeof(hash), 1, f) != 1)
+            goto fail_write;
+    }
+
+    if (fclose(f) != 0) {
+        f = NULL;
+        goto fail_write;
+    }
+    f = NULL;
+
+    if (rename(tmp_path, cc->path) != 0) {
+        rv = -errno;
+        unlink(tmp_path);
+        goto done;
+    }
+    cc->dirty = false;
+    drmu_debug(cc->du, "%s: Saved %s", __func__, cc->path);
+
+done:
+    pthread_mutex_unlock(&cc->lock);
+    if (rv != 0)
+        drmu_warn(cc->du, "%s: Failed to save %s: %s", __func__, cc->path, strerror(-rv));
+    free(tmp_path);
+    return rv;
+
+fail_write:
+    rv = -EIO;
+    if (f != NULL)
+        fclose(f);
+    f = NULL;
+    unlink(tmp_path);
+    goto done;
+}
+
+void
+drmu_cap_cache_int_stats(drmu_cap_cache_t * const cc, uint64_t * const pHits, uint64_t * const pMisses)
+{
+    pthread_mutex_lock(&cc->lock);
+    *pHits = cc->hits;
+    *pMisses = cc->misses;
+    pthread_mutex_unlock(&cc->lock);
+}
+
+void
+drmu_cap_cache_int_free(drmu_cap_cache_t * const cc)
+{
+    if (cc == NULL)
+        return;
+    cap_clear(cc);
+    pthread_mutex_destroy(&cc->lock);
+    free(cc->path);
+    free(cc->key);
+    free(cc);
+}
+
+// Returns NULL if caching is disabled (no dir set) or on error
+drmu_cap_cache_t *
+drmu_cap_cache_int_new(drmu_env_t * const du, const char * const key)
+{
+    drmu_cap_cache_t * cc;
+    char fname[64];
+    int rv;
+
+    snprintf(fname, sizeof(fname), "/drmu-cap-%016"PRIx64".bin",
+             cap_fnv1a(CAP_HASH_INIT, key, strlen(key)));
+
+    pthread_mutex_lock(&cap_dir_lock);
+    if (cap_dir == NULL || strlen(key) > CAP_CACHE_KEY_MAX ||
+        (cc = calloc(1, sizeof(*cc))) == NULL) {
+        pthread_mutex_unlock(&cap_dir_lock);
+        return NULL;
+    }
+    pthread_mutex_init(&cc->lock, NULL);
+    cc->du = du;
+    if ((cc->key = strdup(key)) == NULL ||
+        (cc->path = cap_strcat2(cap_dir, fname)) == NULL) {
+        pthread_mutex_unlock(&cap_dir_lock);
+        drmu_cap_cache_int_free(cc);
+        return NULL;
+    }
+    pthread_mutex_unlock(&cap_dir_lock);
+
+    if ((rv = cap_load(cc)) == 0)
+        drmu_debug(du, "%s: Loaded %s", __func__, cc->path);
+    else if (rv == -EINVAL)
+        drmu_info(du, "%s: Ignoring stale or damaged %s", __func__, cc->path);
+    else if (rv == -EPERM)
+        drmu_warn(du, "%s: Ignoring %s: not ours or writable by others", __func__, cc->path);
+    cc->dirty = rv != 0;
+
+    return cc;
+}
+
+int
+drmu_cap_cache_dir_set(const char * const dir)
+{
+    char * d = NULL;
+
+    if (dir != NULL) {
+        struct stat st;
+
+        if (mkdir(dir, 0700) != 0 && errno != EEXIST)
+            return -errno;
+        // Anyone who can write the dir can replace the files
+        if (stat(dir, &st) != 0)
+            return -errno;
+        if (!S_ISDIR(st.st_mode) || !cap_stat_ok(&st))
+            return -EPERM;
+        if ((d = strdup(dir)) == NULL)
+            return -ENOMEM;
+    }
+
+    pthread_mutex_lock(&cap_dir_lock);
+    free(cap_dir);
+    cap_dir = d;
+    pthread_mutex_unlock(&cap_dir_lock);
+    return 0;
+}
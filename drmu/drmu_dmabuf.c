@@ -197,6 +197,7 @@ drmu_pool_new_dmabuf(drmu_dmabuf_env_t * dde, unsigned int total_fbs_max)
         .alloc_fn = pool_dmabuf_alloc_cb,
         .on_delete_fn = pool_dmabuf_on_delete_cb,
         .try_reuse_fn = drmu_fb_try_reuse,
+        .fits_fn = drmu_fb_fits,
     };
     if (dde == NULL)
         return NULL;
@@ -454,6 +454,20 @@ drmu_chroma_siting_t drmu_fmt_info_chroma_siting(const drmu_fmt_info_t * const f
 {
     return !fmt_info ? DRMU_CHROMA_SITING_TOP_LEFT : fmt_info->chroma_siting;
 }
+size_t drmu_fmt_info_frame_size(const drmu_fmt_info_t * const fmt_info, const uint32_t w, const uint32_t h)
+{
+    // Same layout as drmu_fb_new_dumb: width rounded up to 32, height to
+    // even & every plane's pitch derived from the 1st
+    const size_t pitch0 = ((size_t)((w + 31) & ~31U) * drmu_fmt_info_pixel_bits(fmt_info) + 7) / 8;
+    const size_t h2 = (h + 1) & ~1U;
+    const unsigned int c = drmu_fmt_info_plane_count(fmt_info);
+    size_t size = 0;
+    unsigned int i;
+
+    for (i = 0; i != c; ++i)
+        size += pitch0 * h2 / (drmu_fmt_info_hdiv(fmt_info, i) * drmu_fmt_info_wdiv(fmt_info, i));
+    return size;
+}
 
 #endif
 
@@ -2,6 +2,7 @@
 #define _DRMU_DRMU_FMTS_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "drmu_chroma.h"
@@ -58,6 +59,9 @@ bool drmu_fmt_info_is_yuv(const drmu_fmt_info_t * const fmt_info);
 unsigned int drmu_fmt_info_wdiv(const drmu_fmt_info_t * const fmt_info, const unsigned int plane_n);
 unsigned int drmu_fmt_info_hdiv(const drmu_fmt_info_t * const fmt_info, const unsigned int plane_n);
 drmu_chroma_siting_t drmu_fmt_info_chroma_siting(const drmu_fmt_info_t * const fmt_info);
+// Bytes for a w x h frame laid out as drmu_fb_new_dumb would; 0 if
+// fmt_info is NULL
+size_t drmu_fmt_info_frame_size(const drmu_fmt_info_t * const fmt_info, const uint32_t w, const uint32_t h);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,207 @@
+#include "drmu_hotplug.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/netlink.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "drmu.h"
+#include "drmu_log.h"
+#include "pollqueue.h"
+
+// Kernel uevents are a header ("<action>@<devpath>") followed by NUL
+// separated KEY=value pairs. A DRM hotplug looks like:
+//   change@/devices/.../drm/card0 ACTION=change SUBSYSTEM=drm HOTPLUG=1
+//   [CONNECTOR=<id> PROPERTY=<id>] MAJOR=226 MINOR=0 ...
+#define UEVENT_BUF_SIZE 4096
+
+struct drmu_hotplug_s {
+    drmu_env_t * du;
+    int sock;
+    bool has_rdev;
+    unsigned int major;
+    unsigned int minor;
+    struct pollqueue * pq;
+    struct polltask * pt;
+};
+
+// Value for key or NULL if not present
+static const char *
+uevent_get(const char * const buf, const size_t len, const char * const key)
+{
+    const size_t klen = strlen(key);
+    size_t i = 0;
+
+    while (i < len) {
+        const char * const s = buf + i;
+        const size_t slen = strnlen(s, len - i);
+
+        if (slen > klen && s[klen] == '=' && memcmp(s, key, klen) == 0)
+            return s + klen + 1;
+        i += slen + 1;
+    }
+    return NULL;
+}
+
+static bool
+uevent_is_eq(const char * const buf, const size_t len, const char * const key, const char * const val)
+{
+    const char * const v = uevent_get(buf, len, key);
+    return v != NULL && strcmp(v, val) == 0;
+}
+
+// Returns conn id (0 => all conns) or -1 if not a hotplug for our device
+static long
+hotplug_parse(const drmu_hotplug_t * const hp, const char * const buf, const size_t len)
+{
+    const char * s;
+
+    // Kernel messages have an "action@devpath" header; anything else (e.g.
+    // a udevd rebroadcast) isn't for us
+    if (memchr(buf, '@', strnlen(buf, len)) == NULL)
+        return -1;
+
+    if (!uevent_is_eq(buf, len, "SUBSYSTEM", "drm") ||
+        !uevent_is_eq(buf, len, "HOTPLUG", "1"))
+        return -1;
+
+    if (hp->has_rdev) {
+        const char * const maj = uevent_get(buf, len, "MAJOR");
+        const char * const min = uevent_get(buf, len, "MINOR");
+        if (maj == NULL || min == NULL ||
+            strtoul(maj, NULL, 10) != hp->major || strtoul(min, NULL, 10) != hp->minor)
+            return -1;
+    }
+
+    if ((s = uevent_get(buf, len, "CONNECTOR")) == NULL)
+        return 0;
+    return (long)strtoul(s, NULL, 10);
+}
+
+static void
+hotplug_cb(void * v, short revents)
+{
+    drmu_hotplug_t * const hp = v;
+    char buf[UEVENT_BUF_SIZE];
+    bool all = false;
+    unsigned int n = 0;
+    uint32_t conn_ids[8];
+    unsigned int i;
+
+    (void)revents;
+
+    // Drain the socket first so a burst of events only reprobes once
+    for (;;) {
+        const ssize_t len = recv(hp->sock, buf, sizeof(buf) - 1, MSG_DONTWAIT);
+        long conn_id;
+
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            // ENOBUFS means we have lost some - so check everything
+            if (errno == ENOBUFS)
+                all = true;
+            break;
+        }
+        buf[len] = 0;
+
+        if ((conn_id = hotplug_parse(hp, buf, (size_t)len)) < 0)
+            continue;
+
+        drmu_debug(hp->du, "%s: Hotplug: conn %ld", __func__, conn_id);
+        if (conn_id == 0 || n >= sizeof(conn_ids) / sizeof(conn_ids[0]))
+            all = true;
+        else {
+            for (i = 0; i != n && conn_ids[i] != (uint32_t)conn_id; ++i)
+                /* loop */;
+            if (i == n)
+                conn_ids[n++] = (uint32_t)conn_id;
+        }
+    }
+
+    if (all)
+        drmu_env_hotplug_event(hp->du, 0);
+    else {
+        for (i = 0; i != n; ++i)
+            drmu_env_hotplug_event(hp->du, conn_ids[i]);
+    }
+
+    pollqueue_add_task(hp->pt, -1);
+}
+
+void
+drmu_hotplug_delete(drmu_hotplug_t ** const pphp)
+{
+    drmu_hotplug_t * const hp = *pphp;
+
+    if (hp == NULL)
+        return;
+    *pphp = NULL;
+
+    // Delete will wait for a running polltask to finish
+    polltask_delete(&hp->pt);
+    pollqueue_finish(&hp->pq);
+    if (hp->sock != -1)
+        close(hp->sock);
+    drmu_env_unref(&hp->du);
+    free(hp);
+}
+
+drmu_hotplug_t *
+drmu_hotplug_new(drmu_env_t * const du)
+{
+    drmu_hotplug_t * const hp = calloc(1, sizeof(*hp));
+    struct sockaddr_nl addr = {
+        .nl_family = AF_NETLINK,
+        .nl_pid = 0,
+        .nl_groups = 1,  // Kernel events
+    };
+    struct stat st;
+
+    if (hp == NULL) {
+        drmu_err(du, "%s: Failed to alloc", __func__);
+        return NULL;
+    }
+    hp->du = drmu_env_ref(du);
+
+    // Only take events for our card - if we can't tell what that is then
+    // take any DRM hotplug
+    if (fstat(drmu_fd(du), &st) == 0 && S_ISCHR(st.st_mode)) {
+        hp->has_rdev = true;
+        hp->major = major(st.st_rdev);
+        hp->minor = minor(st.st_rdev);
+    }
+
+    if ((hp->sock = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                           NETLINK_KOBJECT_UEVENT)) == -1) {
+        drmu_err(du, "%s: Failed to open uevent socket: %s", __func__, strerror(errno));
+        goto fail;
+    }
+    if (bind(hp->sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        drmu_err(du, "%s: Failed to bind uevent socket: %s", __func__, strerror(errno));
+        goto fail;
+    }
+
+    if ((hp->pq = pollqueue_new()) == NULL ||
+        (hp->pt = polltask_new(hp->pq, hp->sock, POLLIN, hotplug_cb, hp)) == NULL) {
+        drmu_err(du, "%s: Failed to create pollqueue", __func__);
+        goto fail;
+    }
+    pollqueue_add_task(hp->pt, -1);
+
+    return hp;
+
+fail:
+    {
+        drmu_hotplug_t * t = hp;
+        drmu_hotplug_delete(&t);
+    }
+    return NULL;
+}
@@ -0,0 +1,28 @@
+#ifndef _DRMU_HOTPLUG_H
+#define _DRMU_HOTPLUG_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct drmu_env_s;
+
+// Connector hotplug monitor
+// Listens for kernel uevents on a netlink socket and, when one is a hotplug
+// for the env's device, calls drmu_env_hotplug_event for the conn it names
+// (or all conns if it doesn't name one). Env hotplug listeners (e.g. those
+// set up by drmu_output) are called on the monitor's pollqueue thread.
+// Holds a ref on the env until deleted.
+struct drmu_hotplug_s;
+typedef struct drmu_hotplug_s drmu_hotplug_t;
+
+drmu_hotplug_t * drmu_hotplug_new(struct drmu_env_s * const du);
+// Stops the monitor & waits for any event it is processing to finish
+void drmu_hotplug_delete(drmu_hotplug_t ** const pphp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -4,6 +4,7 @@
 #include "drmu_log.h"
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdatomic.h>
 #include <string.h>
 
@@ -27,8 +28,20 @@ struct drmu_output_s {
     bool has_max_bpc;
     bool max_bpc_allow;
     bool modeset_allow;
+
+    // Guards the mode & hotplug cb as hotplug_cb runs on the hotplug thread.
+    // The _mode_simple_params pointer is only safe on the thread setting
+    // the mode.
+    pthread_mutex_t lock;
     int mode_id;
     drmu_mode_simple_params_t mode_params;
+    // mode_params' mode vanished on hotplug - look for it on the next one
+    bool mode_lost;
+
+    // Hotplug
+    bool hotplug_listening;
+    drmu_output_hotplug_fn * hotplug_fn;
+    void * hotplug_v;
 
     // These are expected to be static consts so no copy / no free
     const drmu_fmt_info_t * fmt_info;
@@ -97,13 +110,17 @@ drmu_atomic_output_add_connect(drmu_atomic_t * const da, drmu_output_t * const d
 int
 drmu_atomic_output_add_props(drmu_atomic_t * const da, drmu_output_t * const dout)
 {
+    struct drm_mode_modeinfo mi;
     int rv = 0;
     unsigned int i;
 
     if (!dout->modeset_allow)
         return 0;
 
-    rv = drmu_atomic_crtc_add_modeinfo(da, dout->dc, drmu_conn_modeinfo(dout->dns[0], dout->mode_id));
+    pthread_mutex_lock(&dout->lock);
+    if (drmu_conn_modeinfo_get(dout->dns[0], dout->mode_id, &mi) == 0)
+        rv = drmu_atomic_crtc_add_modeinfo(da, dout->dc, &mi);
+    pthread_mutex_unlock(&dout->lock);
 
     for (i = 0; i != dout->conn_n; ++i) {
         drmu_conn_t * const dn = dout->dns[i];
@@ -165,17 +182,25 @@ drmu_output_fb_info_unset(drmu_output_t * const dout)
 int
 drmu_output_mode_id_set(drmu_output_t * const dout, const int mode_id)
 {
+    int rv = 0;
+
     drmu_info(dout->du, "%s: mode_id=%d", __func__, mode_id);
 
+    pthread_mutex_lock(&dout->lock);
     if (mode_id != dout->mode_id) {
         drmu_mode_simple_params_t sp = drmu_conn_mode_simple_params(dout->dns[0], mode_id);
-        if (sp.width == 0)
-            return -EINVAL;
+        if (sp.width == 0) {
+            rv = -EINVAL;
+            goto unlock;
+        }
 
         dout->mode_id = mode_id;
         dout->mode_params = sp;
     }
-    return 0;
+    dout->mode_lost = false;
+unlock:
+    pthread_mutex_unlock(&dout->lock);
+    return rv;
 }
 
 const drmu_mode_simple_params_t *
@@ -184,6 +209,104 @@ drmu_output_mode_simple_params(const drmu_output_t * const dout)
     return &dout->mode_params;
 }
 
+bool
+drmu_output_mode_is_lost(drmu_output_t * const dout)
+{
+    bool lost;
+
+    pthread_mutex_lock(&dout->lock);
+    lost = dout->mode_lost;
+    pthread_mutex_unlock(&dout->lock);
+    return lost;
+}
+
+// Find the mode with the same timing as sp in the conn's (new) mode list
+// Lock expected
+static int
+output_mode_find(const drmu_output_t * const dout, const drmu_mode_simple_params_t * const sp)
+{
+    int i;
+
+    for (i = 0;; ++i) {
+        const drmu_mode_simple_params_t t = drmu_conn_mode_simple_params(dout->dns[0], i);
+
+        if (t.width == 0)
+            return -1;
+        if (t.width == sp->width && t.height == sp->height &&
+            t.hz_x_1000 == sp->hz_x_1000 && t.flags == sp->flags)
+            return i;
+    }
+}
+
+// Env hotplug listener
+// Mode ids are indices into the conn's mode list so need remapping after a
+// reprobe. If the mode has gone (display off or unplugged) then stop
+// setting a mode but keep everything else so that when the display comes
+// back with the same mode the output just carries on.
+static void
+output_hotplug_cb(void * v, drmu_conn_t * const dn, const bool connected)
+{
+    drmu_output_t * const dout = v;
+    drmu_output_hotplug_fn * fn;
+    void * fn_v;
+    unsigned int i;
+
+    for (i = 0; i != dout->conn_n && dout->dns[i] != dn; ++i)
+        /* loop */;
+    if (i == dout->conn_n)
+        return;
+
+    pthread_mutex_lock(&dout->lock);
+    if (i == 0 && (dout->mode_id >= 0 || dout->mode_lost)) {
+        const int mode_id = output_mode_find(dout, &dout->mode_params);
+
+        if (mode_id < 0 && !dout->mode_lost)
+            drmu_info(dout->du, "%s: Mode %dx%d lost", __func__, dout->mode_params.width, dout->mode_params.height);
+        else if (mode_id >= 0 && dout->mode_lost)
+            drmu_info(dout->du, "%s: Mode %dx%d restored", __func__, dout->mode_params.width, dout->mode_params.height);
+
+        dout->mode_id = mode_id;
+        dout->mode_lost = mode_id < 0;
+    }
+    fn = dout->hotplug_fn;
+    fn_v = dout->hotplug_v;
+    pthread_mutex_unlock(&dout->lock);
+
+    // The env holds a ref on dout for us
+    if (fn != NULL)
+        fn(fn_v, dout, dn, connected);
+}
+
+// Listener refs - fail if dout is already on its way out
+static bool
+output_hotplug_ref_cb(void * v)
+{
+    drmu_output_t * const dout = v;
+    int n = atomic_load(&dout->ref_count);
+
+    while (n >= 0) {
+        if (atomic_compare_exchange_weak(&dout->ref_count, &n, n + 1))
+            return true;
+    }
+    return false;
+}
+
+static void
+output_hotplug_unref_cb(void * v)
+{
+    drmu_output_t * dout = v;
+    drmu_output_unref(&dout);
+}
+
+void
+drmu_output_hotplug_cb_set(drmu_output_t * const dout, drmu_output_hotplug_fn * const fn, void * const v)
+{
+    pthread_mutex_lock(&dout->lock);
+    dout->hotplug_v = v;
+    dout->hotplug_fn = fn;
+    pthread_mutex_unlock(&dout->lock);
+}
+
 static int
 score_freq(const drmu_mode_simple_params_t * const mode, const drmu_mode_simple_params_t * const p)
 {
@@ -422,7 +545,9 @@ drmu_output_add_output2(drmu_output_t * const dout, const char * const conn_name
     dout->dns[dout->conn_n++] = dn;
     dout->dc = dc;
 
+    pthread_mutex_lock(&dout->lock);
     dout->mode_params = drmu_crtc_mode_simple_params(dout->dc);
+    pthread_mutex_unlock(&dout->lock);
 
     return 0;
 }
@@ -544,11 +669,15 @@ static void
 output_free(drmu_output_t * const dout)
 {
     unsigned int i;
+
+    if (dout->hotplug_listening)
+        drmu_env_hotplug_listener_remove(dout->du, output_hotplug_cb, dout);
     for (i = 0; i != dout->conn_n; ++i)
         drmu_conn_unref(dout->dns + i);
     free(dout->dns);
     drmu_crtc_unref(&dout->dc);
     drmu_env_unref(&dout->du);
+    pthread_mutex_destroy(&dout->lock);
     free(dout);
 }
 
@@ -583,7 +712,13 @@ drmu_output_new(drmu_env_t * const du)
     }
 
     dout->du = drmu_env_ref(du);
+    pthread_mutex_init(&dout->lock, NULL);
     dout->mode_id = -1;
+    // Not fatal - we just won't follow mode list changes
+    if (drmu_env_hotplug_listener_add(du, output_hotplug_cb, output_hotplug_ref_cb, output_hotplug_unref_cb, dout) == 0)
+        dout->hotplug_listening = true;
+    else
+        drmu_warn(du, "%s: Failed to add hotplug listener", __func__);
     return dout;
 }
 
@@ -35,6 +35,20 @@ int drmu_output_mode_id_set(drmu_output_t * const dout, const int mode_id);
 
 // Width/height of the current mode
 const drmu_mode_simple_params_t * drmu_output_mode_simple_params(const drmu_output_t * const dout);
+// The mode set by _mode_id_set went away on a hotplug (e.g. display turned
+// off). The output leaves the CRTC mode alone until a hotplug brings back a
+// mode with the same timing or a new mode is set.
+bool drmu_output_mode_is_lost(drmu_output_t * const dout);
+
+// Hotplug callback
+// Called (on the thread calling drmu_env_hotplug_event - usually a
+// drmu_hotplug_t) after a conn on this output has been reprobed & the output
+// has remapped its mode. The output keeps its conn & CRTC claimed across
+// disconnects so planes, pools & queues using it are unaffected. No output
+// or env lock is held & the env holds a ref on the output for the call so
+// the callback may unref it.
+typedef void drmu_output_hotplug_fn(void * v, drmu_output_t * const dout, drmu_conn_t * const dn, const bool connected);
+void drmu_output_hotplug_cb_set(drmu_output_t * const dout, drmu_output_hotplug_fn * const fn, void * const v);
 
 typedef int drmu_mode_score_fn(void * v, const drmu_mode_simple_params_t * mode);
 
@@ -5,6 +5,21 @@
 // flips callback. This is very safe timing-wise and requires no knowledge
 // of vsync rates but gives a worst case latency of nearly 2 flips for any
 // given commit.
+//
+// By default commits are blocking so the Q thread sleeps in the kernel until
+// the flip. In nonblock mode commits are NONBLOCK | PAGE_FLIP_EVENT and the
+// Q thread polls the DRM fd for the flip event instead. The next commit is
+// still only done once the previous flip has completed.
+//
+// Late latch mode (implies nonblock) uses the flip event timestamps to
+// predict the next vblank and holds the next commit back until just before
+// it so that anything queued in the meantime still makes that vblank. The
+// margin before vblank tunes itself: it grows on a missed vblank and
+// shrinks slowly otherwise, but never below twice the commit ioctl time.
+//
+// Timed atomics (drmu_queue_queue_at) are held on a separate target ordered
+// Q and released onto the main Q by the prod task when they become due for
+// the vblank that the next commit will make.
 
 #include "drmu_poll.h"
 
@@ -14,15 +29,34 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <poll.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include <stdatomic.h>
+#include <stdint.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <libdrm/drm.h>
 #include <libdrm/drm_mode.h>
 
+// If we haven't had a flip event after this long then assume it isn't coming
+#define FLIP_EVENT_TIMEOUT_MS 1000
+
+// Late latch margin limits & initial value
+#define LATCH_MARGIN_MIN_NS  1000000
+#define LATCH_MARGIN_INIT_NS 4000000
+
+// Number of 1ms waits for the flip event after a blocking commit
+#define PRESENT_EVENT_TRIES 10
+
+// Longest we sleep waiting for a timed atomic if the frame period is unknown
+#define TIMED_WAKE_MAX_MS 20
+
+// Max CRTCs that can be synced on one Q (lanes are tracked in a bitmask)
+#define SYNC_LANES_MAX 16
+
 //----------------------------------------------------------------------------
 //
 // Atomic Q fns (internal)
@@ -30,6 +64,7 @@
 typedef struct flips_ent_s {
     drmu_atomic_t * da;
     unsigned int tag;
+    uint64_t queued_ns;  // When first Qed - merges keep the original time
 } flip_ent_t;
 
 typedef struct next_flips_s {
@@ -51,6 +86,12 @@ next_flip_head(const next_flips_t * const nf)
     return next_flip_is_empty(nf) ? NULL : nf->flips[nf->n].da;
 }
 
+static uint64_t
+next_flip_head_queued_ns(const next_flips_t * const nf)
+{
+    return next_flip_is_empty(nf) ? 0 : nf->flips[nf->n].queued_ns;
+}
+
 static drmu_atomic_t **
 next_flip_find_tag(const next_flips_t * const nf, const unsigned int tag)
 {
@@ -82,98 +123,1365 @@ next_flip_pop_head(next_flips_t * const nf)
     return flip;
 }
 
-static drmu_atomic_t **
-next_flip_add_tail(next_flips_t * const nf, unsigned int tag)
+// Pop the oldest atomic with the given tag, closing up the gap it leaves
+static drmu_atomic_t *
+next_flip_pop_tag(next_flips_t * const nf, const unsigned int tag)
+{
+    drmu_atomic_t * flip;
+    unsigned int n = nf->n;
+    unsigned int i;
+
+    for (i = 0; i != nf->len; ++i) {
+        if (nf->flips[n].tag == tag)
+            break;
+        n = n + 1 >= nf->size ? 0 : n + 1;
+    }
+    if (i == nf->len)
+        return NULL;
+
+    flip = nf->flips[n].da;
+    // Shuffle the older entries up one & drop the head
+    for (; i != 0; --i) {
+        const unsigned int p = n == 0 ? nf->size - 1 : n - 1;
+        nf->flips[n] = nf->flips[p];
+        n = p;
+    }
+    nf->n = nf->n + 1 >= nf->size ? 0 : nf->n + 1;
+    --nf->len;
+    return flip;
+}
+
+static drmu_atomic_t **
+next_flip_add_tail(next_flips_t * const nf, unsigned int tag, const uint64_t queued_ns)
+{
+    const unsigned int oldlen = nf->len;
+
+    if (oldlen < nf->size) {
+        unsigned int n = nf->n + oldlen;
+        if (n >= nf->size)
+            n -= nf->size;
+        nf->flips[n].da = NULL;
+        nf->flips[n].tag = tag;
+        nf->flips[n].queued_ns = queued_ns;
+        ++nf->len;
+        return &nf->flips[n].da;
+    }
+    else {
+        // Given the circular buffer can't just realloc, must alloc & rebuild
+        const unsigned int newsize = (oldlen < 8) ? 8 : oldlen * 2;
+        flip_ent_t * newflips = malloc(sizeof(*nf->flips) * newsize);
+        if (newflips == NULL)
+            return NULL;
+
+        assert(oldlen == nf->size);
+        memcpy(newflips, nf->flips + nf->n, (nf->size - nf->n) * sizeof(*nf->flips));
+        memcpy(newflips + (nf->size - nf->n), nf->flips, nf->n * sizeof(*nf->flips));
+        newflips[oldlen].da = NULL;
+        newflips[oldlen].tag = tag;
+        newflips[oldlen].queued_ns = queued_ns;
+        free(nf->flips);
+
+        nf->flips = newflips;
+        nf->size = newsize;
+        nf->len = oldlen + 1;
+        nf->n = 0;
+
+        return &newflips[oldlen].da;
+    }
+}
+
+static bool
+next_flip_discard_head(next_flips_t * const nf)
+{
+    drmu_atomic_t * da = next_flip_pop_head(nf);
+    if (da == NULL)
+        return false;
+    drmu_atomic_unref(&da);
+    return true;
+}
+
+static void
+next_flip_init(next_flips_t * const nf)
+{
+    memset(nf, 0, sizeof(*nf));
+}
+
+// Zap next flip q - leaves in a state that a new add will work
+static void
+next_flip_uninit(next_flips_t * const nf)
+{
+    static const drmu_present_info_t dropped = {.dropped = true};
+
+    while (!next_flip_is_empty(nf)) {
+        drmu_atomic_run_commit_callbacks(next_flip_head(nf));
+        drmu_atomic_run_present_callbacks(next_flip_head(nf), &dropped);
+        next_flip_discard_head(nf);
+    }
+    free(nf->flips);
+    memset(nf, 0, sizeof(*nf));
+}
+
+// Q of atomics waiting for their target time, kept in target order
+typedef struct timed_ent_s {
+    drmu_atomic_t * da;
+    uint64_t target_ns;
+    uint64_t queued_ns;
+    drmu_queue_merge_t qmerge;
+} timed_ent_t;
+
+typedef struct timed_flips_s {
+    timed_ent_t * ents;
+    unsigned int len;
+    unsigned int size;
+} timed_flips_t;
+
+static bool
+timed_flip_is_empty(const timed_flips_t * const tf)
+{
+    return tf->len == 0;
+}
+
+// Insert after any existing entries with the same target so equal targets
+// stay in the order they were queued
+static int
+timed_flip_add(timed_flips_t * const tf, const uint64_t target_ns, const uint64_t queued_ns,
+               const drmu_queue_merge_t qmerge, drmu_atomic_t ** const ppda)
+{
+    unsigned int n;
+
+    if (tf->len >= tf->size) {
+        const unsigned int newsize = (tf->size < 8) ? 8 : tf->size * 2;
+        timed_ent_t * const newents = realloc(tf->ents, sizeof(*tf->ents) * newsize);
+        if (newents == NULL)
+            return -ENOMEM;
+        tf->ents = newents;
+        tf->size = newsize;
+    }
+
+    // Usually appending so search from the end
+    for (n = tf->len; n != 0 && tf->ents[n - 1].target_ns > target_ns; --n)
+        /* loop */;
+    memmove(tf->ents + n + 1, tf->ents + n, (tf->len - n) * sizeof(*tf->ents));
+    tf->ents[n] = (timed_ent_t){
+        .da = drmu_atomic_move(ppda),
+        .target_ns = target_ns,
+        .queued_ns = queued_ns,
+        .qmerge = qmerge
+    };
+    ++tf->len;
+    return 0;
+}
+
+// Remove the first n entries
+static void
+timed_flip_remove_head(timed_flips_t * const tf, const unsigned int n)
+{
+    tf->len -= n;
+    memmove(tf->ents, tf->ents + n, tf->len * sizeof(*tf->ents));
+}
+
+static void
+timed_flip_init(timed_flips_t * const tf)
+{
+    memset(tf, 0, sizeof(*tf));
+}
+
+static void
+timed_flip_uninit(timed_flips_t * const tf)
+{
+    static const drmu_present_info_t dropped = {.dropped = true};
+    unsigned int i;
+
+    for (i = 0; i != tf->len; ++i) {
+        drmu_atomic_run_commit_callbacks(tf->ents[i].da);
+        drmu_atomic_run_present_callbacks(tf->ents[i].da, &dropped);
+        drmu_atomic_unref(&tf->ents[i].da);
+    }
+    free(tf->ents);
+    memset(tf, 0, sizeof(*tf));
+}
+
+//-----------------------------------------------------------------------------
+//
+// Discard list
+// Atomics that are dropped or replaced whilst the Q lock is held are parked
+// here so their dropped callbacks & unrefs can be done outside the lock.
+// They are kept as separate entries rather than merged together as merging
+// allocates and this is mostly done on the Q thread. The array only grows so
+// once it has reached its working size adding doesn't allocate.
+
+#define DISCARD_LIST_INIT 16
+
+typedef struct discard_list_s {
+    unsigned int head;  // Entries [head, len) are in use
+    unsigned int len;
+    unsigned int size;
+    drmu_atomic_t ** das;
+} discard_list_t;
+
+static void
+discard_list_init(discard_list_t * const dl)
+{
+    memset(dl, 0, sizeof(*dl));
+}
+
+static bool
+discard_list_is_empty(const discard_list_t * const dl)
+{
+    return dl->head == dl->len;
+}
+
+// Takes the ref in *ppda
+// If the array can't grow then (and only then) merge with the last entry
+static void
+discard_list_add(discard_list_t * const dl, drmu_atomic_t ** const ppda)
+{
+    if (*ppda == NULL)
+        return;
+
+    if (dl->len == dl->size) {
+        if (dl->head != 0) {
+            memmove(dl->das, dl->das + dl->head, (dl->len - dl->head) * sizeof(*dl->das));
+            dl->len -= dl->head;
+            dl->head = 0;
+        }
+        else {
+            const unsigned int size = dl->size == 0 ? DISCARD_LIST_INIT : dl->size * 2;
+            drmu_atomic_t ** const das = realloc(dl->das, size * sizeof(*das));
+
+            if (das == NULL) {
+                if (dl->len == 0)
+                    drmu_atomic_unref(ppda);
+                else
+                    drmu_atomic_merge(dl->das[dl->len - 1], ppda);
+                return;
+            }
+            dl->das = das;
+            dl->size = size;
+        }
+    }
+
+    dl->das[dl->len++] = *ppda;
+    *ppda = NULL;
+}
+
+// Returns NULL if empty
+static drmu_atomic_t *
+discard_list_pop(discard_list_t * const dl)
+{
+    drmu_atomic_t * da;
+
+    if (discard_list_is_empty(dl))
+        return NULL;
+
+    da = dl->das[dl->head++];
+    if (dl->head == dl->len)
+        dl->head = dl->len = 0;
+    return da;
+}
+
+// Anything left is unrefed without its callbacks being run
+static void
+discard_list_uninit(discard_list_t * const dl)
+{
+    drmu_atomic_t * da;
+
+    while ((da = discard_list_pop(dl)) != NULL)
+        drmu_atomic_unref(&da);
+    free(dl->das);
+    memset(dl, 0, sizeof(*dl));
+}
+
+//-----------------------------------------------------------------------------
+//
+// Submission ring
+// Bounded lock-free multi-producer, single-consumer ring so that producers
+// don't need the Q lock (or to allocate) to submit. The consumer always
+// holds the Q lock so there is only ever one at a time.
+// Each slot has a sequence number: slot == pos when free for the producer
+// at pos, pos + 1 once filled. Default (seq_cst) atomics throughout - the
+// idle handshake with wants_prod relies on that ordering.
+
+#define SUBMIT_RING_SIZE 64  // Must be a power of 2
+
+typedef struct submit_slot_s {
+    atomic_uint seq;
+    drmu_atomic_t * da;
+    unsigned int tag;
+    drmu_queue_merge_t qmerge;
+    uint64_t queued_ns;
+} submit_slot_t;
+
+typedef struct submit_ring_s {
+    atomic_uint head;   // Next pos for producers
+    unsigned int tail;  // Next pos for the consumer
+    submit_slot_t slots[SUBMIT_RING_SIZE];
+} submit_ring_t;
+
+static void
+submit_ring_init(submit_ring_t * const sr)
+{
+    unsigned int i;
+
+    atomic_init(&sr->head, 0);
+    sr->tail = 0;
+    for (i = 0; i != SUBMIT_RING_SIZE; ++i) {
+        atomic_init(&sr->slots[i].seq, i);
+        sr->slots[i].da = NULL;
+    }
+}
+
+// Returns false if full, in which case da is untouched
+static bool
+submit_ring_push(submit_ring_t * const sr, const unsigned int tag, const drmu_queue_merge_t qmerge,
+                 const uint64_t queued_ns, drmu_atomic_t ** const ppda)
+{
+    unsigned int pos = atomic_load(&sr->head);
+    submit_slot_t * slot;
+
+    for (;;) {
+        int diff;
+
+        slot = sr->slots + (pos & (SUBMIT_RING_SIZE - 1));
+        diff = (int)(atomic_load(&slot->seq) - pos);
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak(&sr->head, &pos, pos + 1))
+                break;
+        }
+        else if (diff < 0)
+            return false;
+        else
+            pos = atomic_load(&sr->head);
+    }
+
+    slot->da = *ppda;
+    slot->tag = tag;
+    slot->qmerge = qmerge;
+    slot->queued_ns = queued_ns;
+    *ppda = NULL;
+    atomic_store(&slot->seq, pos + 1);
+    return true;
+}
+
+// Consumer only
+// A slot that has been claimed but not yet filled counts as empty - the
+// producer will kick the Q once it has finished
+static bool
+submit_ring_is_empty(const submit_ring_t * const sr)
+{
+    const submit_slot_t * const slot = sr->slots + (sr->tail & (SUBMIT_RING_SIZE - 1));
+    return (int)(atomic_load(&slot->seq) - (sr->tail + 1)) < 0;
+}
+
+// Consumer only
+static const submit_slot_t *
+submit_ring_head(const submit_ring_t * const sr)
+{
+    return submit_ring_is_empty(sr) ? NULL : sr->slots + (sr->tail & (SUBMIT_RING_SIZE - 1));
+}
+
+// Consumer only - release the head slot back to the producers
+static void
+submit_ring_pop(submit_ring_t * const sr)
+{
+    submit_slot_t * const slot = sr->slots + (sr->tail & (SUBMIT_RING_SIZE - 1));
+
+    slot->da = NULL;
+    atomic_store(&slot->seq, sr->tail + SUBMIT_RING_SIZE);
+    ++sr->tail;
+}
+
+static void
+submit_ring_uninit(submit_ring_t * const sr)
+{
+    static const drmu_present_info_t dropped = {.dropped = true};
+    const submit_slot_t * slot;
+
+    while ((slot = submit_ring_head(sr)) != NULL) {
+        drmu_atomic_t * da = slot->da;
+        submit_ring_pop(sr);
+        drmu_atomic_run_commit_callbacks(da);
+        drmu_atomic_run_present_callbacks(da, &dropped);
+        drmu_atomic_unref(&da);
+    }
+}
+
+//-----------------------------------------------------------------------------
+//
+// Q stats
+// Counters are only ever read as a snapshot so relaxed atomics are all we
+// need - no locks, no ordering
+
+typedef struct queue_hist_s {
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t sum_us;
+    atomic_uint_fast64_t max_us;
+    atomic_uint buckets[DRMU_QUEUE_HIST_BUCKETS];
+} queue_hist_t;
+
+typedef struct queue_stats_s {
+    atomic_uint depth_max;
+    atomic_uint_fast64_t commits;
+    atomic_uint_fast64_t merges;
+    atomic_uint_fast64_t drops;
+    atomic_uint_fast64_t replaces;
+    atomic_uint_fast64_t busy_retries;
+    atomic_uint_fast64_t missed_vblanks;
+    queue_hist_t queue_to_commit;
+    queue_hist_t commit_ioctl;
+} queue_stats_t;
+
+static void
+stat_add(atomic_uint_fast64_t * const p, const uint64_t n)
+{
+    atomic_fetch_add_explicit(p, n, memory_order_relaxed);
+}
+
+static void
+stat_max64(atomic_uint_fast64_t * const p, const uint64_t n)
+{
+    uint_fast64_t cur = atomic_load_explicit(p, memory_order_relaxed);
+    while (n > cur &&
+           !atomic_compare_exchange_weak_explicit(p, &cur, n, memory_order_relaxed, memory_order_relaxed))
+        /* loop */;
+}
+
+static void
+stat_max(atomic_uint * const p, const unsigned int n)
+{
+    unsigned int cur = atomic_load_explicit(p, memory_order_relaxed);
+    while (n > cur &&
+           !atomic_compare_exchange_weak_explicit(p, &cur, n, memory_order_relaxed, memory_order_relaxed))
+        /* loop */;
+}
+
+// 4 linear buckets per power of 2
+static unsigned int
+hist_bucket(const uint64_t us)
+{
+    unsigned int msb = 2;
+    unsigned int n;
+
+    if (us < 4)
+        return (unsigned int)us;
+    while ((us >> (msb + 1)) != 0)
+        ++msb;
+    n = (msb - 1) * 4 + (unsigned int)((us >> (msb - 2)) & 3);
+    return n < DRMU_QUEUE_HIST_BUCKETS ? n : DRMU_QUEUE_HIST_BUCKETS - 1;
+}
+
+static void
+hist_add(queue_hist_t * const h, const uint64_t ns)
+{
+    const uint64_t us = ns / 1000;
+
+    stat_add(&h->count, 1);
+    stat_add(&h->sum_us, us);
+    stat_max64(&h->max_us, us);
+    atomic_fetch_add_explicit(h->buckets + hist_bucket(us), 1, memory_order_relaxed);
+}
+
+static void
+hist_get(drmu_queue_hist_t * const dst, queue_hist_t * const h)
+{
+    unsigned int i;
+
+    dst->count = atomic_load_explicit(&h->count, memory_order_relaxed);
+    dst->sum_us = atomic_load_explicit(&h->sum_us, memory_order_relaxed);
+    dst->max_us = atomic_load_explicit(&h->max_us, memory_order_relaxed);
+    for (i = 0; i != DRMU_QUEUE_HIST_BUCKETS; ++i)
+        dst->buckets[i] = atomic_load_explicit(h->buckets + i, memory_order_relaxed);
+}
+
+static void
+hist_reset(queue_hist_t * const h)
+{
+    unsigned int i;
+
+    atomic_store_explicit(&h->count, 0, memory_order_relaxed);
+    atomic_store_explicit(&h->sum_us, 0, memory_order_relaxed);
+    atomic_store_explicit(&h->max_us, 0, memory_order_relaxed);
+    for (i = 0; i != DRMU_QUEUE_HIST_BUCKETS; ++i)
+        atomic_store_explicit(h->buckets + i, 0, memory_order_relaxed);
+}
+
+//-----------------------------------------------------------------------------
+
+// Vblank tracking from flip events
+typedef struct queue_vbl_s {
+    uint64_t ns;          // Timestamp of last flip event
+    unsigned int seq;     // Sequence of last flip event
+    uint64_t period_ns;   // Estimated frame period, 0 if unknown
+} queue_vbl_t;
+
+// One of a set of CRTCs whose updates are committed together
+typedef struct queue_lane_s {
+    drmu_crtc_t * dc;
+    uint32_t crtc_id;
+    // This CRTC's part of the commit in flight & what it replaced - only
+    // used on the Q thread
+    drmu_atomic_t * cur_flip;
+    drmu_atomic_t * last_flip;
+    // Protected by lock
+    queue_vbl_t vbl;
+    uint64_t present_seq;
+    uint64_t present_ns;
+} queue_lane_t;
+
+struct drmu_queue_s {
+    atomic_int ref_count;
+
+    drmu_env_t * du;
+
+    bool discard_last;
+    bool lock_on_commit;
+    bool locked;
+    bool nonblock;
+    unsigned int retry_count;
+    unsigned int qno; // Handy for debug
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    next_flips_t next;
+    timed_flips_t timed;
+    submit_ring_t ring;
+    discard_list_t discards;
+    // First error from applying a ring submission on the Q thread, returned
+    // (and cleared) by the next _queue call
+    atomic_int async_err;
+    drmu_atomic_t * cur_flip;
+    uint64_t cur_queued_ns;  // Only used on the Q thread
+    drmu_atomic_t * last_flip;
+
+    // Set when the Q is idle, cleared by whoever then kicks it. Lock-free
+    // producers clear it without the lock.
+    atomic_bool wants_prod;
+    atomic_bool prod_queued;
+    struct pollqueue * pq;
+    struct polltask * prod_pt;
+
+    // Nonblock vars
+    // cur_flip has been committed and we are waiting for its flip event
+    bool flip_pending;
+    // Flip event (or timeout) has occured for cur_flip
+    bool flip_done;
+    // Stop event handler prodding once we are shutting down
+    bool closing;
+    // event_pt queued - only used on the Q thread
+    bool event_wait;
+    // Time of the last nonblock commit - only used on the Q thread
+    uint64_t flip_commit_ms;
+    drmu_event_handler_t flip_evh;
+    struct polltask * event_pt;
+
+    // Late latch vars - protected by lock
+    bool late_latch;
+    queue_vbl_t vbl;          // With synced CRTCs only period_ns is used
+    uint64_t latch_target_ns; // Predicted vblank of the commit in flight
+    unsigned int latch_lane;  // Synced CRTC that latch_target_ns is for
+    uint64_t latch_margin_ns; // Time before vblank to commit
+    uint64_t commit_ns;       // Smoothed commit ioctl time
+
+    // Presentation feedback - vblank of the last flip event, protected by lock
+    // Zeroed on commit so 0 means no event (yet)
+    uint64_t present_seq;
+    uint64_t present_ns;
+
+    // Synced CRTCs - set before use
+    unsigned int sync_n;
+    queue_lane_t * lanes;
+    // Lanes still waiting for their flip event & lanes that have had it but
+    // not yet been released by the Q thread - protected by lock
+    uint32_t sync_pending;
+    uint32_t sync_done;
+
+    // CRTC to take release fences from - set before use
+    drmu_crtc_t * fence_crtc;
+
+    queue_stats_t stats;
+
+    // Finish vars
+    bool env_restore_req;
+    sem_t * finish_sem;
+};
+
+static uint64_t
+time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t
+time_ms(void)
+{
+    return time_ns() / 1000000;
+}
+
+// Returns true if the caller should add prod_pt. Stops the prod task being
+// added whilst it is already queued.
+// Atomic so that lock-free producers can use it too
+static bool
+queue_prod_claim(drmu_queue_t * const aq)
+{
+    return !atomic_exchange(&aq->prod_queued, true);
+}
+
+// Returns true if the Q was idle and the caller should add prod_pt
+static bool
+queue_idle_claim(drmu_queue_t * const aq)
+{
+    return atomic_exchange(&aq->wants_prod, false) && queue_prod_claim(aq);
+}
+
+// cur_flip has made it to the screen
+static void
+queue_commit_done(drmu_queue_t * const aq)
+{
+    // This is the only place last_flip is written when not shutting down
+    // so we don't need the lock
+    if (aq->discard_last) {
+        pthread_mutex_lock(&aq->lock);
+        if (aq->locked) {
+            assert(aq->last_flip == NULL);
+            aq->last_flip = aq->cur_flip;
+            aq->cur_flip = NULL;
+        }
+        pthread_mutex_unlock(&aq->lock);
+
+        // Writeback doesn't need to keep the source once done
+        drmu_atomic_unref(&aq->cur_flip);
+    }
+    else {
+        // Must merge cur into last rather than just replace last as there may
+        // still be things on screen not updated by the current commit
+        // Callbacks have been run - don't let them pile up in last_flip
+        drmu_atomic_clear_commit_callbacks(aq->cur_flip);
+        drmu_atomic_move_merge(&aq->last_flip, &aq->cur_flip);
+    }
+}
+
+// Run & clear the present callbacks on cur_flip
+// Must be done before cur_flip is merged into last_flip
+static void
+queue_present(drmu_queue_t * const aq, const bool dropped)
+{
+    drmu_present_info_t info = {.dropped = dropped};
+
+    if (!drmu_atomic_has_present_callbacks(aq->cur_flip))
+        return;
+
+    if (!dropped) {
+        pthread_mutex_lock(&aq->lock);
+        info.sequence = aq->present_seq;
+        info.time_ns = aq->present_ns;
+        pthread_mutex_unlock(&aq->lock);
+    }
+    drmu_atomic_run_present_callbacks(aq->cur_flip, &info);
+    drmu_atomic_clear_present_callbacks(aq->cur_flip);
+}
+
+// Atomic discarded without getting to the screen
+// Not our atomic so don't clear anything
+static void
+queue_atomic_dropped(const drmu_atomic_t * const da)
+{
+    static const drmu_present_info_t dropped = {.dropped = true};
+    drmu_atomic_run_present_callbacks(da, &dropped);
+}
+
+// Run dropped callbacks for & unref everything on the discard list
+// Takes the lock for each pop so call without it
+static void
+queue_discards_flush(drmu_queue_t * const aq)
+{
+    for (;;) {
+        drmu_atomic_t * da;
+
+        pthread_mutex_lock(&aq->lock);
+        da = discard_list_pop(&aq->discards);
+        pthread_mutex_unlock(&aq->lock);
+
+        if (da == NULL)
+            return;
+        queue_atomic_dropped(da);
+        drmu_atomic_unref(&da);
+    }
+}
+
+// Keep the first error for the next _queue call to report
+static void
+queue_async_err_set(drmu_queue_t * const aq, int err)
+{
+    int expected = 0;
+    atomic_compare_exchange_strong(&aq->async_err, &expected, err);
+}
+
+// Synced CRTCs in mask have flipped (or their commit failed) - run their
+// callbacks and let go of whatever they replaced on screen
+static void
+queue_lanes_done(drmu_queue_t * const aq, const uint32_t mask, const bool dropped)
+{
+    unsigned int i;
+
+    for (i = 0; i != aq->sync_n; ++i) {
+        queue_lane_t * const lane = aq->lanes + i;
+        drmu_present_info_t info = {.dropped = dropped};
+
+        if ((mask & (1U << i)) == 0 || lane->cur_flip == NULL)
+            continue;
+
+        // Commit callbacks are run whatever the result
+        drmu_atomic_run_commit_callbacks(lane->cur_flip);
+        if (drmu_atomic_has_present_callbacks(lane->cur_flip)) {
+            if (!dropped) {
+                pthread_mutex_lock(&aq->lock);
+                info.sequence = lane->present_seq;
+                info.time_ns = lane->present_ns;
+                pthread_mutex_unlock(&aq->lock);
+            }
+            drmu_atomic_run_present_callbacks(lane->cur_flip, &info);
+        }
+
+        if (dropped) {
+            drmu_atomic_unref(&lane->cur_flip);
+            continue;
+        }
+        drmu_atomic_clear_commit_callbacks(lane->cur_flip);
+        drmu_atomic_clear_present_callbacks(lane->cur_flip);
+        drmu_atomic_move_merge(&lane->last_flip, &lane->cur_flip);
+    }
+}
+
+// cur_flip has made it to the screen on all synced CRTCs. The merged
+// atomic holds nothing the lanes don't so just drop it.
+static void
+queue_sync_commit_done(drmu_queue_t * const aq)
+{
+    queue_lanes_done(aq, ~0U, false);
+    drmu_atomic_unref(&aq->cur_flip);
+}
+
+// Lock expected
+// Build a single commit for all the synced CRTCs from the oldest waiting
+// atomic of each. Nothing is popped until every CRTC has an atomic waiting
+// so a partial set is held back rather than letting the CRTCs get out of
+// step. ACTIVE is added for every CRTC (it costs nothing if unchanged) so
+// that each produces a flip event. Lanes keep their own atomics with the
+// callbacks so that each can be released on its own event; the merged
+// atomic has none.
+// On failure lanes may still hold atomics which must be dropped.
+static drmu_atomic_t *
+queue_sync_pop(drmu_queue_t * const aq)
+{
+    drmu_atomic_t * da;
+    unsigned int i;
+
+    for (i = 0; i != aq->sync_n; ++i) {
+        if (next_flip_find_tag(&aq->next, i) == NULL)
+            return NULL;
+    }
+    if ((da = drmu_atomic_new(aq->du)) == NULL)
+        goto fail;
+
+    for (i = 0; i != aq->sync_n; ++i) {
+        if (drmu_atomic_crtc_add_active(da, aq->lanes[i].dc, 1) != 0)
+            goto fail;
+    }
+
+    for (i = 0; i != aq->sync_n; ++i) {
+        queue_lane_t * const lane = aq->lanes + i;
+        drmu_atomic_t * copy;
+
+        assert(lane->cur_flip == NULL);
+        lane->cur_flip = next_flip_pop_tag(&aq->next, i);
+        if ((copy = drmu_atomic_copy(lane->cur_flip)) == NULL ||
+            drmu_atomic_move_merge(&da, &copy) != 0)
+            goto fail;
+    }
+
+    drmu_atomic_clear_commit_callbacks(da);
+    drmu_atomic_clear_present_callbacks(da);
+    return da;
+
+fail:
+    drmu_err(aq->du, "[%d]: Failed to build synced commit", aq->qno);
+    drmu_atomic_unref(&da);
+    return NULL;
+}
+
+// Update period estimate & last vblank from a flip event
+// Returns the event timestamp
+static uint64_t
+vbl_track(queue_vbl_t * const vbl, const struct drm_event_vblank * const ev)
+{
+    const uint64_t ts = (uint64_t)ev->tv_sec * 1000000000 + (uint64_t)ev->tv_usec * 1000;
+    const unsigned int dseq = ev->sequence - vbl->seq;
+    const uint64_t period = vbl->period_ns;
+
+    if (vbl->ns != 0 && dseq != 0 && ts > vbl->ns) {
+        const uint64_t p = (ts - vbl->ns) / dseq;
+        // Reset on a big change (e.g. modeset) otherwise smooth
+        if (period == 0 || p > period + period / 2 || p < period / 2)
+            vbl->period_ns = p;
+        else
+            vbl->period_ns = period + ((int64_t)p - (int64_t)period) / 8;
+    }
+
+    vbl->ns = ts;
+    vbl->seq = ev->sequence;
+    return ts;
+}
+
+// Predicted next vblank at or after t, 0 if unknown
+static uint64_t
+vbl_next(const queue_vbl_t * const vbl, const uint64_t t)
+{
+    const uint64_t period = vbl->period_ns;
+
+    if (period == 0 || vbl->ns == 0)
+        return 0;
+    if (t <= vbl->ns)
+        return vbl->ns + period;
+    return vbl->ns + ((t - vbl->ns + period - 1) / period) * period;
+}
+
+// Lock expected
+// Adjust the latch margin given that the flip we aimed at latch_target_ns
+// happened at ts
+static void
+queue_latch_update(drmu_queue_t * const aq, const uint64_t ts, const uint64_t period)
+{
+    if (aq->latch_target_ns != 0 && period != 0) {
+        const uint64_t floor = aq->commit_ns * 2 > LATCH_MARGIN_MIN_NS ? aq->commit_ns * 2 : LATCH_MARGIN_MIN_NS;
+
+        if (ts > aq->latch_target_ns + period / 2) {
+            // Missed - back off quickly but there's no point in going beyond
+            // most of a frame
+            stat_add(&aq->stats.missed_vblanks, (ts - aq->latch_target_ns + period / 2) / period);
+            aq->latch_margin_ns += aq->latch_margin_ns / 2;
+            if (aq->latch_margin_ns > period * 3 / 4)
+                aq->latch_margin_ns = period * 3 / 4;
+        }
+        else {
+            aq->latch_margin_ns -= aq->latch_margin_ns / 32;
+        }
+        if (aq->latch_margin_ns < floor)
+            aq->latch_margin_ns = floor;
+    }
+
+    aq->latch_target_ns = 0;
+}
+
+// Lock expected
+// Update vblank prediction & latch margin from a flip event
+static void
+queue_vbl_update(drmu_queue_t * const aq, const struct drm_event_vblank * const ev)
+{
+    const uint64_t period = aq->vbl.period_ns;
+    queue_latch_update(aq, vbl_track(&aq->vbl, ev), period);
+}
+
+// Lock expected
+// Predicted next vblank at or after t, 0 if unknown
+// With synced CRTCs this is the earliest of their next vblanks as a commit
+// has to be in by then to make all of them. *plane (if not NULL) is set to
+// the lane it belongs to.
+static uint64_t
+queue_vbl_next_lane(const drmu_queue_t * const aq, const uint64_t t, unsigned int * const plane)
+{
+    uint64_t next = 0;
+    unsigned int i;
+
+    if (aq->sync_n == 0)
+        return vbl_next(&aq->vbl, t);
+
+    for (i = 0; i != aq->sync_n; ++i) {
+        const uint64_t n = vbl_next(&aq->lanes[i].vbl, t);
+        // Can't predict one of them so can't predict the set
+        if (n == 0)
+            return 0;
+        if (next == 0 || n < next) {
+            next = n;
+            if (plane != NULL)
+                *plane = i;
+        }
+    }
+    return next;
+}
+
+static uint64_t
+queue_vbl_next(const drmu_queue_t * const aq, const uint64_t t)
+{
+    return queue_vbl_next_lane(aq, t, NULL);
+}
+
+// Lock expected
+// Flip event for one of the synced CRTCs. Only the lane that we aimed the
+// commit at adjusts the latch margin; the Q period is that of the slowest.
+// Returns true once every lane of the commit in flight has had its event.
+static bool
+queue_lane_event(drmu_queue_t * const aq, const struct drm_event_vblank * const ev)
+{
+    uint64_t period = 0;
+    unsigned int i;
+
+    if (ev == NULL) {
+        aq->sync_done |= aq->sync_pending;
+        aq->sync_pending = 0;
+        return true;
+    }
+
+    for (i = 0; i != aq->sync_n; ++i) {
+        queue_lane_t * const lane = aq->lanes + i;
+        const uint32_t bit = 1U << i;
+
+        // Old kernels don't say which CRTC so take the first waiting
+        if (ev->crtc_id != 0 ? lane->crtc_id != ev->crtc_id : (aq->sync_pending & bit) == 0)
+            continue;
+
+        {
+            const uint64_t lane_period = lane->vbl.period_ns;
+            const uint64_t ts = vbl_track(&lane->vbl, ev);
+            if (i == aq->latch_lane)
+                queue_latch_update(aq, ts, lane_period);
+        }
+        lane->present_seq = ev->sequence;
+        lane->present_ns = lane->vbl.ns;
+
+        if ((aq->sync_pending & bit) != 0) {
+            aq->sync_pending &= ~bit;
+            aq->sync_done |= bit;
+        }
+        break;
+    }
+
+    for (i = 0; i != aq->sync_n; ++i)
+        if (aq->lanes[i].vbl.period_ns > period)
+            period = aq->lanes[i].vbl.period_ns;
+    aq->vbl.period_ns = period;
+
+    return aq->sync_pending == 0;
+}
+
+// Lock expected
+// ms to wait before the next commit, 0 if it should happen now
+static unsigned int
+queue_latch_delay_ms(const drmu_queue_t * const aq)
+{
+    const uint64_t now = time_ns();
+    const uint64_t next = queue_vbl_next(aq, now);
+    uint64_t commit_at;
+
+    if (next == 0 || next < aq->latch_margin_ns)
+        return 0;
+    commit_at = next - aq->latch_margin_ns;
+
+    // Polltask timeouts are in ms so commit if we are within 1ms
+    if (commit_at < now + 1000000)
+        return 0;
+    return (unsigned int)((commit_at - now) / 1000000);
+}
+
+// Called by whichever thread reads the event from the DRM fd
+static void
+queue_flip_event_cb(void * v, const struct drm_event_vblank * const ev)
+{
+    drmu_queue_t * const aq = v;
+    bool wants_prod = false;
+
+    bool all_done = true;
+
+    pthread_mutex_lock(&aq->lock);
+    if (aq->sync_n != 0) {
+        all_done = queue_lane_event(aq, ev);
+    }
+    else if (ev != NULL) {
+        queue_vbl_update(aq, ev);
+        aq->present_seq = ev->sequence;
+        aq->present_ns = aq->vbl.ns;
+    }
+    if (aq->flip_pending && !aq->flip_done) {
+        // Synced CRTCs that have flipped are released before the rest
+        if (all_done)
+            aq->flip_done = true;
+        if (aq->flip_done || aq->sync_done != 0)
+            wants_prod = !aq->closing && queue_prod_claim(aq);
+    }
+    pthread_mutex_unlock(&aq->lock);
+
+    if (wants_prod)
+        pollqueue_add_task(aq->prod_pt, 0);
+}
+
+static void
+queue_event_wait(drmu_queue_t * const aq)
+{
+    if (aq->event_wait)
+        return;
+    aq->event_wait = true;
+    pollqueue_add_task(aq->event_pt, FLIP_EVENT_TIMEOUT_MS);
+}
+
+static void
+queue_event_cb(void * v, short revents)
+{
+    drmu_queue_t * const aq = v;
+    bool timeout = false;
+    bool wants_prod = false;
+    bool rearm = false;
+
+    aq->event_wait = false;
+
+    // Our event may already have been read by another thread in which case
+    // there may be nothing here
+    if (revents != 0)
+        drmu_env_int_events_dispatch(aq->du);
+
+    pthread_mutex_lock(&aq->lock);
+    if (aq->flip_pending && !aq->flip_done) {
+        if (revents == 0 && time_ms() - aq->flip_commit_ms >= FLIP_EVENT_TIMEOUT_MS) {
+            timeout = true;
+            aq->flip_done = true;
+            wants_prod = queue_prod_claim(aq);
+        }
+        else {
+            rearm = true;
+        }
+    }
+    pthread_mutex_unlock(&aq->lock);
+
+    if (timeout)
+        drmu_warn(aq->du, "[%d]: Flip event timeout", aq->qno);
+    if (rearm)
+        queue_event_wait(aq);
+    if (wants_prod)
+        pollqueue_add_task(aq->prod_pt, 0);
+}
+
+// cur_flip has been committed with a release fence - everything it
+// replaces can go now rather than when its flip event arrives. Fbs carry the
+// fence so they aren't written until they are really off screen.
+static void
+queue_release_early(drmu_queue_t * const aq, drmu_fence_t * const fence)
+{
+    drmu_atomic_t * da;
+
+    // Anything still on screen after this commit will get a later fence
+    // before it is released
+    drmu_atomic_fb_release_fence_set(aq->last_flip, fence);
+
+    // The real cur_flip keeps its callbacks for the flip event; merging it
+    // into last_flip again then changes nothing
+    if ((da = drmu_atomic_copy(aq->cur_flip)) == NULL)
+        return;
+    drmu_atomic_clear_commit_callbacks(da);
+    drmu_atomic_clear_present_callbacks(da);
+    drmu_atomic_move_merge(&aq->last_flip, &da);
+}
+
+// Flip events need at least one CRTC in the commit (and something to
+// commit) - the kernel rejects the commit with -EINVAL if there isn't one.
+// -EINVAL is also what it says for anything else it doesn't like so check
+// that the commit without the event is OK before retrying without it.
+static bool
+queue_flip_event_unsupported(drmu_queue_t * const aq, const int rv, const uint32_t flags)
+{
+    int rv2;
+
+    if (rv != -EINVAL)
+        return false;
+    if ((rv2 = drmu_atomic_int_commit_check(aq->cur_flip, flags)) == 0)
+        return true;
+    drmu_debug(aq->du, "[%d]: Commit check failed: %s", aq->qno, strerror(-rv2));
+    return false;
+}
+
+// Returns 1 if the commit is in flight & we should wait for its event
+// otherwise the result of the commit
+static int
+queue_commit_nonblock(drmu_queue_t * const aq, const uint32_t flags)
+{
+    drmu_fence_t * fence = NULL;
+    uint64_t t0;
+    int rv;
+
+    // On a retry after BUSY this replaces the unused fence from last time
+    if (aq->fence_crtc != NULL &&
+        (rv = drmu_atomic_crtc_add_out_fence(aq->cur_flip, aq->fence_crtc, &fence)) != 0)
+        drmu_warn(aq->du, "[%d]: Failed to add release fence: %s", aq->qno, strerror(-rv));
+
+    // Event may be read on another thread before the commit returns so
+    // set pending first
+    pthread_mutex_lock(&aq->lock);
+    aq->flip_pending = true;
+    aq->flip_done = false;
+    aq->present_seq = 0;
+    aq->present_ns = 0;
+    aq->sync_pending = (1U << aq->sync_n) - 1;
+    aq->sync_done = 0;
+    for (unsigned int i = 0; i != aq->sync_n; ++i) {
+        aq->lanes[i].present_seq = 0;
+        aq->lanes[i].present_ns = 0;
+    }
+    t0 = time_ns();
+    // The vblank we expect to make given our current margin
+    aq->latch_target_ns = queue_vbl_next_lane(aq, t0 + aq->latch_margin_ns, &aq->latch_lane);
+    pthread_mutex_unlock(&aq->lock);
+
+    aq->flip_commit_ms = t0 / 1000000;
+    rv = drmu_atomic_commit_flip_event(aq->cur_flip, flags | DRM_MODE_ATOMIC_NONBLOCK, &aq->flip_evh);
+    if (rv == 0) {
+        const uint64_t t = time_ns() - t0;
+        pthread_mutex_lock(&aq->lock);
+        aq->commit_ns = aq->commit_ns == 0 ? t : aq->commit_ns + ((int64_t)t - (int64_t)aq->commit_ns) / 8;
+        pthread_mutex_unlock(&aq->lock);
+
+        if (fence != NULL)
+            queue_release_early(aq, fence);
+        drmu_fence_unref(&fence);
+
+        queue_event_wait(aq);
+        return 1;
+    }
+    drmu_fence_unref(&fence);
+
+    pthread_mutex_lock(&aq->lock);
+    aq->flip_pending = false;
+    aq->sync_pending = 0;
+    pthread_mutex_unlock(&aq->lock);
+
+    if (queue_flip_event_unsupported(aq, rv, flags)) {
+        drmu_debug(aq->du, "[%d]: No flip event possible - commit blocking", aq->qno);
+        rv = drmu_atomic_commit(aq->cur_flip, flags);
+    }
+    return rv;
+}
+
+// Blocking commit - if cur_flip wants presentation feedback then ask for a
+// flip event too. The commit only returns once the flip has happened so the
+// event should be ready to read straight away.
+static int
+queue_commit_blocking(drmu_queue_t * const aq, const uint32_t flags)
+{
+    bool done = false;
+    unsigned int i;
+    int rv;
+
+    if (!drmu_atomic_has_present_callbacks(aq->cur_flip))
+        return drmu_atomic_commit(aq->cur_flip, flags);
+
+    pthread_mutex_lock(&aq->lock);
+    aq->present_seq = 0;
+    aq->present_ns = 0;
+    pthread_mutex_unlock(&aq->lock);
+
+    rv = drmu_atomic_commit_flip_event(aq->cur_flip, flags, &aq->flip_evh);
+    if (queue_flip_event_unsupported(aq, rv, flags))
+        return drmu_atomic_commit(aq->cur_flip, flags);
+
+    // As drmu_atomic_commit, commit callbacks are run whatever the result
+    drmu_atomic_run_commit_callbacks(aq->cur_flip);
+    if (rv != 0)
+        return rv;
+
+    // Another thread may have read our event and not quite got round to
+    // calling us yet so allow a little time
+    for (i = 0; !done && i != PRESENT_EVENT_TRIES; ++i) {
+        struct pollfd pf = {.fd = drmu_fd(aq->du), .events = POLLIN};
+
+        if (i != 0)
+            poll(&pf, 1, 1);
+        drmu_env_int_events_dispatch(aq->du);
+
+        pthread_mutex_lock(&aq->lock);
+        done = aq->present_ns != 0;
+        pthread_mutex_unlock(&aq->lock);
+    }
+    if (!done)
+        drmu_debug(aq->du, "[%d]: No flip event after blocking commit", aq->qno);
+    return 0;
+}
+
+// Wait synchronously for any pending flip - used on shutdown once the Q
+// tasks have gone
+static void
+queue_flip_wait_sync(drmu_queue_t * const aq)
 {
-    const unsigned int oldlen = nf->len;
+    const uint64_t t0 = time_ms();
+    bool pending;
 
-    if (oldlen < nf->size) {
-        unsigned int n = nf->n + oldlen;
-        if (n >= nf->size)
-            n -= nf->size;
-        nf->flips[n].da = NULL;
-        nf->flips[n].tag = tag;
-        ++nf->len;
-        return &nf->flips[n].da;
-    }
-    else {
-        // Given the circular buffer can't just realloc, must alloc & rebuild
-        const unsigned int newsize = (oldlen < 8) ? 8 : oldlen * 2;
-        flip_ent_t * newflips = malloc(sizeof(*nf->flips) * newsize);
-        if (newflips == NULL)
-            return NULL;
+    for (;;) {
+        struct pollfd pf = {.fd = drmu_fd(aq->du), .events = POLLIN};
 
-        assert(oldlen == nf->size);
-        memcpy(newflips, nf->flips + nf->n, (nf->size - nf->n) * sizeof(*nf->flips));
-        memcpy(newflips + (nf->size - nf->n), nf->flips, nf->n * sizeof(*nf->flips));
-        newflips[oldlen].da = NULL;
-        newflips[oldlen].tag = tag;
-        free(nf->flips);
+        pthread_mutex_lock(&aq->lock);
+        pending = aq->flip_pending && !aq->flip_done;
+        pthread_mutex_unlock(&aq->lock);
 
-        nf->flips = newflips;
-        nf->size = newsize;
-        nf->len = oldlen + 1;
-        nf->n = 0;
+        if (!pending)
+            break;
+        if (time_ms() - t0 >= FLIP_EVENT_TIMEOUT_MS) {
+            drmu_warn(aq->du, "[%d]: Flip event timeout on close", aq->qno);
+            break;
+        }
 
-        return &newflips[oldlen].da;
+        poll(&pf, 1, 10);
+        drmu_env_int_events_dispatch(aq->du);
     }
 }
 
-static bool
-next_flip_discard_head(next_flips_t * const nf)
+// Lock expected
+// Add to the next Q as per qmerge. If this displaces an atomic then it is
+// put on the discard list so it can be unrefed outside the lock. If the new
+// atomic isn't taken (DROP or error) it is left in *ppda.
+static int
+queue_next_add(drmu_queue_t * const aq, const unsigned int tag, const drmu_queue_merge_t qmerge,
+               const uint64_t queued_ns, drmu_atomic_t ** const ppda)
 {
-    drmu_atomic_t * da = next_flip_pop_head(nf);
-    if (da == NULL)
-        return false;
-    drmu_atomic_unref(&da);
-    return true;
-}
+    drmu_atomic_t ** ppna = NULL;
 
-static void
-next_flip_init(next_flips_t * const nf)
-{
-    memset(nf, 0, sizeof(*nf));
+    if (qmerge != DRMU_QUEUE_MERGE_QUEUE)
+        ppna = next_flip_find_tag(&aq->next, tag);
+
+    if (ppna == NULL) {
+        if ((ppna = next_flip_add_tail(&aq->next, tag, queued_ns)) == NULL)
+            return -ENOMEM;
+        stat_max(&aq->stats.depth_max, aq->next.len + aq->timed.len);
+    }
+
+    switch (qmerge) {
+        case DRMU_QUEUE_MERGE_MERGE:
+            if (*ppna != NULL)
+                stat_add(&aq->stats.merges, 1);
+            return drmu_atomic_move_merge(ppna, ppda);
+        case DRMU_QUEUE_MERGE_QUEUE:
+        case DRMU_QUEUE_MERGE_DROP:
+            if (*ppna == NULL)
+                *ppna = drmu_atomic_move(ppda);
+            else
+                stat_add(&aq->stats.drops, 1);
+            break;
+        case DRMU_QUEUE_MERGE_REPLACE:
+            if (*ppna != NULL)
+                stat_add(&aq->stats.replaces, 1);
+            discard_list_add(&aq->discards, ppna);
+            *ppna = drmu_atomic_move(ppda);
+            break;
+        default:
+            drmu_err(aq->du, "Bad qmerge value");
+            return -EINVAL;
+    }
+    return 0;
 }
 
-// Zap next flip q - leaves in a state that a new add will work
+// Lock expected
+// Move everything in the submission ring onto the next Q. Anything dropped
+// or replaced goes on the discard list to be dealt with outside the lock.
+// Errors are kept for the next _queue call to return.
 static void
-next_flip_uninit(next_flips_t * const nf)
+queue_ring_drain(drmu_queue_t * const aq)
 {
-    while (!next_flip_is_empty(nf)) {
-        drmu_atomic_run_commit_callbacks(next_flip_head(nf));
-        next_flip_discard_head(nf);
+    const submit_slot_t * slot;
+
+    while ((slot = submit_ring_head(&aq->ring)) != NULL) {
+        drmu_atomic_t * da = slot->da;
+        const unsigned int tag = slot->tag;
+        const drmu_queue_merge_t qmerge = slot->qmerge;
+        const uint64_t queued_ns = slot->queued_ns;
+        int rv;
+
+        submit_ring_pop(&aq->ring);
+
+        if ((rv = queue_next_add(aq, tag, qmerge, queued_ns, &da)) != 0) {
+            drmu_err(aq->du, "[%d]: Failed to Q atomic: %s", aq->qno, strerror(-rv));
+            queue_async_err_set(aq, rv);
+        }
+        // Anything left in da was dropped (or failed)
+        discard_list_add(&aq->discards, &da);
     }
-    free(nf->flips);
-    memset(nf, 0, sizeof(*nf));
 }
 
-//-----------------------------------------------------------------------------
+// Lock expected
+// Move timed atomics that are due by the vblank a commit now would make
+// onto the next Q. Only the newest due atomic is wanted; older ones are
+// merged under it if their qmerge is MERGE, otherwise they are dropped and
+// put on the discard list to be unrefed outside the lock. A QUEUE atomic is
+// never merged and gets a flip of its own.
+// Returns ms until we should look again, 0 if the timed Q is empty
+static unsigned int
+queue_timed_release(drmu_queue_t * const aq)
+{
+    timed_flips_t * const tf = &aq->timed;
+    const uint64_t now = time_ns();
+    const uint64_t period = aq->vbl.period_ns;
+    const uint64_t vbl = queue_vbl_next(aq, now + aq->latch_margin_ns);
+    // Anything nearer this vblank than the following one is due
+    const uint64_t due_ns = vbl == 0 ? now : vbl + period / 2;
+    drmu_atomic_t * da = NULL;
+    uint64_t release_ns;
+    unsigned int delay;
+    unsigned int max_delay;
+    unsigned int n;
+    unsigned int i;
+    int rv;
 
-struct drmu_queue_s {
-    atomic_int ref_count;
+    for (n = 0; n != tf->len && tf->ents[n].target_ns <= due_ns; ++n) {
+        if (tf->ents[n].qmerge == DRMU_QUEUE_MERGE_QUEUE) {
+            if (n == 0)
+                n = 1;
+            break;
+        }
+    }
 
-    drmu_env_t * du;
+    if (n != 0) {
+        const timed_ent_t * const sel = tf->ents + n - 1;
+        // As with the next Q a merge keeps the time the oldest part was Qed
+        uint64_t queued_ns = sel->queued_ns;
+
+        for (i = 0; i != n - 1; ++i) {
+            if (tf->ents[i].qmerge == DRMU_QUEUE_MERGE_MERGE) {
+                stat_add(&aq->stats.merges, 1);
+                drmu_atomic_move_merge(&da, &tf->ents[i].da);
+                if (tf->ents[i].queued_ns < queued_ns)
+                    queued_ns = tf->ents[i].queued_ns;
+            }
+            else {
+                stat_add(tf->ents[i].qmerge == DRMU_QUEUE_MERGE_REPLACE ?
+                         &aq->stats.replaces : &aq->stats.drops, 1);
+                discard_list_add(&aq->discards, &tf->ents[i].da);
+            }
+        }
+        drmu_atomic_move_merge(&da, &tf->ents[n - 1].da);
 
-    bool discard_last;
-    bool lock_on_commit;
-    bool locked;
-    unsigned int retry_count;
-    unsigned int qno; // Handy for debug
+        if ((rv = queue_next_add(aq, 0,
+                                 sel->qmerge == DRMU_QUEUE_MERGE_QUEUE ? DRMU_QUEUE_MERGE_QUEUE : DRMU_QUEUE_MERGE_MERGE,
+                                 queued_ns, &da)) != 0) {
+            drmu_err(aq->du, "[%d]: Failed to Q timed atomic: %s", aq->qno, strerror(-rv));
+            queue_async_err_set(aq, rv);
+        }
+        discard_list_add(&aq->discards, &da);
 
-    pthread_mutex_t lock;
-    pthread_cond_t cond;
-    next_flips_t next;
-    drmu_atomic_t * cur_flip;
-    drmu_atomic_t * last_flip;
+        timed_flip_remove_head(tf, n);
+    }
 
-    bool wants_prod;
-    struct pollqueue * pq;
-    struct polltask * prod_pt;
+    if (timed_flip_is_empty(tf))
+        return 0;
 
-    // Finish vars
-    bool env_restore_req;
-    sem_t * finish_sem;
-};
+    // Wake when the head would become due - but not too late as an untimed
+    // atomic Qed in the meantime will also wait for this
+    release_ns = tf->ents[0].target_ns;
+    if (vbl != 0)
+        release_ns = release_ns > period / 2 + aq->latch_margin_ns ?
+            release_ns - period / 2 - aq->latch_margin_ns : 0;
+    max_delay = vbl == 0 ? TIMED_WAKE_MAX_MS : (unsigned int)(period / 1000000);
+    if (max_delay == 0)
+        max_delay = 1;
+
+    delay = release_ns <= now ? 1 : (unsigned int)((release_ns - now + 999999) / 1000000);
+    return delay > max_delay ? max_delay : delay;
+}
 
 static void
 queue_prod_cb(void * v, short revents)
@@ -183,53 +1491,128 @@ queue_prod_cb(void * v, short revents)
     (void)revents;
     uint32_t flags = DRM_MODE_ATOMIC_ALLOW_MODESET;
     unsigned int prod_time = 0;
+    unsigned int timed_delay = 0;
+    bool flip_done = false;
+    bool discards;
+    bool wants_prod = false;
+    uint64_t t0;
     int rv;
 
     // cur_flip, last_flip only used here so can be used outside lock
 
     pthread_mutex_lock(&aq->lock);
+    atomic_store(&aq->prod_queued, false);
+
+    if (aq->flip_pending) {
+        if (!aq->flip_done) {
+            // Still waiting for the flip event which will prod us again
+            // Synced CRTCs that have already flipped can be released now
+            const uint32_t lanes_done = aq->sync_done;
+            aq->sync_done = 0;
+            pthread_mutex_unlock(&aq->lock);
+            queue_lanes_done(aq, lanes_done, false);
+            return;
+        }
+        aq->flip_pending = false;
+        aq->flip_done = false;
+        aq->sync_pending = 0;
+        aq->sync_done = 0;
+        flip_done = true;
+    }
+
+    pthread_mutex_unlock(&aq->lock);
+
+    // Nonblock flip completed - commit callbacks weren't run on commit
+    if (flip_done) {
+        if (aq->sync_n != 0) {
+            queue_sync_commit_done(aq);
+        }
+        else {
+            drmu_atomic_run_commit_callbacks(aq->cur_flip);
+            queue_present(aq, false);
+            queue_commit_done(aq);
+        }
+    }
+
+    pthread_mutex_lock(&aq->lock);
+    queue_ring_drain(aq);
+    if (!aq->locked && aq->cur_flip == NULL)
+        timed_delay = queue_timed_release(aq);
+    discards = !discard_list_is_empty(&aq->discards);
+    pthread_mutex_unlock(&aq->lock);
+
+    if (discards)
+        queue_discards_flush(aq);
+
+    pthread_mutex_lock(&aq->lock);
+
+    // Late latch - if there is time before the next vblank then wait so
+    // that anything else queued in the meantime makes it too
+    if (aq->late_latch && !aq->locked && aq->cur_flip == NULL && !next_flip_is_empty(&aq->next)) {
+        const unsigned int delay = queue_latch_delay_ms(aq);
+        if (delay != 0) {
+            wants_prod = queue_prod_claim(aq);
+            pthread_mutex_unlock(&aq->lock);
+            if (wants_prod)
+                pollqueue_add_task(aq->prod_pt, delay);
+            return;
+        }
+    }
 
     if (!aq->locked) {
-        if (aq->cur_flip == NULL)
-            aq->cur_flip = next_flip_pop_head(&aq->next);
+        if (aq->cur_flip == NULL) {
+            aq->cur_queued_ns = next_flip_head_queued_ns(&aq->next);
+            aq->cur_flip = aq->sync_n != 0 ? queue_sync_pop(aq) : next_flip_pop_head(&aq->next);
+        }
         if (aq->cur_flip != NULL)
             aq->locked = aq->lock_on_commit;
+        else if (timed_delay != 0) {
+            // Nothing to do yet but timed atomics still waiting
+            wants_prod = queue_prod_claim(aq);
+        }
         else {
-            aq->wants_prod = true;
-            pthread_cond_broadcast(&aq->cond);
+            atomic_store(&aq->wants_prod, true);
+            // A lock-free push may have just missed seeing us idle
+            if (!submit_ring_is_empty(&aq->ring))
+                wants_prod = queue_idle_claim(aq);
+            else
+                pthread_cond_broadcast(&aq->cond);
         }
     }
 
     pthread_mutex_unlock(&aq->lock);
 
-    if (aq->cur_flip == NULL)
+    if (aq->cur_flip == NULL) {
+        // Anything a failed synced pop took off the Q
+        queue_lanes_done(aq, ~0U, true);
+        if (wants_prod)
+            pollqueue_add_task(aq->prod_pt, timed_delay);
         return;
+    }
+
+    t0 = time_ns();
+    if (aq->retry_count == 0)
+        hist_add(&aq->stats.queue_to_commit, t0 - aq->cur_queued_ns);
 
-    rv = drmu_atomic_commit(aq->cur_flip, flags);
+    rv = !aq->nonblock ? queue_commit_blocking(aq, flags) : queue_commit_nonblock(aq, flags);
+
+    hist_add(&aq->stats.commit_ioctl, time_ns() - t0);
+    if (rv == 0 || rv == 1)
+        stat_add(&aq->stats.commits, 1);
+    if (rv == 1)
+        return;
 
     if (rv == 0) {
         if (aq->retry_count != 0)
             drmu_warn(du, "[%d]: Atomic commit OK", aq->qno);
         aq->retry_count = 0;
 
-        // This is the only place last_flip is written when not shutting down
-        // so we don't need the lock
-        if (aq->discard_last) {
-            pthread_mutex_lock(&aq->lock);
-            if (aq->locked) {
-                assert(aq->last_flip == NULL);
-                aq->last_flip = aq->cur_flip;
-                aq->cur_flip = NULL;
-            }
-            pthread_mutex_unlock(&aq->lock);
-
-            // Writeback doesn't need to keep the source once done
-            drmu_atomic_unref(&aq->cur_flip);
+        if (aq->sync_n != 0) {
+            queue_sync_commit_done(aq);
         }
         else {
-            // Must merge cur into last rather than just replace last as there may
-            // still be things on screen not updated by the current commit
-            drmu_atomic_move_merge(&aq->last_flip, &aq->cur_flip);
+            queue_present(aq, false);
+            queue_commit_done(aq);
         }
     }
     else if (rv == -EBUSY && ++aq->retry_count < 16) {
@@ -237,12 +1620,17 @@ queue_prod_cb(void * v, short revents)
         // a modeset often fails with BUSY.  It seems to be fine on a 10ms retry
         // but allow some more in case we need a bit longer in some cases
         // *** This may never happen now with blocking commits
+        // In nonblock mode we don't commit until the previous flip event so
+        // our own flips can't cause this either.
         drmu_warn(du, "[%d]: Atomic commit BUSY", aq->qno);
+        stat_add(&aq->stats.busy_retries, 1);
         prod_time = 20;
     }
     else {
         drmu_err(du, "[%d]: Atomic commit failed: %s", aq->qno, strerror(-rv));
         drmu_atomic_dump(aq->cur_flip);
+        queue_lanes_done(aq, ~0U, true);
+        queue_present(aq, true);
         drmu_atomic_unref(&aq->cur_flip);
         aq->retry_count = 0;
         // We haven't had a good commit so _unlock must not be called so no
@@ -250,24 +1638,66 @@ queue_prod_cb(void * v, short revents)
         aq->locked = false;
     }
 
-    pollqueue_add_task(aq->prod_pt, prod_time);
+    pthread_mutex_lock(&aq->lock);
+    wants_prod = queue_prod_claim(aq);
+    pthread_mutex_unlock(&aq->lock);
+
+    if (wants_prod)
+        pollqueue_add_task(aq->prod_pt, prod_time);
 }
 
 static void
 queue_free(drmu_queue_t * const aq)
 {
     sem_t * const finish_sem = aq->finish_sem;
+    bool in_flight;
+
+    pthread_mutex_lock(&aq->lock);
+    aq->closing = true;
+    pthread_mutex_unlock(&aq->lock);
 
     // Delete will wait for a running polltask to finish
     polltask_delete(&aq->prod_pt);
+    polltask_delete(&aq->event_pt);
+
+    // A nonblock commit may still be in flight - wait for it to get to the
+    // screen before we restore or free anything
+    queue_flip_wait_sync(aq);
+    // If we timed out the kernel may still send the event - once removed
+    // the env drops it rather than calling us
+    drmu_env_int_event_handler_remove(aq->du, &aq->flip_evh);
+    in_flight = aq->flip_pending;
+    aq->flip_pending = false;
+    if (in_flight) {
+        if (aq->sync_n != 0) {
+            queue_sync_commit_done(aq);
+        }
+        else {
+            drmu_atomic_run_commit_callbacks(aq->cur_flip);
+            queue_present(aq, false);
+            queue_commit_done(aq);
+        }
+    }
 
+    submit_ring_uninit(&aq->ring);
+    queue_discards_flush(aq);
+    discard_list_uninit(&aq->discards);
     next_flip_uninit(&aq->next);
+    timed_flip_uninit(&aq->timed);
+    queue_lanes_done(aq, ~0U, true);
+    queue_present(aq, true);
     drmu_atomic_unref(&aq->cur_flip);
 
     if (aq->env_restore_req)
         drmu_env_int_restore(aq->du);
 
     drmu_atomic_unref(&aq->last_flip);
+    for (unsigned int i = 0; i != aq->sync_n; ++i) {
+        drmu_atomic_unref(&aq->lanes[i].last_flip);
+        drmu_crtc_unref(&aq->lanes[i].dc);
+    }
+    free(aq->lanes);
+    drmu_crtc_unref(&aq->fence_crtc);
 
     pollqueue_finish(&aq->pq);
 
@@ -341,10 +1771,16 @@ drmu_queue_new(struct drmu_env_s * const du)
 
     aq->du = drmu_env_ref(du);
     next_flip_init(&aq->next);
+    timed_flip_init(&aq->timed);
     aq->cur_flip = NULL;
     aq->last_flip = NULL;
     aq->qno = atomic_fetch_add(&qcount, 1);
-    aq->wants_prod = true;
+    atomic_init(&aq->wants_prod, true);
+    atomic_init(&aq->prod_queued, false);
+    submit_ring_init(&aq->ring);
+    discard_list_init(&aq->discards);
+    atomic_init(&aq->async_err, 0);
+    aq->latch_margin_ns = LATCH_MARGIN_INIT_NS;
 
     pthread_mutex_init(&aq->lock, NULL);
 
@@ -357,6 +1793,11 @@ drmu_queue_new(struct drmu_env_s * const du)
         goto fail;
     if ((aq->prod_pt = polltask_new(aq->pq, -1, 0, queue_prod_cb, aq)) == NULL)
         goto fail;
+    aq->flip_evh = (drmu_event_handler_t){.fn = queue_flip_event_cb, .v = aq};
+    if (drmu_env_int_event_handler_add(du, &aq->flip_evh) != 0)
+        goto fail;
+    if ((aq->event_pt = polltask_new(aq->pq, drmu_fd(du), POLLIN, queue_event_cb, aq)) == NULL)
+        goto fail;
     return aq;
 
 fail:
@@ -400,67 +1841,104 @@ drmu_queue_queue_tagged(drmu_queue_t * const aq,
                         struct drmu_atomic_s ** ppda)
 {
     int rv = 0;
-    drmu_env_t * const du = drmu_atomic_env(*ppda);
-    drmu_atomic_t ** ppna = NULL;
-    drmu_atomic_t * discard_da = NULL;
-    bool wants_prod = false;
+    bool discards;
+    uint64_t now;
 
     if (aq == NULL) {
         rv = -EINVAL;
         goto fail_unref;
     }
+    if ((unsigned int)qmerge > DRMU_QUEUE_MERGE_QUEUE) {
+        drmu_err(aq->du, "Bad qmerge value");
+        rv = -EINVAL;
+        goto fail_unref;
+    }
+    if (aq->sync_n != 0 && tag >= aq->sync_n) {
+        drmu_err(aq->du, "Tag %u is not a synced CRTC", tag);
+        rv = -EINVAL;
+        goto fail_unref;
+    }
 
     if (drmu_atomic_is_empty(*ppda))
         goto fail_unref;  // rv = 0 so not an error really
 
+    now = time_ns();
+    {
+        drmu_atomic_t * da = drmu_atomic_move(ppda);
+        if (da == NULL)
+            return -ENOMEM;
+
+        // Fast path - merge policy is resolved when the Q thread drains the
+        // ring
+        if (submit_ring_push(&aq->ring, tag, qmerge, now, &da)) {
+            if (queue_idle_claim(aq))
+                pollqueue_add_task(aq->prod_pt, 0);
+            return atomic_exchange(&aq->async_err, 0);
+        }
+        *ppda = da;
+    }
+
+    // Ring full - take the lock and drain it ourselves so order is kept
     pthread_mutex_lock(&aq->lock);
 
-    if (qmerge != DRMU_QUEUE_MERGE_QUEUE)
-        ppna = next_flip_find_tag(&aq->next, tag);
+    queue_ring_drain(aq);
 
-    if (ppna == NULL) {
-        if ((ppna = next_flip_add_tail(&aq->next, tag)) == NULL) {
-            rv = -ENOMEM;
-            goto fail_unlock;
-        }
-    }
+    rv = queue_next_add(aq, tag, qmerge, now, ppda);
+    // If DROP (or an error) didn't take the new atomic then it is dropped
+    // Unref of a dropped or replaced atomic can take a short while - do
+    // outside lock
+    discard_list_add(&aq->discards, ppda);
+    discards = !discard_list_is_empty(&aq->discards);
 
-    switch (qmerge) {
-        case DRMU_QUEUE_MERGE_MERGE:
-            if ((rv = drmu_atomic_move_merge(ppna, ppda)) != 0)
-                goto fail_unlock;
-            break;
-        case DRMU_QUEUE_MERGE_QUEUE:
-        case DRMU_QUEUE_MERGE_DROP:
-            if (*ppna == NULL)
-                *ppna = drmu_atomic_move(ppda);
-            break;
-        case DRMU_QUEUE_MERGE_REPLACE:
-            discard_da = *ppna; // Unref can take a short while - move outside lock
-            *ppna = drmu_atomic_move(ppda);
-            break;
-        default:
-            drmu_err(du, "Bad qmerge value");
-            rv = -EINVAL;
-            goto fail_unlock;
-    }
+    pthread_mutex_unlock(&aq->lock);
+
+    if (queue_idle_claim(aq))
+        pollqueue_add_task(aq->prod_pt, 0);
+
+    if (discards)
+        queue_discards_flush(aq);
+    if (rv == 0)
+        rv = atomic_exchange(&aq->async_err, 0);
+fail_unref:
+    drmu_atomic_unref(ppda);
+    return rv;
+}
+
+int
+drmu_queue_queue_at(drmu_queue_t * const aq,
+                    const uint64_t target_ns, const drmu_queue_merge_t qmerge,
+                    struct drmu_atomic_s ** ppda)
+{
+    int rv = 0;
+    bool wants_prod = false;
+    uint64_t now;
 
-    // No pending commit?
-    if (aq->wants_prod) {
-        aq->wants_prod = false;
-        wants_prod = true;
+    // Timed atomics have no tag so can't say which synced CRTC they are for
+    if (aq == NULL || (unsigned int)qmerge > DRMU_QUEUE_MERGE_QUEUE || aq->sync_n != 0) {
+        rv = -EINVAL;
+        goto fail_unref;
     }
 
-    rv = 0;
+    if (drmu_atomic_is_empty(*ppda))
+        goto fail_unref;  // rv = 0 so not an error really
+
+    now = time_ns();
+    pthread_mutex_lock(&aq->lock);
+
+    if ((rv = timed_flip_add(&aq->timed, target_ns, now, qmerge, ppda)) != 0)
+        goto fail_unlock;
+    stat_max(&aq->stats.depth_max, aq->next.len + aq->timed.len);
+
+    // Prod if idle - prod will work out when we need to commit
+    wants_prod = queue_idle_claim(aq);
+    rv = atomic_exchange(&aq->async_err, 0);
 
 fail_unlock:
     pthread_mutex_unlock(&aq->lock);
 
-    // Do outside lock to avoid possible unneeded lock conflict
     if (wants_prod)
         pollqueue_add_task(aq->prod_pt, 0);
 
-    drmu_atomic_unref(&discard_da);
 fail_unref:
     drmu_atomic_unref(ppda);
     return rv;
@@ -496,7 +1974,7 @@ drmu_queue_wait(drmu_queue_t * const aq)
     ts.tv_sec += 1;  // We should never timeout if all is well - 1 sec is plenty
 
     // wants_prod will be true once Q empty and commit finished
-    while (!aq->wants_prod)
+    while (!atomic_load(&aq->wants_prod))
         if ((rv = pthread_cond_timedwait(&aq->cond, &aq->lock, &ts)) != 0)
             break;
 
@@ -507,12 +1985,89 @@ drmu_queue_wait(drmu_queue_t * const aq)
 void
 drmu_queue_keep_last_set(drmu_queue_t * const aq, const bool keep_last)
 {
+    if (!keep_last && aq->fence_crtc != NULL) {
+        drmu_err(aq->du, "[%d]: keep_last is required with release fences", aq->qno);
+        return;
+    }
     aq->discard_last = !keep_last;
 }
 
+void
+drmu_queue_nonblock_set(drmu_queue_t * const aq, const bool nonblock)
+{
+    aq->nonblock = nonblock;
+}
+
+void
+drmu_queue_late_latch_set(drmu_queue_t * const aq, const bool late_latch)
+{
+    pthread_mutex_lock(&aq->lock);
+    aq->late_latch = late_latch;
+    if (late_latch)
+        aq->nonblock = true;
+    pthread_mutex_unlock(&aq->lock);
+}
+
+int
+drmu_queue_sync_crtcs_set(drmu_queue_t * const aq, drmu_crtc_t * const * const dcs, const unsigned int n)
+{
+    queue_lane_t * lanes;
+    unsigned int i;
+
+    if (n == 0 || n > SYNC_LANES_MAX || aq->sync_n != 0 || aq->fence_crtc != NULL)
+        return -EINVAL;
+    if ((lanes = calloc(n, sizeof(*lanes))) == NULL)
+        return -ENOMEM;
+
+    for (i = 0; i != n; ++i) {
+        unsigned int j;
+
+        if (dcs[i] == NULL)
+            goto fail;
+        // Each CRTC only gets one flip event per commit
+        for (j = 0; j != i; ++j) {
+            if (lanes[j].crtc_id == drmu_crtc_id(dcs[i]))
+                goto fail;
+        }
+        lanes[i].dc = drmu_crtc_ref(dcs[i]);
+        lanes[i].crtc_id = drmu_crtc_id(dcs[i]);
+    }
+
+    pthread_mutex_lock(&aq->lock);
+    aq->lanes = lanes;
+    aq->sync_n = n;
+    aq->nonblock = true;
+    pthread_mutex_unlock(&aq->lock);
+    return 0;
+
+fail:
+    while (i-- != 0)
+        drmu_crtc_unref(&lanes[i].dc);
+    free(lanes);
+    return -EINVAL;
+}
+
+int
+drmu_queue_release_fence_set(drmu_queue_t * const aq, drmu_crtc_t * const dc)
+{
+    if (dc == NULL || aq->sync_n != 0 || aq->fence_crtc != NULL ||
+        aq->discard_last || aq->lock_on_commit)
+        return -EINVAL;
+
+    pthread_mutex_lock(&aq->lock);
+    aq->fence_crtc = drmu_crtc_ref(dc);
+    aq->nonblock = true;
+    pthread_mutex_unlock(&aq->lock);
+    return 0;
+}
+
 void
 drmu_queue_lock_on_commit_set(drmu_queue_t * const aq, const bool lock)
 {
+    if (lock && aq->fence_crtc != NULL) {
+        drmu_err(aq->du, "[%d]: Lock on commit can't be used with release fences", aq->qno);
+        return;
+    }
     aq->lock_on_commit = lock;
 }
 
@@ -525,7 +2080,7 @@ drmu_queue_unlock(drmu_queue_t * const aq)
     pthread_mutex_lock(&aq->lock);
     if (aq->locked) {
         aq->locked = false;
-        wants_prod = true;
+        wants_prod = queue_prod_claim(aq);
 
         if (aq->discard_last) {
             da = aq->last_flip;
@@ -547,3 +2102,42 @@ drmu_env_queue_wait(drmu_env_t * const du)
     return drmu_queue_wait(drmu_env_queue_default(du));
 }
 
+uint64_t
+drmu_queue_hist_bucket_us(const unsigned int n)
+{
+    if (n < 4)
+        return n;
+    return (uint64_t)(4 + (n & 3)) << (n / 4 - 1);
+}
+
+void
+drmu_queue_stats_get(drmu_queue_t * const aq, drmu_queue_stats_t * const stats)
+{
+    queue_stats_t * const qs = &aq->stats;
+
+    stats->depth_max = atomic_load_explicit(&qs->depth_max, memory_order_relaxed);
+    stats->commits = atomic_load_explicit(&qs->commits, memory_order_relaxed);
+    stats->merges = atomic_load_explicit(&qs->merges, memory_order_relaxed);
+    stats->drops = atomic_load_explicit(&qs->drops, memory_order_relaxed);
+    stats->replaces = atomic_load_explicit(&qs->replaces, memory_order_relaxed);
+    stats->busy_retries = atomic_load_explicit(&qs->busy_retries, memory_order_relaxed);
+    stats->missed_vblanks = atomic_load_explicit(&qs->missed_vblanks, memory_order_relaxed);
+    hist_get(&stats->queue_to_commit, &qs->queue_to_commit);
+    hist_get(&stats->commit_ioctl, &qs->commit_ioctl);
+}
+
+void
+drmu_queue_stats_reset(drmu_queue_t * const aq)
+{
+    queue_stats_t * const qs = &aq->stats;
+
+    atomic_store_explicit(&qs->depth_max, 0, memory_order_relaxed);
+    atomic_store_explicit(&qs->commits, 0, memory_order_relaxed);
+    atomic_store_explicit(&qs->merges, 0, memory_order_relaxed);
+    atomic_store_explicit(&qs->drops, 0, memory_order_relaxed);
+    atomic_store_explicit(&qs->replaces, 0, memory_order_relaxed);
+    atomic_store_explicit(&qs->busy_retries, 0, memory_order_relaxed);
+    atomic_store_explicit(&qs->missed_vblanks, 0, memory_order_relaxed);
+    hist_reset(&qs->queue_to_commit);
+    hist_reset(&qs->commit_ioctl);
+}
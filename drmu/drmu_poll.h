@@ -2,6 +2,7 @@
 #define _DRMU_DRMU_POLL_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -9,6 +10,7 @@ extern "C" {
 
 struct drmu_env_s;
 struct drmu_atomic_s;
+struct drmu_crtc_s;
 
 struct drmu_queue_s;
 typedef struct drmu_queue_s drmu_queue_t;
@@ -38,6 +40,12 @@ typedef enum drmu_queue_merge_e {
 // If there is a pending commit this atomic will be merged with it
 // Commits are done with the PAGE_FLIP flag set so we expect the ack
 // on the next page flip.
+// Submission goes through a lock-free ring and the merge policy is applied
+// on the Q thread so this doesn't wait for the Q or allocate unless the
+// ring is full (or the atomic has other refs and so must be copied).
+// As the merge happens later an error from it (e.g. -ENOMEM) can't be
+// returned by the call that Qed the atomic; it is returned by the next
+// _queue or _queue_at call instead. The failed atomic is dropped.
 int drmu_queue_queue_tagged(drmu_queue_t * const aq,
                             const unsigned int tag, const drmu_queue_merge_t qmerge,
                             struct drmu_atomic_s ** ppda);
@@ -47,6 +55,21 @@ drmu_queue_queue(drmu_queue_t * const aq, struct drmu_atomic_s ** const ppda)
     return drmu_queue_queue_tagged(aq, 0, DRMU_QUEUE_MERGE_MERGE, ppda);
 }
 
+// Q the atomic to be displayed at target_ns (CLOCK_MONOTONIC)
+//
+// Timed atomics are held in target order until the vblank nearest their
+// target is the next one a commit could make. Then the newest due atomic is
+// passed to the Q as above with any older ones that are also due merged
+// under it (qmerge MERGE) or dropped (DROP or REPLACE). QUEUE atomics are
+// never merged and get a flip each. Targets in the past are due
+// immediately.
+// Vblank times are only known in nonblock mode, otherwise an atomic is
+// simply held until its target time.
+// _queue_wait also waits for timed atomics to be committed.
+int drmu_queue_queue_at(drmu_queue_t * const aq,
+                        const uint64_t target_ns, const drmu_queue_merge_t qmerge,
+                        struct drmu_atomic_s ** ppda);
+
 // Default Q
 drmu_queue_t * drmu_env_queue_default(struct drmu_env_s * const du);
 
@@ -65,6 +88,78 @@ int drmu_env_queue_wait(struct drmu_env_s * const du);
 // Default queue keep_last state is true
 void drmu_queue_keep_last_set(drmu_queue_t * const aq, const bool keep_last);
 
+// Commit with NONBLOCK | PAGE_FLIP_EVENT and wait for the flip event on the
+// DRM fd rather than blocking in the commit. Commit callbacks are run when
+// the flip event arrives.
+// Events are only expected on a single CRTC so use a Q per output.
+// Default is false. Set before use.
+void drmu_queue_nonblock_set(drmu_queue_t * const aq, const bool nonblock);
+
+// Hold commits back until just before the predicted next vblank so that
+// later updates can be merged into them. Vblank times are learnt from flip
+// events so this implies nonblock.
+// Default is false.
+void drmu_queue_late_latch_set(drmu_queue_t * const aq, const bool late_latch);
+
+// Commit updates for several CRTCs (e.g. the panels of a video wall) together
+// so they all show the same frame. Atomics are queued with tag = index of
+// their CRTC in dcs and each commit merges the oldest waiting atomic for
+// every CRTC into a single atomic commit. Nothing is committed until every
+// CRTC has an atomic waiting so every frame must have an atomic for each
+// CRTC (ACTIVE on its own will do if nothing else changes). A partial set
+// stays waiting (_queue_wait doesn't wait for it). The next commit waits for flip
+// events from all of them (so is paced by the slowest) but each CRTC's
+// callbacks are run and its old buffers released as soon as its own event
+// arrives. With late latch the commit is timed to make the earliest of
+// their next vblanks.
+// Implies nonblock. Timed (_queue_at) atomics are not supported.
+// Up to 16 CRTCs, each only once (-EINVAL otherwise). Set before use.
+int drmu_queue_sync_crtcs_set(drmu_queue_t * const aq, struct drmu_crtc_s * const * const dcs, const unsigned int n);
+
+// Take a release fence (CRTC OUT_FENCE_PTR) with every commit and release
+// the fbs it replaces as soon as the commit is done rather than when its
+// flip event arrives. Each fb carries the fence (drmu_fb_release_fence_*)
+// and pools wait for it before reusing the fb so a pool can be a buffer
+// smaller. All planes on the Q must be on dc.
+// Implies nonblock. Not for use with synced CRTCs, keep_last false or lock
+// on commit: -EINVAL if they are already set and they can't be set after.
+// Set before use.
+int drmu_queue_release_fence_set(drmu_queue_t * const aq, struct drmu_crtc_s * const dc);
+
+// Queue statistics
+// Always gathered. Counters are updated without locks so a snapshot may be
+// very slightly inconsistent between fields.
+
+// Log-linear histogram of times in us: 4 linear buckets per power of 2.
+// Bucket n covers [drmu_queue_hist_bucket_us(n), drmu_queue_hist_bucket_us(n+1))
+// The last bucket also holds everything above it
+#define DRMU_QUEUE_HIST_BUCKETS 64
+typedef struct drmu_queue_hist_s {
+    uint64_t count;
+    uint64_t sum_us;
+    uint64_t max_us;
+    uint32_t buckets[DRMU_QUEUE_HIST_BUCKETS];
+} drmu_queue_hist_t;
+
+// Lowest time (us) that goes in bucket n
+uint64_t drmu_queue_hist_bucket_us(const unsigned int n);
+
+typedef struct drmu_queue_stats_s {
+    unsigned int depth_max;      // High water mark of atomics waiting on the Q
+    uint64_t commits;            // Successful commits
+    uint64_t merges;             // Atomics merged into a waiting one
+    uint64_t drops;              // Atomics dropped (DROP)
+    uint64_t replaces;           // Waiting atomics replaced (REPLACE)
+    uint64_t busy_retries;       // Commits retried after -EBUSY
+    uint64_t missed_vblanks;     // Flips later than predicted (nonblock only)
+    drmu_queue_hist_t queue_to_commit; // Time from _queue to commit start
+    drmu_queue_hist_t commit_ioctl;    // Commit ioctl time (blocking commits
+                                       // include the wait for the flip)
+} drmu_queue_stats_t;
+
+void drmu_queue_stats_get(drmu_queue_t * const aq, drmu_queue_stats_t * const stats);
+void drmu_queue_stats_reset(drmu_queue_t * const aq);
+
 // Set a lock on this queue after a successful commit, next commit will not
 // proceed until _queue_unlock is called.
 // If _keep_last_set is false it also postpones the atomic unref until the
@@ -1,37 +1,88 @@
 #include "drmu_pool.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 
 #include "drmu.h"
+#include "drmu_fmts.h"
 #include "drmu_log.h"
 
+// Max time to wait for a free fb's release fence. It should signal on the
+// next vblank so if it hasn't by now something is stuck.
+#define RELEASE_FENCE_TIMEOUT_MS 1000
+
+// Free fbs are bucketed by size class of their area - 4 classes per power
+// of 2. Lookup checks the request's class & the one above (allocations may
+// be padded) or, with best fit, every class up to the largest free fb.
+#define SIZE_CLASS_SLACK    1
+
 //----------------------------------------------------------------------------
 //
 // Pool fns
 
+// Every fb allocated by the pool owns a slot until it is freed
 typedef struct drmu_fb_slot_s {
     struct drmu_fb_s * fb;
-    struct drmu_fb_slot_s * next;
+    struct drmu_pool_s * pool;
+    struct drmu_fb_slot_s * next;    // Free LRU list (or unused list)
     struct drmu_fb_slot_s * prev;
+    struct drmu_fb_slot_s * b_next;  // Bucket LRU list
+    struct drmu_fb_slot_s * b_prev;
+    struct fb_bucket_s * bucket;
+    struct drmu_fb_slot_s * r_next;  // Returned stack
+    bool spare;                      // Counted in pool->spare_free
 } drmu_fb_slot_t;
 
+// Free fbs of the same format, modifier & size class
+typedef struct fb_bucket_s {
+    uint32_t format;
+    unsigned int size_class;
+    uint64_t modifier;
+    drmu_fb_slot_t * head;           // LRU @ head
+    drmu_fb_slot_t * tail;
+    struct fb_bucket_s * chain;      // Hash chain (or unused list)
+} fb_bucket_t;
+
 typedef struct drmu_fb_list_s {
     drmu_fb_slot_t * head;      // Double linked list of free FBs; LRU @ head
     drmu_fb_slot_t * tail;
     drmu_fb_slot_t * unused;    // Single linked list of unused slots
+
+    // There can't be more non-empty buckets than free fbs
+    fb_bucket_t ** hash;        // [hash_mask + 1]
+    unsigned int hash_mask;
+    fb_bucket_t * buckets;      // [fb_max]
+    fb_bucket_t * unused_buckets;
+    unsigned int size_class_max;  // Largest class ever added
 } drmu_fb_list_t;
 
 struct drmu_pool_s {
     atomic_int ref_count;       // 0 == 1 ref for ease of init
-    bool dead;                  // Pool killed - never alloc again
+    atomic_bool dead;           // Pool killed - never alloc again
+    bool best_fit;              // Reuse larger fbs rather than alloc
 
     unsigned int fb_count;      // FBs allocated (not free count)
     unsigned int fb_max;        // Max FBs to allocate
+    size_t bytes_total;         // Bytes in all fbs allocated
+    size_t bytes_free;          // Bytes in free fbs
+    size_t bytes_max;           // Budget for bytes_total; 0 == unlimited
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
 
     struct drmu_env_s * du;     // Logging only - not reffed
 
@@ -42,16 +93,127 @@ struct drmu_pool_s {
 
     drmu_fb_list_t free_fbs;    // Free FB list header
     drmu_fb_slot_t * slots;     // [fb_max]
+
+    // FBs given back to the pool but not yet on the free list. Pushed
+    // (lock free) by whichever thread drops the last ref, drained in one go
+    // with the lock held.
+    _Atomic(drmu_fb_slot_t *) returned;
+
+    // Spare allocator thread - all protected by lock
+    unsigned int spare_n;       // Spare fbs to keep; 0 == thread idle
+    bool spare_running;         // Thread exists
+    bool spare_stop;
+    bool spare_kick;            // Geometry requested since thread last ran
+    uint32_t spare_w;           // Geometry of the last fb_new
+    uint32_t spare_h;
+    uint32_t spare_format;
+    uint64_t spare_mod;
+    unsigned int spare_free;    // Free fbs that fit the spare geometry
+    pthread_cond_t spare_cond;
+    pthread_t spare_thread;
+
+    // Memory pressure thread
+    int psi_fd;                 // -1 if no thread
+    int psi_stop_fd;
+    pthread_t psi_thread;
 };
 
+static unsigned int
+size_class(const uint64_t area)
+{
+    unsigned int msb = 2;
+
+    if (area < 4)
+        return (unsigned int)area;
+    while ((area >> (msb + 1)) != 0)
+        ++msb;
+    return (msb - 1) * 4 + (unsigned int)((area >> (msb - 2)) & 3);
+}
+
+static fb_bucket_t **
+fb_bucket_hash_head(const drmu_fb_list_t * const fbl, const uint32_t format, const uint64_t mod,
+                    const unsigned int sc)
+{
+    uint64_t h = (((uint64_t)format << 32) | sc) ^ (mod * 0x9e3779b97f4a7c15ULL);
+    h *= 0xff51afd7ed558ccdULL;
+    return fbl->hash + ((unsigned int)(h >> 32) & fbl->hash_mask);
+}
+
+// Returns NULL if not found (and not created)
+static fb_bucket_t *
+fb_bucket_find(drmu_fb_list_t * const fbl, const uint32_t format, const uint64_t mod,
+               const unsigned int sc, const bool create)
+{
+    fb_bucket_t ** const pp = fb_bucket_hash_head(fbl, format, mod, sc);
+    fb_bucket_t * b;
+
+    for (b = *pp; b != NULL; b = b->chain) {
+        if (b->format == format && b->modifier == mod && b->size_class == sc)
+            return b;
+    }
+    if (!create)
+        return NULL;
+
+    b = fbl->unused_buckets;
+    assert(b != NULL);
+    fbl->unused_buckets = b->chain;
+    *b = (fb_bucket_t){.format = format, .size_class = sc, .modifier = mod, .chain = *pp};
+    *pp = b;
+    return b;
+}
+
 static void
-fb_list_add_tail(drmu_fb_list_t * const fbl, drmu_fb_t * const dfb)
+fb_bucket_release(drmu_fb_list_t * const fbl, fb_bucket_t * const b)
 {
-    drmu_fb_slot_t * const slot = fbl->unused;
+    fb_bucket_t ** pp = fb_bucket_hash_head(fbl, b->format, b->modifier, b->size_class);
+
+    while (*pp != b)
+        pp = &(*pp)->chain;
+    *pp = b->chain;
+    b->chain = fbl->unused_buckets;
+    fbl->unused_buckets = b;
+}
+
+static int
+fb_list_init(drmu_fb_list_t * const fbl, drmu_fb_slot_t * const slots, const unsigned int n)
+{
+    unsigned int hash_size = 8;
+    unsigned int i;
+
+    while (hash_size < n * 2)
+        hash_size *= 2;
+
+    if ((fbl->hash = calloc(hash_size, sizeof(*fbl->hash))) == NULL)
+        return -ENOMEM;
+    if ((fbl->buckets = calloc(n, sizeof(*fbl->buckets))) == NULL) {
+        free(fbl->hash);
+        return -ENOMEM;
+    }
+    fbl->hash_mask = hash_size - 1;
+
+    for (i = 1; i < n; ++i) {
+        slots[i - 1].next = slots + i;
+        fbl->buckets[i - 1].chain = fbl->buckets + i;
+    }
+    fbl->unused = n == 0 ? NULL : slots + 0;
+    fbl->unused_buckets = n == 0 ? NULL : fbl->buckets + 0;
+    return 0;
+}
+
+static void
+fb_list_uninit(drmu_fb_list_t * const fbl)
+{
+    free(fbl->hash);
+    free(fbl->buckets);
+}
+
+static void
+fb_list_add_tail(drmu_fb_list_t * const fbl, drmu_fb_slot_t * const slot)
+{
+    drmu_fb_t * const dfb = slot->fb;
+    fb_bucket_t * b;
+    unsigned int sc;
 
-    assert(slot != NULL);
-    fbl->unused = slot->next;
-    slot->fb = dfb;
     slot->next = NULL;
 
     if (fbl->tail == NULL)
@@ -60,12 +222,25 @@ fb_list_add_tail(drmu_fb_list_t * const fbl, drmu_fb_t * const dfb)
         fbl->tail->next = slot;
     slot->prev = fbl->tail;
     fbl->tail = slot;
+
+    sc = size_class((uint64_t)drmu_fb_width(dfb) * drmu_fb_height(dfb));
+    if (sc > fbl->size_class_max)
+        fbl->size_class_max = sc;
+    b = fb_bucket_find(fbl, drmu_fb_pixel_format(dfb), drmu_fb_modifier(dfb, 0), sc, true);
+    slot->bucket = b;
+    slot->b_next = NULL;
+    if (b->tail == NULL)
+        b->head = slot;
+    else
+        b->tail->b_next = slot;
+    slot->b_prev = b->tail;
+    b->tail = slot;
 }
 
 static drmu_fb_t *
 fb_list_extract(drmu_fb_list_t * const fbl, drmu_fb_slot_t * const slot)
 {
-    drmu_fb_t * dfb;
+    fb_bucket_t * b;
 
     if (slot == NULL)
         return NULL;
@@ -80,27 +255,432 @@ fb_list_extract(drmu_fb_list_t * const fbl, drmu_fb_slot_t * const slot)
     else
         slot->next->prev = slot->prev;
 
-    dfb = slot->fb;
-    slot->fb = NULL;
-    slot->next = fbl->unused;
+    b = slot->bucket;
+    if (slot->b_prev == NULL)
+        b->head = slot->b_next;
+    else
+        slot->b_prev->b_next = slot->b_next;
+
+    if (slot->b_next == NULL)
+        b->tail = slot->b_prev;
+    else
+        slot->b_next->b_prev = slot->b_prev;
+
+    if (b->head == NULL)
+        fb_bucket_release(fbl, b);
+
+    slot->next = NULL;
     slot->prev = NULL;
-    fbl->unused = slot;
+    slot->b_next = NULL;
+    slot->b_prev = NULL;
+    slot->bucket = NULL;
+    return slot->fb;
+}
+
+// Could dfb be reused for w x h? Unlike try_reuse_fn this leaves the fb
+// alone so is safe to use on fbs that are just being counted.
+static bool
+pool_fb_fits(const drmu_pool_t * const pool, const drmu_fb_t * const dfb,
+             uint32_t w, uint32_t h, const uint32_t format, const uint64_t mod)
+{
+    return pool->callback_fns.fits_fn != NULL ?
+        pool->callback_fns.fits_fn(dfb, w, h, format, mod) :
+        drmu_fb_fits(dfb, w, h, format, mod);
+}
+
+// Find a reusable fb in the bucket. Returns one whose release fence has
+// signalled if there is one, otherwise NULL with the first that is still
+// on screen noted in *pbusy (if not already set).
+static drmu_fb_slot_t *
+fb_bucket_fit(const drmu_pool_t * const pool, const fb_bucket_t * const b,
+              uint32_t w, uint32_t h, const uint32_t format, const uint64_t mod,
+              drmu_fb_slot_t ** const pbusy)
+{
+    drmu_fb_slot_t * slot;
+
+    if (b == NULL)
+        return NULL;
+
+    // Only reset the geometry of the fb we actually return
+    for (slot = b->head; slot != NULL; slot = slot->b_next) {
+        if (!pool_fb_fits(pool, slot->fb, w, h, format, mod))
+            continue;
+        if (drmu_fb_release_fence_wait(slot->fb, 0) == 0) {
+            if (*pbusy == NULL)
+                *pbusy = slot;
+        }
+        else if (pool->callback_fns.try_reuse_fn(slot->fb, w, h, format, mod)) {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+// Give a newly allocated fb a slot. fb_count must already include it.
+// Lock must be held.
+static drmu_fb_slot_t *
+pool_slot_new(drmu_pool_t * const pool, drmu_fb_t * const dfb)
+{
+    drmu_fb_slot_t * const slot = pool->free_fbs.unused;
+
+    // fb_count <= fb_max so there is always a slot
+    assert(slot != NULL);
+    pool->free_fbs.unused = slot->next;
+    slot->fb = dfb;
+    slot->next = NULL;
+    pool->bytes_total += drmu_fb_size(dfb);
+    return slot;
+}
+
+// FB leaving the pool for good - release its slot & return it for unref.
+// Lock must be held.
+static drmu_fb_t *
+pool_fb_forget(drmu_pool_t * const pool, drmu_fb_slot_t * const slot)
+{
+    drmu_fb_t * const dfb = slot->fb;
+
+    --pool->fb_count;
+    pool->bytes_total -= drmu_fb_size(dfb);
+    slot->fb = NULL;
+    slot->next = pool->free_fbs.unused;
+    pool->free_fbs.unused = slot;
     return dfb;
 }
 
+// Does the fb fit the geometry the spare thread is keeping spares for
+static bool
+pool_fb_is_spare(const drmu_pool_t * const pool, const drmu_fb_t * const dfb)
+{
+    return pool->spare_n != 0 &&
+        pool_fb_fits(pool, dfb, pool->spare_w, pool->spare_h, pool->spare_format, pool->spare_mod);
+}
+
+// Free list add & extract with byte & spare accounting. Lock must be held.
+static void
+pool_free_add(drmu_pool_t * const pool, drmu_fb_slot_t * const slot)
+{
+    pool->bytes_free += drmu_fb_size(slot->fb);
+    if ((slot->spare = pool_fb_is_spare(pool, slot->fb)))
+        ++pool->spare_free;
+    fb_list_add_tail(&pool->free_fbs, slot);
+}
+
 static drmu_fb_t *
-fb_list_extract_head(drmu_fb_list_t * const fbl)
+pool_free_extract(drmu_pool_t * const pool, drmu_fb_slot_t * const slot)
+{
+    drmu_fb_t * const dfb = fb_list_extract(&pool->free_fbs, slot);
+
+    if (dfb != NULL) {
+        pool->bytes_free -= drmu_fb_size(dfb);
+        if (slot->spare)
+            --pool->spare_free;
+        slot->spare = false;
+    }
+    return dfb;
+}
+
+// Recount spare_free after the spare geometry or spare_n has changed
+// Lock must be held.
+static void
+pool_spare_recount(drmu_pool_t * const pool)
+{
+    drmu_fb_slot_t * slot;
+
+    pool->spare_free = 0;
+    for (slot = pool->free_fbs.head; slot != NULL; slot = slot->next) {
+        if ((slot->spare = pool_fb_is_spare(pool, slot->fb)))
+            ++pool->spare_free;
+    }
+}
+
+// Any thread, no lock
+static void
+pool_returned_push(drmu_pool_t * const pool, drmu_fb_slot_t * const slot)
+{
+    drmu_fb_slot_t * head = atomic_load(&pool->returned);
+
+    do {
+        slot->r_next = head;
+    } while (!atomic_compare_exchange_weak(&pool->returned, &head, slot));
+}
+
+// Would allocating another fb of size bytes break the count or byte limit
+static bool
+pool_over(const drmu_pool_t * const pool, const size_t size)
+{
+    return pool->fb_count >= pool->fb_max ||
+        (pool->bytes_max != 0 && pool->bytes_total + size > pool->bytes_max);
+}
+
+// Free LRU free fbs until no more than bytes_free_max are held in free fbs
+// and the pool is within its byte budget (if any).
+// Lock must be held; it is dropped whilst fbs are freed.
+// Returns bytes freed
+static size_t
+pool_trim(drmu_pool_t * const pool, const size_t bytes_free_max)
+{
+    size_t freed = 0;
+    drmu_fb_slot_t * slot;
+
+    while ((pool->bytes_free > bytes_free_max ||
+            (pool->bytes_max != 0 && pool->bytes_total > pool->bytes_max)) &&
+           (slot = pool->free_fbs.head) != NULL) {
+        drmu_fb_t * dfb;
+
+        pool_free_extract(pool, slot);
+        dfb = pool_fb_forget(pool, slot);
+        ++pool->evictions;
+        freed += drmu_fb_size(dfb);
+        pthread_mutex_unlock(&pool->lock);
+        drmu_fb_unref(&dfb);
+        pthread_mutex_lock(&pool->lock);
+    }
+    return freed;
+}
+
+// Move everything returned onto the free list. The whole stack is taken at
+// once so there is no ABA problem. Lock must be held.
+// This is the cost of the lock-free return: the free list insert (& any
+// trim) now happens here, inside fb_new, rather than on the unref.
+static void
+pool_returned_drain(drmu_pool_t * const pool)
+{
+    drmu_fb_slot_t * slot = atomic_exchange(&pool->returned, NULL);
+    drmu_fb_slot_t * prev = NULL;
+
+    if (slot == NULL)
+        return;
+
+    // Stack is newest first - reverse so LRU order is kept
+    while (slot != NULL) {
+        drmu_fb_slot_t * const next = slot->r_next;
+        slot->r_next = prev;
+        prev = slot;
+        slot = next;
+    }
+    for (slot = prev; slot != NULL; slot = slot->r_next)
+        pool_free_add(pool, slot);
+
+    // May have allocated over budget whilst everything was in use
+    if (pool->bytes_max != 0)
+        pool_trim(pool, SIZE_MAX);
+}
+
+// Count free fbs that could be used for w x h. Lock must be held.
+static unsigned int
+pool_spare_count(drmu_pool_t * const pool, uint32_t w, uint32_t h, const uint32_t format, const uint64_t mod)
+{
+    const unsigned int sc = size_class((uint64_t)w * h);
+    const unsigned int sc_last = pool->best_fit ? pool->free_fbs.size_class_max : sc + SIZE_CLASS_SLACK;
+    unsigned int n = 0;
+    unsigned int i;
+
+    for (i = sc; i <= sc_last; ++i) {
+        const fb_bucket_t * const b = fb_bucket_find(&pool->free_fbs, format, mod, i, false);
+        const drmu_fb_slot_t * slot;
+
+        for (slot = b == NULL ? NULL : b->head; slot != NULL; slot = slot->b_next)
+            n += pool_fb_fits(pool, slot->fb, w, h, format, mod);
+    }
+    return n;
+}
+
+// Wake the spare thread if the geometry has changed or fewer than spare_n
+// usable fbs are left free. Only a geometry change walks the free list.
+// Lock must be held.
+static void
+pool_spare_kick(drmu_pool_t * const pool, uint32_t w, uint32_t h, const uint32_t format, const uint64_t mod)
+{
+    const bool geo_changed = w != pool->spare_w || h != pool->spare_h ||
+        format != pool->spare_format || mod != pool->spare_mod;
+
+    if (pool->spare_n == 0 ||
+        (!geo_changed && (pool->spare_kick || pool->spare_free >= pool->spare_n)))
+        return;
+
+    if (geo_changed) {
+        pool->spare_w = w;
+        pool->spare_h = h;
+        pool->spare_format = format;
+        pool->spare_mod = mod;
+        pool_spare_recount(pool);
+    }
+    pool->spare_kick = true;
+    pthread_cond_signal(&pool->spare_cond);
+}
+
+// Extract the LRU free fb that can't be used for w x h & isn't still on
+// screen. Lock must be held.
+static drmu_fb_slot_t *
+pool_extract_unfit(drmu_pool_t * const pool, uint32_t w, uint32_t h, const uint32_t format, const uint64_t mod)
 {
-    return fb_list_extract(fbl, fbl->head);
+    drmu_fb_slot_t * slot;
+
+    for (slot = pool->free_fbs.head; slot != NULL; slot = slot->next) {
+        if (!pool_fb_fits(pool, slot->fb, w, h, format, mod) &&
+            drmu_fb_release_fence_wait(slot->fb, 0) != 0) {
+            pool_free_extract(pool, slot);
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+// Allocate until there are n free fbs usable for w x h. If the pool is
+// full or over budget then unusable free fbs are freed to make room.
+// Returns number of fbs allocated or -ve error
+static int
+pool_prealloc(drmu_pool_t * const pool, const unsigned int n,
+              uint32_t w, uint32_t h, const uint32_t format, const uint64_t mod)
+{
+    const size_t size_est = drmu_fmt_info_frame_size(drmu_fmt_info_find_fmt(format), w, h);
+    int made = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    pool_returned_drain(pool);
+    while (!pool->dead && pool_spare_count(pool, w, h, format, mod) < n) {
+        drmu_fb_t * dfb = NULL;
+
+        if (pool_over(pool, size_est)) {
+            drmu_fb_slot_t * const slot = pool_extract_unfit(pool, w, h, format, mod);
+
+            if (slot == NULL)
+                break;
+            dfb = pool_fb_forget(pool, slot);
+            ++pool->evictions;
+            pthread_mutex_unlock(&pool->lock);
+            drmu_fb_unref(&dfb);
+            pthread_mutex_lock(&pool->lock);
+            continue;
+        }
+        ++pool->fb_count;
+        pthread_mutex_unlock(&pool->lock);
+
+        dfb = pool->callback_fns.alloc_fn(pool->callback_v, w, h, format, mod);
+
+        pthread_mutex_lock(&pool->lock);
+        if (dfb == NULL || pool->dead) {
+            --pool->fb_count;
+            pthread_mutex_unlock(&pool->lock);
+            if (dfb == NULL) {
+                drmu_err(pool->du, "%s: Failed to alloc %dx%d %s", __func__, w, h, drmu_log_fourcc(format));
+                return -ENOMEM;
+            }
+            drmu_fb_unref(&dfb);
+            return made;
+        }
+        pool_free_add(pool, pool_slot_new(pool, dfb));
+        ++made;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return made;
+}
+
+static void *
+pool_spare_thread(void * v)
+{
+    drmu_pool_t * const pool = v;
+
+    // Low priority - on Linux this only affects the calling thread
+    setpriority(PRIO_PROCESS, 0, 19);
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->spare_stop) {
+        unsigned int n;
+        uint32_t w, h, format;
+        uint64_t mod;
+
+        if (!pool->spare_kick || pool->spare_n == 0) {
+            pthread_cond_wait(&pool->spare_cond, &pool->lock);
+            continue;
+        }
+        pool->spare_kick = false;
+        n = pool->spare_n;
+        w = pool->spare_w;
+        h = pool->spare_h;
+        format = pool->spare_format;
+        mod = pool->spare_mod;
+        pthread_mutex_unlock(&pool->lock);
+
+        pool_prealloc(pool, n, w, h, format, mod);
+
+        pthread_mutex_lock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static void
+pool_spare_thread_stop(drmu_pool_t * const pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    if (!pool->spare_running) {
+        pthread_mutex_unlock(&pool->lock);
+        return;
+    }
+    pool->spare_stop = true;
+    pthread_cond_signal(&pool->spare_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    pthread_join(pool->spare_thread, NULL);
+    pool->spare_running = false;
+}
+
+static void *
+pool_psi_thread(void * v)
+{
+    drmu_pool_t * const pool = v;
+    struct pollfd pfds[2] = {
+        {.fd = pool->psi_fd, .events = POLLPRI},
+        {.fd = pool->psi_stop_fd, .events = POLLIN},
+    };
+
+    for (;;) {
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if ((pfds[1].revents | (pfds[0].revents & (POLLERR | POLLNVAL))) != 0)
+            break;
+        if ((pfds[0].revents & POLLPRI) != 0) {
+            size_t freed;
+
+            pthread_mutex_lock(&pool->lock);
+            pool_returned_drain(pool);
+            freed = pool_trim(pool, 0);
+            pthread_mutex_unlock(&pool->lock);
+            drmu_debug(pool->du, "%s: Memory pressure: freed %zu bytes", __func__, freed);
+        }
+    }
+    return NULL;
+}
+
+static void
+pool_psi_thread_stop(drmu_pool_t * const pool)
+{
+    if (pool->psi_fd == -1)
+        return;
+
+    eventfd_write(pool->psi_stop_fd, 1);
+    pthread_join(pool->psi_thread, NULL);
+    close(pool->psi_fd);
+    close(pool->psi_stop_fd);
+    pool->psi_fd = -1;
+    pool->psi_stop_fd = -1;
 }
 
 static void
 pool_free_pool(drmu_pool_t * const pool)
 {
-    drmu_fb_t * dfb;
+    drmu_fb_slot_t * slot;
     pthread_mutex_lock(&pool->lock);
-    while ((dfb = fb_list_extract_head(&pool->free_fbs)) != NULL) {
-        --pool->fb_count;
+    pool_returned_drain(pool);
+    while ((slot = pool->free_fbs.head) != NULL) {
+        drmu_fb_t * dfb;
+
+        pool_free_extract(pool, slot);
+        dfb = pool_fb_forget(pool, slot);
         pthread_mutex_unlock(&pool->lock);
         drmu_fb_unref(&dfb);
         pthread_mutex_lock(&pool->lock);
@@ -113,8 +693,12 @@ pool_free(drmu_pool_t * const pool)
 {
     void *const v = pool->callback_v;
     const drmu_pool_on_delete_fn on_delete_fn = pool->callback_fns.on_delete_fn;
+    pool_psi_thread_stop(pool);
+    pool_spare_thread_stop(pool);
     pool_free_pool(pool);
+    fb_list_uninit(&pool->free_fbs);
     free(pool->slots);
+    pthread_cond_destroy(&pool->spare_cond);
     pthread_mutex_destroy(&pool->lock);
     free(pool);
 
@@ -151,26 +735,31 @@ drmu_pool_new_alloc(drmu_env_t * const du, const unsigned int total_fbs_max,
                     void * const v)
 {
     drmu_pool_t * const pool = calloc(1, sizeof(*pool));
-    unsigned int i;
 
     if (pool == NULL)
         goto fail0;
     if ((pool->slots = calloc(total_fbs_max, sizeof(*pool->slots))) == NULL)
         goto fail1;
+    if (fb_list_init(&pool->free_fbs, pool->slots, total_fbs_max) != 0)
+        goto fail2;
+    for (unsigned int i = 0; i != total_fbs_max; ++i)
+        pool->slots[i].pool = pool;
 
     pool->du = du;
+    pool->best_fit = true;
     pool->fb_max = total_fbs_max;
     pool->callback_fns = *cb_fns;
     pool->callback_v = v;
-
-    for (i = 1; i != total_fbs_max; ++i)
-        pool->slots[i - 1].next = pool->slots + i;
-    pool->free_fbs.unused = pool->slots + 0;
+    pool->psi_fd = -1;
+    pool->psi_stop_fd = -1;
 
     pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->spare_cond, NULL);
 
     return pool;
 
+fail2:
+    free(pool->slots);
 fail1:
     free(pool);
 fail0:
@@ -179,27 +768,27 @@ fail0:
     return NULL;
 }
 
+// Runs on whatever thread drops the last ref (often the commit thread) so
+// must not take the pool lock
 static int
 pool_fb_pre_delete_cb(drmu_fb_t * dfb, void * v)
 {
-    drmu_pool_t * pool = v;
+    drmu_fb_slot_t * const slot = v;
+    drmu_pool_t * pool = slot->pool;
 
     // Ensure we cannot end up in a delete loop
     drmu_fb_pre_delete_unset(dfb);
 
     // If dead set then might as well delete now
     // It should all work without this shortcut but this reclaims
-    // storage quicker
-    if (pool->dead) {
+    // storage quicker. The slot is simply abandoned.
+    if (atomic_load(&pool->dead)) {
         drmu_pool_unref(&pool);
         return 0;
     }
 
     drmu_fb_ref(dfb);  // Restore ref
-
-    pthread_mutex_lock(&pool->lock);
-    fb_list_add_tail(&pool->free_fbs, dfb);
-    pthread_mutex_unlock(&pool->lock);
+    pool_returned_push(pool, slot);
 
     // May cause suicide & recursion on fb delete, but that should be OK as
     // the 1 we return here should cause simple exit of fb delete
@@ -211,7 +800,15 @@ drmu_fb_t *
 drmu_pool_fb_new(drmu_pool_t * const pool, uint32_t w, uint32_t h, const uint32_t format, const uint64_t mod)
 {
     drmu_fb_t * dfb;
-    drmu_fb_slot_t * slot;
+    drmu_fb_slot_t * slot = NULL;
+    drmu_fb_slot_t * busy_slot = NULL;
+    const unsigned int sc = size_class((uint64_t)w * h);
+    unsigned int sc_last;
+    unsigned int i;
+    size_t size_est;
+    // Peek before locking so the usual nothing returned case skips the
+    // drain. A miss looks again before allocating.
+    bool returned = atomic_load(&pool->returned) != NULL;
 
     pthread_mutex_lock(&pool->lock);
 
@@ -219,38 +816,82 @@ drmu_pool_fb_new(drmu_pool_t * const pool, uint32_t w, uint32_t h, const uint32_
     if (pool->dead)
         goto fail_unlock;
 
-    slot = pool->free_fbs.head;
-    while (slot != NULL) {
-        dfb = slot->fb;
-        if (pool->callback_fns.try_reuse_fn(dfb, w, h, format, mod)) {
-            fb_list_extract(&pool->free_fbs, slot);
-            pthread_mutex_unlock(&pool->lock);
-            goto found;
-        }
-        slot = slot->next;
+    if (returned)
+        pool_returned_drain(pool);
+
+retry:
+    // Smallest class that fits first. FBs may come back whilst still on
+    // screen with a release fence - prefer one that is actually free.
+    sc_last = pool->best_fit ? pool->free_fbs.size_class_max : sc + SIZE_CLASS_SLACK;
+    for (i = sc; slot == NULL && i <= sc_last; ++i)
+        slot = fb_bucket_fit(pool, fb_bucket_find(&pool->free_fbs, format, mod, i, false),
+                             w, h, format, mod, &busy_slot);
+    if (slot != NULL) {
+        dfb = pool_free_extract(pool, slot);
+        ++pool->hits;
+        pool_spare_kick(pool, w, h, format, mod);
+        pthread_mutex_unlock(&pool->lock);
+        goto found;
     }
-    // Nothing reusable
-    dfb = NULL;
 
-    // Simply allocate new buffers until we hit fb_max then free LRU
-    // first. If nothing to free then fail.
-    if (pool->fb_count++ >= pool->fb_max) {
-        --pool->fb_count;
-        if ((dfb = fb_list_extract_head(&pool->free_fbs)) == NULL)
+    // Waiting for the next vblank beats allocating another fb
+    if (busy_slot != NULL && pool->callback_fns.try_reuse_fn(busy_slot->fb, w, h, format, mod)) {
+        int rv;
+
+        slot = busy_slot;
+        dfb = pool_free_extract(pool, slot);
+        ++pool->hits;
+        pool_spare_kick(pool, w, h, format, mod);
+        pthread_mutex_unlock(&pool->lock);
+
+        if ((rv = drmu_fb_release_fence_wait(dfb, RELEASE_FENCE_TIMEOUT_MS)) <= 0)
+            drmu_warn(pool->du, "%s: Release fence wait failed: %s", __func__, rv == 0 ? "timeout" : strerror(-rv));
+        // Use it anyway - no point in holding on to a stuck fence
+        drmu_fb_release_fence_set(dfb, NULL);
+        goto found;
+    }
+
+    // Nothing reusable - check once more for returns before allocating
+    if (!returned && atomic_load(&pool->returned) != NULL) {
+        returned = true;
+        pool_returned_drain(pool);
+        goto retry;
+    }
+    ++pool->misses;
+    pool_spare_kick(pool, w, h, format, mod);
+
+    // Simply allocate new buffers until we hit fb_max or the byte budget
+    // then free LRU first. If nothing to free then fail if at fb_max; the
+    // byte budget only limits what is kept free.
+    size_est = drmu_fmt_info_frame_size(drmu_fmt_info_find_fmt(format), w, h);
+    while (pool_over(pool, size_est) && (slot = pool->free_fbs.head) != NULL) {
+        pool_free_extract(pool, slot);
+        dfb = pool_fb_forget(pool, slot);
+        ++pool->evictions;
+        pthread_mutex_unlock(&pool->lock);
+        drmu_fb_unref(&dfb);  // Will free the dfb as pre-delete CB will be unset
+        pthread_mutex_lock(&pool->lock);
+        if (pool->dead)
             goto fail_unlock;
     }
+    if (pool->fb_count >= pool->fb_max)
+        goto fail_unlock;
+    ++pool->fb_count;
     pthread_mutex_unlock(&pool->lock);
 
-    drmu_fb_unref(&dfb);  // Will free the dfb as pre-delete CB will be unset
+    dfb = pool->callback_fns.alloc_fn(pool->callback_v, w, h, format, mod);
 
-    if ((dfb = pool->callback_fns.alloc_fn(pool->callback_v, w, h, format, mod)) == NULL) {
-        pthread_mutex_lock(&pool->lock);
+    pthread_mutex_lock(&pool->lock);
+    if (dfb == NULL) {
         --pool->fb_count;
         goto fail_unlock;
     }
+    slot = pool_slot_new(pool, dfb);
+    pthread_mutex_unlock(&pool->lock);
 
 found:
-    drmu_fb_pre_delete_set(dfb, pool_fb_pre_delete_cb, drmu_pool_ref(pool));
+    drmu_pool_ref(pool);
+    drmu_fb_pre_delete_set(dfb, pool_fb_pre_delete_cb, slot);
     return dfb;
 
 fail_unlock:
@@ -258,6 +899,124 @@ fail_unlock:
     return NULL;
 }
 
+void
+drmu_pool_best_fit_set(drmu_pool_t * const pool, const bool best_fit)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->best_fit = best_fit;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+int
+drmu_pool_prealloc(drmu_pool_t * const pool, const unsigned int n,
+                   uint32_t w, uint32_t h, const uint32_t format, const uint64_t mod)
+{
+    const int rv = pool_prealloc(pool, n, w, h, format, mod);
+    return rv < 0 ? rv : 0;
+}
+
+int
+drmu_pool_spares_set(drmu_pool_t * const pool, const unsigned int n)
+{
+    int rv = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->dead) {
+        rv = -EINVAL;
+    }
+    else if (n != 0 && !pool->spare_running) {
+        pool->spare_stop = false;
+        if ((rv = -pthread_create(&pool->spare_thread, NULL, pool_spare_thread, pool)) == 0)
+            pool->spare_running = true;
+        else
+            drmu_err(pool->du, "%s: Failed to create thread: %s", __func__, strerror(-rv));
+    }
+    if (rv == 0) {
+        pool->spare_n = n;
+        pool_spare_recount(pool);
+        // Top up straight away if we have seen an fb_new
+        pool->spare_kick = pool->spare_w != 0;
+        pthread_cond_signal(&pool->spare_cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return rv;
+}
+
+void
+drmu_pool_bytes_max_set(drmu_pool_t * const pool, const size_t bytes_max)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->bytes_max = bytes_max;
+    pool_returned_drain(pool);
+    pool_trim(pool, SIZE_MAX);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+size_t
+drmu_pool_trim(drmu_pool_t * const pool, const size_t bytes_free_max)
+{
+    size_t freed;
+
+    pthread_mutex_lock(&pool->lock);
+    pool_returned_drain(pool);
+    freed = pool_trim(pool, bytes_free_max);
+    pthread_mutex_unlock(&pool->lock);
+    return freed;
+}
+
+int
+drmu_pool_pressure_trim_set(drmu_pool_t * const pool, const unsigned int stall_us, const unsigned int window_us)
+{
+    char trigger[64];
+    int rv;
+
+    if (pool->psi_fd != -1)
+        return -EBUSY;
+
+    if ((pool->psi_fd = open("/proc/pressure/memory", O_RDWR | O_NONBLOCK | O_CLOEXEC)) == -1) {
+        rv = -errno;
+        drmu_warn(pool->du, "%s: Failed to open PSI: %s", __func__, strerror(-rv));
+        return rv;
+    }
+    snprintf(trigger, sizeof(trigger), "some %u %u", stall_us, window_us);
+    if (write(pool->psi_fd, trigger, strlen(trigger) + 1) < 0) {
+        rv = -errno;
+        drmu_warn(pool->du, "%s: Failed to set PSI trigger '%s': %s", __func__, trigger, strerror(-rv));
+        goto fail;
+    }
+    if ((pool->psi_stop_fd = eventfd(0, EFD_CLOEXEC)) == -1) {
+        rv = -errno;
+        goto fail;
+    }
+    if ((rv = -pthread_create(&pool->psi_thread, NULL, pool_psi_thread, pool)) != 0)
+        goto fail;
+    return 0;
+
+fail:
+    if (pool->psi_stop_fd != -1)
+        close(pool->psi_stop_fd);
+    close(pool->psi_fd);
+    pool->psi_fd = -1;
+    pool->psi_stop_fd = -1;
+    return rv;
+}
+
+void
+drmu_pool_stats_get(drmu_pool_t * const pool, drmu_pool_stats_t * const stats)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool_returned_drain(pool);
+    *stats = (drmu_pool_stats_t){
+        .fbs_allocated = pool->fb_count,
+        .bytes_allocated = pool->bytes_total,
+        .bytes_free = pool->bytes_free,
+        .hits = pool->hits,
+        .misses = pool->misses,
+        .evictions = pool->evictions,
+    };
+    pthread_mutex_unlock(&pool->lock);
+}
+
 // Mark pool as dead (i.e. no new allocs) and unref it
 // Simple unref will also work but this reclaims storage faster
 // Actual pool structure will persist until all referencing fbs are deleted too
@@ -271,6 +1030,8 @@ drmu_pool_kill(drmu_pool_t ** const pppool)
     *pppool = NULL;
 
     pool->dead = true;
+    pool_psi_thread_stop(pool);
+    pool_spare_thread_stop(pool);
     pool_free_pool(pool);
 
     drmu_pool_unref(&pool);
@@ -300,6 +1061,7 @@ drmu_pool_new_dumb(drmu_env_t * const du, unsigned int total_fbs_max)
         .alloc_fn = pool_dumb_alloc_cb,
         .on_delete_fn = pool_dumb_on_delete_cb,
         .try_reuse_fn = drmu_fb_try_reuse,
+        .fits_fn = drmu_fb_fits,
     };
     return drmu_pool_new_alloc(du, total_fbs_max, &fns, drmu_env_ref(du));
 }
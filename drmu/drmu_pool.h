@@ -2,6 +2,7 @@
 #define _DRMU_DRMU_POOL_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -24,11 +25,14 @@ typedef struct drmu_fb_s * (* drmu_pool_alloc_fn)(void * const v, const uint32_t
 // cb called when pool deleted or on new_pool failure - takes the same v as alloc
 typedef void (* drmu_pool_on_delete_fn)(void * const v);
 typedef bool (* drmu_pool_try_reuse_fn)(struct drmu_fb_s * dfb, uint32_t w, uint32_t h, const uint32_t format, const uint64_t mod);
+// cb to check whether try_reuse_fn would succeed without changing the fb
+typedef bool (* drmu_pool_fits_fn)(const struct drmu_fb_s * dfb, uint32_t w, uint32_t h, const uint32_t format, const uint64_t mod);
 
 typedef struct drmu_pool_callback_fns_s {
     drmu_pool_alloc_fn alloc_fn;
     drmu_pool_on_delete_fn on_delete_fn;
     drmu_pool_try_reuse_fn try_reuse_fn;
+    drmu_pool_fits_fn fits_fn;  // Optional; NULL => drmu_fb_fits
 } drmu_pool_callback_fns_t;
 
 // Create a new pool with custom alloc & pool delete
@@ -49,10 +53,74 @@ void drmu_pool_kill(drmu_pool_t ** const pppool);
 drmu_pool_t * drmu_pool_new_dumb(struct drmu_env_s * const du, unsigned int total_fbs_max);
 
 // Allocate a fb from the pool
-// Allocations need not be all of the same size but no guarantees are made about
-// efficient memory use if this is the case
+// Free fbs are kept in buckets by format, modifier & size class (area in 1/4
+// powers of 2) so lookup doesn't depend on how many are free. If nothing
+// reusable is free a new fb is allocated, freeing the LRU fb first if the
+// pool is full.
+// Dropping the last ref on a pool fb returns it to the pool without taking
+// any lock (so is safe on a commit thread); it is moved onto the free list
+// by the next call here.
+// FBs returned to the pool with a release fence (see
+// drmu_fb_release_fence_set) are only reused once it has signalled; if
+// nothing else is free this waits for the fence.
 struct drmu_fb_s * drmu_pool_fb_new(drmu_pool_t * const pool, uint32_t w, uint32_t h, const uint32_t format, const uint64_t mod);
 
+// Best fit: if there is no free fb of the requested size reuse the smallest
+// larger one (with active & crop set to the requested size) rather than
+// allocating. Good for streams whose resolution changes often (e.g.
+// adaptive bitrate). If false only fbs of the requested size class (or the
+// one above to allow for padding) are reused which keeps memory use down
+// after a resolution drop.
+// Default true.
+void drmu_pool_best_fit_set(drmu_pool_t * const pool, const bool best_fit);
+
+// Allocate fbs until the pool has n free fbs that can be used for a w x h
+// request so the first frames after start or a resolution change don't pay
+// for allocation. Stops early if the pool is full & nothing unusable can be
+// freed to make room.
+// Returns 0 or -ve error if allocation failed.
+int drmu_pool_prealloc(drmu_pool_t * const pool, const unsigned int n,
+                       uint32_t w, uint32_t h, const uint32_t format, const uint64_t mod);
+
+// Keep n spare fbs of the geometry last asked for by drmu_pool_fb_new
+// allocated on a low priority background thread (as drmu_pool_prealloc).
+// The thread is created on the first non-zero call & lives as long as the
+// pool; 0 stops it allocating. The pool's alloc_fn must be thread safe.
+// Returns 0 or -ve error if the thread could not be created.
+int drmu_pool_spares_set(drmu_pool_t * const pool, const unsigned int n);
+
+// Byte budget for all fbs allocated by the pool (in use & free), as
+// counted by drmu_fb_size. LRU free fbs are freed to stay within it. If
+// everything is in use allocation still succeeds (up to total_fbs_max).
+// Returned fbs are only counted as free & the budget only re-applied when
+// something drains them (fb_new, prealloc, trim, stats, this or the
+// spare & pressure threads), so an idle pool keeps the excess until then.
+// 0 == no limit (default)
+void drmu_pool_bytes_max_set(drmu_pool_t * const pool, const size_t bytes_max);
+
+// Free LRU free fbs until no more than bytes_free_max bytes are held free.
+// 0 frees everything not in use.
+// Returns bytes freed
+size_t drmu_pool_trim(drmu_pool_t * const pool, const size_t bytes_free_max);
+
+// Watch Linux PSI (/proc/pressure/memory) & drop all free fbs whenever
+// memory stalls for more than stall_us in any window_us. The kernel
+// limits window_us to 500ms..10s (& unprivileged users to multiples of 2s).
+// Call at most once per pool.
+// Returns 0 or -ve error (e.g. -ENOENT if the kernel lacks PSI)
+int drmu_pool_pressure_trim_set(drmu_pool_t * const pool, const unsigned int stall_us, const unsigned int window_us);
+
+typedef struct drmu_pool_stats_s {
+    unsigned int fbs_allocated;  // In use + free
+    size_t bytes_allocated;      // In use + free
+    size_t bytes_free;
+    uint64_t hits;               // fb_new satisfied from free fbs
+    uint64_t misses;             // fb_new that had to allocate
+    uint64_t evictions;          // Free fbs freed to make room or by trim
+} drmu_pool_stats_t;
+
+void drmu_pool_stats_get(drmu_pool_t * const pool, drmu_pool_stats_t * const stats);
+
 #ifdef __cplusplus
 }
 #endif
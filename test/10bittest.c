@@ -874,6 +874,7 @@ int main(int argc, char *argv[])
     const char * drm_device = DRM_MODULE;
     const char * conn_name = NULL;
     drmu_mode_simple_params_t mp = {0};
+    struct drm_mode_modeinfo mi;
     drmu_colorspace_t colorspace = DRMU_COLORSPACE_BT2020_RGB;
     drmu_color_encoding_t encoding = DRMU_COLOR_ENCODING_BT2020;
     drmu_color_range_t range = NULL;
@@ -1207,7 +1208,8 @@ int main(int argc, char *argv[])
             int mode = drmu_output_mode_pick_simple(dout, drmu_mode_pick_simple_preferred_cb, NULL);
             mp = drmu_conn_mode_simple_params(dn, mode);
             printf("No current mode using preferred; %s\n", drmu_util_simple_mode(&mp));
-            drmu_atomic_crtc_add_modeinfo(da, dc, drmu_conn_modeinfo(dn, mode));
+            if (drmu_conn_modeinfo_get(dn, mode, &mi) == 0)
+                drmu_atomic_crtc_add_modeinfo(da, dc, &mi);
         }
         else {
             printf("Mode %s\n", drmu_util_simple_mode(&mp));
@@ -1239,7 +1241,8 @@ int main(int argc, char *argv[])
                 goto fail;
             }
 
-            drmu_atomic_crtc_add_modeinfo(da, dc, drmu_conn_modeinfo(dn, mode));
+            if (drmu_conn_modeinfo_get(dn, mode, &mi) == 0)
+                drmu_atomic_crtc_add_modeinfo(da, dc, &mi);
         }
         else {
             fprintf(stderr, "No mode that matches request found\n");
@@ -0,0 +1,181 @@
+// Microbenchmark for atomic allocation
+//
+// Builds, merges & frees atomics in the same pattern as a video plane
+// update (plus an overlay update) going through drmu_queue and counts heap
+// calls once the env's allocation cache has warmed up. malloc & friends are
+// wrapped at link time so this only sees calls made from a statically
+// linked drmu.
+// The env is opened on a real vc4 device (props are made up and
+// never committed); if there isn't one the bench is skipped.
+//
+// Usage: atomic_alloc_bench [<frames>]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "drmu.h"
+#include "drmu_log.h"
+
+#define DRM_MODULE "vc4"
+
+// Made up object ids - props are never committed
+#define VIDEO_PLANE_ID 0x40
+#define OVERLAY_PLANE_ID 0x41
+#define CRTC_ID 0x60
+#define CONN_ID 0x70
+
+static unsigned long heap_calls = 0;
+
+void * __real_malloc(size_t size);
+void * __real_calloc(size_t nmemb, size_t size);
+void * __real_realloc(void * ptr, size_t size);
+void __real_free(void * ptr);
+
+void *
+__wrap_malloc(size_t size)
+{
+    ++heap_calls;
+    return __real_malloc(size);
+}
+
+void *
+__wrap_calloc(size_t nmemb, size_t size)
+{
+    ++heap_calls;
+    return __real_calloc(nmemb, size);
+}
+
+void *
+__wrap_realloc(void * ptr, size_t size)
+{
+    ++heap_calls;
+    return __real_realloc(ptr, size);
+}
+
+void
+__wrap_free(void * ptr)
+{
+    if (ptr != NULL)
+        ++heap_calls;
+    __real_free(ptr);
+}
+
+static void
+drmu_log_stderr_cb(void * v, enum drmu_log_level_e level, const char * fmt, va_list vl)
+{
+    char buf[256];
+    int n = vsnprintf(buf, 255, fmt, vl);
+
+    (void)v;
+    (void)level;
+
+    if (n >= 255)
+        n = 255;
+    buf[n] = '\n';
+    fwrite(buf, n + 1, 1, stderr);
+}
+
+static uint64_t
+time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+frame_done_cb(void * v)
+{
+    ++*(unsigned int *)v;
+}
+
+// One frame: video & overlay updates merged on the Q, committed & then
+// merged into the Q's record of what is on screen
+static int
+do_frame(drmu_env_t * const du, drmu_atomic_t ** const pplast, const unsigned int n, unsigned int * const done)
+{
+    drmu_atomic_t * pending = NULL;
+    drmu_atomic_t * da;
+    uint32_t i;
+
+    if ((da = drmu_atomic_new(du)) == NULL)
+        return -1;
+    for (i = 1; i <= 10; ++i)
+        drmu_atomic_add_prop_value(da, VIDEO_PLANE_ID, i, n + i);
+    drmu_atomic_add_prop_value(da, CRTC_ID, 1, 1);
+    drmu_atomic_add_prop_value(da, CRTC_ID, 2, n);
+    drmu_atomic_add_prop_value(da, CONN_ID, 1, CRTC_ID);
+    drmu_atomic_add_commit_callback(da, frame_done_cb, done);
+    drmu_atomic_move_merge(&pending, &da);
+
+    if ((da = drmu_atomic_new(du)) == NULL)
+        return -1;
+    for (i = 1; i <= 4; ++i)
+        drmu_atomic_add_prop_value(da, OVERLAY_PLANE_ID, i, n + i);
+    drmu_atomic_move_merge(&pending, &da);
+
+    drmu_atomic_run_commit_callbacks(pending);
+    drmu_atomic_clear_commit_callbacks(pending);
+    return drmu_atomic_move_merge(pplast, &pending);
+}
+
+int
+main(int argc, char *argv[])
+{
+    const unsigned int frames = argc > 1 ? (unsigned int)atoi(argv[1]) : 100000;
+    const unsigned int warm = frames / 2 < 256 ? 256 : frames / 2;
+    const drmu_log_env_t log = {
+        .fn = drmu_log_stderr_cb,
+        .v = NULL,
+        .max_level = DRMU_LOG_LEVEL_ERROR
+    };
+    drmu_env_t * du = NULL;
+    drmu_atomic_t * last = NULL;
+    unsigned int done = 0;
+    unsigned int i;
+    unsigned long warm_calls;
+    unsigned long steady_calls;
+    uint64_t t0, t1;
+    int rv = 1;
+
+    if (frames <= warm) {
+        fprintf(stderr, "Usage: %s [<frames (> 512)>]\n", argv[0]);
+        return 1;
+    }
+
+    // The env needs a real device even though nothing is ever committed
+    if ((du = drmu_env_new_open(DRM_MODULE, &log)) == NULL) {
+        printf("No %s device - skipping\n", DRM_MODULE);
+        return 0;
+    }
+
+    for (i = 0; i != warm; ++i) {
+        if (do_frame(du, &last, i, &done) != 0)
+            goto fail;
+    }
+    warm_calls = heap_calls;
+
+    t0 = time_ns();
+    for (; i != frames; ++i) {
+        if (do_frame(du, &last, i, &done) != 0)
+            goto fail;
+    }
+    t1 = time_ns();
+    steady_calls = heap_calls - warm_calls;
+
+    if (warm_calls == 0) {
+        fprintf(stderr, "No heap calls seen at all - is drmu linked dynamically?\n");
+        goto fail;
+    }
+
+    printf("%u frames: %.1fns/frame, %lu heap calls in steady state (%.3f/frame)\n",
+           frames - warm, (double)(t1 - t0) / (double)(frames - warm),
+           steady_calls, (double)steady_calls / (double)(frames - warm));
+    rv = steady_calls != 0 || done != frames;
+
+fail:
+    drmu_atomic_unref(&last);
+    drmu_env_unref(&du);
+    return rv;
+}
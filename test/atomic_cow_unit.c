@@ -0,0 +1,126 @@
+// Checks that atomics that share props arrays (copy, merge of a multiply
+// reffed atomic) don't see each other's changes and that prop refs balance.
+// No env is needed as nothing is committed.
+
+#include <stdio.h>
+
+#include "drmu.h"
+
+static int prop_refs = 0;
+
+static void
+count_ref(void * v)
+{
+    (void)v;
+    ++prop_refs;
+}
+
+static void
+count_unref(void * v)
+{
+    (void)v;
+    --prop_refs;
+}
+
+static const drmu_atomic_prop_fns_t count_fns = {
+    .ref = count_ref,
+    .unref = count_unref,
+    .commit = drmu_prop_fn_null_commit,
+};
+
+static int
+add(drmu_atomic_t * const da, const uint32_t obj, const uint32_t prop, const uint64_t val)
+{
+    return drmu_atomic_add_prop_generic(da, obj, prop, val, &count_fns, NULL);
+}
+
+// Value of obj/prop in da, ~0 if not present
+static uint64_t
+get(const drmu_atomic_t * const da, const uint32_t obj, const uint32_t prop)
+{
+    drmu_atomic_prep_t * ap = drmu_atomic_prep_new_atomic(da);
+    const int slot = ap == NULL ? -1 : drmu_atomic_prep_slot_find(ap, obj, prop);
+    const uint64_t val = slot < 0 ? ~(uint64_t)0 : drmu_atomic_prep_get(ap, slot);
+
+    drmu_atomic_prep_delete(&ap);
+    return val;
+}
+
+#define CHECK(x) do {\
+    if (!(x)) {\
+        fprintf(stderr, "%s:%d: Check failed: %s\n", __FILE__, __LINE__, #x);\
+        ++fails;\
+    }\
+} while (0)
+
+int
+main(int argc, char *argv[])
+{
+    drmu_atomic_t * a = drmu_atomic_new(NULL);
+    drmu_atomic_t * b = NULL;
+    drmu_atomic_t * c = NULL;
+    drmu_atomic_t * d = NULL;
+    uint32_t i;
+    int fails = 0;
+    (void)argc;
+    (void)argv;
+
+    // Out of order adds so the arrays start unsorted
+    for (i = 8; i != 0; --i) {
+        add(a, 1, i, 100 + i);
+        add(a, 2, i, 200 + i);
+    }
+
+    // Changes to a copy don't show in the original & vice versa
+    b = drmu_atomic_copy(a);
+    CHECK(b != NULL);
+    add(b, 1, 3, 1003);
+    add(b, 1, 9, 1009);
+    add(a, 2, 4, 2004);
+    CHECK(get(a, 1, 3) == 103);
+    CHECK(get(a, 1, 9) == ~(uint64_t)0);
+    CHECK(get(b, 1, 3) == 1003);
+    CHECK(get(b, 1, 9) == 1009);
+    CHECK(get(b, 2, 4) == 204);
+    CHECK(get(a, 2, 4) == 2004);
+
+    // Merge an update that is also held elsewhere so it must be shared
+    c = drmu_atomic_new(NULL);
+    add(c, 2, 1, 3001);
+    add(c, 3, 1, 3101);
+    d = drmu_atomic_ref(c);
+    CHECK(drmu_atomic_merge(b, &d) == 0);
+    CHECK(get(b, 2, 1) == 3001);
+    CHECK(get(b, 3, 1) == 3101);
+    CHECK(get(b, 2, 2) == 202);
+    add(c, 3, 1, 4101);
+    CHECK(get(b, 3, 1) == 3101);
+
+    // Merge a copy of a into a - every prop overridden by the same value
+    d = drmu_atomic_copy(a);
+    CHECK(drmu_atomic_merge(a, &d) == 0);
+    CHECK(get(a, 1, 5) == 105);
+    CHECK(get(a, 2, 4) == 2004);
+
+    // Sub from a copy leaves the original intact
+    d = drmu_atomic_copy(b);
+    drmu_atomic_sub(d, c);
+    CHECK(get(d, 2, 1) == ~(uint64_t)0);
+    CHECK(get(d, 3, 1) == ~(uint64_t)0);
+    CHECK(get(d, 2, 2) == 202);
+    CHECK(get(b, 2, 1) == 3001);
+    CHECK(get(b, 3, 1) == 3101);
+
+    drmu_atomic_unref(&a);
+    drmu_atomic_unref(&b);
+    drmu_atomic_unref(&c);
+    drmu_atomic_unref(&d);
+    CHECK(prop_refs == 0);
+
+    if (fails != 0) {
+        fprintf(stderr, "%d checks failed\n", fails);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,124 @@
+// Microbenchmark for atomic copy & merge
+//
+// Models 8 planes on 2 CRTCs (with a connector each) as the Q's record of
+// what is on screen and times merging updates that touch 1..8 planes into
+// it, as drmu_queue does after every commit. With shared props arrays the
+// cost should follow the number of planes changed rather than the size of
+// the screen state. Copy of the whole state is also timed.
+// No env is used so arrays come from the heap rather than the env cache.
+//
+// Usage: atomic_merge_bench [<iterations>]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "drmu.h"
+
+#define PLANES 8
+#define CRTCS 2
+#define PLANE_PROPS 12
+#define UPDATE_PROPS 10
+
+#define PLANE_ID(n) (0x40 + (n))
+#define CRTC_ID(n)  (0x60 + (n))
+#define CONN_ID(n)  (0x70 + (n))
+
+static uint64_t
+time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static drmu_atomic_t *
+screen_new(void)
+{
+    drmu_atomic_t * const da = drmu_atomic_new(NULL);
+    unsigned int i, j;
+
+    if (da == NULL)
+        return NULL;
+    for (i = 0; i != CRTCS; ++i) {
+        drmu_atomic_add_prop_value(da, CRTC_ID(i), 1, 1);
+        drmu_atomic_add_prop_value(da, CRTC_ID(i), 2, 0x1000 + i);
+        drmu_atomic_add_prop_value(da, CRTC_ID(i), 3, 0);
+        drmu_atomic_add_prop_value(da, CONN_ID(i), 1, CRTC_ID(i));
+        drmu_atomic_add_prop_value(da, CONN_ID(i), 2, 0);
+    }
+    for (i = 0; i != PLANES; ++i)
+        for (j = 1; j <= PLANE_PROPS; ++j)
+            drmu_atomic_add_prop_value(da, PLANE_ID(i), j, j);
+    return da;
+}
+
+// Update the first n planes
+static drmu_atomic_t *
+update_new(const unsigned int n, const unsigned int frame)
+{
+    drmu_atomic_t * const da = drmu_atomic_new(NULL);
+    unsigned int i, j;
+
+    if (da == NULL)
+        return NULL;
+    for (i = 0; i != n; ++i)
+        for (j = 1; j <= UPDATE_PROPS; ++j)
+            drmu_atomic_add_prop_value(da, PLANE_ID(i), j, frame + j);
+    return da;
+}
+
+// Time merging updates of n planes into last
+// If shared then the update has another ref (as if also held by its
+// creator) so cannot simply be moved
+static double
+time_merge(drmu_atomic_t * const last, const unsigned int n, const bool shared, const unsigned int iters)
+{
+    uint64_t t = 0;
+    unsigned int i;
+
+    for (i = 0; i != iters; ++i) {
+        drmu_atomic_t * upd = update_new(n, i);
+        drmu_atomic_t * hold = shared ? drmu_atomic_ref(upd) : NULL;
+        uint64_t t0 = time_ns();
+
+        drmu_atomic_merge(last, &upd);
+        t += time_ns() - t0;
+        drmu_atomic_unref(&hold);
+    }
+    return (double)t / iters;
+}
+
+int
+main(int argc, char *argv[])
+{
+    const unsigned int iters = argc > 1 ? (unsigned int)atoi(argv[1]) : 100000;
+    drmu_atomic_t * last = NULL;
+    unsigned int n;
+    uint64_t t0, t1;
+    unsigned int i;
+
+    if (iters == 0) {
+        fprintf(stderr, "Usage: %s [<iterations>]\n", argv[0]);
+        return 1;
+    }
+
+    if ((last = screen_new()) == NULL)
+        return 1;
+
+    t0 = time_ns();
+    for (i = 0; i != iters; ++i) {
+        drmu_atomic_t * c = drmu_atomic_copy(last);
+        drmu_atomic_unref(&c);
+    }
+    t1 = time_ns();
+    printf("Copy of %d objs: %.1fns\n", PLANES + CRTCS * 2, (double)(t1 - t0) / iters);
+
+    printf("Planes changed   merge (ns)   merge shared (ns)\n");
+    for (n = 1; n <= PLANES; n *= 2)
+        printf("%14u %12.1f %19.1f\n", n,
+               time_merge(last, n, false, iters), time_merge(last, n, true, iters));
+
+    drmu_atomic_unref(&last);
+    return 0;
+}
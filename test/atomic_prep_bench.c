@@ -0,0 +1,139 @@
+// Microbenchmark for prepared atomics
+//
+// Compares the per-frame CPU cost of a plane update built as a new
+// drmu_atomic_t each frame with the same update done through a
+// drmu_atomic_prep_t. The update clears a plane so no FBs are needed and
+// all commits are TEST_ONLY so nothing changes on screen.
+//
+// Usage: atomic_prep_bench [<frames>]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <libdrm/drm_mode.h>
+
+#include "drmu.h"
+#include "drmu_log.h"
+
+#define DRM_MODULE "vc4"
+
+static void
+drmu_log_stderr_cb(void * v, enum drmu_log_level_e level, const char * fmt, va_list vl)
+{
+    char buf[256];
+    int n = vsnprintf(buf, 255, fmt, vl);
+
+    (void)v;
+    (void)level;
+
+    if (n >= 255)
+        n = 255;
+    buf[n] = '\n';
+    fwrite(buf, n + 1, 1, stderr);
+}
+
+static uint64_t
+time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+frame_atomic(drmu_env_t * const du, drmu_plane_t * const dp, const bool commit)
+{
+    drmu_atomic_t * da = drmu_atomic_new(du);
+    int rv;
+
+    if (da == NULL)
+        return -1;
+    rv = drmu_atomic_plane_clear_add(da, dp);
+    if (rv == 0 && commit)
+        rv = drmu_atomic_commit(da, DRM_MODE_ATOMIC_TEST_ONLY);
+    drmu_atomic_unref(&da);
+    return rv;
+}
+
+static int
+frame_prep(drmu_atomic_prep_t * const ap, const bool commit)
+{
+    const unsigned int n = drmu_atomic_prep_slot_count(ap);
+    unsigned int i;
+
+    // Write every slot as a real frame would
+    for (i = 0; i != n; ++i)
+        drmu_atomic_prep_set(ap, i, 0);
+    return !commit ? 0 : drmu_atomic_prep_commit(ap, DRM_MODE_ATOMIC_TEST_ONLY);
+}
+
+int
+main(int argc, char *argv[])
+{
+    const unsigned int frames = argc > 1 ? (unsigned int)atoi(argv[1]) : 100000;
+    const drmu_log_env_t log = {
+        .fn = drmu_log_stderr_cb,
+        .v = NULL,
+        .max_level = DRMU_LOG_LEVEL_ERROR
+    };
+    drmu_env_t * du = NULL;
+    drmu_atomic_t * da = NULL;
+    drmu_atomic_prep_t * ap = NULL;
+    drmu_plane_t * dp;
+    uint64_t t0, t1, t2, t3, t4;
+    unsigned int i;
+    int rv = 1;
+
+    if (frames == 0) {
+        fprintf(stderr, "Usage: %s [<frames>]\n", argv[0]);
+        return 1;
+    }
+
+    if ((du = drmu_env_new_open(DRM_MODULE, &log)) == NULL)
+        return 1;
+
+    if ((dp = drmu_env_plane_find_n(du, 0)) == NULL) {
+        fprintf(stderr, "No planes found\n");
+        goto fail;
+    }
+
+    // Template the prepared atomic from the general one
+    if ((da = drmu_atomic_new(du)) == NULL ||
+        drmu_atomic_plane_clear_add(da, dp) != 0 ||
+        (ap = drmu_atomic_prep_new_atomic(da)) == NULL)
+        goto fail;
+    drmu_atomic_unref(&da);
+
+    if (frame_atomic(du, dp, true) != 0 || frame_prep(ap, true) != 0) {
+        fprintf(stderr, "Test commit failed\n");
+        goto fail;
+    }
+
+    t0 = time_ns();
+    for (i = 0; i != frames; ++i)
+        frame_atomic(du, dp, false);
+    t1 = time_ns();
+    for (i = 0; i != frames; ++i)
+        frame_prep(ap, false);
+    t2 = time_ns();
+    for (i = 0; i != frames; ++i)
+        frame_atomic(du, dp, true);
+    t3 = time_ns();
+    for (i = 0; i != frames; ++i)
+        frame_prep(ap, true);
+    t4 = time_ns();
+
+    printf("Plane %#x, %u props, %u frames\n", drmu_plane_id(dp), drmu_atomic_prep_slot_count(ap), frames);
+    printf("Build:  atomic %8.1fns/frame, prep %8.1fns/frame\n",
+           (double)(t1 - t0) / frames, (double)(t2 - t1) / frames);
+    printf("Commit: atomic %8.1fns/frame, prep %8.1fns/frame (TEST_ONLY)\n",
+           (double)(t3 - t2) / frames, (double)(t4 - t3) / frames);
+    rv = 0;
+
+fail:
+    drmu_atomic_unref(&da);
+    drmu_atomic_prep_delete(&ap);
+    drmu_env_unref(&du);
+    return rv;
+}
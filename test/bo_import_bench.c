@@ -0,0 +1,160 @@
+// Microbenchmark for FD BO import
+//
+// Creates N dumb buffers on one env, exports them as dmabufs and then has
+// M threads repeatedly import (& unref) all of them into a second env.
+// The second env holds a ref on every BO throughout so, as with a running
+// player, the imports are lookups of already known BOs.
+//
+// Usage: bo_import_bench [<N buffers> [<M threads> [<loops>]]]
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libdrm/drm_mode.h>
+
+#include "drmu.h"
+#include "drmu_log.h"
+
+#define DRM_MODULE "vc4"
+
+typedef struct bench_env_s {
+    drmu_env_t * du;
+    unsigned int n;
+    unsigned int loops;
+    const int * fds;
+    unsigned int fails;
+} bench_env_t;
+
+static void
+drmu_log_stderr_cb(void * v, enum drmu_log_level_e level, const char * fmt, va_list vl)
+{
+    char buf[256];
+    int n = vsnprintf(buf, 255, fmt, vl);
+
+    (void)v;
+    (void)level;
+
+    if (n >= 255)
+        n = 255;
+    buf[n] = '\n';
+    fwrite(buf, n + 1, 1, stderr);
+}
+
+static uint64_t
+time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *
+import_thread(void * v)
+{
+    bench_env_t * const be = v;
+    unsigned int i, j;
+
+    for (i = 0; i != be->loops; ++i) {
+        for (j = 0; j != be->n; ++j) {
+            drmu_bo_t * bo = drmu_bo_new_fd(be->du, be->fds[j]);
+            if (bo == NULL)
+                ++be->fails;
+            drmu_bo_unref(&bo);
+        }
+    }
+    return NULL;
+}
+
+int
+main(int argc, char *argv[])
+{
+    const unsigned int n = argc > 1 ? (unsigned int)atoi(argv[1]) : 256;
+    const unsigned int m = argc > 2 ? (unsigned int)atoi(argv[2]) : 4;
+    const unsigned int loops = argc > 3 ? (unsigned int)atoi(argv[3]) : 1000;
+    const drmu_log_env_t log = {
+        .fn = drmu_log_stderr_cb,
+        .v = NULL,
+        .max_level = DRMU_LOG_LEVEL_ERROR
+    };
+    drmu_env_t * du_src = NULL;
+    drmu_env_t * du = NULL;
+    drmu_bo_t ** src_bos = calloc(n, sizeof(*src_bos));
+    drmu_bo_t ** held_bos = calloc(n, sizeof(*held_bos));
+    int * fds = malloc(n * sizeof(*fds));
+    bench_env_t * bes = calloc(m, sizeof(*bes));
+    pthread_t * thds = calloc(m, sizeof(*thds));
+    unsigned int i;
+    unsigned int started;
+    unsigned int fails = 0;
+    uint64_t t0, t1;
+    int rv = 1;
+
+    for (i = 0; fds != NULL && i != n; ++i)
+        fds[i] = -1;
+
+    if (n == 0 || m == 0) {
+        fprintf(stderr, "Usage: %s [<N buffers> [<M threads> [<loops>]]]\n", argv[0]);
+        goto fail;
+    }
+    if (!src_bos || !held_bos || !fds || !bes || !thds) {
+        fprintf(stderr, "Out of memory\n");
+        goto fail;
+    }
+
+    // Separate envs (so separate DRM fds) for export & import so imported
+    // handles are not aliases of the dumb handles
+    if ((du_src = drmu_env_new_open(DRM_MODULE, &log)) == NULL ||
+        (du = drmu_env_new_open(DRM_MODULE, &log)) == NULL)
+        goto fail;
+
+    for (i = 0; i != n; ++i) {
+        struct drm_mode_create_dumb dumb = {.width = 64, .height = 64, .bpp = 32};
+        if ((src_bos[i] = drmu_bo_new_dumb(du_src, &dumb)) == NULL ||
+            (fds[i] = drmu_bo_export_fd(src_bos[i], 0)) < 0 ||
+            (held_bos[i] = drmu_bo_new_fd(du, fds[i])) == NULL) {
+            fprintf(stderr, "Failed to create buffer %u\n", i);
+            goto fail;
+        }
+    }
+
+    t0 = time_ns();
+    for (started = 0; started != m; ++started) {
+        bes[started] = (bench_env_t){.du = du, .n = n, .loops = loops, .fds = fds};
+        if (pthread_create(thds + started, NULL, import_thread, bes + started) != 0) {
+            fprintf(stderr, "Failed to create thread %u\n", started);
+            break;
+        }
+    }
+    for (i = 0; i != started; ++i) {
+        pthread_join(thds[i], NULL);
+        fails += bes[i].fails;
+    }
+    t1 = time_ns();
+    if (started != m)
+        goto fail;
+
+    printf("%u buffers, %u threads, %u loops: %u imports in %.3fms = %.1fns/import (%u fails)\n",
+           n, m, loops, n * m * loops, (double)(t1 - t0) / 1000000.0,
+           (double)(t1 - t0) / ((double)n * m * loops), fails);
+    rv = fails != 0;
+
+fail:
+    for (i = 0; i != n && src_bos && held_bos && fds; ++i) {
+        drmu_bo_unref(held_bos + i);
+        if (fds[i] >= 0)
+            close(fds[i]);
+        drmu_bo_unref(src_bos + i);
+    }
+    drmu_env_unref(&du);
+    drmu_env_unref(&du_src);
+    free(thds);
+    free(bes);
+    free(fds);
+    free(held_bos);
+    free(src_bos);
+    return rv;
+}
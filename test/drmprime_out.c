@@ -44,6 +44,7 @@
 #include "drmu_dmabuf.h"
 #include "drmu_fmts.h"
 #include "drmu_fourcc.h"
+#include "drmu_hotplug.h"
 #include "drmu_log.h"
 #include "drmu_output.h"
 #include "drmu_pool.h"
@@ -61,6 +62,8 @@
 struct drmprime_out_env_s {
     drmu_env_t * du;
     drmu_output_t * dout;
+    // Follows display power cycles & replugs
+    drmu_hotplug_t * hp;
 
     // Writeback stuff
     pthread_mutex_t lock;
@@ -106,6 +109,7 @@ void drmprime_out_delete(drmprime_out_env_t *dpo)
 
     drmu_writeback_env_finish(&dpo->wbe);
 
+    drmu_hotplug_delete(&dpo->hp);
     drmu_output_unref(&dpo->dout);
     drmu_env_kill(&dpo->du);
     pthread_mutex_destroy(&dpo->lock);
@@ -143,6 +147,9 @@ drmprime_out_env_t* drmprime_out_new()
 
     drmu_output_max_bpc_allow(dpo->dout, true);
 
+    if ((dpo->hp = drmu_hotplug_new(dpo->du)) == NULL)
+        fprintf(stderr, "Failed to start hotplug monitor\n");
+
     return dpo;
 
 fail:
@@ -176,6 +183,9 @@ drmprime_out_env_t* drmprime_out_new_fd(int fd)
 
     drmu_output_max_bpc_allow(dpo->dout, true);
 
+    if ((dpo->hp = drmu_hotplug_new(dpo->du)) == NULL)
+        fprintf(stderr, "Failed to start hotplug monitor\n");
+
     return dpo;
 
 fail:
@@ -658,6 +668,8 @@ drmprime_video_env_t* drmprime_video_new(drmprime_out_env_t * const dpo)
 
     if ((de->pic_pool = drmu_pool_new_dmabuf_video(de->du, 32)) == NULL)
         goto fail;
+    // Keep a couple of fbs ready so resolution changes don't stall decode
+    drmu_pool_spares_set(de->pic_pool, 2);
 
     // Plane allocation delayed till we have a format - not all planes are idempotent
 
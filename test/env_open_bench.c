@@ -0,0 +1,161 @@
+// Env startup benchmark
+//
+// Opens & closes an env repeatedly without the capability cache, then with
+// it cold (empty cache dir) & warm and reports the time & number of ioctls
+// per open. ioctl is wrapped at link time so this only sees calls made from
+// a statically linked drmu.
+//
+// Usage: env_open_bench [<module> [<opens>]]
+
+#include <dirent.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libdrm/drm.h>
+#include <libdrm/drm_mode.h>
+
+#include "drmu.h"
+#include "drmu_log.h"
+
+static unsigned long ioctl_calls = 0;
+static unsigned long ioctl_prop_calls = 0;
+
+int __real_ioctl(int fd, unsigned long req, ...);
+
+int
+__wrap_ioctl(int fd, unsigned long req, ...)
+{
+    va_list va;
+    void * arg;
+
+    va_start(va, req);
+    arg = va_arg(va, void *);
+    va_end(va);
+
+    ++ioctl_calls;
+    if (req == DRM_IOCTL_MODE_GETPROPERTY || req == DRM_IOCTL_MODE_GETPROPBLOB)
+        ++ioctl_prop_calls;
+    return __real_ioctl(fd, req, arg);
+}
+
+static void
+drmu_log_stderr_cb(void * v, enum drmu_log_level_e level, const char * fmt, va_list vl)
+{
+    char buf[256];
+    int n = vsnprintf(buf, 255, fmt, vl);
+
+    (void)v;
+    (void)level;
+
+    if (n >= 255)
+        n = 255;
+    buf[n] = '\n';
+    fwrite(buf, n + 1, 1, stderr);
+}
+
+static uint64_t
+time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+run(const char * const name, const char * const module, const unsigned int opens, const drmu_log_env_t * const log)
+{
+    const unsigned long calls0 = ioctl_calls;
+    const unsigned long prop_calls0 = ioctl_prop_calls;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t t0, t1;
+    unsigned int i;
+
+    t0 = time_ns();
+    for (i = 0; i != opens; ++i) {
+        drmu_env_t * du = drmu_env_new_open(module, log);
+        uint64_t h, m;
+
+        if (du == NULL)
+            return -1;
+        drmu_env_cap_cache_stats(du, &h, &m);
+        hits += h;
+        misses += m;
+        drmu_env_unref(&du);
+    }
+    t1 = time_ns();
+
+    printf("%-8s %u opens: %8.1fus/open, %7.1f ioctls/open (%.1f prop/blob), cache hits %"PRIu64" misses %"PRIu64"\n",
+           name, opens, (double)(t1 - t0) / 1000.0 / (double)opens,
+           (double)(ioctl_calls - calls0) / (double)opens,
+           (double)(ioctl_prop_calls - prop_calls0) / (double)opens,
+           hits, misses);
+    return 0;
+}
+
+static void
+dir_remove(const char * const path)
+{
+    DIR * const d = opendir(path);
+    const struct dirent * de;
+
+    if (d == NULL)
+        return;
+    while ((de = readdir(d)) != NULL) {
+        char fname[512];
+        if (de->d_name[0] == '.')
+            continue;
+        snprintf(fname, sizeof(fname), "%s/%s", path, de->d_name);
+        unlink(fname);
+    }
+    closedir(d);
+    rmdir(path);
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char * const module = argc > 1 ? argv[1] : "vc4";
+    const unsigned int opens = argc > 2 ? (unsigned int)atoi(argv[2]) : 20;
+    const drmu_log_env_t log = {
+        .fn = drmu_log_stderr_cb,
+        .v = NULL,
+        .max_level = DRMU_LOG_LEVEL_ERROR
+    };
+    char dir[] = "/tmp/drmu_capXXXXXX";
+    int rv = 1;
+
+    if (opens == 0) {
+        fprintf(stderr, "Usage: %s [<module> [<opens>]]\n", argv[0]);
+        return 1;
+    }
+
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    if (run("Uncached", module, opens, &log) != 0)
+        goto fail;
+    if (ioctl_calls == 0) {
+        fprintf(stderr, "No ioctls seen at all - is drmu linked dynamically?\n");
+        goto fail;
+    }
+
+    if (drmu_cap_cache_dir_set(dir) != 0)
+        goto fail;
+    if (run("Cold", module, 1, &log) != 0 ||
+        run("Warm", module, opens, &log) != 0)
+        goto fail;
+    rv = 0;
+
+fail:
+    drmu_cap_cache_dir_set(NULL);
+    dir_remove(dir);
+    return rv;
+}
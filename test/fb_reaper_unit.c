@@ -0,0 +1,245 @@
+// Checks that the fb reaper copes with an fb's on_delete dropping the last
+// env ref whilst other fbs are still queued behind it: every fb must still
+// be torn down & the env freed exactly once, after all of them. Run under
+// ASan to catch use of the env after it has gone. The env sits on one end
+// of a socketpair with ioctl wrapped at link time to play a minimal
+// device. Needs a statically linked drmu.
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libdrm/drm.h>
+#include <libdrm/drm_fourcc.h>
+#include <libdrm/drm_mode.h>
+
+#include "drmu.h"
+
+#define CRTC_ID     0x60
+#define CONN_ID     0x70
+#define PROP_MODE_ID 0x20
+#define PROP_ACTIVE  0x21
+#define FBS_N       8
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static bool gate_open = false;
+static unsigned int deleted = 0;
+static unsigned int env_frees = 0;
+static unsigned int deleted_at_env_free = 0;
+
+static void
+ids_copy(const __u64 ptr, __u32 * const pcount, const uint32_t * const ids, const unsigned int n)
+{
+    if (*pcount >= n && ptr != 0)
+        memcpy((void *)(uintptr_t)ptr, ids, n * sizeof(*ids));
+    *pcount = n;
+}
+
+static int
+fake_get_property(struct drm_mode_get_property * const p)
+{
+    static const uint64_t active_range[2] = {0, 1};
+
+    if (p->prop_id == PROP_MODE_ID) {
+        p->flags = DRM_MODE_PROP_ATOMIC | DRM_MODE_PROP_BLOB;
+        strcpy(p->name, "MODE_ID");
+        p->count_values = 0;
+    }
+    else if (p->prop_id == PROP_ACTIVE) {
+        p->flags = DRM_MODE_PROP_ATOMIC | DRM_MODE_PROP_RANGE;
+        strcpy(p->name, "ACTIVE");
+        if (p->count_values >= 2 && p->values_ptr != 0)
+            memcpy((void *)(uintptr_t)p->values_ptr, active_range, sizeof(active_range));
+        p->count_values = 2;
+    }
+    else {
+        errno = ENOENT;
+        return -1;
+    }
+    p->count_enum_blobs = 0;
+    return 0;
+}
+
+int
+__wrap_ioctl(int fd, unsigned long req, ...)
+{
+    va_list va;
+    void * arg;
+
+    va_start(va, req);
+    arg = va_arg(va, void *);
+    va_end(va);
+
+    switch (req) {
+        case DRM_IOCTL_SET_CLIENT_CAP:
+        case DRM_IOCTL_MODE_GETCRTC:
+        case DRM_IOCTL_MODE_ATOMIC:
+            return 0;
+        case DRM_IOCTL_MODE_GETRESOURCES:
+        {
+            static const uint32_t crtc_id = CRTC_ID;
+            static const uint32_t conn_id = CONN_ID;
+            struct drm_mode_card_res * const res = arg;
+            ids_copy(res->crtc_id_ptr, &res->count_crtcs, &crtc_id, 1);
+            ids_copy(res->connector_id_ptr, &res->count_connectors, &conn_id, 1);
+            res->count_encoders = 0;
+            res->count_fbs = 0;
+            return 0;
+        }
+        case DRM_IOCTL_MODE_GETCONNECTOR:
+        {
+            struct drm_mode_get_connector * const conn = arg;
+            conn->count_modes = 0;
+            conn->count_props = 0;
+            conn->count_encoders = 0;
+            conn->connector_type = DRM_MODE_CONNECTOR_VIRTUAL;
+            conn->connection = 2;  // Disconnected
+            return 0;
+        }
+        case DRM_IOCTL_MODE_GETPLANERESOURCES:
+            ((struct drm_mode_get_plane_res *)arg)->count_planes = 0;
+            return 0;
+        case DRM_IOCTL_MODE_OBJ_GETPROPERTIES:
+        {
+            static const uint32_t crtc_props[2] = {PROP_MODE_ID, PROP_ACTIVE};
+            struct drm_mode_obj_get_properties * const op = arg;
+            if (op->obj_type != DRM_MODE_OBJECT_CRTC) {
+                op->count_props = 0;
+                return 0;
+            }
+            if (op->count_props >= 2 && op->prop_values_ptr != 0)
+                memset((void *)(uintptr_t)op->prop_values_ptr, 0, 2 * sizeof(uint64_t));
+            ids_copy(op->props_ptr, &op->count_props, crtc_props, 2);
+            return 0;
+        }
+        case DRM_IOCTL_MODE_GETPROPERTY:
+            return fake_get_property(arg);
+        default:
+            break;
+    }
+    (void)fd;
+    errno = EINVAL;
+    return -1;
+}
+
+static void
+post_delete_cb(void * v, int fd)
+{
+    (void)v;
+    close(fd);
+    pthread_mutex_lock(&lock);
+    ++env_frees;
+    deleted_at_env_free = deleted;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+// 1st fb: hold the reaper until everything else has been queued
+static void
+gate_on_delete_cb(void * v)
+{
+    (void)v;
+    pthread_mutex_lock(&lock);
+    while (!gate_open)
+        pthread_cond_wait(&cond, &lock);
+    ++deleted;
+    pthread_mutex_unlock(&lock);
+}
+
+static void
+on_delete_cb(void * v)
+{
+    drmu_env_t ** const ppdu = v;
+
+    pthread_mutex_lock(&lock);
+    ++deleted;
+    pthread_mutex_unlock(&lock);
+    // Last fb queued is torn down first; it takes the env ref with it
+    if (ppdu != NULL)
+        drmu_env_unref(ppdu);
+}
+
+static drmu_fb_t *
+fb_make(drmu_env_t * const du, drmu_fb_on_delete_fn fn, void * v)
+{
+    drmu_fb_t * const dfb = drmu_fb_int_alloc(du);
+
+    if (dfb == NULL)
+        return NULL;
+    drmu_fb_int_fmt_size_set(dfb, DRM_FORMAT_XRGB8888, 64, 64, drmu_rect_wh(64, 64));
+    drmu_fb_int_on_delete_set(dfb, fn, v);
+    return dfb;
+}
+
+int
+main(int argc, char *argv[])
+{
+    drmu_env_t * du;
+    drmu_fb_t * fbs[FBS_N];
+    struct timespec ts;
+    int sv[2];
+    unsigned int i;
+    int rv = 0;
+    (void)argc;
+    (void)argv;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+        perror("socketpair");
+        return 1;
+    }
+
+    if ((du = drmu_env_new_fd2(sv[0], NULL, post_delete_cb, NULL)) == NULL) {
+        fprintf(stderr, "Failed to create env\n");
+        return 1;
+    }
+    if (drmu_env_fb_reaper_start(du) != 0) {
+        fprintf(stderr, "Failed to start reaper\n");
+        return 1;
+    }
+
+    fbs[0] = fb_make(du, gate_on_delete_cb, NULL);
+    for (i = 1; i != FBS_N; ++i)
+        fbs[i] = fb_make(du, on_delete_cb, i == FBS_N - 1 ? &du : NULL);
+    for (i = 0; i != FBS_N; ++i) {
+        if (fbs[i] == NULL) {
+            fprintf(stderr, "Failed to make fb %u\n", i);
+            return 1;
+        }
+    }
+
+    // Our env ref now belongs to the last fb's on_delete
+    for (i = 0; i != FBS_N; ++i)
+        drmu_fb_unref(fbs + i);
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += 5;
+    pthread_mutex_lock(&lock);
+    gate_open = true;
+    pthread_cond_broadcast(&cond);
+    while (env_frees == 0 && rv == 0)
+        rv = pthread_cond_timedwait(&cond, &lock, &ts);
+    pthread_mutex_unlock(&lock);
+
+    if (rv != 0) {
+        fprintf(stderr, "Env not freed\n");
+        return 1;
+    }
+    // Let the reaper thread exit so a sanitizer sees everything
+    usleep(20000);
+
+    if (env_frees != 1 || deleted_at_env_free != FBS_N) {
+        fprintf(stderr, "Env freed %u times with %u/%u fbs torn down\n", env_frees, deleted_at_env_free, FBS_N);
+        return 1;
+    }
+    close(sv[1]);
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,151 @@
+// Microbenchmark for pool reuse under resolution changes
+//
+// Models a decoder following an adaptive bitrate ladder: each frame takes
+// an fb from the pool at the current rung's size and holds it for a few
+// frames (DPB + display) before returning it. Every so often the stream
+// steps up or down the ladder. Counts how often the pool has to allocate
+// and times drmu_pool_fb_new, with & without best fit and with a byte
+// budget that only just holds the frames in use at the top rung.
+// FBs are never made real so no DRM device is needed.
+//
+// Usage: pool_bench [<frames>]
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <libdrm/drm_fourcc.h>
+
+#include "drmu.h"
+#include "drmu_pool.h"
+
+#define POOL_MAX 12
+#define HELD 8
+#define SEGMENT 60
+// NV12 1920x1088 * (HELD + 1)
+#define BUDGET (1920 * 1088 * 3 / 2 * (HELD + 1))
+
+static const struct {
+    uint32_t w;
+    uint32_t h;
+} ladder[] = {
+    {426, 240},
+    {640, 360},
+    {854, 480},
+    {1280, 720},
+    {1920, 1080},
+};
+#define RUNGS (sizeof(ladder) / sizeof(ladder[0]))
+
+typedef struct bench_stats_s {
+    unsigned long allocs;
+} bench_stats_t;
+
+static uint64_t
+time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static drmu_fb_t *
+fake_alloc_cb(void * const v, const uint32_t w, const uint32_t h, const uint32_t format, const uint64_t mod)
+{
+    bench_stats_t * const stats = v;
+    drmu_fb_t * const dfb = drmu_fb_int_alloc(NULL);
+
+    (void)mod;  // Always linear
+    if (dfb == NULL)
+        return NULL;
+    // Pretend the allocator pads the height as real ones do
+    drmu_fb_int_fmt_size_set(dfb, format, w, (h + 15) & ~15U, drmu_rect_wh(w, h));
+    ++stats->allocs;
+    return dfb;
+}
+
+static void
+fake_on_delete_cb(void * const v)
+{
+    (void)v;
+}
+
+static int
+run(const unsigned int frames, const bool best_fit, const size_t bytes_max)
+{
+    static const drmu_pool_callback_fns_t fns = {
+        .alloc_fn = fake_alloc_cb,
+        .on_delete_fn = fake_on_delete_cb,
+        .try_reuse_fn = drmu_fb_try_reuse,
+        .fits_fn = drmu_fb_fits,
+    };
+    bench_stats_t stats = {0};
+    drmu_pool_stats_t ps;
+    drmu_fb_t * held[HELD] = {NULL};
+    drmu_pool_t * pool;
+    unsigned int rung = RUNGS / 2;
+    unsigned int changes = 0;
+    uint32_t seed = 1;
+    uint64_t t = 0;
+    unsigned int i;
+    int rv = 0;
+
+    if ((pool = drmu_pool_new_alloc(NULL, POOL_MAX, &fns, &stats)) == NULL)
+        return -1;
+    drmu_pool_best_fit_set(pool, best_fit);
+    drmu_pool_bytes_max_set(pool, bytes_max);
+
+    for (i = 0; i != frames; ++i) {
+        drmu_fb_t * dfb;
+        uint64_t t0;
+
+        if (i % SEGMENT == SEGMENT - 1) {
+            // Random walk up & down the ladder
+            seed = seed * 1103515245 + 12345;
+            if (((seed >> 16) & 1) != 0 ? rung + 1 < RUNGS : rung == 0)
+                ++rung;
+            else
+                --rung;
+            ++changes;
+        }
+
+        t0 = time_ns();
+        dfb = drmu_pool_fb_new(pool, ladder[rung].w, ladder[rung].h, DRM_FORMAT_NV12, DRM_FORMAT_MOD_LINEAR);
+        t += time_ns() - t0;
+
+        if (dfb == NULL) {
+            fprintf(stderr, "Pool alloc failed at frame %u\n", i);
+            rv = -1;
+            break;
+        }
+        drmu_fb_unref(held + i % HELD);
+        held[i % HELD] = dfb;
+    }
+
+    drmu_pool_stats_get(pool, &ps);
+    printf("best fit %-3s, budget %2zuMB: %u frames, %u rung changes: %lu allocs, %.1fns/fb_new\n",
+           best_fit ? "on" : "off", bytes_max >> 20, frames, changes, stats.allocs, (double)t / (double)frames);
+    printf("    hits %" PRIu64 ", misses %" PRIu64 ", evictions %" PRIu64 ", %zuKB allocated, %zuKB free\n",
+           ps.hits, ps.misses, ps.evictions, ps.bytes_allocated >> 10, ps.bytes_free >> 10);
+
+    for (i = 0; i != HELD; ++i)
+        drmu_fb_unref(held + i);
+    drmu_pool_kill(&pool);
+    return rv;
+}
+
+int
+main(int argc, char *argv[])
+{
+    const unsigned int frames = argc > 1 ? (unsigned int)atoi(argv[1]) : 100000;
+
+    if (frames == 0) {
+        fprintf(stderr, "Usage: %s [<frames>]\n", argv[0]);
+        return 1;
+    }
+
+    if (run(frames, false, 0) != 0 || run(frames, true, 0) != 0 || run(frames, true, BUDGET) != 0)
+        return 1;
+    return 0;
+}
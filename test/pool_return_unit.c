@@ -0,0 +1,169 @@
+// Stress test for returning fbs to drmu_pool from another thread
+//
+// One thread takes fbs from the pool (changing size every so often so
+// that buckets, best fit & the byte budget all get used) & hands them to a
+// second thread which drops the last ref, so fbs go back through the
+// lock-free return stack whilst drmu_pool_fb_new is draining it. Checks
+// that no fb_new fails, that the pool never holds more than its fb limit
+// & that the accounting balances once everything is back. Most useful
+// built with -fsanitize=thread or address.
+// FBs are never made real so no DRM device is needed.
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <libdrm/drm_fourcc.h>
+
+#include "drmu.h"
+#include "drmu_pool.h"
+
+#define POOL_MAX 8
+#define RING_SIZE 4     // In flight < POOL_MAX so fb_new never runs dry
+#define FRAMES 200000
+#define SEGMENT 97
+
+static const struct {
+    uint32_t w;
+    uint32_t h;
+} sizes[] = {
+    {640, 360},
+    {1280, 720},
+    {1920, 1080},
+};
+#define SIZES_N (sizeof(sizes) / sizeof(sizes[0]))
+
+typedef struct stress_s {
+    atomic_int allocs;
+    atomic_int frees;
+    _Atomic(drmu_fb_t *) ring[RING_SIZE];
+    atomic_bool done;
+} stress_t;
+
+static drmu_fb_t *
+fake_alloc_cb(void * const v, const uint32_t w, const uint32_t h, const uint32_t format, const uint64_t mod)
+{
+    stress_t * const st = v;
+    drmu_fb_t * const dfb = drmu_fb_int_alloc(NULL);
+
+    (void)mod;
+    if (dfb == NULL)
+        return NULL;
+    drmu_fb_int_fmt_size_set(dfb, format, w, h, drmu_rect_wh(w, h));
+    atomic_fetch_add(&st->allocs, 1);
+    return dfb;
+}
+
+static void
+fake_on_delete_cb(void * const v)
+{
+    (void)v;
+}
+
+// Drop whatever the alloc thread hands over
+static void *
+free_thread(void * v)
+{
+    stress_t * const st = v;
+    unsigned int i = 0;
+
+    for (;;) {
+        // Read done first so nothing handed over before it was set is missed
+        const bool done = atomic_load(&st->done);
+        drmu_fb_t * dfb = atomic_exchange(st->ring + i, NULL);
+
+        if (dfb == NULL) {
+            if (done)
+                break;
+            sched_yield();
+            continue;
+        }
+        drmu_fb_unref(&dfb);
+        atomic_fetch_add(&st->frees, 1);
+        i = (i + 1) % RING_SIZE;
+    }
+    return NULL;
+}
+
+int
+main(int argc, char *argv[])
+{
+    static const drmu_pool_callback_fns_t fns = {
+        .alloc_fn = fake_alloc_cb,
+        .on_delete_fn = fake_on_delete_cb,
+        .try_reuse_fn = drmu_fb_try_reuse,
+        .fits_fn = drmu_fb_fits,
+    };
+    static stress_t st;
+    drmu_pool_stats_t ps;
+    drmu_pool_t * pool;
+    pthread_t thread;
+    unsigned int i;
+    int fails = 0;
+    (void)argc;
+    (void)argv;
+
+    if ((pool = drmu_pool_new_alloc(NULL, POOL_MAX, &fns, &st)) == NULL) {
+        fprintf(stderr, "Failed to create pool\n");
+        return 1;
+    }
+    // Room for the in flight fbs at the largest size but not many free
+    drmu_pool_bytes_max_set(pool, (size_t)1920 * 1080 * 3 / 2 * (RING_SIZE + 2));
+
+    if (pthread_create(&thread, NULL, free_thread, &st) != 0) {
+        fprintf(stderr, "Failed to create thread\n");
+        return 1;
+    }
+
+    for (i = 0; i != FRAMES; ++i) {
+        const unsigned int n = (i / SEGMENT) % SIZES_N;
+        drmu_fb_t * dfb = drmu_pool_fb_new(pool, sizes[n].w, sizes[n].h, DRM_FORMAT_NV12, DRM_FORMAT_MOD_LINEAR);
+        _Atomic(drmu_fb_t *) * const slot = st.ring + i % RING_SIZE;
+        drmu_fb_t * empty = NULL;
+
+        if (dfb == NULL) {
+            fprintf(stderr, "fb_new failed at frame %u\n", i);
+            ++fails;
+            break;
+        }
+        while (!atomic_compare_exchange_weak(slot, &empty, dfb)) {
+            empty = NULL;
+            sched_yield();
+        }
+    }
+
+    atomic_store(&st.done, true);
+    pthread_join(thread, NULL);
+
+    // Stats drains the return stack so everything should now be free
+    drmu_pool_stats_get(pool, &ps);
+    printf("%u frames: %d allocs, %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64 " evictions\n",
+           i, atomic_load(&st.allocs), ps.hits, ps.misses, ps.evictions);
+
+    if (atomic_load(&st.frees) != (int)i) {
+        fprintf(stderr, "Frees %d != frames %u\n", atomic_load(&st.frees), i);
+        ++fails;
+    }
+    if (ps.hits + ps.misses != i) {
+        fprintf(stderr, "Hits + misses %" PRIu64 " != frames %u\n", ps.hits + ps.misses, i);
+        ++fails;
+    }
+    if (ps.fbs_allocated > POOL_MAX) {
+        fprintf(stderr, "%u fbs allocated > max %u\n", ps.fbs_allocated, POOL_MAX);
+        ++fails;
+    }
+    if (ps.bytes_free != ps.bytes_allocated) {
+        fprintf(stderr, "Bytes free %zu != allocated %zu with nothing in use\n", ps.bytes_free, ps.bytes_allocated);
+        ++fails;
+    }
+
+    drmu_pool_kill(&pool);
+
+    if (fails != 0)
+        return 1;
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,278 @@
+// Checks that a Q with synced CRTCs only commits complete sets of frames
+// and that every CRTC shows the same frame after each commit. The env sits
+// on one end of a socketpair with ioctl wrapped at link time to play a
+// device with two CRTCs (and the connector an env needs); flip events are
+// written to the other end. Needs a statically linked drmu.
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libdrm/drm.h>
+#include <libdrm/drm_mode.h>
+
+#include "drmu.h"
+#include "drmu_poll.h"
+
+#define CRTC0_ID    0x60
+#define CRTCS_N     2
+#define CONN_ID     0x70
+#define PROP_MODE_ID 0x20
+#define PROP_ACTIVE  0x21
+#define FRAMES_MAX  16
+
+static int ev_fd = -1;
+static unsigned int commits = 0;
+
+// Frame shown on each CRTC by present callbacks, by commit
+static int shown[FRAMES_MAX][CRTCS_N];
+static unsigned int dropped = 0;
+
+static void
+ids_copy(const __u64 ptr, __u32 * const pcount, const uint32_t * const ids, const unsigned int n)
+{
+    if (*pcount >= n && ptr != 0)
+        memcpy((void *)(uintptr_t)ptr, ids, n * sizeof(*ids));
+    *pcount = n;
+}
+
+static int
+fake_get_property(struct drm_mode_get_property * const p)
+{
+    static const uint64_t active_range[2] = {0, 1};
+
+    if (p->prop_id == PROP_MODE_ID) {
+        p->flags = DRM_MODE_PROP_ATOMIC | DRM_MODE_PROP_BLOB;
+        strcpy(p->name, "MODE_ID");
+        p->count_values = 0;
+    }
+    else if (p->prop_id == PROP_ACTIVE) {
+        p->flags = DRM_MODE_PROP_ATOMIC | DRM_MODE_PROP_RANGE;
+        strcpy(p->name, "ACTIVE");
+        if (p->count_values >= 2 && p->values_ptr != 0)
+            memcpy((void *)(uintptr_t)p->values_ptr, active_range, sizeof(active_range));
+        p->count_values = 2;
+    }
+    else {
+        errno = ENOENT;
+        return -1;
+    }
+    p->count_enum_blobs = 0;
+    return 0;
+}
+
+// Send a flip event for every CRTC in the commit
+static int
+fake_atomic(const struct drm_mode_atomic * const at)
+{
+    const uint32_t * const objs = (const uint32_t *)(uintptr_t)at->objs_ptr;
+    unsigned int i;
+
+    if ((at->flags & DRM_MODE_ATOMIC_TEST_ONLY) != 0)
+        return 0;
+
+    ++commits;
+    for (i = 0; i != at->count_objs; ++i) {
+        struct drm_event_vblank ev = {
+            .base = {.type = DRM_EVENT_FLIP_COMPLETE, .length = sizeof(ev)},
+            .user_data = at->user_data,
+            .sequence = commits,
+            .crtc_id = objs[i],
+        };
+
+        if (objs[i] < CRTC0_ID || objs[i] >= CRTC0_ID + CRTCS_N ||
+            (at->flags & DRM_MODE_PAGE_FLIP_EVENT) == 0)
+            continue;
+        if (write(ev_fd, &ev, sizeof(ev)) != sizeof(ev))
+            return -1;
+    }
+    return 0;
+}
+
+int
+__wrap_ioctl(int fd, unsigned long req, ...)
+{
+    va_list va;
+    void * arg;
+
+    va_start(va, req);
+    arg = va_arg(va, void *);
+    va_end(va);
+
+    switch (req) {
+        case DRM_IOCTL_SET_CLIENT_CAP:
+        case DRM_IOCTL_MODE_GETCRTC:
+            return 0;
+        case DRM_IOCTL_MODE_GETRESOURCES:
+        {
+            static const uint32_t crtc_ids[CRTCS_N] = {CRTC0_ID, CRTC0_ID + 1};
+            static const uint32_t conn_id = CONN_ID;
+            struct drm_mode_card_res * const res = arg;
+            ids_copy(res->crtc_id_ptr, &res->count_crtcs, crtc_ids, CRTCS_N);
+            ids_copy(res->connector_id_ptr, &res->count_connectors, &conn_id, 1);
+            res->count_encoders = 0;
+            res->count_fbs = 0;
+            return 0;
+        }
+        case DRM_IOCTL_MODE_GETCONNECTOR:
+        {
+            struct drm_mode_get_connector * const conn = arg;
+            conn->count_modes = 0;
+            conn->count_props = 0;
+            conn->count_encoders = 0;
+            conn->connector_type = DRM_MODE_CONNECTOR_VIRTUAL;
+            conn->connection = 2;  // Disconnected
+            return 0;
+        }
+        case DRM_IOCTL_MODE_GETPLANERESOURCES:
+            ((struct drm_mode_get_plane_res *)arg)->count_planes = 0;
+            return 0;
+        case DRM_IOCTL_MODE_OBJ_GETPROPERTIES:
+        {
+            static const uint32_t crtc_props[2] = {PROP_MODE_ID, PROP_ACTIVE};
+            struct drm_mode_obj_get_properties * const op = arg;
+            if (op->obj_type != DRM_MODE_OBJECT_CRTC) {
+                op->count_props = 0;
+                return 0;
+            }
+            if (op->count_props >= 2 && op->prop_values_ptr != 0)
+                memset((void *)(uintptr_t)op->prop_values_ptr, 0, 2 * sizeof(uint64_t));
+            ids_copy(op->props_ptr, &op->count_props, crtc_props, 2);
+            return 0;
+        }
+        case DRM_IOCTL_MODE_GETPROPERTY:
+            return fake_get_property(arg);
+        case DRM_IOCTL_MODE_ATOMIC:
+            return fake_atomic(arg);
+        default:
+            break;
+    }
+    (void)fd;
+    errno = EINVAL;
+    return -1;
+}
+
+typedef struct frame_s {
+    unsigned int crtc;
+    int frame;
+} frame_t;
+
+static frame_t frames[CRTCS_N][FRAMES_MAX];
+
+static void
+present_cb(void * v, const drmu_present_info_t * const info)
+{
+    const frame_t * const f = v;
+
+    if (info->dropped)
+        ++dropped;
+    else if (info->sequence < FRAMES_MAX)
+        shown[info->sequence][f->crtc] = f->frame;
+}
+
+static int
+queue_frame(drmu_queue_t * const aq, drmu_crtc_t * const dc, const unsigned int crtc, const int frame)
+{
+    drmu_atomic_t * da = drmu_atomic_new(drmu_crtc_env(dc));
+    frame_t * const f = frames[crtc] + frame;
+
+    f->crtc = crtc;
+    f->frame = frame;
+    drmu_atomic_crtc_add_active(da, dc, 1);
+    drmu_atomic_add_present_callback(da, present_cb, f);
+    return drmu_queue_queue_tagged(aq, crtc, DRMU_QUEUE_MERGE_QUEUE, &da);
+}
+
+static void
+msleep(const unsigned int ms)
+{
+    const struct timespec ts = {.tv_sec = 0, .tv_nsec = ms * 1000000};
+    nanosleep(&ts, NULL);
+}
+
+#define CHECK(x) do {\
+    if (!(x)) {\
+        fprintf(stderr, "%s:%d: Check failed: %s\n", __FILE__, __LINE__, #x);\
+        ++fails;\
+    }\
+} while (0)
+
+int
+main(int argc, char *argv[])
+{
+    drmu_env_t * du;
+    drmu_queue_t * aq;
+    drmu_crtc_t * dcs[CRTCS_N];
+    drmu_crtc_t * dup[2];
+    int sv[2];
+    unsigned int i;
+    int fails = 0;
+    (void)argc;
+    (void)argv;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+        perror("socketpair");
+        return 1;
+    }
+    ev_fd = sv[1];
+
+    if ((du = drmu_env_new_fd(sv[0], NULL)) == NULL) {
+        fprintf(stderr, "Failed to create env\n");
+        return 1;
+    }
+    for (i = 0; i != CRTCS_N; ++i)
+        dcs[i] = drmu_env_crtc_find_n(du, i);
+    CHECK(dcs[0] != NULL && dcs[1] != NULL);
+
+    aq = drmu_queue_new(du);
+    CHECK(aq != NULL);
+
+    // Same CRTC twice
+    dup[0] = dcs[0];
+    dup[1] = dcs[0];
+    CHECK(drmu_queue_sync_crtcs_set(aq, dup, 2) == -EINVAL);
+    CHECK(drmu_queue_sync_crtcs_set(aq, dcs, CRTCS_N) == 0);
+
+    // A partial set is held back
+    CHECK(queue_frame(aq, dcs[0], 0, 1) == 0);
+    CHECK(queue_frame(aq, dcs[0], 0, 2) == 0);
+    CHECK(drmu_queue_wait(aq) == 0);
+    msleep(20);
+    CHECK(commits == 0);
+
+    // Completing it commits frame 1 on both then frame 2 is waiting for
+    // CRTC 1
+    CHECK(queue_frame(aq, dcs[1], 1, 1) == 0);
+    CHECK(drmu_queue_wait(aq) == 0);
+    msleep(20);
+    CHECK(commits == 1);
+    CHECK(shown[1][0] == 1 && shown[1][1] == 1);
+
+    // Several frames waiting for CRTC 0 while CRTC 1 catches up
+    CHECK(queue_frame(aq, dcs[0], 0, 3) == 0);
+    CHECK(queue_frame(aq, dcs[1], 1, 2) == 0);
+    CHECK(queue_frame(aq, dcs[1], 1, 3) == 0);
+    CHECK(queue_frame(aq, dcs[0], 0, 4) == 0);
+    CHECK(drmu_queue_wait(aq) == 0);
+    msleep(20);
+    CHECK(commits == 3);
+    for (i = 1; i <= commits; ++i)
+        CHECK(shown[i][0] == shown[i][1] && shown[i][0] == (int)i);
+
+    drmu_queue_finish(&aq);
+    // Frame 4 on CRTC 0 never got a partner
+    CHECK(dropped == 1);
+    drmu_env_unref(&du);
+
+    if (fails != 0) {
+        fprintf(stderr, "%d checks failed\n", fails);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}